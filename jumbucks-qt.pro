@@ -199,8 +199,12 @@ HEADERS += src/qt/bitcoingui.h \
     src/walletdb.h \
     src/script.h \
     src/stealth.h \
+    src/coinselection.h \
+    src/addressindex.h \
+    src/notify.h \
     src/init.h \
     src/mruset.h \
+    src/bloom.h \
     src/json/json_spirit_writer_template.h \
     src/json/json_spirit_writer.h \
     src/json/json_spirit_value.h \
@@ -313,7 +317,11 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/scrypt-x86_64.S \
     src/scrypt.cpp \
     src/pbkdf2.cpp \
-    src/stealth.cpp 
+    src/stealth.cpp \
+    src/coinselection.cpp \
+    src/addressindex.cpp \
+    src/rest.cpp \
+    src/notify.cpp
 
 RESOURCES += \
     src/qt/bitcoin.qrc \
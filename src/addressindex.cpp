@@ -0,0 +1,185 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addressindex.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned char& nTypeRet, uint160& hashRet)
+{
+    CTxDestination dest;
+    if (!ExtractDestination(scriptPubKey, dest))
+        return false;
+
+    if (const CKeyID* pkeyID = boost::get<CKeyID>(&dest))
+    {
+        nTypeRet = ADDRESS_INDEX_PUBKEYHASH;
+        hashRet = *pkeyID;
+        return true;
+    }
+    if (const CScriptID* pscriptID = boost::get<CScriptID>(&dest))
+    {
+        nTypeRet = ADDRESS_INDEX_SCRIPTHASH;
+        hashRet = *pscriptID;
+        return true;
+    }
+    return false;
+}
+
+void CBlockAddressIndex::AddTx(const CTransaction& tx, const MapPrevTx& mapInputs, int nHeight)
+{
+    uint256 hashTx = tx.GetHash();
+
+    if (!tx.IsCoinBase())
+    {
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            MapPrevTx::const_iterator mi = mapInputs.find(prevout.hash);
+            if (mi == mapInputs.end() || prevout.n >= mi->second.second.vout.size())
+                continue;
+            const CTxOut& txoutPrev = mi->second.second.vout[prevout.n];
+
+            unsigned char nType = ADDRESS_INDEX_NONE;
+            uint160 hashBytes = 0;
+            bool fKnown = GetAddressIndexKey(txoutPrev.scriptPubKey, nType, hashBytes);
+
+            if (fAddressIndex && fKnown)
+            {
+                vAddressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, nHeight, hashTx, i, true), -txoutPrev.nValue));
+                vUnspentSpent.push_back(CAddressUnspentKey(nType, hashBytes, prevout.hash, prevout.n));
+            }
+            if (fSpentIndex)
+                vSpentIndex.push_back(make_pair(prevout, CSpentIndexValue(hashTx, i, nHeight, txoutPrev.nValue, nType, hashBytes)));
+        }
+    }
+
+    if (!fAddressIndex)
+        return;
+
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        unsigned char nType;
+        uint160 hashBytes;
+        if (!GetAddressIndexKey(txout.scriptPubKey, nType, hashBytes))
+            continue;
+
+        vAddressIndex.push_back(make_pair(CAddressIndexKey(nType, hashBytes, nHeight, hashTx, i, false), txout.nValue));
+        vUnspentCreated.push_back(make_pair(CAddressUnspentKey(nType, hashBytes, hashTx, i), CAddressUnspentValue(txout.nValue, txout.scriptPubKey, nHeight)));
+    }
+}
+
+// The same entries as ConnectBlock adds for a block of the best chain, with the
+// inputs read back from the transaction index
+bool CBlockAddressIndex::AddBlockFromDisk(CTxDB& txdb, const CBlock& block, int nHeight)
+{
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        MapPrevTx mapInputs;
+        if (!tx.IsCoinBase())
+        {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                if (mapInputs.count(txin.prevout.hash))
+                    continue;
+                pair<CTxIndex, CTransaction>& input = mapInputs[txin.prevout.hash];
+                if (!txdb.ReadDiskTx(txin.prevout.hash, input.second, input.first))
+                    return error("AddBlockFromDisk() : %s input %s not found", tx.GetHash().ToString().substr(0,10).c_str(),
+                                 txin.prevout.hash.ToString().substr(0,10).c_str());
+            }
+        }
+        AddTx(tx, mapInputs, nHeight);
+    }
+    return true;
+}
+
+bool InitAddressIndex()
+{
+    int nWanted = (fAddressIndex ? BLOCK_INDEX_ADDRESS : 0) | (fSpentIndex ? BLOCK_INDEX_SPENT : 0);
+
+    CTxDB txdb;
+    int nFlags;
+    txdb.ReadIndexFlags(nFlags);
+    if (nFlags == nWanted)
+        return true;
+
+    // An index that was not kept up to date can't be patched up, it is thrown
+    // away and built again. The flags are cleared first, so that an interrupted
+    // build starts over next time.
+    if (!txdb.WriteIndexFlags(0))
+        return false;
+    if (nFlags != 0)
+    {
+        printf("Removing the address and spent indexes\n");
+        if (!txdb.WipeAddressIndex())
+            return false;
+    }
+    if (nWanted == 0)
+        return true;
+
+    uiInterface.InitMessage(_("Building address index..."));
+    printf("Building the address and spent indexes from the best chain\n");
+    int64_t nStart = GetTimeMillis();
+    unsigned int nEntries = 0;
+    for (CBlockIndex* pindex = pindexGenesisBlock; pindex; pindex = pindex->pnext)
+    {
+        if (fRequestShutdown)
+            return true;
+
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return error("InitAddressIndex() : block %d unreadable", pindex->nHeight);
+
+        CBlockAddressIndex index;
+        if (!index.AddBlockFromDisk(txdb, block, pindex->nHeight))
+            return false;
+        nEntries += index.size();
+
+        txdb.TxnBegin();
+        if (!txdb.WriteBlockAddressIndex(pindex->GetBlockHash(), index))
+        {
+            txdb.TxnAbort();
+            return error("InitAddressIndex() : WriteBlockAddressIndex failed at %d", pindex->nHeight);
+        }
+        if (!txdb.TxnCommit())
+            return error("InitAddressIndex() : TxnCommit failed at %d", pindex->nHeight);
+
+        if (pindex->nHeight % 10000 == 0)
+            printf("InitAddressIndex() : at block %d, %u entries\n", pindex->nHeight, nEntries);
+    }
+    printf(" address index %13"PRId64"ms, %u entries\n", GetTimeMillis() - nStart, nEntries);
+
+    return txdb.WriteIndexFlags(nWanted);
+}
+
+void RecordAddressIndexCost(unsigned int nEntries, int64_t nIndexMicros, int64_t nBlockMicros)
+{
+    // Only ever called from ConnectBlock, under cs_main
+    static unsigned int nBlocks = 0;
+    static unsigned int nTotalEntries = 0;
+    static int64_t nTotalIndexMicros = 0;
+    static int64_t nTotalBlockMicros = 0;
+
+    nBlocks++;
+    nTotalEntries += nEntries;
+    nTotalIndexMicros += nIndexMicros;
+    nTotalBlockMicros += nBlockMicros;
+    if (nBlocks < 1000)
+        return;
+
+    printf("Address index: %u entries for the last %u blocks, %.3fs of %.3fs connecting them (%.1f%%)\n",
+           nTotalEntries, nBlocks, nTotalIndexMicros * 0.000001, nTotalBlockMicros * 0.000001,
+           nTotalBlockMicros ? 100.0 * nTotalIndexMicros / nTotalBlockMicros : 0.0);
+    nBlocks = 0;
+    nTotalEntries = 0;
+    nTotalIndexMicros = 0;
+    nTotalBlockMicros = 0;
+}
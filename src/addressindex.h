@@ -0,0 +1,273 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_ADDRESSINDEX_H
+#define BITCOIN_ADDRESSINDEX_H
+
+#include "main.h"
+
+#include <utility>
+#include <vector>
+
+class CTxDB;
+
+/** The kinds of address the indexes know about, as kept in their keys */
+enum AddressIndexType
+{
+    ADDRESS_INDEX_NONE = 0,
+    ADDRESS_INDEX_PUBKEYHASH = 1,
+    ADDRESS_INDEX_SCRIPTHASH = 2,
+};
+
+/** Flags, as kept in the database, of which indexes it holds */
+enum
+{
+    BLOCK_INDEX_ADDRESS = (1 << 0),
+    BLOCK_INDEX_SPENT   = (1 << 1),
+};
+
+// Heights are kept big endian in keys, so that LevelDB orders the entries of
+// one address by height and a height range is a single forward scan.
+template<typename Stream>
+inline void WriteHeightBE(Stream& s, int nHeight)
+{
+    unsigned char ch[4] = { (unsigned char)(nHeight >> 24), (unsigned char)(nHeight >> 16),
+                            (unsigned char)(nHeight >> 8), (unsigned char)nHeight };
+    s.write((char*)ch, 4);
+}
+
+template<typename Stream>
+inline int ReadHeightBE(Stream& s)
+{
+    unsigned char ch[4];
+    s.read((char*)ch, 4);
+    return ((int)ch[0] << 24) | ((int)ch[1] << 16) | ((int)ch[2] << 8) | (int)ch[3];
+}
+
+/** An output paid to, or an input spending from, an address, at some height.
+ *  The value it maps to is the amount, negative for spending. */
+class CAddressIndexKey
+{
+public:
+    unsigned char nType;
+    uint160 hashBytes;
+    int nBlockHeight;
+    uint256 txhash;
+    unsigned int nIndex;    // output index if receiving, input index if spending
+    bool fSpending;
+
+    CAddressIndexKey()
+    {
+        SetNull();
+    }
+
+    CAddressIndexKey(unsigned char nTypeIn, const uint160& hashIn, int nHeightIn, const uint256& txhashIn, unsigned int nIndexIn, bool fSpendingIn)
+    {
+        nType = nTypeIn;
+        hashBytes = hashIn;
+        nBlockHeight = nHeightIn;
+        txhash = txhashIn;
+        nIndex = nIndexIn;
+        fSpending = fSpendingIn;
+    }
+
+    void SetNull()
+    {
+        nType = ADDRESS_INDEX_NONE;
+        hashBytes = 0;
+        nBlockHeight = 0;
+        txhash = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    unsigned int GetSerializeSize(int nType_, int nVersion) const
+    {
+        return 1 + 20 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType_, int nVersion) const
+    {
+        ::Serialize(s, nType, nType_, nVersion);
+        ::Serialize(s, hashBytes, nType_, nVersion);
+        WriteHeightBE(s, nBlockHeight);
+        ::Serialize(s, txhash, nType_, nVersion);
+        ::Serialize(s, nIndex, nType_, nVersion);
+        ::Serialize(s, fSpending, nType_, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType_, int nVersion)
+    {
+        ::Unserialize(s, nType, nType_, nVersion);
+        ::Unserialize(s, hashBytes, nType_, nVersion);
+        nBlockHeight = ReadHeightBE(s);
+        ::Unserialize(s, txhash, nType_, nVersion);
+        ::Unserialize(s, nIndex, nType_, nVersion);
+        ::Unserialize(s, fSpending, nType_, nVersion);
+    }
+};
+
+/** Where a scan of the address index starts: an address, from some height */
+class CAddressIndexIteratorKey
+{
+public:
+    unsigned char nType;
+    uint160 hashBytes;
+    int nBlockHeight;
+
+    CAddressIndexIteratorKey(unsigned char nTypeIn, const uint160& hashIn, int nHeightIn)
+    {
+        nType = nTypeIn;
+        hashBytes = hashIn;
+        nBlockHeight = nHeightIn;
+    }
+
+    unsigned int GetSerializeSize(int nType_, int nVersion) const
+    {
+        return 1 + 20 + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType_, int nVersion) const
+    {
+        ::Serialize(s, nType, nType_, nVersion);
+        ::Serialize(s, hashBytes, nType_, nVersion);
+        WriteHeightBE(s, nBlockHeight);
+    }
+};
+
+/** An unspent output paid to an address */
+class CAddressUnspentKey
+{
+public:
+    unsigned char nType;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int nIndex;
+
+    CAddressUnspentKey()
+    {
+        nType = ADDRESS_INDEX_NONE;
+        hashBytes = 0;
+        txhash = 0;
+        nIndex = 0;
+    }
+
+    CAddressUnspentKey(unsigned char nTypeIn, const uint160& hashIn, const uint256& txhashIn, unsigned int nIndexIn)
+    {
+        nType = nTypeIn;
+        hashBytes = hashIn;
+        txhash = txhashIn;
+        nIndex = nIndexIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nType);
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(nIndex);
+    )
+};
+
+class CAddressUnspentValue
+{
+public:
+    int64_t nValue;
+    CScript script;
+    int nBlockHeight;
+
+    CAddressUnspentValue()
+    {
+        nValue = -1;
+        nBlockHeight = 0;
+    }
+
+    CAddressUnspentValue(int64_t nValueIn, const CScript& scriptIn, int nHeightIn)
+    {
+        nValue = nValueIn;
+        script = scriptIn;
+        nBlockHeight = nHeightIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nBlockHeight);
+    )
+};
+
+/** What spent an output, kept under the output spent */
+class CSpentIndexValue
+{
+public:
+    uint256 txid;
+    unsigned int nInputIndex;
+    int nBlockHeight;
+    int64_t nValue;
+    unsigned char nType;
+    uint160 hashBytes;
+
+    CSpentIndexValue()
+    {
+        txid = 0;
+        nInputIndex = 0;
+        nBlockHeight = 0;
+        nValue = 0;
+        nType = ADDRESS_INDEX_NONE;
+        hashBytes = 0;
+    }
+
+    CSpentIndexValue(const uint256& txidIn, unsigned int nInputIndexIn, int nHeightIn, int64_t nValueIn, unsigned char nTypeIn, const uint160& hashIn)
+    {
+        txid = txidIn;
+        nInputIndex = nInputIndexIn;
+        nBlockHeight = nHeightIn;
+        nValue = nValueIn;
+        nType = nTypeIn;
+        hashBytes = hashIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txid);
+        READWRITE(nInputIndex);
+        READWRITE(nBlockHeight);
+        READWRITE(nValue);
+        READWRITE(nType);
+        READWRITE(hashBytes);
+    )
+};
+
+/** The entries one block adds to the address and spent indexes, worked out in
+ *  ConnectBlock (and again in DisconnectBlock to take them out) and written to
+ *  the block's database transaction in one go. */
+class CBlockAddressIndex
+{
+public:
+    std::vector<std::pair<CAddressIndexKey, int64_t> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspentCreated;
+    std::vector<CAddressUnspentKey> vUnspentSpent;
+    std::vector<std::pair<COutPoint, CSpentIndexValue> > vSpentIndex;
+
+    void AddTx(const CTransaction& tx, const MapPrevTx& mapInputs, int nHeight);
+    bool AddBlockFromDisk(CTxDB& txdb, const CBlock& block, int nHeight);
+
+    unsigned int size() const
+    {
+        return vAddressIndex.size() + vUnspentCreated.size() + vUnspentSpent.size() + vSpentIndex.size();
+    }
+};
+
+/** The kind of address and its hash an output pays to, if it is one the indexes know */
+bool GetAddressIndexKey(const CScript& scriptPubKey, unsigned char& nTypeRet, uint160& hashRet);
+/** Bring the indexes on disk in line with -addressindex and -spentindex, building them from the best chain if need be */
+bool InitAddressIndex();
+/** Account for the time taken updating the indexes for a block, and now and then log what they cost */
+void RecordAddressIndexCost(unsigned int nEntries, int64_t nIndexMicros, int64_t nBlockMicros);
+
+#endif
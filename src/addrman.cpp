@@ -281,9 +281,14 @@ void CAddrMan::Good_(const CService &addr, int64_t nTime)
     info.nTime = nTime;
     info.nAttempts = 0;
 
+    Journal_(CAddrJournalEntry(CAddrJournalEntry::GOOD, info, nTime));
+
     // if it is already in the tried set, don't do anything else
     if (info.fInTried)
+    {
+        UpdateSnapshotEntry_(nId);
         return;
+    }
 
     // find a bucket it is in now
     int nRnd = GetRandInt(vvNew.size());
@@ -307,6 +312,7 @@ void CAddrMan::Good_(const CService &addr, int64_t nTime)
 
     // move nId to the tried tables
     MakeTried(info, nId, nUBucket);
+    InvalidateSnapshot_();
 }
 
 bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimePenalty)
@@ -364,12 +370,15 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
             ShrinkNew(nUBucket);
         vvNew[nUBucket].insert(nId);
     }
+    if (fNew)
+        Journal_(CAddrJournalEntry(CAddrJournalEntry::ADD, addr, nTimePenalty, source));
     return fNew;
 }
 
 void CAddrMan::Attempt_(const CService &addr, int64_t nTime)
 {
-    CAddrInfo *pinfo = Find(addr);
+    int nId;
+    CAddrInfo *pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -384,50 +393,116 @@ void CAddrMan::Attempt_(const CService &addr, int64_t nTime)
     // update info
     info.nLastTry = nTime;
     info.nAttempts++;
+
+    Journal_(CAddrJournalEntry(CAddrJournalEntry::ATTEMPT, info, nTime));
+    UpdateSnapshotEntry_(nId);
 }
 
-CAddress CAddrMan::Select_(int nUnkBias)
+CAddress CAddrManSnapshot::Select(int nUnkBias) const
 {
-    if (size() == 0)
+    if (nSize == 0)
         return CAddress();
 
     double nCorTried = sqrt(nTried) * (100.0 - nUnkBias);
     double nCorNew = sqrt(nNew) * nUnkBias;
-    if ((nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried)
+    bool fTried = (nCorTried + nCorNew)*GetRandInt(1<<30)/(1<<30) < nCorTried;
+    const std::vector<boost::shared_ptr<const std::vector<CAddrInfo> > > &vvBuckets = fTried ? vvTried : vvNew;
+    const std::vector<int> &vUsed = fTried ? vTriedUsed : vNewUsed;
+    if (vUsed.empty())
+        return CAddress();
+
+    double fChanceFactor = 1.0;
+    while(1)
     {
-        // use a tried node
-        double fChanceFactor = 1.0;
-        while(1)
-        {
-            int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
-            int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
-    } else {
-        // use a new node
-        double fChanceFactor = 1.0;
-        while(1)
-        {
-            int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
-            int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
-            if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
+        const std::vector<CAddrInfo> &vBucket = *vvBuckets[vUsed[GetRandInt(vUsed.size())]];
+        const CAddrInfo &info = vBucket[GetRandInt(vBucket.size())];
+        if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
+            return info;
+        fChanceFactor *= 1.2;
+    }
+}
+
+boost::shared_ptr<const CAddrManSnapshot> CAddrMan::MakeSnapshot_()
+{
+    CAddrManSnapshot* pnew = new CAddrManSnapshot();
+    pnew->nCreated = GetTime();
+    pnew->nSize = size();
+    pnew->nTried = nTried;
+    pnew->nNew = nNew;
+    pnew->vvTried.resize(vvTried.size());
+    for (unsigned int n = 0; n < vvTried.size(); n++)
+    {
+        if (vvTried[n].empty())
+            continue;
+        std::vector<CAddrInfo>* pBucket = new std::vector<CAddrInfo>();
+        pBucket->reserve(vvTried[n].size());
+        BOOST_FOREACH(int nId, vvTried[n])
+            pBucket->push_back(mapInfo[nId]);
+        pnew->vvTried[n].reset(pBucket);
+        pnew->vTriedUsed.push_back(n);
+    }
+    pnew->vvNew.resize(vvNew.size());
+    for (unsigned int n = 0; n < vvNew.size(); n++)
+    {
+        if (vvNew[n].empty())
+            continue;
+        std::vector<CAddrInfo>* pBucket = new std::vector<CAddrInfo>();
+        pBucket->reserve(vvNew[n].size());
+        BOOST_FOREACH(int nId, vvNew[n])
+            pBucket->push_back(mapInfo[nId]);
+        pnew->vvNew[n].reset(pBucket);
+        pnew->vNewUsed.push_back(n);
+    }
+    return boost::shared_ptr<const CAddrManSnapshot>(pnew);
+}
+
+void CAddrMan::InvalidateSnapshot_()
+{
+    boost::atomic_store(&pSnapshot, boost::shared_ptr<const CAddrManSnapshot>());
+}
+
+// Replace the copy of info in a snapshot bucket, copying the bucket
+static void UpdateSnapshotBucket(boost::shared_ptr<const std::vector<CAddrInfo> >& pBucket, const CAddrInfo& info)
+{
+    if (!pBucket)
+        return;
+    std::vector<CAddrInfo>* pnew = new std::vector<CAddrInfo>(*pBucket);
+    BOOST_FOREACH(CAddrInfo& entry, *pnew)
+        if ((CService)entry == (CService)info)
+            entry = info;
+    pBucket.reset(pnew);
+}
+
+void CAddrMan::UpdateSnapshotEntry_(int nId)
+{
+    boost::shared_ptr<const CAddrManSnapshot> pCurrent = boost::atomic_load(&pSnapshot);
+    if (!pCurrent)
+        return;
+
+    // only the bucket pointers are copied, and the buckets the entry is in
+    const CAddrInfo& info = mapInfo[nId];
+    CAddrManSnapshot* pnew = new CAddrManSnapshot(*pCurrent);
+    if (info.fInTried)
+        UpdateSnapshotBucket(pnew->vvTried[info.GetTriedBucket(nKey)], info);
+    else
+    {
+        for (unsigned int n = 0; n < vvNew.size(); n++)
+            if (vvNew[n].count(nId))
+                UpdateSnapshotBucket(pnew->vvNew[n], info);
+    }
+    boost::atomic_store(&pSnapshot, boost::shared_ptr<const CAddrManSnapshot>(pnew));
+}
+
+void CAddrMan::Journal_(const CAddrJournalEntry& entry)
+{
+    if (fReplaying)
+        return;
+    if (vJournal.size() >= ADDRMAN_JOURNAL_MAX)
+    {
+        fJournalOverflow = true;
+        return;
     }
+    vJournal.push_back(entry);
 }
 
 #ifdef DEBUG_ADDRMAN
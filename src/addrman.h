@@ -13,6 +13,9 @@
 #include <map>
 #include <vector>
 
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+
 #include <openssl/rand.h>
 
 
@@ -93,6 +96,67 @@ public:
 
 };
 
+/** A change to the address tables, appended to peers.log between full rewrites of peers.dat */
+class CAddrJournalEntry
+{
+public:
+    enum
+    {
+        ADD,
+        GOOD,
+        ATTEMPT,
+    };
+
+    unsigned char nAction;
+    CAddress addr;
+    int64_t nTime; // time of a GOOD or ATTEMPT, time penalty of an ADD
+    CNetAddr source;
+
+    IMPLEMENT_SERIALIZE(
+        READWRITE(nAction);
+        READWRITE(addr);
+        READWRITE(nTime);
+        if (nAction == ADD)
+            READWRITE(source);
+    )
+
+    CAddrJournalEntry()
+    {
+        nAction = ADD;
+        nTime = 0;
+    }
+
+    CAddrJournalEntry(unsigned char nActionIn, const CAddress& addrIn, int64_t nTimeIn, const CNetAddr& sourceIn = CNetAddr())
+        : nAction(nActionIn), addr(addrIn), nTime(nTimeIn), source(sourceIn)
+    {
+    }
+};
+
+/** Immutable copy of the bucket tables, used by Select() without taking CAddrMan::cs */
+class CAddrManSnapshot
+{
+public:
+    // when this copy was made
+    int64_t nCreated;
+
+    // number of addresses at that time
+    int nSize;
+
+    int nTried;
+    int nNew;
+
+    // all the buckets, NULL when empty; shared with the copies made to update an entry
+    std::vector<boost::shared_ptr<const std::vector<CAddrInfo> > > vvTried;
+    std::vector<boost::shared_ptr<const std::vector<CAddrInfo> > > vvNew;
+
+    // the non-empty buckets; selecting a random non-empty bucket is
+    // equivalent to retrying random buckets until a non-empty one is hit
+    std::vector<int> vTriedUsed;
+    std::vector<int> vNewUsed;
+
+    CAddress Select(int nUnkBias) const;
+};
+
 // Stochastic address manager
 //
 // Design goals:
@@ -161,6 +225,12 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+// how old (in seconds) a snapshot used by Select may get before it is rebuilt
+#define ADDRMAN_SNAPSHOT_MAX_AGE 60
+
+// the maximum number of journal entries kept in memory between two dumps
+#define ADDRMAN_JOURNAL_MAX 100000
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -195,6 +265,18 @@ private:
     // list of "new" buckets
     std::vector<std::set<int> > vvNew;
 
+    // read-only copy of the tables for Select; swapped atomically, empty if it must be rebuilt
+    boost::shared_ptr<const CAddrManSnapshot> pSnapshot;
+
+    // changes not yet appended to peers.log
+    std::vector<CAddrJournalEntry> vJournal;
+
+    // set if changes were dropped from vJournal, so only a full rewrite of peers.dat will do
+    bool fJournalOverflow;
+
+    // set while replaying peers.log, so replayed changes are not journaled again
+    bool fReplaying;
+
 protected:
 
     // Find an entry.
@@ -228,10 +310,6 @@ protected:
     // Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, int64_t nTime);
 
-    // Select an address to connect to.
-    // nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
-    CAddress Select_(int nUnkBias);
-
 #ifdef DEBUG_ADDRMAN
     // Perform consistency check. Returns an error code or zero.
     int Check_();
@@ -243,6 +321,19 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
 
+    // Record a change for the next append to peers.log.
+    void Journal_(const CAddrJournalEntry& entry);
+
+    // Copy the bucket tables into a new snapshot.
+    boost::shared_ptr<const CAddrManSnapshot> MakeSnapshot_();
+
+    // Drop the current snapshot, so the next Select rebuilds it.
+    void InvalidateSnapshot_();
+
+    // Swap in a copy of the snapshot with the buckets holding nId brought up to date,
+    // for changes to an entry that leave it in the same buckets.
+    void UpdateSnapshotEntry_(int nId);
+
 public:
     // serialized format:
     // * version byte (currently 0)
@@ -325,6 +416,9 @@ public:
         int nUBuckets = 0;
         s >> nUBuckets;
         nIdCount = 0;
+        InvalidateSnapshot_();
+        vJournal.clear();
+        fJournalOverflow = false;
         mapInfo.clear();
         mapAddr.clear();
         vRandom.clear();
@@ -389,6 +483,8 @@ public:
          nIdCount = 0;
          nTried = 0;
          nNew = 0;
+         fJournalOverflow = false;
+         fReplaying = false;
     }
 
     // Return the number of (unique) addresses in all tables.
@@ -419,6 +515,8 @@ public:
             Check();
             fRet |= Add_(addr, source, nTimePenalty);
             Check();
+            if (fRet)
+                InvalidateSnapshotIfGrown_();
         }
         if (fRet)
             printf("Added %s from %s: %i tried, %i new\n", addr.ToStringIPPort().c_str(), source.ToString().c_str(), nTried, nNew);
@@ -435,6 +533,8 @@ public:
             for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
                 nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
             Check();
+            if (nAdd)
+                InvalidateSnapshotIfGrown_();
         }
         if (nAdd)
             printf("Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString().c_str(), nTried, nNew);
@@ -465,16 +565,22 @@ public:
 
     // Choose an address to connect to.
     // nUnkBias determines how much "new" entries are favored over "tried" ones (0-100).
+    // Selection works on a snapshot of the tables and only takes cs when that has to be rebuilt.
     CAddress Select(int nUnkBias = 50)
     {
-        CAddress addrRet;
+        boost::shared_ptr<const CAddrManSnapshot> pCurrent = boost::atomic_load(&pSnapshot);
+        if (!pCurrent || GetTime() - pCurrent->nCreated > ADDRMAN_SNAPSHOT_MAX_AGE)
         {
             LOCK(cs);
             Check();
-            addrRet = Select_(nUnkBias);
-            Check();
+            pCurrent = boost::atomic_load(&pSnapshot);
+            if (!pCurrent || GetTime() - pCurrent->nCreated > ADDRMAN_SNAPSHOT_MAX_AGE)
+            {
+                pCurrent = MakeSnapshot_();
+                boost::atomic_store(&pSnapshot, pCurrent);
+            }
         }
-        return addrRet;
+        return pCurrent->Select(nUnkBias);
     }
 
     // Return a bunch of addresses, selected at random.
@@ -500,6 +606,61 @@ public:
             Check();
         }
     }
+
+    // Move the changes recorded since the last call into vEntries.
+    // Returns false if changes were lost and peers.dat must be rewritten in full instead.
+    bool TakeJournal(std::vector<CAddrJournalEntry>& vEntries)
+    {
+        LOCK(cs);
+        vEntries.clear();
+        vEntries.swap(vJournal);
+        bool fComplete = !fJournalOverflow;
+        fJournalOverflow = false;
+        return fComplete;
+    }
+
+    // Forget recorded changes, because the full tables are about to be written.
+    void ClearJournal()
+    {
+        LOCK(cs);
+        vJournal.clear();
+        fJournalOverflow = false;
+    }
+
+    // Apply changes read back from peers.log.
+    void Replay(const std::vector<CAddrJournalEntry>& vEntries)
+    {
+        LOCK(cs);
+        Check();
+        fReplaying = true;
+        BOOST_FOREACH(const CAddrJournalEntry& entry, vEntries)
+        {
+            switch (entry.nAction)
+            {
+            case CAddrJournalEntry::ADD:
+                Add_(entry.addr, entry.source, entry.nTime);
+                break;
+            case CAddrJournalEntry::GOOD:
+                Good_(entry.addr, entry.nTime);
+                break;
+            case CAddrJournalEntry::ATTEMPT:
+                Attempt_(entry.addr, entry.nTime);
+                break;
+            }
+        }
+        fReplaying = false;
+        InvalidateSnapshot_();
+        Check();
+    }
+
+private:
+    // Drop the snapshot once the table has grown by an eighth since it was taken.
+    void InvalidateSnapshotIfGrown_()
+    {
+        boost::shared_ptr<const CAddrManSnapshot> pCurrent = boost::atomic_load(&pSnapshot);
+        if (pCurrent && size() > pCurrent->nSize + pCurrent->nSize / 8)
+            InvalidateSnapshot_();
+    }
 };
 
 #endif
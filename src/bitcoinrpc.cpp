@@ -24,6 +24,9 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread.hpp>
+#include <deque>
 #include <list>
 
 #define printf OutputDebugStringF
@@ -36,10 +39,12 @@ using namespace json_spirit;
 void ThreadRPCServer2(void* parg);
 
 static std::string strRPCUserColonPass;
+static bool fREST = false;
 
-const Object emptyobj;
+// Size of the chunks a reply written as it is made goes out in
+static const unsigned int RPC_REPLY_CHUNK_SIZE = 64 * 1024;
 
-void ThreadRPCServer3(void* parg);
+const Object emptyobj;
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -226,6 +231,108 @@ Value stop(const Array& params, bool fHelp)
 }
 
 
+//
+// Server statistics
+//
+
+// Latency buckets, each up to ten times the last: 1ms, 10ms, 100ms, 1s, and longer
+static const int RPC_LATENCY_BUCKETS = 5;
+// Queue depth buckets, each up to twice the last: 0, 1, 2-3, 4-7, 8-15, 16-31, and deeper
+static const int RPC_DEPTH_BUCKETS = 7;
+
+/** Calls made to one RPC method, and how long they took */
+class CRPCMethodStats
+{
+public:
+    int64_t nCalls;
+    int64_t nTotalMicros;
+    int64_t vLatency[RPC_LATENCY_BUCKETS];
+
+    CRPCMethodStats()
+    {
+        nCalls = 0;
+        nTotalMicros = 0;
+        for (int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+            vLatency[i] = 0;
+    }
+};
+
+static CCriticalSection cs_rpcStats;
+static map<string, CRPCMethodStats> mapRPCMethodStats;
+static int64_t vRPCQueueDepth[RPC_DEPTH_BUCKETS];   // depth found by each request queued
+static unsigned int nRPCQueueDepth = 0;
+static unsigned int nRPCQueueDepthMax = 0;
+static int64_t nRPCRejected = 0;
+static int nRPCThreads = 0;
+static unsigned int nRPCWorkQueue = 0;
+static int nRPCBatchConcurrency = 1;
+
+static void RecordRPCCall(const string& strMethod, int64_t nMicros)
+{
+    int nBucket = 0;
+    for (int64_t nLimit = 1000; nBucket < RPC_LATENCY_BUCKETS - 1 && nMicros >= nLimit; nLimit *= 10)
+        nBucket++;
+
+    LOCK(cs_rpcStats);
+    CRPCMethodStats& stats = mapRPCMethodStats[strMethod];
+    stats.nCalls++;
+    stats.nTotalMicros += nMicros;
+    stats.vLatency[nBucket]++;
+}
+
+static void RecordRPCQueueDepth(unsigned int nDepth)
+{
+    int nBucket = 0;
+    for (unsigned int nLimit = 1; nBucket < RPC_DEPTH_BUCKETS - 1 && nDepth >= nLimit; nLimit *= 2)
+        nBucket++;
+
+    LOCK(cs_rpcStats);
+    vRPCQueueDepth[nBucket]++;
+}
+
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns the state of the RPC work queue, and the calls made to each method "
+            "with a histogram of how long they took.");
+
+    static const char* vLatencyName[RPC_LATENCY_BUCKETS] = { "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+    static const char* vDepthName[RPC_DEPTH_BUCKETS] = { "0", "1", "2-3", "4-7", "8-15", "16-31", ">=32" };
+
+    LOCK(cs_rpcStats);
+    Object obj;
+    obj.push_back(Pair("threads",       nRPCThreads));
+    obj.push_back(Pair("workqueue",     (int)nRPCWorkQueue));
+    obj.push_back(Pair("batchconcurrency", nRPCBatchConcurrency));
+    obj.push_back(Pair("queuedepth",    (int)nRPCQueueDepth));
+    obj.push_back(Pair("maxqueuedepth", (int)nRPCQueueDepthMax));
+    obj.push_back(Pair("rejected",      nRPCRejected));
+
+    Object depth;
+    for (int i = 0; i < RPC_DEPTH_BUCKETS; i++)
+        depth.push_back(Pair(vDepthName[i], vRPCQueueDepth[i]));
+    obj.push_back(Pair("queuedepthhistogram", depth));
+
+    Object methods;
+    BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapRPCMethodStats)
+    {
+        const CRPCMethodStats& stats = item.second;
+        Object method;
+        method.push_back(Pair("calls", stats.nCalls));
+        method.push_back(Pair("averagems", (double)stats.nTotalMicros / stats.nCalls / 1000));
+        Object latency;
+        for (int i = 0; i < RPC_LATENCY_BUCKETS; i++)
+            latency.push_back(Pair(vLatencyName[i], stats.vLatency[i]));
+        method.push_back(Pair("latency", latency));
+        methods.push_back(Pair(item.first, method));
+    }
+    obj.push_back(Pair("methods", methods));
+    return obj;
+}
+
+
 
 //
 // Call Table
@@ -233,89 +340,112 @@ Value stop(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      function                 safemd  unlocked
-  //  ------------------------  -----------------------  ------  --------
-    { "help",                   &help,                   true,   true },
-    { "stop",                   &stop,                   true,   true },
-    { "getbestblockhash",       &getbestblockhash,       true,   false },
-    { "getblockcount",          &getblockcount,          true,   false },
-    { "getconnectioncount",     &getconnectioncount,     true,   false },
-    { "getpeerinfo",            &getpeerinfo,            true,   false },
-    { "getdifficulty",          &getdifficulty,          true,   false },
-    { "getinfo",                &getinfo,                true,   false },
-    { "getsubsidy",             &getsubsidy,             true,   false },
-    { "getmininginfo",          &getmininginfo,          true,   false },
-    { "getstakinginfo",         &getstakinginfo,         true,   false },
-    { "getnewaddress",          &getnewaddress,          true,   false },
-    { "getnewpubkey",           &getnewpubkey,           true,   false },
-    { "getaccountaddress",      &getaccountaddress,      true,   false },
-    { "setaccount",             &setaccount,             true,   false },
-    { "getaccount",             &getaccount,             false,  false },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,   false },
-    { "sendtoaddress",          &sendtoaddress,          false,  false },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,  false },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,  false },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,  false },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,  false },
-    { "backupwallet",           &backupwallet,           true,   false },
-    { "keypoolrefill",          &keypoolrefill,          true,   false },
-    { "walletpassphrase",       &walletpassphrase,       true,   false },
-    { "walletpassphrasechange", &walletpassphrasechange, false,  false },
-    { "walletlock",             &walletlock,             true,   false },
-    { "encryptwallet",          &encryptwallet,          false,  false },
-    { "validateaddress",        &validateaddress,        true,   false },
-    { "validatepubkey",         &validatepubkey,         true,   false },
-    { "getbalance",             &getbalance,             false,  false },
-    { "move",                   &movecmd,                false,  false },
-    { "sendfrom",               &sendfrom,               false,  false },
-    { "sendmany",               &sendmany,               false,  false },
-    { "addmultisigaddress",     &addmultisigaddress,     false,  false },
-    { "addredeemscript",        &addredeemscript,        false,  false },
-    { "getrawmempool",          &getrawmempool,          true,   false },
-    { "getblock",               &getblock,               false,  false },
-    { "getblockbynumber",       &getblockbynumber,       false,  false },
-    { "getblockhash",           &getblockhash,           false,  false },
-    { "gettransaction",         &gettransaction,         false,  false },
-    { "dumpbootstrap",          &dumpbootstrap,          false,  false },
-    { "listtransactions",       &listtransactions,       false,  false },
-    { "listaddressgroupings",   &listaddressgroupings,   false,  false },
-    { "signmessage",            &signmessage,            false,  false },
-    { "verifymessage",          &verifymessage,          false,  false },
-    { "getwork",                &getwork,                true,   false },
-    { "getworkex",              &getworkex,              true,   false },
-    { "listaccounts",           &listaccounts,           false,  false },
-    { "settxfee",               &settxfee,               false,  false },
-    { "getblocktemplate",       &getblocktemplate,       true,   false },
-    { "submitblock",            &submitblock,            false,  false },
-    { "listsinceblock",         &listsinceblock,         false,  false },
-    { "dumpprivkey",            &dumpprivkey,            false,  false },
-    { "dumpwallet",             &dumpwallet,             true,   false },
-    { "importwallet",           &importwallet,           false,  false },
-    { "importprivkey",          &importprivkey,          false,  false },
-    { "listunspent",            &listunspent,            false,  false },
-    { "getrawtransaction",      &getrawtransaction,      false,  false },
-    { "createrawtransaction",   &createrawtransaction,   false,  false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,  false },
-    { "decodescript",           &decodescript,           false,  false },
-    { "signrawtransaction",     &signrawtransaction,     false,  false },
-    { "sendrawtransaction",     &sendrawtransaction,     false,  false },
-    { "getcheckpoint",          &getcheckpoint,          true,   false },
-    { "reservebalance",         &reservebalance,         false,  true},
-    { "checkwallet",            &checkwallet,            false,  true},
-    { "repairwallet",           &repairwallet,           false,  true},
-    { "resendtx",               &resendtx,               false,  true},
-    { "makekeypair",            &makekeypair,            false,  true},
-    { "sendalert",              &sendalert,              false,  false},
-    
-    { "getnewstealthaddress",   &getnewstealthaddress,   false,  false},
-    { "liststealthaddresses",   &liststealthaddresses,   false,  false},
-    { "importstealthaddress",   &importstealthaddress,   false,  false},
-    { "sendtostealthaddress",   &sendtostealthaddress,   false,  false},
-    { "clearwallettransactions",&clearwallettransactions,false,  false},
-    { "scanforalltxns",         &scanforalltxns,         false,  false},
-    { "scanforstealthtxns",     &scanforstealthtxns,     false,  false},
-    { "getwalletinfo",          &getwalletinfo,          true,   false},
-    
+{ //  name                      function                 safemd  locks
+  //  ------------------------  -----------------------  ------  ----------------------
+    { "help",                   &help,                   true,   RPC_LOCKS_NONE },
+    { "stop",                   &stop,                   true,   RPC_LOCKS_NONE },
+    { "getrpcinfo",             &getrpcinfo,             true,   RPC_LOCKS_NONE },
+    { "getbestblockhash",       &getbestblockhash,       true,   RPC_LOCKS_CHAIN_SHARED },
+    { "getblockcount",          &getblockcount,          true,   RPC_LOCKS_CHAIN_SHARED },
+    { "getconnectioncount",     &getconnectioncount,     true,   RPC_LOCKS_MAIN_WALLET },
+    { "getpeerinfo",            &getpeerinfo,            true,   RPC_LOCKS_MAIN_WALLET },
+    { "getnotifyinfo",          &getnotifyinfo,          true,   RPC_LOCKS_NONE },
+    { "getdifficulty",          &getdifficulty,          true,   RPC_LOCKS_CHAIN_SHARED },
+    { "getinfo",                &getinfo,                true,   RPC_LOCKS_MAIN_WALLET },
+    { "getsubsidy",             &getsubsidy,             true,   RPC_LOCKS_MAIN_WALLET },
+    { "getmininginfo",          &getmininginfo,          true,   RPC_LOCKS_MAIN_WALLET },
+    { "getstakinginfo",         &getstakinginfo,         true,   RPC_LOCKS_MAIN_WALLET },
+    { "getnewaddress",          &getnewaddress,          true,   RPC_LOCKS_MAIN_WALLET },
+    { "getnewpubkey",           &getnewpubkey,           true,   RPC_LOCKS_MAIN_WALLET },
+    { "getaccountaddress",      &getaccountaddress,      true,   RPC_LOCKS_MAIN_WALLET },
+    { "setaccount",             &setaccount,             true,   RPC_LOCKS_MAIN_WALLET },
+    { "getaccount",             &getaccount,             false,  RPC_LOCKS_MAIN_WALLET },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,   RPC_LOCKS_MAIN_WALLET },
+    { "sendtoaddress",          &sendtoaddress,          false,  RPC_LOCKS_MAIN_WALLET },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,  RPC_LOCKS_MAIN_WALLET },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,  RPC_LOCKS_MAIN_WALLET },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,  RPC_LOCKS_MAIN_WALLET },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,  RPC_LOCKS_MAIN_WALLET },
+    { "backupwallet",           &backupwallet,           true,   RPC_LOCKS_MAIN_WALLET },
+    { "keypoolrefill",          &keypoolrefill,          true,   RPC_LOCKS_MAIN_WALLET },
+    { "walletpassphrase",       &walletpassphrase,       true,   RPC_LOCKS_MAIN_WALLET },
+    { "walletpassphrasechange", &walletpassphrasechange, false,  RPC_LOCKS_MAIN_WALLET },
+    { "walletlock",             &walletlock,             true,   RPC_LOCKS_MAIN_WALLET },
+    { "encryptwallet",          &encryptwallet,          false,  RPC_LOCKS_MAIN_WALLET },
+    { "validateaddress",        &validateaddress,        true,   RPC_LOCKS_NONE },
+    { "validatepubkey",         &validatepubkey,         true,   RPC_LOCKS_NONE },
+    { "getbalance",             &getbalance,             false,  RPC_LOCKS_MAIN_WALLET },
+    { "move",                   &movecmd,                false,  RPC_LOCKS_MAIN_WALLET },
+    { "sendfrom",               &sendfrom,               false,  RPC_LOCKS_MAIN_WALLET },
+    { "sendmany",               &sendmany,               false,  RPC_LOCKS_MAIN_WALLET },
+    { "addmultisigaddress",     &addmultisigaddress,     false,  RPC_LOCKS_MAIN_WALLET },
+    { "addredeemscript",        &addredeemscript,        false,  RPC_LOCKS_MAIN_WALLET },
+    { "getrawmempool",          &getrawmempool,          true,   RPC_LOCKS_NONE },
+    { "getblock",               &getblock,               false,  RPC_LOCKS_CHAIN_SHARED },
+    { "getblockbynumber",       &getblockbynumber,       false,  RPC_LOCKS_CHAIN_SHARED },
+    { "getblockhash",           &getblockhash,           false,  RPC_LOCKS_CHAIN_SHARED },
+    { "getblockheaders",        &getblockheaders,        true,   RPC_LOCKS_CHAIN_SHARED },
+    { "gettransaction",         &gettransaction,         false,  RPC_LOCKS_WALLET_SHARED },
+    { "dumpbootstrap",          &dumpbootstrap,          false,  RPC_LOCKS_MAIN_WALLET },
+    { "listtransactions",       &listtransactions,       false,  RPC_LOCKS_MAIN_WALLET },
+    { "listaddressgroupings",   &listaddressgroupings,   false,  RPC_LOCKS_MAIN_WALLET },
+    { "signmessage",            &signmessage,            false,  RPC_LOCKS_MAIN_WALLET },
+    { "verifymessage",          &verifymessage,          false,  RPC_LOCKS_MAIN_WALLET },
+    { "getwork",                &getwork,                true,   RPC_LOCKS_MAIN_WALLET },
+    { "getworkex",              &getworkex,              true,   RPC_LOCKS_MAIN_WALLET },
+    { "listaccounts",           &listaccounts,           false,  RPC_LOCKS_MAIN_WALLET },
+    { "settxfee",               &settxfee,               false,  RPC_LOCKS_MAIN_WALLET },
+    { "getblocktemplate",       &getblocktemplate,       true,   RPC_LOCKS_NONE },
+    { "submitblock",            &submitblock,            false,  RPC_LOCKS_MAIN_WALLET },
+    { "listsinceblock",         &listsinceblock,         false,  RPC_LOCKS_MAIN_WALLET },
+    { "dumpprivkey",            &dumpprivkey,            false,  RPC_LOCKS_MAIN_WALLET },
+    { "dumpwallet",             &dumpwallet,             true,   RPC_LOCKS_MAIN_WALLET },
+    { "importwallet",           &importwallet,           false,  RPC_LOCKS_WALLET_SELF },
+    { "importprivkey",          &importprivkey,          false,  RPC_LOCKS_WALLET_SELF },
+    { "listunspent",            &listunspent,            false,  RPC_LOCKS_MAIN_WALLET },
+    { "getrawtransaction",      &getrawtransaction,      false,  RPC_LOCKS_CHAIN_SHARED },
+    { "createrawtransaction",   &createrawtransaction,   false,  RPC_LOCKS_MAIN_WALLET },
+    { "decoderawtransaction",   &decoderawtransaction,   false,  RPC_LOCKS_NONE },
+    { "decodescript",           &decodescript,           false,  RPC_LOCKS_NONE },
+    { "signrawtransaction",     &signrawtransaction,     false,  RPC_LOCKS_MAIN_WALLET },
+    { "sendrawtransaction",     &sendrawtransaction,     false,  RPC_LOCKS_MAIN_WALLET },
+    { "getaddresstxids",        &getaddresstxids,        false,  RPC_LOCKS_NONE },
+    { "getaddressutxos",        &getaddressutxos,        false,  RPC_LOCKS_NONE },
+    { "getspentinfo",           &getspentinfo,           false,  RPC_LOCKS_NONE },
+    { "getcheckpoint",          &getcheckpoint,          true,   RPC_LOCKS_CHAIN_SHARED },
+    { "reservebalance",         &reservebalance,         false,  RPC_LOCKS_NONE },
+    { "consolidatecoins",       &consolidatecoins,       false,  RPC_LOCKS_MAIN_WALLET },
+    { "checkwallet",            &checkwallet,            false,  RPC_LOCKS_NONE },
+    { "repairwallet",           &repairwallet,           false,  RPC_LOCKS_NONE },
+    { "resendtx",               &resendtx,               false,  RPC_LOCKS_NONE },
+    { "makekeypair",            &makekeypair,            false,  RPC_LOCKS_NONE },
+    { "sendalert",              &sendalert,              false,  RPC_LOCKS_MAIN_WALLET },
+
+    { "getnewstealthaddress",   &getnewstealthaddress,   false,  RPC_LOCKS_MAIN_WALLET },
+    { "liststealthaddresses",   &liststealthaddresses,   false,  RPC_LOCKS_MAIN_WALLET },
+    { "importstealthaddress",   &importstealthaddress,   false,  RPC_LOCKS_MAIN_WALLET },
+    { "sendtostealthaddress",   &sendtostealthaddress,   false,  RPC_LOCKS_MAIN_WALLET },
+    { "clearwallettransactions", &clearwallettransactions, false,  RPC_LOCKS_MAIN_WALLET },
+    { "scanforalltxns",         &scanforalltxns,         false,  RPC_LOCKS_WALLET_SELF },
+    { "scanforstealthtxns",     &scanforstealthtxns,     false,  RPC_LOCKS_MAIN_WALLET },
+    { "getwalletinfo",          &getwalletinfo,          true,   RPC_LOCKS_MAIN_WALLET },
+    { "getrescaninfo",          &getrescaninfo,          true,   RPC_LOCKS_NONE },
+
+};
+
+// Commands with large results, which the server has write them out as text as they
+// are made, to send once the command is done; the actors in vRPCCommands build the
+// whole result as before
+static const struct
+{
+    const char* name;
+    rpcstreamfn_type streamActor;
+} vRPCStreamCommands[] =
+{
+    { "getblock",               &getblock },
+    { "getblockbynumber",       &getblockbynumber },
+    { "listtransactions",       &listtransactions },
+    { "listunspent",            &listunspent },
 };
 
 CRPCTable::CRPCTable()
@@ -328,6 +458,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCStreamCommands) / sizeof(vRPCStreamCommands[0])); vcidx++)
+        mapStreamActors[vRPCStreamCommands[vcidx].name] = vRPCStreamCommands[vcidx].streamActor;
 }
 
 const CRPCCommand *CRPCTable::operator[](string name) const
@@ -338,6 +470,103 @@ const CRPCCommand *CRPCTable::operator[](string name) const
     return (*it).second;
 }
 
+//
+// Writing JSON a piece at a time
+//
+
+void CJSONStreamWriter::Separate()
+{
+    if (fKey)
+        fKey = false;
+    else if (!vfEmpty.empty())
+    {
+        if (!vfEmpty.back())
+            stream << ',';
+        vfEmpty.back() = false;
+    }
+}
+
+void CJSONStreamWriter::BeginObject()
+{
+    Separate();
+    stream << '{';
+    vfEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndObject()
+{
+    vfEmpty.pop_back();
+    stream << '}';
+}
+
+void CJSONStreamWriter::BeginArray()
+{
+    Separate();
+    stream << '[';
+    vfEmpty.push_back(true);
+}
+
+void CJSONStreamWriter::EndArray()
+{
+    vfEmpty.pop_back();
+    stream << ']';
+}
+
+void CJSONStreamWriter::Key(const string& strKey)
+{
+    Separate();
+    stream << write_string(Value(strKey), false) << ':';
+    fKey = true;
+}
+
+void CJSONStreamWriter::Write(const Value& value)
+{
+    Separate();
+    stream << write_string(value, false);
+    // the client went away, no use making the rest
+    if (!stream)
+        throw runtime_error("CJSONStreamWriter::Write() : write failed");
+}
+
+// Parents are not added to while a member is open, so the pointers to the open
+// objects and arrays stay good
+Value& CJSONValueWriter::Add(const Value& valueAdd)
+{
+    if (vOpen.empty())
+    {
+        value = valueAdd;
+        return value;
+    }
+    Value& parent = *vOpen.back();
+    if (parent.type() == obj_type)
+    {
+        parent.get_obj().push_back(Pair(strKey, valueAdd));
+        return parent.get_obj().back().value_;
+    }
+    parent.get_array().push_back(valueAdd);
+    return parent.get_array().back();
+}
+
+void CJSONValueWriter::BeginObject()
+{
+    vOpen.push_back(&Add(Object()));
+}
+
+void CJSONValueWriter::EndObject()
+{
+    vOpen.pop_back();
+}
+
+void CJSONValueWriter::BeginArray()
+{
+    vOpen.push_back(&Add(Array()));
+}
+
+void CJSONValueWriter::EndArray()
+{
+    vOpen.pop_back();
+}
+
 //
 // HTTP protocol
 //
@@ -375,7 +604,35 @@ string rfc1123Time()
     return string(buffer);
 }
 
-static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+// The headers of a reply whose body of nContentLength bytes follows
+static string HTTPReplyHeader(int nStatus, size_t nContentLength, bool keepalive, const string& strContentType = "application/json")
+{
+    const char *cStatus;
+         if (nStatus == HTTP_OK) cStatus = "OK";
+    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
+    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
+    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
+    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
+    else cStatus = "";
+    return strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Content-Length: %"PRIszu"\r\n"
+            "Content-Type: %s\r\n"
+            "Server: jumbucks-json-rpc/%s\r\n"
+            "\r\n",
+        nStatus,
+        cStatus,
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        nContentLength,
+        strContentType.c_str(),
+        FormatFullVersion().c_str());
+}
+
+static string HTTPReply(int nStatus, const string& strMsg, bool keepalive, const string& strContentType = "application/json")
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -394,29 +651,24 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
-    const char *cStatus;
-         if (nStatus == HTTP_OK) cStatus = "OK";
-    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
-    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
-    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
-    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
-    else cStatus = "";
+    return HTTPReplyHeader(nStatus, strMsg.size(), keepalive, strContentType) + strMsg;
+}
+
+// The headers of a reply whose body follows in chunks, as it is made
+static string HTTPReplyChunkedHeader(bool keepalive, const string& strContentType)
+{
     return strprintf(
-            "HTTP/1.1 %d %s\r\n"
+            "HTTP/1.1 200 OK\r\n"
             "Date: %s\r\n"
             "Connection: %s\r\n"
-            "Content-Length: %u\r\n"
-            "Content-Type: application/json\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: %s\r\n"
             "Server: jumbucks-json-rpc/%s\r\n"
-            "\r\n"
-            "%s",
-        nStatus,
-        cStatus,
+            "\r\n",
         rfc1123Time().c_str(),
         keepalive ? "keep-alive" : "close",
-        strMsg.size(),
-        FormatFullVersion().c_str(),
-        strMsg.c_str());
+        strContentType.c_str(),
+        FormatFullVersion().c_str());
 }
 
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
@@ -507,7 +759,29 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        while (true)
+        {
+            string str;
+            std::getline(stream, str);
+            int nChunk = strtol(str.c_str(), NULL, 16);
+            if (!stream || nChunk < 0 || nChunk > (int)MAX_SIZE)
+                return HTTP_INTERNAL_SERVER_ERROR;
+            if (nChunk == 0)
+            {
+                // trailers, if any, up to the empty line
+                while (std::getline(stream, str) && !str.empty() && str != "\r")
+                    ;
+                break;
+            }
+            vector<char> vch(nChunk);
+            stream.read(&vch[0], nChunk);
+            strMessageRet.append(vch.begin(), vch.end());
+            std::getline(stream, str);
+        }
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -661,112 +935,425 @@ private:
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
-class AcceptedConnection
+void ThreadRPCServer(void* parg)
+{
+    // Make this thread recognisable as the RPC listener
+    RenameThread("jumbucks-rpclist");
+
+    try
+    {
+        vnThreadsRunning[THREAD_RPCLISTENER]++;
+        ThreadRPCServer2(parg);
+        vnThreadsRunning[THREAD_RPCLISTENER]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_RPCLISTENER]--;
+        PrintException(&e, "ThreadRPCServer()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_RPCLISTENER]--;
+        PrintException(NULL, "ThreadRPCServer()");
+    }
+    printf("ThreadRPCServer exited\n");
+}
+
+class CRPCWorkQueue;
+
+/**
+ * A client connection to the RPC server.
+ *
+ * Requests are read asynchronously by the listener thread's io_service and handed
+ * to the work queue whole, so no thread is tied up by a client that is slow to
+ * send or keeps its connection open between requests. A connection is served one
+ * request at a time: only once a reply has been written is the next request read,
+ * from what is already buffered if the client sent several without waiting, so
+ * replies go back in the order the requests came in.
+ */
+class CRPCConnection : public boost::enable_shared_from_this<CRPCConnection>
 {
 public:
-    virtual ~AcceptedConnection() {}
+    ip::tcp::endpoint peer;
+    asio::ssl::stream<ip::tcp::socket> sslStream;
+
+    CRPCConnection(asio::io_service& io_serviceIn, ssl::context& context, bool fUseSSLIn, CRPCWorkQueue& workQueueIn) :
+        sslStream(io_serviceIn, context), io_service(io_serviceIn), timer(io_serviceIn), buf(MAX_SIZE), workQueue(workQueueIn)
+    {
+        fUseSSL = fUseSSLIn;
+        fReading = false;
+        nProto = 0;
+    }
 
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
+    void Start();
+    void ReadRequest();
+    void Process();
+    void ProcessREST();
+    bool Write(const string& strData);
+    bool Write(const char* pch, size_t nSize);
+    void Close();
+
+private:
+    asio::io_service& io_service;
+    deadline_timer timer;       // closes the connection when a request takes too long to arrive
+    asio::streambuf buf;        // received, not yet handled
+    CRPCWorkQueue& workQueue;
+    bool fUseSSL;
+    bool fReading;
+
+    // the request being handled
+    int nProto;
+    string strMethod;
+    string strURI;
+    map<string, string> mapHeaders;
+    string strRequest;
+
+    void HandleHandshake(const boost::system::error_code& error);
+    void HandleHeaders(const boost::system::error_code& error, size_t nHeaderBytes);
+    void HandleBody(const boost::system::error_code& error);
+    void HandleTimeout(const boost::system::error_code& error);
+    void Dispatch();
 };
 
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+static void ProcessConnection(const boost::shared_ptr<CRPCConnection>& conn)
 {
-public:
-    AcceptedConnectionImpl(
-            asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
-        sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+    try
     {
+        conn->Process();
     }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessConnection()");
+        conn->Close();
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessConnection()");
+        conn->Close();
+    }
+}
 
-    virtual std::iostream& stream()
+/**
+ * Connections with a request read, waiting for one of the -rpcthreads workers.
+ * At most -rpcworkqueue may wait, further requests are turned away with a 503.
+ * Workers also help with the batches other workers are running. Those requests
+ * for help come first, and are not limited, as there are never more than the
+ * batches being run asked for.
+ *
+ * A getblocktemplate long poll whose template is still current is parked rather
+ * than left to wait on a worker, so that miners waiting on the next block never
+ * keep the workers from other requests. One thread looks at the parked polls as
+ * the best block changes, and every second for the memory pool, and queues those
+ * with a new template to have, ahead of the depth limit as they were let in once.
+ */
+class CRPCWorkQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<boost::shared_ptr<CRPCConnection> > queue;
+    std::deque<boost::shared_ptr<CRPCBatch> > queueBatches;
+    std::list<std::pair<boost::shared_ptr<CRPCConnection>, Array> > listLongPolls;
+    unsigned int nMaxDepth;
+    bool fStop;
+    boost::thread_group threadGroup;
+
+    void Run();
+    void RunLongPolls();
+
+public:
+    CRPCWorkQueue(unsigned int nMaxDepthIn, int nThreads)
     {
-        return _stream;
+        nMaxDepth = nMaxDepthIn;
+        fStop = false;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CRPCWorkQueue::Run, this));
+        threadGroup.create_thread(boost::bind(&CRPCWorkQueue::RunLongPolls, this));
     }
 
-    virtual std::string peer_address_to_string() const
+    ~CRPCWorkQueue()
     {
-        return peer.address().to_string();
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        cond.notify_all();
+        threadGroup.join_all();
     }
 
-    virtual void close()
+    bool Enqueue(const boost::shared_ptr<CRPCConnection>& conn)
     {
-        _stream.close();
+        unsigned int nDepth;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nDepth = queue.size();
+            if (nDepth >= nMaxDepth)
+            {
+                LOCK(cs_rpcStats);
+                nRPCRejected++;
+                return false;
+            }
+            queue.push_back(conn);
+            {
+                LOCK(cs_rpcStats);
+                nRPCQueueDepth = queue.size();
+                nRPCQueueDepthMax = max(nRPCQueueDepthMax, nRPCQueueDepth);
+            }
+        }
+        RecordRPCQueueDepth(nDepth);
+        cond.notify_one();
+        return true;
     }
 
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
+    void EnqueueBatchHelpers(const boost::shared_ptr<CRPCBatch>& batch, int nHelpers)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (int i = 0; i < nHelpers; i++)
+                queueBatches.push_back(batch);
+        }
+        cond.notify_all();
+    }
 
-private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    void ParkLongPoll(const boost::shared_ptr<CRPCConnection>& conn, const Array& params)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        listLongPolls.push_back(make_pair(conn, params));
+    }
 };
 
-void ThreadRPCServer(void* parg)
+static CCriticalSection cs_THREAD_RPCHANDLER;
+
+void CRPCWorkQueue::RunLongPolls()
 {
-    // Make this thread recognisable as the RPC listener
-    RenameThread("jumbucks-rpclist");
+    RenameThread("jumbucks-rpcpoll");
 
-    try
+    uint256 hashSeen = 0;
+    while (true)
     {
-        vnThreadsRunning[THREAD_RPCLISTENER]++;
-        ThreadRPCServer2(parg);
-        vnThreadsRunning[THREAD_RPCLISTENER]--;
+        WaitForBestChainChange(hashSeen, 1000);
+
+        std::list<std::pair<boost::shared_ptr<CRPCConnection>, Array> > listPolls;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fStop || fShutdown)
+                break;
+            listPolls.swap(listLongPolls);
+        }
+
+        // Looked at without the queue's lock, as it takes csChainState
+        std::list<std::pair<boost::shared_ptr<CRPCConnection>, Array> > listPending;
+        std::vector<boost::shared_ptr<CRPCConnection> > vReady;
+        while (!listPolls.empty())
+        {
+            if (IsLongPollPending(listPolls.front().second))
+                listPending.splice(listPending.end(), listPolls, listPolls.begin());
+            else
+            {
+                vReady.push_back(listPolls.front().first);
+                listPolls.pop_front();
+            }
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            listLongPolls.splice(listLongPolls.end(), listPending);
+            queue.insert(queue.end(), vReady.begin(), vReady.end());
+            LOCK(cs_rpcStats);
+            nRPCQueueDepth = queue.size();
+        }
+        if (!vReady.empty())
+            cond.notify_all();
     }
-    catch (std::exception& e) {
-        vnThreadsRunning[THREAD_RPCLISTENER]--;
-        PrintException(&e, "ThreadRPCServer()");
-    } catch (...) {
-        vnThreadsRunning[THREAD_RPCLISTENER]--;
-        PrintException(NULL, "ThreadRPCServer()");
+}
+
+void CRPCWorkQueue::Run()
+{
+    // Make this thread recognisable as an RPC handler
+    RenameThread("jumbucks-rpchand");
+
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]++;
+    }
+
+    while (true)
+    {
+        boost::shared_ptr<CRPCConnection> conn;
+        boost::shared_ptr<CRPCBatch> batch;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            // StopNode waits for the handlers, so they look at fShutdown now and then
+            while (queue.empty() && queueBatches.empty() && !fStop && !fShutdown)
+                cond.timed_wait(lock, posix_time::milliseconds(250));
+            if (fStop || fShutdown)
+                break;
+            if (!queueBatches.empty())
+            {
+                batch = queueBatches.front();
+                queueBatches.pop_front();
+            }
+            else
+            {
+                conn = queue.front();
+                queue.pop_front();
+                LOCK(cs_rpcStats);
+                nRPCQueueDepth = queue.size();
+            }
+        }
+
+        if (batch)
+            batch->Help();
+        else
+            ProcessConnection(conn);
+    }
+
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
-    printf("ThreadRPCServer exited\n");
 }
 
-// Forward declaration required for RPCListen
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-                             ssl::context& context,
-                             bool fUseSSL,
-                             AcceptedConnection* conn,
-                             const boost::system::error_code& error);
+void CRPCConnection::Start()
+{
+    if (fUseSSL)
+        sslStream.async_handshake(ssl::stream_base::server,
+            boost::bind(&CRPCConnection::HandleHandshake, shared_from_this(), asio::placeholders::error));
+    else
+        ReadRequest();
+}
+
+void CRPCConnection::HandleHandshake(const boost::system::error_code& error)
+{
+    if (error)
+        Close();
+    else
+        ReadRequest();
+}
+
+void CRPCConnection::ReadRequest()
+{
+    if (fShutdown)
+    {
+        Close();
+        return;
+    }
+
+    fReading = true;
+    timer.expires_from_now(posix_time::seconds(GetArg("-rpcservertimeout", 30)));
+    timer.async_wait(boost::bind(&CRPCConnection::HandleTimeout, shared_from_this(), asio::placeholders::error));
+
+    // Read up to the end of the HTTP headers, which may be buffered already
+    if (fUseSSL)
+        asio::async_read_until(sslStream, buf, "\r\n\r\n",
+            boost::bind(&CRPCConnection::HandleHeaders, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred));
+    else
+        asio::async_read_until(sslStream.next_layer(), buf, "\r\n\r\n",
+            boost::bind(&CRPCConnection::HandleHeaders, shared_from_this(), asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+void CRPCConnection::HandleTimeout(const boost::system::error_code& error)
+{
+    // the timer may have been set again for the next request since this expired
+    if (error || !fReading || timer.expires_at() > deadline_timer::traits_type::now())
+        return;
+    boost::system::error_code ec;
+    sslStream.lowest_layer().close(ec);
+}
+
+void CRPCConnection::HandleHeaders(const boost::system::error_code& error, size_t nHeaderBytes)
+{
+    if (error)
+    {
+        Close();
+        return;
+    }
+
+    // Find the length of the body in the headers, they are parsed properly once it is here
+    string strHeaders(asio::buffers_begin(buf.data()), asio::buffers_begin(buf.data()) + nHeaderBytes);
+    istringstream ssHeaders(strHeaders);
+    string strRequestLine;
+    getline(ssHeaders, strRequestLine);
+    map<string, string> mapHeadersPeek;
+    int nLen = ReadHTTPHeaders(ssHeaders, mapHeadersPeek);
+    if (nLen < 0 || nLen > (int)MAX_SIZE - (int)nHeaderBytes)
+    {
+        Close();
+        return;
+    }
+
+    size_t nTotal = nHeaderBytes + nLen;
+    if (buf.size() >= nTotal)
+        Dispatch();
+    else if (fUseSSL)
+        asio::async_read(sslStream, buf, asio::transfer_at_least(nTotal - buf.size()),
+            boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error));
+    else
+        asio::async_read(sslStream.next_layer(), buf, asio::transfer_at_least(nTotal - buf.size()),
+            boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error));
+}
+
+void CRPCConnection::HandleBody(const boost::system::error_code& error)
+{
+    if (error)
+        Close();
+    else
+        Dispatch();
+}
+
+void CRPCConnection::Dispatch()
+{
+    fReading = false;
+    timer.cancel();
+
+    // Takes exactly this request out of the buffer, leaving any that follow it
+    std::istream stream(&buf);
+    if (!ReadHTTPRequestLine(stream, nProto, strMethod, strURI))
+    {
+        Close();
+        return;
+    }
+    ReadHTTPMessage(stream, mapHeaders, strRequest, nProto);
+
+    if (!workQueue.Enqueue(shared_from_this()))
+    {
+        printf("ThreadRPCServer work queue full, request from %s turned away\n", peer.address().to_string().c_str());
+        Write(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", false));
+        Close();
+    }
+}
+
+bool CRPCConnection::Write(const string& strData)
+{
+    return Write(strData.data(), strData.size());
+}
+
+bool CRPCConnection::Write(const char* pch, size_t nSize)
+{
+    boost::system::error_code ec;
+    if (fUseSSL)
+        asio::write(sslStream, asio::buffer(pch, nSize), asio::transfer_all(), ec);
+    else
+        asio::write(sslStream.next_layer(), asio::buffer(pch, nSize), asio::transfer_all(), ec);
+    return !ec;
+}
+
+void CRPCConnection::Close()
+{
+    boost::system::error_code ec;
+    sslStream.lowest_layer().close(ec);
+}
 
 /**
  * Sets up I/O resources to accept and handle a new connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                    ssl::context& context,
-                   const bool fUseSSL)
-{
-    // Accept connection
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL);
-
-    acceptor->async_accept(
-            conn->sslStream.lowest_layer(),
-            conn->peer,
-            boost::bind(&RPCAcceptHandler<Protocol, SocketAcceptorService>,
-                acceptor,
-                boost::ref(context),
-                fUseSSL,
-                conn,
-                boost::asio::placeholders::error));
-}
+                   const bool fUseSSL,
+                   CRPCWorkQueue& workQueue);
 
 /**
  * Accept and handle incoming connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             CRPCWorkQueue& workQueue,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error)
 {
     vnThreadsRunning[THREAD_RPCLISTENER]++;
@@ -774,37 +1361,51 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted
      && acceptor->is_open())
-        RPCListen(acceptor, context, fUseSSL);
-
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
+        RPCListen(acceptor, context, fUseSSL, workQueue);
 
     // TODO: Actually handle errors
     if (error)
     {
-        delete conn;
     }
 
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading anything, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn
-          && !ClientAllowed(tcp_conn->peer.address()))
+    else if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        delete conn;
+            conn->Write(HTTPReply(HTTP_FORBIDDEN, "", false));
+        conn->Close();
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
-    }
+    // start reading requests, they are handed to the workers as they arrive
+    else
+        conn->Start();
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
 
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor,
+                   ssl::context& context,
+                   const bool fUseSSL,
+                   CRPCWorkQueue& workQueue)
+{
+    // Accept connection
+    boost::shared_ptr<CRPCConnection> conn(new CRPCConnection(acceptor->get_io_service(), context, fUseSSL, workQueue));
+
+    acceptor->async_accept(
+            conn->sslStream.lowest_layer(),
+            conn->peer,
+            boost::bind(&RPCAcceptHandler,
+                acceptor,
+                boost::ref(context),
+                fUseSSL,
+                boost::ref(workQueue),
+                conn,
+                boost::asio::placeholders::error));
+}
+
 void ThreadRPCServer2(void* parg)
 {
     printf("ThreadRPCServer started\n");
@@ -839,9 +1440,16 @@ void ThreadRPCServer2(void* parg)
     }
 
     const bool fUseSSL = GetBoolArg("-rpcssl");
+    fREST = GetBoolArg("-rest");
 
     asio::io_service io_service;
 
+    // Requests are executed by a fixed number of workers, whatever the number of clients
+    nRPCThreads = max((int)GetArg("-rpcthreads", 4), 1);
+    nRPCWorkQueue = max((int)GetArg("-rpcworkqueue", 16), 1);
+    nRPCBatchConcurrency = max((int)GetArg("-rpcbatchconcurrency", 4), 1);
+    CRPCWorkQueue workQueue(nRPCWorkQueue, nRPCThreads);
+
     ssl::context context(io_service, ssl::context::sslv23);
     if (fUseSSL)
     {
@@ -883,7 +1491,7 @@ void ThreadRPCServer2(void* parg)
         acceptor->bind(endpoint);
         acceptor->listen(socket_base::max_connections);
 
-        RPCListen(acceptor, context, fUseSSL);
+        RPCListen(acceptor, context, fUseSSL, workQueue);
         // Cancel outstanding listen-requests for this acceptor when shutting down
         StopRequests.connect(signals2::slot<void ()>(
                     static_cast<void (ip::tcp::acceptor::*)()>(&ip::tcp::acceptor::close), acceptor.get())
@@ -909,7 +1517,7 @@ void ThreadRPCServer2(void* parg)
             acceptor->bind(endpoint);
             acceptor->listen(socket_base::max_connections);
 
-            RPCListen(acceptor, context, fUseSSL);
+            RPCListen(acceptor, context, fUseSSL, workQueue);
             // Cancel outstanding listen-requests for this acceptor when shutting down
             StopRequests.connect(signals2::slot<void ()>(
                         static_cast<void (ip::tcp::acceptor::*)()>(&ip::tcp::acceptor::close), acceptor.get())
@@ -1001,126 +1609,346 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
+// Whether a batch request is for a command that may change the wallet
+static bool IsWalletChangingRequest(const Value& req)
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    if (req.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && (pcmd->locks == RPC_LOCKS_MAIN_WALLET || pcmd->locks == RPC_LOCKS_WALLET_SELF);
+}
 
-    return write_string(Value(ret), false) + "\n";
+CRPCBatch::CRPCBatch(const Array& vReqIn) : vReq(vReqIn), vReply(vReqIn.size())
+{
+    for (unsigned int i = 0; i < vReq.size(); i++)
+    {
+        if (IsWalletChangingRequest(vReq[i]))
+            vOrdered.push_back(i);
+        else
+            vUnordered.push_back(i);
+    }
+    nNext = 0;
+    nDone = 0;
 }
 
-static CCriticalSection cs_THREAD_RPCHANDLER;
+void CRPCBatch::Run(unsigned int nReq)
+{
+    // no other thread touches this reply until all are done
+    vReply[nReq] = JSONRPCExecOne(vReq[nReq]);
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (++nDone == vReq.size())
+        cond.notify_all();
+}
 
-void ThreadRPCServer3(void* parg)
+void CRPCBatch::Help()
 {
-    // Make this thread recognisable as the RPC handler
-    RenameThread("jumbucks-rpchand");
+    while (true)
+    {
+        unsigned int nWork;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (nNext > vUnordered.size())
+                return;
+            nWork = nNext++;
+        }
+
+        if (nWork == 0)
+        {
+            BOOST_FOREACH(unsigned int nReq, vOrdered)
+                Run(nReq);
+        }
+        else
+            Run(vUnordered[nWork - 1]);
+    }
+}
+
+Array CRPCBatch::Wait()
+{
+    Help();
+
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (nDone < vReq.size())
+        cond.wait(lock);
+    return Array(vReply.begin(), vReply.end());
+}
 
+static string JSONRPCExecBatch(const Array& vReq, CRPCWorkQueue& workQueue)
+{
+    boost::shared_ptr<CRPCBatch> batch(new CRPCBatch(vReq));
+
+    // This thread runs the batch too, and asking for more helpers than there are
+    // other workers gains nothing. A helper that only gets to run once the batch
+    // is done finds nothing left and returns.
+    int nHelpers = min(min(nRPCBatchConcurrency, nRPCThreads), (int)vReq.size()) - 1;
+    if (nHelpers > 0)
+        workQueue.EnqueueBatchHelpers(batch, nHelpers);
+
+    return write_string(Value(batch->Wait()), false) + "\n";
+}
+
+/**
+ * The body of a reply, sent in chunks as it is written. A body that never fills a
+ * chunk goes out as a plain reply with its length, just as if it had been written
+ * whole, and until the first chunk has gone the reply can still be replaced by an
+ * error. The content type is looked at when the headers go out.
+ */
+class CRPCChunkedBuf : public std::streambuf
+{
+private:
+    CRPCConnection& conn;
+    bool fKeepAlive;
+    const string& strContentType;
+    bool fStarted;
+    vector<char> vch;
+
+    bool SendChunk()
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        string strData;
+        if (!fStarted)
+        {
+            strData = HTTPReplyChunkedHeader(fKeepAlive, strContentType);
+            fStarted = true;
+        }
+        unsigned int nSize = pptr() - pbase();
+        if (nSize > 0)
+            strData += strprintf("%x\r\n", nSize) + string(pbase(), nSize) + "\r\n";
+        setp(&vch[0], &vch[0] + vch.size());
+        return conn.Write(strData);
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
 
-    bool fRun = true;
-    while (true)
+protected:
+    int overflow(int c)
     {
-        if (fShutdown || !fRun)
+        if (!SendChunk())
+            return traits_type::eof();
+        if (c != traits_type::eof())
         {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
-            return;
+            *pptr() = c;
+            pbump(1);
         }
+        return traits_type::not_eof(c);
+    }
+
+public:
+    CRPCChunkedBuf(CRPCConnection& connIn, bool fKeepAliveIn, const string& strContentTypeIn) :
+        conn(connIn), strContentType(strContentTypeIn), vch(RPC_REPLY_CHUNK_SIZE)
+    {
+        fKeepAlive = fKeepAliveIn;
+        fStarted = false;
+        setp(&vch[0], &vch[0] + vch.size());
+    }
 
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+    bool Started() const { return fStarted; }
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+    // Only a body that has not started going out can have a status other than 200
+    bool Finish(int nStatus = HTTP_OK)
+    {
+        if (!fStarted)
+            return conn.Write(HTTPReply(nStatus, string(pbase(), pptr() - pbase()), fKeepAlive, strContentType));
+        return SendChunk() && conn.Write("0\r\n\r\n");
+    }
+};
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+// A reply written out in full before any of it is sent, which is read where it lies
+class CRPCReplyBuf : public std::stringbuf
+{
+public:
+    const char* Data() const { return pbase(); }
+    size_t Size() const { return pptr() - pbase(); }
+};
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
+void CRPCConnection::ProcessREST()
+{
+    bool fKeepAlive = mapHeaders["connection"] != "close" && nProto >= 1;
+    string strContentType = "text/plain";
+    CRPCChunkedBuf chunkbuf(*this, fKeepAlive, strContentType);
+    std::stringbuf bufWhole;    // HTTP/1.0 has no chunks, the body goes out whole
+    std::ostream stream(nProto >= 1 ? (std::streambuf*)&chunkbuf : &bufWhole);
+    int nStatus;
+    try
+    {
+        if (strMethod != "GET")
         {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            stream << "Only GET is supported\r\n";
+            nStatus = HTTP_BAD_REQUEST;
         }
-        if (!HTTPAuthorized(mapHeaders))
+        else
+            nStatus = HTTPReqREST(strURI, strContentType, stream);
+    }
+    catch (std::exception& e)
+    {
+        // part of the reply has gone already, too late for an error
+        if (chunkbuf.Started())
         {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
+            Close();
+            return;
         }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        Write(HTTPReply(HTTP_INTERNAL_SERVER_ERROR, string(e.what()) + "\r\n", false, "text/plain"));
+        Close();
+        return;
+    }
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+    bool fWritten;
+    if (nProto >= 1)
+        fWritten = chunkbuf.Finish(nStatus);
+    else
+        fWritten = Write(HTTPReply(nStatus, bufWhole.str(), false, strContentType));
+    if (fKeepAlive && fWritten && !fShutdown)
+        io_service.post(boost::bind(&CRPCConnection::ReadRequest, shared_from_this()));
+    else
+        Close();
+}
+
+void CRPCConnection::Process()
+{
+    // The REST interface reads only public data, and needs no authorization
+    if (fREST && strURI.compare(0, 6, "/rest/") == 0)
+    {
+        ProcessREST();
+        return;
+    }
 
-            string strReply;
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        Write(HTTPReply(HTTP_UNAUTHORIZED, "", false));
+        Close();
+        return;
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", peer.address().to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            MilliSleep(250);
+
+        Write(HTTPReply(HTTP_UNAUTHORIZED, "", false));
+        Close();
+        return;
+    }
+    bool fKeepAlive = mapHeaders["connection"] != "close";
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!read_string(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        string strReply;
 
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
+
+            // Comes back through the queue when there is a new template to have
+            if (jreq.strMethod == "getblocktemplate" && IsLongPollPending(jreq.params))
+            {
+                workQueue.ParkLongPoll(shared_from_this(), jreq.params);
+                return;
+            }
+
+            // A large result is written out as text as it is made, in the same form as
+            // JSONRPCReply gives, rather than built up as a Value first. It goes to the
+            // socket only once the command has returned and released its locks, so a
+            // client that reads slowly holds up nothing but its own connection: the
+            // headers first, then the text straight from the buffer it was written to.
+            if (tableRPC.IsStreamed(jreq.strMethod))
+            {
+                CRPCReplyBuf bufReply;
+                std::ostream stream(&bufReply);
+                CJSONStreamWriter writer(stream);
+                writer.BeginObject();
+                writer.Key("result");
+                tableRPC.execute(jreq.strMethod, jreq.params, writer);
+                writer.Write("error", Value::null);
+                writer.Write("id", jreq.id);
+                writer.EndObject();
+                stream << "\n";
+                if (!Write(HTTPReplyHeader(HTTP_OK, bufReply.Size(), fKeepAlive)) ||
+                    !Write(bufReply.Data(), bufReply.Size()))
+                    fKeepAlive = false;
+            }
+            else
+            {
                 Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
                 // Send reply
                 strReply = JSONRPCReply(result, Value::null, jreq.id);
+                Write(HTTPReply(HTTP_OK, strReply, fKeepAlive));
+            }
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
-        {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+        // array of requests
+        } else if (valRequest.type() == array_type) {
+            strReply = JSONRPCExecBatch(valRequest.get_array(), workQueue);
+            Write(HTTPReply(HTTP_OK, strReply, fKeepAlive));
         }
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
     }
-
-    delete conn;
+    catch (Object& objError)
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]--;
+        ostringstream stream;
+        ErrorReply(stream, objError, jreq.id);
+        Write(stream.str());
+        fKeepAlive = false;
     }
+    catch (std::exception& e)
+    {
+        ostringstream stream;
+        ErrorReply(stream, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        Write(stream.str());
+        fKeepAlive = false;
+    }
+
+    // the next request, if any, is read by the listener thread again
+    if (fKeepAlive && !fShutdown)
+        io_service.post(boost::bind(&CRPCConnection::ReadRequest, shared_from_this()));
+    else
+        Close();
 }
 
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    Value result;
+    Run(strMethod, params, &result, NULL);
+    return result;
+}
+
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& writer) const
+{
+    Run(strMethod, params, NULL, &writer);
+}
+
+static void CallActor(const CRPCCommand *pcmd, rpcstreamfn_type pfnStream, const Array& params, Value* presult, CJSONWriter* pwriter)
+{
+    if (pwriter)
+        (*pfnStream)(params, false, *pwriter);
+    else
+        *presult = pcmd->actor(params, false);
+}
+
+void CRPCTable::Run(const std::string &strMethod, const json_spirit::Array &params, Value* presult, CJSONWriter* pwriter) const
 {
     // Find method
     const CRPCCommand *pcmd = tableRPC[strMethod];
     if (!pcmd)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+    rpcstreamfn_type pfnStream = NULL;
+    if (pwriter)
+    {
+        map<string, rpcstreamfn_type>::const_iterator it = mapStreamActors.find(strMethod);
+        if (it == mapStreamActors.end())
+            throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+        pfnStream = it->second;
+    }
 
     // Observe safe mode
     string strWarning = GetWarnings("rpc");
@@ -1131,16 +1959,39 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     try
     {
         // Execute
-        Value result;
+        int64_t nStart = GetTimeMicros();
+        try
         {
-            if (pcmd->unlocked)
-                result = pcmd->actor(params, false);
+            if (pcmd->locks == RPC_LOCKS_NONE || pcmd->locks == RPC_LOCKS_WALLET_SELF)
+                CallActor(pcmd, pfnStream, params, presult, pwriter);
+            else if (pcmd->locks == RPC_LOCKS_CHAIN_SHARED) {
+                // runs alongside other readers, and block validation up to the point the chain changes
+                READ_LOCK(csChainState);
+                CallActor(pcmd, pfnStream, params, presult, pwriter);
+            }
+            else if (pcmd->locks == RPC_LOCKS_WALLET_SHARED) {
+                // the wallet first: a block submitted over RPC holds it on its way to
+                // changing the chain
+                LOCK(pwalletMain->cs_wallet);
+                READ_LOCK(csChainState);
+                CallActor(pcmd, pfnStream, params, presult, pwriter);
+            }
             else {
                 LOCK2(cs_main, pwalletMain->cs_wallet);
-                result = pcmd->actor(params, false);
+                CallActor(pcmd, pfnStream, params, presult, pwriter);
             }
         }
-        return result;
+        catch (...)
+        {
+            RecordRPCCall(strMethod, GetTimeMicros() - nStart);
+            throw;
+        }
+        RecordRPCCall(strMethod, GetTimeMicros() - nStart);
+        // what the call changed in the wallet is written in one go; commands that
+        // don't take the wallet lock leave it to the wallet flush thread rather than
+        // wait behind staking or a rescan here
+        if (pcmd->locks == RPC_LOCKS_MAIN_WALLET || pcmd->locks == RPC_LOCKS_WALLET_SELF)
+            pwalletMain->FlushPendingTxs();
     }
     catch (std::exception& e)
     {
@@ -1255,6 +2106,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "getblockbynumber"       && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getblockbynumber"       && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getblockheaders"        && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getblockheaders"        && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "dumpbootstrap"          && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "move"                   && n > 2) ConvertTo<double>(params[2]);
     if (strMethod == "move"                   && n > 3) ConvertTo<int64_t>(params[3]);
@@ -1278,12 +2131,23 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "sendmany"               && n > 2) ConvertTo<int64_t>(params[2]);
     if (strMethod == "reservebalance"         && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "reservebalance"         && n > 1) ConvertTo<double>(params[1]);
+    if (strMethod == "consolidatecoins"       && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "consolidatecoins"       && n > 1) ConvertTo<double>(params[1]);
+    if (strMethod == "consolidatecoins"       && n > 2) ConvertTo<boost::int64_t>(params[2]);
+    if (strMethod == "consolidatecoins"       && n > 3) ConvertTo<double>(params[3]);
     if (strMethod == "addmultisigaddress"     && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "addmultisigaddress"     && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "listunspent"            && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listunspent"            && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "listunspent"            && n > 2) ConvertTo<Array>(params[2]);
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "getaddresstxids"        && n > 3) ConvertTo<int64_t>(params[3]);
+    if (strMethod == "getaddresstxids"        && n > 4) ConvertTo<int64_t>(params[4]);
+    if (strMethod == "getaddressutxos"        && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddressutxos"        && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "getspentinfo"           && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "signrawtransaction"     && n > 1) ConvertTo<Array>(params[1], true);
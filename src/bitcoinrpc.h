@@ -9,6 +9,7 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 
 class CBlockIndex;
 
@@ -28,6 +29,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -88,7 +90,89 @@ void RPCTypeCheck(const json_spirit::Array& params,
 void RPCTypeCheck(const json_spirit::Object& o,
                   const std::map<std::string, json_spirit::Value_type>& typesExpected, bool fAllowNull=false);
 
+/**
+ * Writes a JSON value a piece at a time, in exactly the form write_string(value, false)
+ * would give it as a whole, so that a large result need not be built up in memory
+ * first. Objects and arrays are begun and ended around their members, any of which
+ * may also be written whole as a json_spirit value.
+ */
+class CJSONWriter
+{
+public:
+    virtual ~CJSONWriter() {}
+
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    // names the next value, which is a member of the object begun last
+    virtual void Key(const std::string& strKey) = 0;
+    virtual void Write(const json_spirit::Value& value) = 0;
+
+    void Write(const std::string& strKey, const json_spirit::Value& value)
+    {
+        Key(strKey);
+        Write(value);
+    }
+};
+
+/** Writes the JSON text to a stream as it goes */
+class CJSONStreamWriter : public CJSONWriter
+{
+private:
+    std::ostream& stream;
+    std::vector<bool> vfEmpty;  // for each object or array begun and not ended, innermost last
+    bool fKey;                  // a key was written, its value comes next
+
+    void Separate();
+
+public:
+    CJSONStreamWriter(std::ostream& streamIn) : stream(streamIn), fKey(false) {}
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+    void Write(const json_spirit::Value& value);
+    using CJSONWriter::Write;
+};
+
+/** Builds the json_spirit value, for callers that want one */
+class CJSONValueWriter : public CJSONWriter
+{
+private:
+    json_spirit::Value value;
+    std::vector<json_spirit::Value*> vOpen;  // objects and arrays begun and not ended, innermost last
+    std::string strKey;
+
+    json_spirit::Value& Add(const json_spirit::Value& valueAdd);
+
+public:
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKeyIn) { strKey = strKeyIn; }
+    void Write(const json_spirit::Value& valueWrite) { Add(valueWrite); }
+    using CJSONWriter::Write;
+
+    const json_spirit::Value& GetValue() const { return value; }
+};
+
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+// For commands with large results: writes the result out as it is made
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
+
+/** The locks CRPCTable::execute takes for a command */
+enum RPCLocks
+{
+    RPC_LOCKS_NONE,          // none, the command takes what it needs itself
+    RPC_LOCKS_CHAIN_SHARED,  // csChainState shared, for reading the block index and best chain only
+    RPC_LOCKS_MAIN_WALLET,   // cs_main and the wallet
+    RPC_LOCKS_WALLET_SELF,   // none, the command changes the wallet taking cs_main and the wallet itself
+    RPC_LOCKS_WALLET_SHARED, // the wallet, then csChainState shared, for reading the wallet and the chain only
+};
 
 class CRPCCommand
 {
@@ -96,7 +180,7 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
-    bool unlocked;
+    RPCLocks locks;
 };
 
 /**
@@ -106,10 +190,15 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, rpcstreamfn_type> mapStreamActors;
+
+    void Run(const std::string &method, const json_spirit::Array &params, json_spirit::Value* presult, CJSONWriter* pwriter) const;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
     std::string help(std::string name) const;
+    // whether the command can write its result out as it goes
+    bool IsStreamed(const std::string& name) const { return mapStreamActors.count(name) > 0; }
 
     /**
      * Execute a method.
@@ -119,10 +208,53 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+    // The same, with the result written out through writer as it is made
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& writer) const;
 };
 
 extern const CRPCTable tableRPC;
 
+/**
+ * The requests of a JSON-RPC batch, run by any number of threads at once. Each
+ * thread that calls Help takes the next piece of work nobody has started and runs
+ * it, until there are none left; the thread that waits for the replies helps too,
+ * so the batch gets done even if no other thread comes along.
+ *
+ * Requests whose commands may change the wallet depend on each other, as with
+ * walletpassphrase, sendtoaddress and walletlock, so they all make up one piece of
+ * work, run one after another in the order they were asked for. Every other
+ * request, which only reads, is a piece of work of its own; gettransaction is one
+ * of them, so it need not see what an earlier request in the batch sent.
+ */
+class CRPCBatch
+{
+private:
+    const json_spirit::Array vReq;
+    std::vector<json_spirit::Object> vReply;
+    std::vector<unsigned int> vOrdered;     // the requests that may change the wallet
+    std::vector<unsigned int> vUnordered;   // and the others
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    unsigned int nNext;     // the first piece of work nobody has started: 0 for the ordered requests, then each other one
+    unsigned int nDone;     // requests
+
+    void Run(unsigned int nReq);
+
+public:
+    CRPCBatch(const json_spirit::Array& vReqIn);
+
+    void Help();
+    // The replies, in the order of the requests
+    json_spirit::Array Wait();
+};
+
+/** Most headers with their proof-of-stake fields one getblockheaders or REST request gets */
+static const int MAX_BLOCK_HEADERS_RESULTS = 50000;
+
+/** Answers a GET of a /rest/ URI, for -rest. The body is written to stream and its
+ *  type set, an error's body being its message; returns the HTTP status. */
+int HTTPReqREST(const std::string& strURI, std::string& strContentTypeRet, std::ostream& stream);
+
 extern int64_t nWalletUnlockTime;
 extern int64_t AmountFromValue(const json_spirit::Value& value);
 extern json_spirit::Value ValueFromAmount(int64_t amount);
@@ -132,6 +264,8 @@ extern double GetPoWMHashPS();
 extern double GetPoSKernelPS();
 
 extern std::string HexBits(unsigned int nBits);
+// Whether getblocktemplate params hold a valid longpollid whose template is still current
+extern bool IsLongPollPending(const json_spirit::Array& params);
 extern std::string HelpRequiringPassphrase();
 extern void EnsureWalletIsUnlocked();
 
@@ -145,6 +279,7 @@ extern std::vector<unsigned char> ParseHexV(const json_spirit::Value& v, std::st
 extern std::vector<unsigned char> ParseHexO(const json_spirit::Object& o, std::string strKey); 
 
 extern json_spirit::Value getconnectioncount(const json_spirit::Array& params, bool fHelp); // in rpcnet.cpp
+extern json_spirit::Value getnotifyinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value importwallet(const json_spirit::Array& params, bool fHelp);
@@ -181,6 +316,7 @@ extern json_spirit::Value addredeemscript(const json_spirit::Array& params, bool
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaccount(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listtransactions(const json_spirit::Array& params, bool fHelp);
+extern void listtransactions(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
@@ -195,6 +331,7 @@ extern json_spirit::Value validateaddress(const json_spirit::Array& params, bool
 extern json_spirit::Value getinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwalletinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value reservebalance(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value consolidatecoins(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value checkwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value repairwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value resendtx(const json_spirit::Array& params, bool fHelp);
@@ -204,11 +341,15 @@ extern json_spirit::Value getnewpubkey(const json_spirit::Array& params, bool fH
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
+extern void listunspent(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decoderawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decodescript(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value signrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendrawtransaction(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddresstxids(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressutxos(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getspentinfo(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getbestblockhash(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getblockcount(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
@@ -216,8 +357,11 @@ extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool f
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getblockheaders(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value getblockbynumber(const json_spirit::Array& params, bool fHelp);
+extern void getblockbynumber(const json_spirit::Array& params, bool fHelp, CJSONWriter& writer);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getnewstealthaddress(const json_spirit::Array& params, bool fHelp);
@@ -227,5 +371,6 @@ extern json_spirit::Value sendtostealthaddress(const json_spirit::Array& params,
 extern json_spirit::Value clearwallettransactions(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value scanforalltxns(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value scanforstealthtxns(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrescaninfo(const json_spirit::Array& params, bool fHelp);
 
 #endif
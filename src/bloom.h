@@ -0,0 +1,121 @@
+// Copyright (c) 2014 The Jumbucks developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include <string.h>
+#include <vector>
+
+#include <stdint.h>
+
+/** Compact probabilistic set of byte strings: contains() may give false
+ * positives, at a rate of about 1 in 1700 while no more than the sized for
+ * number of elements are inserted, but never false negatives.
+ *
+ * Elements are expected to be hashes or public keys already, so rather than
+ * hashing them again they are folded into two 64 bit words with a per-filter
+ * random tweak, from which the probe positions are derived.
+ */
+class CBloomFilter
+{
+private:
+    std::vector<uint64_t> vData;
+    unsigned int nElements;
+    unsigned int nCapacity;
+    uint64_t nTweak;
+
+    static const unsigned int BITS_PER_ELEMENT = 16;
+    static const unsigned int PROBES = 8;
+
+    static uint64_t Mix(uint64_t n)
+    {
+        n ^= n >> 33;
+        n *= 0xff51afd7ed558ccdULL;
+        n ^= n >> 33;
+        n *= 0xc4ceb9fe1a85ec53ULL;
+        n ^= n >> 33;
+        return n;
+    }
+
+    void Fold(const unsigned char* pch, unsigned int nSize, uint64_t& h1, uint64_t& h2) const
+    {
+        uint64_t n = nTweak ^ nSize;
+        unsigned int i = 0;
+        for (; i + 8 <= nSize; i += 8)
+        {
+            uint64_t w;
+            memcpy(&w, pch + i, 8);
+            n = Mix(n ^ w);
+        }
+        if (i < nSize)
+        {
+            uint64_t w = 0;
+            memcpy(&w, pch + i, nSize - i);
+            n = Mix(n ^ w);
+        }
+        h1 = n;
+        h2 = Mix(n + nTweak) | 1;
+    }
+
+public:
+    CBloomFilter()
+    {
+        nElements = 0;
+        nCapacity = 0;
+        nTweak = 0;
+    }
+
+    // Empty the filter and size it for nCapacityIn elements
+    void Reset(unsigned int nCapacityIn, uint64_t nTweakIn)
+    {
+        nCapacity = nCapacityIn;
+        nElements = 0;
+        nTweak = nTweakIn;
+        vData.assign((nCapacity * BITS_PER_ELEMENT + 63) / 64 + 1, 0);
+    }
+
+    void insert(const unsigned char* pch, unsigned int nSize)
+    {
+        if (vData.empty())
+            return;
+        uint64_t h1, h2;
+        Fold(pch, nSize, h1, h2);
+        uint64_t nBits = vData.size() * 64;
+        for (unsigned int i = 0; i < PROBES; i++)
+        {
+            uint64_t nBit = (h1 + i * h2) % nBits;
+            vData[nBit >> 6] |= (uint64_t)1 << (nBit & 63);
+        }
+        nElements++;
+    }
+
+    bool contains(const unsigned char* pch, unsigned int nSize) const
+    {
+        if (vData.empty())
+            return false;
+        uint64_t h1, h2;
+        Fold(pch, nSize, h1, h2);
+        uint64_t nBits = vData.size() * 64;
+        for (unsigned int i = 0; i < PROBES; i++)
+        {
+            uint64_t nBit = (h1 + i * h2) % nBits;
+            if (!(vData[nBit >> 6] & ((uint64_t)1 << (nBit & 63))))
+                return false;
+        }
+        return true;
+    }
+
+    // for uint160 and uint256 based types, which are stored as their raw bytes
+    template<typename T>
+    void insert(const T& obj) { insert((const unsigned char*)&obj, sizeof(obj)); }
+
+    template<typename T>
+    bool contains(const T& obj) const { return contains((const unsigned char*)&obj, sizeof(obj)); }
+
+    // Once past its capacity the false positive rate climbs quickly, time to resize
+    bool IsFull() const { return nElements >= nCapacity; }
+    unsigned int size() const { return nElements; }
+};
+
+#endif
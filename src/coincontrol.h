@@ -6,6 +6,8 @@ class CCoinControl
 {
 public:
     CTxDestination destChange;
+    // leave out the change output, what would have gone there is added to the fee
+    bool fNoChange;
 
     CCoinControl()
     {
@@ -15,6 +17,7 @@ public:
     void SetNull()
     {
         destChange = CNoDestination();
+        fNoChange = false;
         setSelected.clear();
     }
     
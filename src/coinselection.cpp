@@ -0,0 +1,257 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+struct CompareValueDescending
+{
+    bool operator()(const CCoinSelector::CoinValue& t1, const CCoinSelector::CoinValue& t2) const
+    {
+        return t1.first > t2.first;
+    }
+};
+
+CCoinSelector::CCoinSelector(const vector<CoinValue>& vCoinsIn) : vCoins(vCoinsIn)
+{
+    // shuffled first, so that coins of equal value are not always picked in the same order
+    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    stable_sort(vCoins.begin(), vCoins.end(), CompareValueDescending());
+
+    nLastTarget = 0;
+    nLastValue = -1;
+
+    vRemaining.resize(vCoins.size() + 1);
+    vRemaining[vCoins.size()] = 0;
+    for (int i = vCoins.size() - 1; i >= 0; i--)
+        vRemaining[i] = vRemaining[i + 1] + vCoins[i].first;
+}
+
+// index of the first, that is largest, coin worth less than nValue
+unsigned int CCoinSelector::FirstBelow(int64_t nValue) const
+{
+    unsigned int nLow = 0, nHigh = vCoins.size();
+    while (nLow < nHigh)
+    {
+        unsigned int nMid = (nLow + nHigh) / 2;
+        if (vCoins[nMid].first < nValue)
+            nHigh = nMid;
+        else
+            nLow = nMid + 1;
+    }
+    return nLow;
+}
+
+bool CCoinSelector::SelectBnB(unsigned int nBegin, int64_t nTargetValue, int64_t nSlack, vector<char>& vfBest, int64_t& nBest) const
+{
+    unsigned int nCoins = vCoins.size() - nBegin;
+    vector<char> vfIncluded(nCoins, false);
+    vector<unsigned int> vIncluded;   // the same, as a stack of positions
+    bool fFound = false;
+    int64_t nTotal = 0;
+    unsigned int nDepth = 0;   // next coin to decide on
+
+    for (unsigned int nTries = 0; nTries < SELECT_COINS_BNB_MAX_TRIES; nTries++)
+    {
+        bool fBacktrack = false;
+        if (nTotal + vRemaining[nBegin + nDepth] < nTargetValue)
+            fBacktrack = true;    // can't reach the target any more
+        else if (nTotal > nTargetValue + nSlack)
+            fBacktrack = true;    // overshot, and coins only add up
+        else if (nTotal >= nTargetValue)
+        {
+            if (!fFound || nTotal < nBest)
+            {
+                fFound = true;
+                nBest = nTotal;
+                vfBest = vfIncluded;
+                if (nBest == nTargetValue)
+                    break;
+            }
+            fBacktrack = true;
+        }
+
+        if (!fBacktrack)
+        {
+            // first try with the next coin
+            vfIncluded[nDepth] = true;
+            vIncluded.push_back(nDepth);
+            nTotal += vCoins[nBegin + nDepth].first;
+            nDepth++;
+            continue;
+        }
+
+        // then without the last coin included so far
+        if (vIncluded.empty())
+            break;
+        nDepth = vIncluded.back() + 1;
+        vIncluded.pop_back();
+        vfIncluded[nDepth - 1] = false;
+        nTotal -= vCoins[nBegin + nDepth - 1].first;
+
+        // leaving out a coin and taking one of equal value instead gives the same totals again
+        while (nDepth < nCoins && vCoins[nBegin + nDepth].first == vCoins[nBegin + nDepth - 1].first)
+            nDepth++;
+    }
+
+    if (fFound)
+        vfBest.resize(nCoins, false);
+    return fFound;
+}
+
+void CCoinSelector::ApproximateBestSubset(unsigned int nBegin, int64_t nTotalLower, int64_t nTargetValue,
+                                          vector<char>& vfBest, int64_t& nBest, int64_t nDeadline, int iterations) const
+{
+    unsigned int nCoins = vCoins.size() - nBegin;
+    vector<char> vfIncluded;
+
+    vfBest.assign(nCoins, true);
+    nBest = nTotalLower;
+
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    {
+        if (nRep > 0 && GetTimeMillis() > nDeadline)
+            break;
+
+        vfIncluded.assign(nCoins, false);
+        int64_t nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (unsigned int i = 0; i < nCoins; i++)
+            {
+                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                {
+                    nTotal += vCoins[nBegin + i].first;
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vCoins[nBegin + i].first;
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+}
+
+bool CCoinSelector::Select(int64_t nTargetValue, int64_t nChangelessSlack, vector<CoinValue>& vSelectedRet, int64_t& nValueRet, bool& fChangelessRet) const
+{
+    // the fee loop asks again for a little more each round, and what it was given
+    // last time still does if it covers the new target, unless the change left
+    // over only now drops below a cent
+    if (nLastValue >= nTargetValue && nTargetValue >= nLastTarget)
+    {
+        int64_t nChange = nLastValue - nTargetValue;
+        if (nChange >= CENT || nLastValue - nLastTarget < CENT)
+        {
+            vSelectedRet = vLastSelected;
+            nValueRet = nLastValue;
+            fChangelessRet = nChange <= nChangelessSlack;
+            return true;
+        }
+    }
+
+    if (!SelectNew(nTargetValue, nChangelessSlack, vSelectedRet, nValueRet, fChangelessRet))
+        return false;
+    nLastTarget = nTargetValue;
+    vLastSelected = vSelectedRet;
+    nLastValue = nValueRet;
+    return true;
+}
+
+bool CCoinSelector::SelectNew(int64_t nTargetValue, int64_t nChangelessSlack, vector<CoinValue>& vSelectedRet, int64_t& nValueRet, bool& fChangelessRet) const
+{
+    vSelectedRet.clear();
+    nValueRet = 0;
+    fChangelessRet = false;
+
+    // a coin of just the right value
+    unsigned int nExact = FirstBelow(nTargetValue + 1);
+    if (nExact < vCoins.size() && vCoins[nExact].first == nTargetValue)
+    {
+        vSelectedRet.push_back(vCoins[nExact]);
+        nValueRet = nTargetValue;
+        fChangelessRet = true;
+        return true;
+    }
+
+    // coins less than target + CENT, and the smallest coin above those
+    unsigned int nLower = FirstBelow(nTargetValue + CENT);
+    int64_t nTotalLower = vRemaining[nLower];
+    const CoinValue* pcoinLowestLarger = nLower > 0 ? &vCoins[nLower - 1] : NULL;
+
+    if (nTotalLower == nTargetValue)
+    {
+        vSelectedRet.assign(vCoins.begin() + nLower, vCoins.end());
+        nValueRet = nTotalLower;
+        fChangelessRet = true;
+        return true;
+    }
+
+    if (nTotalLower < nTargetValue)
+    {
+        if (!pcoinLowestLarger)
+            return false;
+        vSelectedRet.push_back(*pcoinLowestLarger);
+        nValueRet = pcoinLowestLarger->first;
+        return true;
+    }
+
+    vector<char> vfBest;
+    int64_t nBest;
+    if (nChangelessSlack >= 0 && SelectBnB(nLower, nTargetValue, nChangelessSlack, vfBest, nBest))
+    {
+        fChangelessRet = true;
+    }
+    else
+    {
+        // Solve subset sum by stochastic approximation
+        int64_t nDeadline = GetTimeMillis() + SELECT_COINS_MAX_MILLIS;
+        ApproximateBestSubset(nLower, nTotalLower, nTargetValue, vfBest, nBest, nDeadline);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
+            ApproximateBestSubset(nLower, nTotalLower, nTargetValue + CENT, vfBest, nBest, nDeadline);
+
+        // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+        //                                   or the next bigger coin is closer), return the bigger coin
+        if (pcoinLowestLarger &&
+            ((nBest != nTargetValue && nBest < nTargetValue + CENT) || pcoinLowestLarger->first <= nBest))
+        {
+            vSelectedRet.push_back(*pcoinLowestLarger);
+            nValueRet = pcoinLowestLarger->first;
+            return true;
+        }
+    }
+
+    for (unsigned int i = 0; i < vfBest.size(); i++)
+        if (vfBest[i])
+        {
+            vSelectedRet.push_back(vCoins[nLower + i]);
+            nValueRet += vCoins[nLower + i].first;
+        }
+
+    if (fDebug && GetBoolArg("-printpriority"))
+    {
+        //// debug print
+        printf("SelectCoins() best subset: ");
+        BOOST_FOREACH(const CoinValue& coin, vSelectedRet)
+            printf("%s ", FormatMoney(coin.first).c_str());
+        printf("total %s%s\n", FormatMoney(nValueRet).c_str(), fChangelessRet ? " (no change)" : "");
+    }
+
+    return true;
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_COINSELECTION_H
+#define BITCOIN_COINSELECTION_H
+
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+class CWalletTx;
+
+/** Branch and bound gives up after trying this many combinations */
+static const unsigned int SELECT_COINS_BNB_MAX_TRIES = 100000;
+/** Repetitions of the stochastic approximation, when it has the time */
+static const int SELECT_COINS_APPROX_ITERATIONS = 1000;
+/** Milliseconds the stochastic approximation may take at most */
+static const int64_t SELECT_COINS_MAX_MILLIS = 250;
+
+/** Picks inputs adding up to a target out of a fixed set of coins.
+ *
+ * The coins are sorted, and their running totals worked out, once up front, so
+ * one selector answers the repeated queries of the CreateTransaction fee loop
+ * cheaply, and a selection that still covers a slightly higher target is handed
+ * out again. Otherwise each query tries, in order:
+ *  - a single coin of exactly the target value
+ *  - a branch and bound search for a set of coins that overshoots the target by
+ *    no more than nChangelessSlack, so that no change output is needed
+ *  - the original stochastic subset approximation, bounded in time, or the
+ *    smallest coin larger than the target if that is closer
+ */
+class CCoinSelector
+{
+public:
+    typedef std::pair<int64_t, std::pair<const CWalletTx*, unsigned int> > CoinValue;
+
+private:
+    std::vector<CoinValue> vCoins;     // largest value first
+    std::vector<int64_t> vRemaining;   // vRemaining[i] is the total of vCoins[i..]
+
+    // the last selection made, which may do for the next target too
+    mutable int64_t nLastTarget;
+    mutable std::vector<CoinValue> vLastSelected;
+    mutable int64_t nLastValue;
+
+    unsigned int FirstBelow(int64_t nValue) const;
+    bool SelectNew(int64_t nTargetValue, int64_t nChangelessSlack, std::vector<CoinValue>& vSelectedRet, int64_t& nValueRet, bool& fChangelessRet) const;
+
+public:
+    explicit CCoinSelector(const std::vector<CoinValue>& vCoinsIn);
+
+    bool Select(int64_t nTargetValue, int64_t nChangelessSlack, std::vector<CoinValue>& vSelectedRet, int64_t& nValueRet, bool& fChangelessRet) const;
+
+    // Subset of vCoins[nBegin..] whose total lies in [nTargetValue, nTargetValue + nSlack], closest to the target found
+    bool SelectBnB(unsigned int nBegin, int64_t nTargetValue, int64_t nSlack, std::vector<char>& vfBest, int64_t& nBest) const;
+    // Smallest total not below nTargetValue of vCoins[nBegin..] that a number of random tries come up with
+    void ApproximateBestSubset(unsigned int nBegin, int64_t nTotalLower, int64_t nTargetValue, std::vector<char>& vfBest, int64_t& nBest, int64_t nDeadline, int iterations = SELECT_COINS_APPROX_ITERATIONS) const;
+
+    unsigned int size() const { return vCoins.size(); }
+    int64_t GetTotal() const { return vRemaining.empty() ? 0 : vRemaining[0]; }
+};
+
+#endif
@@ -486,6 +486,7 @@ void CDBEnv::Flush(bool fShutdown)
 CAddrDB::CAddrDB()
 {
     pathAddr = GetDataDir() / "peers.dat";
+    pathLog = GetDataDir() / "peers.log";
 }
 
 bool CAddrDB::Write(const CAddrMan& addr)
@@ -576,6 +577,121 @@ bool CAddrDB::Read(CAddrMan& addr)
         return error("CAddrman::Read() : I/O error or stream data corrupted");
     }
 
+    // bring the tables up to date with changes made after peers.dat was written
+    ReadLog(addr);
+
     return true;
 }
 
+bool CAddrDB::Append(CAddrMan& addr)
+{
+    std::vector<CAddrJournalEntry> vEntries;
+    if (!addr.TakeJournal(vEntries))
+        return false;
+    if (vEntries.empty())
+        return true;
+
+    // each batch: magic, payload size, payload, checksum of everything before it
+    CDataStream ssBatch(SER_DISK, CLIENT_VERSION);
+    ssBatch << vEntries;
+    CDataStream ssLog(SER_DISK, CLIENT_VERSION);
+    ssLog << FLATDATA(pchMessageStart);
+    ssLog << (unsigned int)ssBatch.size();
+    ssLog << ssBatch;
+    uint256 hash = Hash(ssLog.begin(), ssLog.end());
+    ssLog << hash;
+
+    FILE *file = fopen(pathLog.string().c_str(), "ab");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CAddrman::Append() : open failed");
+
+    try {
+        fileout << ssLog;
+    }
+    catch (std::exception &e) {
+        return error("CAddrman::Append() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    return true;
+}
+
+bool CAddrDB::ReadLog(CAddrMan& addr)
+{
+    if (!boost::filesystem::exists(pathLog))
+        return true;
+
+    FILE *file = fopen(pathLog.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("CAddrman::ReadLog() : open failed");
+
+    int nBatches = 0;
+    int nEntries = 0;
+    while (true)
+    {
+        // a torn or corrupted batch ends the log; everything before it is kept
+        CDataStream ssLog(SER_DISK, CLIENT_VERSION);
+        std::vector<CAddrJournalEntry> vEntries;
+        try {
+            unsigned char pchMsgTmp[4];
+            unsigned int nSize = 0;
+            filein >> FLATDATA(pchMsgTmp);
+            if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+                break;
+            filein >> nSize;
+            if (nSize > MAX_SIZE)
+                break;
+            ssLog << FLATDATA(pchMsgTmp) << nSize;
+            ssLog.resize(ssLog.size() + nSize);
+            filein.read((char*)&ssLog[ssLog.size() - nSize], nSize);
+
+            uint256 hashIn;
+            filein >> hashIn;
+            if (hashIn != Hash(ssLog.begin(), ssLog.end()))
+                break;
+
+            ssLog.ignore(sizeof(pchMsgTmp) + sizeof(nSize));
+            ssLog >> vEntries;
+        }
+        catch (std::exception &e) {
+            break;
+        }
+
+        addr.Replay(vEntries);
+        nBatches++;
+        nEntries += vEntries.size();
+    }
+    filein.fclose();
+
+    printf("Replayed %d address changes in %d batches from peers.log\n", nEntries, nBatches);
+    return true;
+}
+
+bool CAddrDB::ClearLog()
+{
+    try {
+        boost::filesystem::remove(pathLog);
+    }
+    catch (boost::filesystem::filesystem_error &e) {
+        return error("CAddrman::ClearLog() : %s", e.what());
+    }
+    return true;
+}
+
+bool CAddrDB::LogNeedsCompaction()
+{
+    try {
+        if (!boost::filesystem::exists(pathLog))
+            return false;
+        uintmax_t nLogSize = boost::filesystem::file_size(pathLog);
+        uintmax_t nAddrSize = boost::filesystem::exists(pathAddr) ? boost::filesystem::file_size(pathAddr) : 0;
+        return nLogSize > std::max((uintmax_t)1000000, nAddrSize / 2);
+    }
+    catch (boost::filesystem::filesystem_error &e) {
+        return true;
+    }
+}
+
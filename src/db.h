@@ -264,6 +264,39 @@ protected:
         return 0;
     }
 
+    // Read as many records as fit in vchBuffer in one call, appending them to vRecords.
+    // The buffer grows when a single record does not fit in it.
+    int ReadBulkAtCursor(Dbc* pcursor, std::vector<char>& vchBuffer, std::vector<std::pair<CDataStream, CDataStream> >& vRecords)
+    {
+        Dbt datKey;
+        Dbt datValue;
+        int ret;
+        while (true)
+        {
+            datValue.set_data(&vchBuffer[0]);
+            datValue.set_ulen(vchBuffer.size());
+            datValue.set_flags(DB_DBT_USERMEM);
+            ret = pcursor->get(&datKey, &datValue, DB_NEXT | DB_MULTIPLE_KEY);
+            if (ret != DB_BUFFER_SMALL)
+                break;
+            // bulk buffers must be a multiple of 1024 bytes
+            vchBuffer.resize(std::max(2 * vchBuffer.size(), (size_t)(datValue.get_size() + 1023) / 1024 * 1024));
+        }
+        if (ret != 0)
+            return ret;
+
+        DbMultipleKeyDataIterator it(datValue);
+        Dbt datK, datV;
+        while (it.next(datK, datV))
+        {
+            const char* pchKey = (const char*)datK.get_data();
+            const char* pchValue = (const char*)datV.get_data();
+            vRecords.push_back(std::make_pair(CDataStream(pchKey, pchKey + datK.get_size(), SER_DISK, CLIENT_VERSION),
+                                              CDataStream(pchValue, pchValue + datV.get_size(), SER_DISK, CLIENT_VERSION)));
+        }
+        return 0;
+    }
+
 public:
     bool TxnBegin()
     {
@@ -309,15 +342,25 @@ public:
 };
 
 
-/** Access to the (IP) address database (peers.dat) */
+/** Access to the (IP) address database (peers.dat)
+ *
+ * peers.dat holds the full tables. Changes made since it was last written are
+ * appended to peers.log in checksummed batches, and replayed on top of peers.dat
+ * at startup. peers.dat is only rewritten once the log has grown too large.
+ */
 class CAddrDB
 {
 private:
     boost::filesystem::path pathAddr;
+    boost::filesystem::path pathLog;
 public:
     CAddrDB();
     bool Write(const CAddrMan& addr);
     bool Read(CAddrMan& addr);
+    bool Append(CAddrMan& addr);
+    bool ReadLog(CAddrMan& addr);
+    bool ClearLog();
+    bool LogNeedsCompaction();
 };
 
 #endif // BITCOIN_DB_H
@@ -3,9 +3,11 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 #include "txdb.h"
+#include "addressindex.h"
 #include "walletdb.h"
 #include "bitcoinrpc.h"
 #include "net.h"
+#include "notify.h"
 #include "init.h"
 #include "util.h"
 #include "ui_interface.h"
@@ -84,7 +86,9 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
 //        CTxDB().Close();
         bitdb.Flush(false);
+        StopNotifyPublisher();
         StopNode();
+        FlushWallets();
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
@@ -268,12 +272,18 @@ std::string HelpMessage()
         "  -dnsseed               " + _("Query for peer addresses via DNS lookup, if low on addresses (default: 1 unless -connect)") + "\n" +
         "  -forcednsseed          " + _("Always query for peer addresses via DNS lookup (default: 0)") + "\n" +
         "  -staking               " + _("Stake your coins to support network and gain reward (default: 1)") + "\n" +
+        "  -stakeconsolidate      " + _("Merge small coins and split large ones to the target size in the background (default: 0)") + "\n" +
+        "  -consolidatetarget=<amt> " + _("Size of the coins consolidation aims for, best not below the 900 at which staking stops combining coins (default: 1000)") + "\n" +
+        "  -consolidatemaxinputs=<n> " + _("Most coins consolidation spends, or creates, in one transaction (default: 50)") + "\n" +
+        "  -consolidatefeebudget=<amt> " + _("Most fees consolidation pays in a day (default: 0.1)") + "\n" +
         "  -synctime              " + _("Sync time with other nodes. Disable if time on your system is precise e.g. syncing with NTP (default: 1)") + "\n" +
         "  -cppolicy              " + _("Sync checkpoints policy (default: strict)") + "\n" +
         "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n" +
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -peerbandwidth=<n>     " + _("Limit upload to each peer to <n>*1000 bytes per second (default: 0 = unlimited)") + "\n" +
+        "  -maxuploadtarget=<n>   " + _("Stop serving historical blocks once more than <n> MB per 24 hours have been uploaded (default: 0 = unlimited)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -303,8 +313,15 @@ std::string HelpMessage()
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 51716 or testnet: 51976)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
+        "  -rpcthreads=<n>        " + _("Number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Number of RPC requests that may wait for a thread before new ones are refused (default: 16)") + "\n" +
+        "  -rpcbatchconcurrency=<n> " + _("Number of requests of one JSON-RPC batch that may run at once (default: 4)") + "\n" +
+        "  -rpcservertimeout=<n>  " + _("Seconds an RPC connection may sit idle before it is closed (default: 30)") + "\n" +
+        "  -rest                  " + _("Accept public REST requests for blocks, transactions and headers on the RPC port (default: 0)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
+        "  -pubnotify=<port>      " + _("Publish new blocks, transactions and wallet transactions to subscribers connecting to <port> on the loopback address") + "\n" +
+        "  -pubnotifyqueue=<n>    " + _("Number of messages a notification subscriber may fall behind before further ones are dropped (default: 1000)") + "\n" +
         "  -confchange            " + _("Require a confirmations for change (default: 0)") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
@@ -314,6 +331,8 @@ std::string HelpMessage()
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -addressindex          " + _("Maintain an index of the outputs and spends of each address, built on first start (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of which transaction spent each output, built on first start (default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -399,6 +418,8 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fAddressIndex = GetBoolArg("-addressindex", false);
+    fSpentIndex = GetBoolArg("-spentindex", false);
     nMinerSleep = GetArg("-minersleep", 500);
 
     nDerivationMethodIndex = 0;
@@ -684,6 +705,18 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
     }
 
+    if (mapArgs.count("-consolidatetarget"))
+    {
+        if (!ParseMoney(mapArgs["-consolidatetarget"], nConsolidateTargetValue) || nConsolidateTargetValue < COIN)
+            return InitError(strprintf(_("Invalid amount for -consolidatetarget=<amount>: '%s'"), mapArgs["-consolidatetarget"].c_str()));
+    }
+    if (mapArgs.count("-consolidatefeebudget"))
+    {
+        if (!ParseMoney(mapArgs["-consolidatefeebudget"], nConsolidateFeeBudget))
+            return InitError(strprintf(_("Invalid amount for -consolidatefeebudget=<amount>: '%s'"), mapArgs["-consolidatefeebudget"].c_str()));
+    }
+    nConsolidateMaxInputs = max((int64_t)2, GetArg("-consolidatemaxinputs", nConsolidateMaxInputs));
+
     BOOST_FOREACH(string strDest, mapMultiArgs["-seednode"])
         AddOneShot(strDest);
 
@@ -722,6 +755,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     printf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    if (!InitAddressIndex())
+        return InitError(_("Error building the address index"));
+    if (fRequestShutdown)
+    {
+        printf("Shutdown requested. Exiting.\n");
+        return false;
+    }
+
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
         PrintBlockTree();
@@ -824,6 +865,17 @@ bool AppInit2(boost::thread_group& threadGroup)
         CBlockLocator locator;
         if (walletdb.ReadBestBlock(locator))
             pindexRescan = locator.GetBlockIndex();
+
+        // pick up where an interrupted rescan stopped
+        if (walletdb.ReadRescanPos(locator))
+        {
+            CBlockIndex* pindexResume = locator.GetBlockIndex();
+            if (pindexResume && (!pindexRescan || pindexResume->nHeight < pindexRescan->nHeight))
+            {
+                printf("Resuming interrupted rescan at block %d\n", pindexResume->nHeight);
+                pindexRescan = pindexResume;
+            }
+        }
     }
     if (pindexBest != pindexRescan && pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
     {
@@ -890,6 +942,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     printf("mapWallet.size() = %u\n",       pwalletMain->mapWallet.size());
     printf("mapAddressBook.size() = %u\n",  pwalletMain->mapAddressBook.size());
 
+    if (mapArgs.count("-pubnotify"))
+    {
+        string strError;
+        if (!StartNotifyPublisher(strError))
+            return InitError(strError);
+    }
+
     if (!NewThread(StartNode, NULL))
         InitError(_("Error: could not start node"));
 
@@ -7,7 +7,9 @@
 #include "checkpoints.h"
 #include "db.h"
 #include "txdb.h"
+#include "addressindex.h"
 #include "net.h"
+#include "notify.h"
 #include "init.h"
 #include "ui_interface.h"
 #include "kernel.h"
@@ -28,10 +30,21 @@ set<CWallet*> setpwalletRegistered;
 
 CCriticalSection cs_main;
 
+// The block index and the best chain are changed holding both cs_main and this
+// exclusively, so they can be read holding either one: cs_main, or this shared
+// by code that must not wait on block validation. Never take cs_main while
+// holding this shared.
+CSharedCriticalSection csChainState;
+
+// Notified, holding csBestBlock, whenever the best chain changes
+boost::mutex csBestBlock;
+boost::condition_variable cvBlockChange;
+
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
 map<uint256, CBlockIndex*> mapBlockIndex;
+vector<CBlockIndex*> vBlockIndexByHeight;   // the best chain, by height
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfWorkLimit(~uint256(0) >> 20);      // "standard" scrypt target limit for proof of work, results with 0,000244140625 proof-of-work difficulty
@@ -71,6 +84,8 @@ const string strMessageMagic = "Jumbucks Signed Message:\n";
 int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
+bool fAddressIndex = false;
+bool fSpentIndex = false;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -126,6 +141,9 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
 {
     if (!fConnect)
     {
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->TxBlockDisconnected(tx.GetHash());
+
         // ppcoin: wallets need to refund inputs when disconnecting coinstake
         if (tx.IsCoinStake())
         {
@@ -138,6 +156,17 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
 
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
         pwallet->AddToWalletIfInvolvingMe(tx, pblock, fUpdate);
+    NotifyTransaction(tx);
+}
+
+// let wallets do the work for a whole block up front, before its transactions are synced
+void static PrepareWalletsForBlock(const CBlock& block)
+{
+    std::vector<const CTransaction*> vtx;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        vtx.push_back(&tx);
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->PrepareStealthScan(vtx);
 }
 
 // notify wallets about a new best chain
@@ -169,6 +198,13 @@ void static Inventory(const uint256& hash)
 }
 
 // ask wallets to resend their transactions
+// write out the wallet changes queued up, such as those made by a block
+void FlushWallets()
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->FlushPendingTxs();
+}
+
 void ResendWalletTransactions(bool fForce)
 {
     BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
@@ -784,11 +820,11 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
 
 
+// Callers hold cs_main, or csChainState shared
 int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
 {
     if (hashBlock == 0 || nIndex == -1)
         return 0;
-    AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
     map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
@@ -812,7 +848,6 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
 
 int CMerkleTx::GetDepthInMainChain(CBlockIndex* &pindexRet) const
 {
-    AssertLockHeld(cs_main);
     int nResult = GetDepthInMainChainINTERNAL(pindexRet);
     if (nResult == 0 && !mempool.exists(GetHash()))
         return -1; // Not in chain, not in mempool
@@ -883,10 +918,10 @@ int CTxIndex::GetDepthInMainChain() const
 }
 
 // Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock
+// Callers hold cs_main, or csChainState shared
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 {
     {
-        LOCK(cs_main);
         {
             if (mempool.lookup(hash, tx))
             {
@@ -936,22 +971,22 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
+// The block at nHeight in the best chain, NULL if there is none
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 0 || nHeight >= (int)vBlockIndexByHeight.size())
+        return NULL;
+    return vBlockIndexByHeight[nHeight];
+}
+
+// Makes vBlockIndexByHeight end at pindexTip, replacing the blocks above the
+// fork when the tip is on another branch. Callers hold cs_main, and
+// csChainState exclusively once other threads may read.
+void SetBlockIndexByHeight(CBlockIndex* pindexTip)
+{
+    vBlockIndexByHeight.resize(pindexTip->nHeight + 1);
+    for (CBlockIndex* pindex = pindexTip; pindex && vBlockIndexByHeight[pindex->nHeight] != pindex; pindex = pindex->pprev)
+        vBlockIndexByHeight[pindex->nHeight] = pindex;
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1419,6 +1454,17 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Take the block out of the address and spent indexes, while the inputs it
+    // spends can still be looked up
+    if (fAddressIndex || fSpentIndex)
+    {
+        CBlockAddressIndex addressindex;
+        if (!addressindex.AddBlockFromDisk(txdb, *this, pindex->nHeight))
+            return error("DisconnectBlock() : AddBlockFromDisk failed");
+        if (!txdb.EraseBlockAddressIndex(pindex->GetBlockHash(), addressindex))
+            return error("DisconnectBlock() : EraseBlockAddressIndex failed");
+    }
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
         if (!vtx[i].DisconnectInputs(txdb))
@@ -1457,6 +1503,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
     map<uint256, CTxIndex> mapQueuedChanges;
+    bool fIndexAddresses = (fAddressIndex || fSpentIndex) && !fJustCheck;
+    CBlockAddressIndex addressindex;
+    int64_t nStartMicros = fIndexAddresses ? GetTimeMicros() : 0;
+    int64_t nIndexMicros = 0;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
@@ -1523,6 +1573,13 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+
+        if (fIndexAddresses)
+        {
+            int64_t nIndexStart = GetTimeMicros();
+            addressindex.AddTx(tx, mapInputs, pindex->nHeight);
+            nIndexMicros += GetTimeMicros() - nIndexStart;
+        }
     }
 
     if (IsProofOfWork())
@@ -1563,6 +1620,16 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // Address and spent index entries go into the same database transaction
+    if (fIndexAddresses)
+    {
+        int64_t nIndexStart = GetTimeMicros();
+        if (!txdb.WriteBlockAddressIndex(pindex->GetBlockHash(), addressindex))
+            return error("ConnectBlock() : WriteBlockAddressIndex failed");
+        nIndexMicros += GetTimeMicros() - nIndexStart;
+        RecordAddressIndexCost(addressindex.size(), nIndexMicros, GetTimeMicros() - nStartMicros);
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1574,6 +1641,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     }
 
     // Watch for transactions paying to me
+    PrepareWalletsForBlock(*this);
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
 
@@ -1655,15 +1723,19 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     if (!txdb.TxnCommit())
         return error("Reorganize() : TxnCommit failed");
 
-    // Disconnect shorter branch
-    BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = NULL;
+    {
+        WRITE_LOCK(csChainState);
 
-    // Connect longer branch
-    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = pindex;
+        // Disconnect shorter branch
+        BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+            if (pindex->pprev)
+                pindex->pprev->pnext = NULL;
+
+        // Connect longer branch
+        BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+            if (pindex->pprev)
+                pindex->pprev->pnext = pindex;
+    }
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
@@ -1697,7 +1769,10 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         return error("SetBestChain() : TxnCommit failed");
 
     // Add to current best branch
-    pindexNew->pprev->pnext = pindexNew;
+    {
+        WRITE_LOCK(csChainState);
+        pindexNew->pprev->pnext = pindexNew;
+    }
 
     // Delete redundant memory transactions
     BOOST_FOREACH(CTransaction& tx, vtx)
@@ -1706,6 +1781,28 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
     return true;
 }
 
+bool WaitForBestChainChange(uint256& hashSeen, int64_t nMilliseconds)
+{
+    // the best block is read holding csBestBlock, so a change after it can't be missed
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    for (int nTry = 0; nTry < 2; nTry++)
+    {
+        uint256 hashBest;
+        {
+            READ_LOCK(csChainState);
+            hashBest = hashBestChain;
+        }
+        if (hashBest != hashSeen)
+        {
+            hashSeen = hashBest;
+            return true;
+        }
+        if (nTry == 0)
+            cvBlockChange.timed_wait(lock, boost::posix_time::milliseconds(nMilliseconds));
+    }
+    return false;
+}
+
 bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     uint256 hash = GetHash();
@@ -1780,11 +1877,18 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     }
 
     // New best block
-    hashBestChain = hash;
-    pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
-    nBestHeight = pindexBest->nHeight;
-    nBestChainTrust = pindexNew->nChainTrust;
+    {
+        WRITE_LOCK(csChainState);
+        hashBestChain = hash;
+        pindexBest = pindexNew;
+        SetBlockIndexByHeight(pindexNew);
+        nBestHeight = pindexBest->nHeight;
+        nBestChainTrust = pindexNew->nChainTrust;
+    }
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
 
@@ -1814,6 +1918,8 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
             strMiscWarning = _("Warning: This version is obsolete, upgrade required!");
     }
 
+    NotifyBlock(*this);
+
     std::string strCmd = GetArg("-blocknotify", "");
 
     if (!fIsInitialDownload && !strCmd.empty())
@@ -1930,10 +2036,13 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    {
+        WRITE_LOCK(csChainState);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+    }
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-    pindexNew->phashBlock = &((*mi).first);
 
     // Write to disk block index
     CTxDB txdb;
@@ -2302,6 +2411,9 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
+    // everything the block, and any orphans after it, changed in the wallets goes to disk together
+    FlushWallets();
+
     printf("ProcessBlock: ACCEPTED\n");
 
     return true;
@@ -3065,7 +3177,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     CBlock block;
                     block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+
+                    // Old blocks requested by a syncing peer wait behind relay of new ones
+                    bool fHistorical = (*mi).second->nHeight < nBestHeight - HISTORICAL_BLOCK_DEPTH;
+                    if (fHistorical)
+                        pfrom->PushBulkMessage("block", block);
+                    else
+                        pfrom->PushMessage("block", block);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3075,7 +3193,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         // block might be rejected by stake connection check)
                         vector<CInv> vInv;
                         vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
+                        // keep it behind the block it follows
+                        if (fHistorical)
+                            pfrom->PushBulkMessage("inv", vInv);
+                        else
+                            pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
                 }
@@ -3420,6 +3542,75 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     return true;
 }
 
+// Check and process one complete message; false if the stream is out of step
+static bool ProcessReceivedMessage(CNode* pfrom, CNetMessage& msg)
+{
+    // Scan for message start
+    if (memcmp(msg.hdr.pchMessageStart, pchMessageStart, sizeof(pchMessageStart)) != 0) {
+        printf("\n\nPROCESSMESSAGE: INVALID MESSAGESTART\n\n");
+        return false;
+    }
+
+    // Read header
+    CMessageHeader& hdr = msg.hdr;
+    if (!hdr.IsValid())
+    {
+        printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
+        return true;
+    }
+    string strCommand = hdr.GetCommand();
+
+    // Message size
+    unsigned int nMessageSize = hdr.nMessageSize;
+
+    // Checksum, computed as the data arrived
+    CDataStream& vRecv = msg.vRecv;
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &msg.hashData, sizeof(nChecksum));
+    if (nChecksum != hdr.nChecksum)
+    {
+        printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
+           strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+        return true;
+    }
+
+    // Process message
+    bool fRet = false;
+    try
+    {
+        {
+            LOCK(cs_main);
+            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+        }
+    }
+    catch (std::ios_base::failure& e)
+    {
+        if (strstr(e.what(), "end of data"))
+        {
+            // Allow exceptions from under-length message on vRecv
+            printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand.c_str(), nMessageSize, e.what());
+        }
+        else if (strstr(e.what(), "size too large"))
+        {
+            // Allow exceptions from over-long size
+            printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught\n", strCommand.c_str(), nMessageSize, e.what());
+        }
+        else
+        {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+
+    if (!fRet)
+        printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+    return true;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -3435,16 +3626,17 @@ bool ProcessMessages(CNode* pfrom)
     //  (x) data
     //
     bool fOk = true;
+    bool fHoldGetData = false;
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
-            break;
-
         // get next message
         CNetMessage& msg = *it;
 
+        // Don't bother if send buffer is too full to respond anyway
+        if (pfrom->nSendSize - pfrom->nSendSizeBulk >= SendBufferSize())
+            break;
+
         //if (fDebug)
         //    printf("ProcessMessages(message %u msgsz, %zu bytes, complete:%s)\n",
         //            msg.hdr.nMessageSize, msg.vRecv.size(),
@@ -3454,86 +3646,55 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
-        // at this point, any failure means we can delete the current message
-        it++;
-
-        // Scan for message start
-        if (memcmp(msg.hdr.pchMessageStart, pchMessageStart, sizeof(pchMessageStart)) != 0) {
-            printf("\n\nPROCESSMESSAGE: INVALID MESSAGESTART\n\n");
-            fOk = false;
-            break;
-        }
-
-        // Read header
-        CMessageHeader& hdr = msg.hdr;
-        if (!hdr.IsValid())
+        // Historical blocks held back by the upload target hold up only requests for
+        // data: those stay queued, in order, while the messages after them, pings
+        // among them, are answered
+        if (msg.hdr.GetCommand() == "getdata" && (fHoldGetData || pfrom->nSendSize >= SendBufferSize()))
         {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
+            fHoldGetData = true;
+            it++;
             continue;
         }
-        string strCommand = hdr.GetCommand();
-
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
-        CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
-        {
-            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
-        }
+        bool fValid = ProcessReceivedMessage(pfrom, msg);
 
-        // Process message
-        bool fRet = false;
-        try
-        {
-            {
-                LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
-            }
-            if (fShutdown)
-                break;
-        }
-        catch (std::ios_base::failure& e)
+        // In case the connection got shut down, its receive buffer was wiped
+        if (pfrom->fDisconnect)
+            break;
+        it = pfrom->vRecvMsg.erase(it);
+        if (!fValid)
         {
-            if (strstr(e.what(), "end of data"))
-            {
-                // Allow exceptions from under-length message on vRecv
-                printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand.c_str(), nMessageSize, e.what());
-            }
-            else if (strstr(e.what(), "size too large"))
-            {
-                // Allow exceptions from over-long size
-                printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught\n", strCommand.c_str(), nMessageSize, e.what());
-            }
-            else
-            {
-                PrintExceptionContinue(&e, "ProcessMessages()");
-            }
-        }
-        catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
+            fOk = false;
+            break;
         }
-
-        if (!fRet)
-            printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+        if (fShutdown)
+            break;
     }
 
-    // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
-
     return fOk;
 }
 
 
+// Number of in-memory-pool ancestors above a transaction, memoized in mapDepth.
+// requires LOCK(mempool.cs)
+static int GetMemPoolDepth(const uint256& hash, map<uint256, int>& mapDepth, int nMaxDepth)
+{
+    map<uint256, int>::iterator mi = mapDepth.find(hash);
+    if (mi != mapDepth.end())
+        return (*mi).second;
+
+    int nDepth = 0;
+    map<uint256, CTransaction>::const_iterator it = mempool.mapTx.find(hash);
+    if (it != mempool.mapTx.end() && nMaxDepth > 0)
+    {
+        BOOST_FOREACH(const CTxIn& txin, (*it).second.vin)
+            if (mempool.mapTx.count(txin.prevout.hash))
+                nDepth = max(nDepth, 1 + GetMemPoolDepth(txin.prevout.hash, mapDepth, nMaxDepth - 1));
+    }
+    mapDepth[hash] = nDepth;
+    return nDepth;
+}
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     TRY_LOCK(cs_main, lockMain);
@@ -3629,58 +3790,93 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
+        vector<uint256> vTxCandidates;
+        int64_t nNowMicros = GetTimeMicros();
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
-            {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        CWalletTx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
-                    {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
 
+            // Blocks are never delayed and go out ahead of any queued transactions
+            vInv.reserve(std::min<size_t>(pto->vInventoryBlockToSend.size() + INVENTORY_BROADCAST_MAX, MAX_INV_SEND_SZ));
+            BOOST_FOREACH(const CInv& inv, pto->vInventoryBlockToSend)
+            {
                 // returns true if wasn't already contained in the set
                 if (pto->setInventoryKnown.insert(inv).second)
                 {
                     vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
+                    if (vInv.size() >= MAX_INV_SEND_SZ)
                     {
+                        pto->nInvSent += vInv.size();
                         pto->PushMessage("inv", vInv);
                         vInv.clear();
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryBlockToSend.clear();
+
+            // Transactions are trickled in batches at Poisson-distributed intervals,
+            // which hides their origin and groups them into fewer, larger messages
+            if (pto->nNextInvSend < nNowMicros)
+            {
+                int64_t nIntervalMicros = (int64_t)INVENTORY_BROADCAST_INTERVAL * 1000000;
+                pto->nNextInvSend = PoissonNextSend(nNowMicros, pto->fInbound ? nIntervalMicros : nIntervalMicros / 2);
+                vTxCandidates.reserve(pto->setInventoryTxToSend.size());
+                BOOST_FOREACH(const uint256& hash, pto->setInventoryTxToSend)
+                {
+                    if (pto->setInventoryKnown.count(CInv(MSG_TX, hash)))
+                        continue;
+                    vTxCandidates.push_back(hash);
+                }
+                pto->setInventoryTxToSend.clear();
+            }
+        }
+
+        if (!vTxCandidates.empty())
+        {
+            // Drop transactions that already left the memory pool and announce
+            // parents ahead of their children, so the peer can accept each one
+            // as it arrives instead of holding it as an orphan
+            vector<pair<int, uint256> > vSorted;
+            vSorted.reserve(vTxCandidates.size());
+            {
+                LOCK(mempool.cs);
+                map<uint256, int> mapDepth;
+                BOOST_FOREACH(const uint256& hash, vTxCandidates)
+                    if (mempool.mapTx.count(hash))
+                        vSorted.push_back(make_pair(GetMemPoolDepth(hash, mapDepth, 25), hash));
+            }
+            sort(vSorted.begin(), vSorted.end());
+
+            LOCK(pto->cs_inventory);
+            unsigned int nBroadcast = 0;
+            for (unsigned int i = 0; i < vSorted.size(); i++)
+            {
+                CInv inv(MSG_TX, vSorted[i].second);
+                if (nBroadcast >= INVENTORY_BROADCAST_MAX)
+                {
+                    // over budget for this broadcast; wait for the next one
+                    pto->setInventoryTxToSend.insert(inv.hash);
+                    continue;
+                }
+                if (!pto->setInventoryKnown.insert(inv).second)
+                    continue;
+                vInv.push_back(inv);
+                nBroadcast++;
+                if (vInv.size() >= MAX_INV_SEND_SZ)
+                {
+                    pto->nInvSent += vInv.size();
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
+                }
+            }
         }
         if (!vInv.empty())
+        {
+            {
+                LOCK(pto->cs_inventory);
+                pto->nInvSent += vInv.size();
+            }
             pto->PushMessage("inv", vInv);
+        }
 
 
         //
@@ -52,7 +52,11 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 10 * 60; } // up to 1
 
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
+extern CSharedCriticalSection csChainState;
+extern boost::mutex csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern std::vector<CBlockIndex*> vBlockIndexByHeight;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nTargetSpacing;
@@ -80,6 +84,8 @@ extern int64_t nTransactionFee;
 extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
+extern bool fAddressIndex;
+extern bool fSpentIndex;
 extern unsigned int nDerivationMethodIndex;
 
 // Minimum disk space required - used in CheckDiskSpace()
@@ -100,6 +106,10 @@ FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+void SetBlockIndexByHeight(CBlockIndex* pindexTip);
+/** Waits up to nMilliseconds for the best block to be other than hashSeen; returns
+ *  whether it is, with hashSeen set to it */
+bool WaitForBestChainChange(uint256& hashSeen, int64_t nMilliseconds);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
@@ -118,6 +128,7 @@ uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void StakeMiner(CWallet *pwallet);
 void ResendWalletTransactions(bool fForce = false);
+void FlushWallets();
 
 
 
@@ -1417,6 +1428,95 @@ public:
 
 
 
+/** A block header as the block index has it, with the proof-of-stake fields,
+ *  for light clients that check the header chain. Every record is the same
+ *  size, the first 80 bytes being the header the block hash is taken over; a
+ *  proof-of-work block has a null prevoutStake and a zero nStakeTime. The
+ *  block signature is only in the block files, and is not included. */
+class CBlockIndexHeader
+{
+public:
+    static const unsigned int SIZE = 80 + 4 + 4 + 8 + 36 + 4 + 32;
+
+    // block header
+    int nVersion;
+    uint256 hashPrevBlock;
+    uint256 hashMerkleRoot;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+
+    int nHeight;
+    unsigned int nFlags;
+    uint64_t nStakeModifier;
+    COutPoint prevoutStake;
+    unsigned int nStakeTime;
+    uint256 hashProof;
+
+    CBlockIndexHeader()
+    {
+        nVersion = 0;
+        hashPrevBlock = 0;
+        hashMerkleRoot = 0;
+        nTime = 0;
+        nBits = 0;
+        nNonce = 0;
+        nHeight = 0;
+        nFlags = 0;
+        nStakeModifier = 0;
+        prevoutStake.SetNull();
+        nStakeTime = 0;
+        hashProof = 0;
+    }
+
+    explicit CBlockIndexHeader(const CBlockIndex* pindex)
+    {
+        nVersion = pindex->nVersion;
+        hashPrevBlock = pindex->pprev ? pindex->pprev->GetBlockHash() : 0;
+        hashMerkleRoot = pindex->hashMerkleRoot;
+        nTime = pindex->nTime;
+        nBits = pindex->nBits;
+        nNonce = pindex->nNonce;
+        nHeight = pindex->nHeight;
+        nFlags = pindex->nFlags;
+        nStakeModifier = pindex->nStakeModifier;
+        prevoutStake = pindex->prevoutStake;
+        nStakeTime = pindex->nStakeTime;
+        hashProof = pindex->hashProof;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(this->nVersion);
+        nVersion = this->nVersion;
+        READWRITE(hashPrevBlock);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+        READWRITE(nHeight);
+        READWRITE(nFlags);
+        READWRITE(nStakeModifier);
+        READWRITE(prevoutStake);
+        READWRITE(nStakeTime);
+        READWRITE(hashProof);
+    )
+
+    uint256 GetHash() const
+    {
+        CBlock block;
+        block.nVersion       = nVersion;
+        block.hashPrevBlock  = hashPrevBlock;
+        block.hashMerkleRoot = hashMerkleRoot;
+        block.nTime          = nTime;
+        block.nBits          = nBits;
+        block.nNonce         = nNonce;
+        return block.GetHash();
+    }
+};
+
+
+
 
 
 
@@ -1478,9 +1578,14 @@ public:
         {
             vHave.push_back(pindex->GetBlockHash());
 
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
+            // Exponentially larger steps back, straight there by height on the best chain
+            if (pindex->nHeight < nStep)
+                pindex = NULL;
+            else if (pindex->nHeight < (int)vBlockIndexByHeight.size() && vBlockIndexByHeight[pindex->nHeight] == pindex)
+                pindex = vBlockIndexByHeight[pindex->nHeight - nStep];
+            else
+                for (int i = 0; pindex && i < nStep; i++)
+                    pindex = pindex->pprev;
             if (vHave.size() > 10)
                 nStep *= 2;
         }
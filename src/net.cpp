@@ -13,6 +13,9 @@
 #include <string.h>
 #endif
 
+#include <cmath>
+#include <boost/bind.hpp>
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniwget.h>
 #include <miniupnpc/miniupnpc.h>
@@ -24,6 +27,10 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
+/** Maximum number of outbound connection attempts raced against each other. */
+static const int MAX_CONNECT_RACE = 16;
+/** Delay before each extra raced attempt is started (in milliseconds). */
+static const int CONNECT_RACE_STAGGER = 250;
 
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
@@ -34,6 +41,7 @@ void ThreadMapPort2(void* parg);
 #endif
 void ThreadDNSAddressSeed2(void* parg);
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+int OpenNetworkConnections(const std::vector<CAddress>& vConnect, CSemaphoreGrant& grantOutbound, int nSlots);
 
 
 struct LocalServiceInfo {
@@ -57,6 +65,7 @@ uint64_t nLocalHostNonce = 0;
 boost::array<int, THREAD_MAX> vnThreadsRunning;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
+CNetMessagePool netMessagePool;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
@@ -75,6 +84,7 @@ vector<std::string> vAddedNodes;
 CCriticalSection cs_vAddedNodes;
 
 static CSemaphore *semOutbound = NULL;
+static int nMaxOutbound = MAX_OUTBOUND_CONNECTIONS;
 
 void AddOneShot(string strDest)
 {
@@ -414,6 +424,7 @@ void AddressCurrentlyConnected(const CService& addr)
 
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
+CTokenBucket CNode::bucketUploadTarget;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
@@ -448,6 +459,32 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+// Wrap a connected outbound socket in a new node and start servicing it
+static CNode* AddOutboundNode(SOCKET hSocket, const CAddress& addrConnect, const char *pszDest)
+{
+    // Set to non-blocking
+#ifdef WIN32
+    u_long nOne = 1;
+    if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
+        printf("ConnectSocket() : ioctlsocket non-blocking setting failed, error %d\n", WSAGetLastError());
+#else
+    if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+        printf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
+#endif
+
+    // Add node
+    CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+    pnode->AddRef();
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+
+    pnode->nTimeConnected = GetTime();
+    return pnode;
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -478,27 +515,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         /// debug print
         printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
 
-        // Set to non-blocking
-#ifdef WIN32
-        u_long nOne = 1;
-        if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
-            printf("ConnectSocket() : ioctlsocket non-blocking setting failed, error %d\n", WSAGetLastError());
-#else
-        if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
-            printf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
-#endif
-
-        // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
-        pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
-
-        pnode->nTimeConnected = GetTime();
-        return pnode;
+        return AddOutboundNode(hSocket, addrConnect, pszDest);
     }
     else
     {
@@ -623,9 +640,30 @@ void CNode::copyStats(CNodeStats &stats)
     // Raw ping time is in microseconds, but show it to user as whole seconds (Bitcoin users should be well used to small numbers with many decimal places by now :)
     stats.dPingTime = (((double)nPingUsecTime) / 1e6);
     stats.dPingWait = (((double)nPingUsecWait) / 1e6);
+
+    {
+        LOCK(cs_inventory);
+        stats.nInvQueueTx = setInventoryTxToSend.size();
+        stats.nInvQueueBlock = vInventoryBlockToSend.size();
+        stats.nInvSent = nInvSent;
+    }
+    X(nSendBytesBulk);
+    X(nSendThrottled);
+    X(nSendBulkThrottled);
 }
 #undef X
 
+bool CNode::IsSendReady()
+{
+    if (vSendMsg.empty() && vSendMsgBulk.empty())
+        return false;
+    if (bucketSend.Available(GetTimeMicros()) <= 0)
+        return false;
+    if (nSendOffset == 0 && vSendMsg.empty() && !HasUploadBudget())
+        return false;
+    return true;
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -636,6 +674,7 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+    bucketUploadTarget.Consume(bytes);
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -650,6 +689,19 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+void CNode::SetMaxUploadTarget(uint64_t nBytesPerDay)
+{
+    // spread evenly over the day, allowing up to an hour's worth in one burst
+    LOCK(cs_totalBytesSent);
+    bucketUploadTarget.SetRate(nBytesPerDay / (24 * 60 * 60), nBytesPerDay / 24);
+}
+
+bool CNode::HasUploadBudget()
+{
+    LOCK(cs_totalBytesSent);
+    return bucketUploadTarget.Available(GetTimeMicros()) > 0;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -709,7 +761,12 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    CSerializeData vch;
+    netMessagePool.Acquire(vch, hdr.nMessageSize);
+    vRecv.swap(vch);
+
+    if (hdr.nMessageSize == 0)
+        hashData = hasher.GetHash();
 
     return nCopy;
 }
@@ -719,13 +776,74 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
+    // hash while the data is still in cache, rather than all at once when processing it
+    hasher.write(pch, nCopy);
+    if (nDataPos == hdr.nMessageSize)
+        hashData = hasher.GetHash();
+
     return nCopy;
 }
 
+CNetMessage::~CNetMessage()
+{
+    CSerializeData vch;
+    vRecv.swap(vch);
+    netMessagePool.Release(vch);
+}
 
+// index of the smallest size class holding nSize bytes, or -1 if too large to pool
+static int GetPoolClass(size_t nSize)
+{
+    for (int nClass = 0; nClass < NET_MESSAGE_POOL_CLASSES; nClass++)
+        if (nSize <= ((size_t)NET_MESSAGE_POOL_MIN_SIZE << nClass))
+            return nClass;
+    return -1;
+}
+
+void CNetMessagePool::Acquire(CSerializeData& vch, unsigned int nSize)
+{
+    // a larger payload starts in the largest class, and grows from there as it arrives
+    int nClass = GetPoolClass(nSize);
+    if (nClass < 0)
+        nClass = NET_MESSAGE_POOL_CLASSES - 1;
+    {
+        LOCK(cs);
+        if (!vFree[nClass].empty())
+        {
+            vch.swap(vFree[nClass].back());
+            vFree[nClass].pop_back();
+            nFreeBytes -= vch.capacity();
+        }
+    }
+    // allocate the whole class size, so the buffer fits any later message of this class
+    if (vch.capacity() == 0)
+        vch.reserve((size_t)NET_MESSAGE_POOL_MIN_SIZE << nClass);
+}
+
+void CNetMessagePool::Release(CSerializeData& vch)
+{
+    size_t nCapacity = vch.capacity();
+    if (nCapacity < NET_MESSAGE_POOL_MIN_SIZE)
+        return;
+
+    // largest class the buffer can serve
+    int nClass = GetPoolClass(nCapacity);
+    if (nClass < 0)
+        return;
+    if (((size_t)NET_MESSAGE_POOL_MIN_SIZE << nClass) > nCapacity)
+        nClass--;
+
+    vch.clear();
+    LOCK(cs);
+    if (nFreeBytes + nCapacity > NET_MESSAGE_POOL_MAX_BYTES)
+        return;
+    vFree[nClass].push_back(CSerializeData());
+    vFree[nClass].back().swap(vch);
+    nFreeBytes += nCapacity;
+}
 
 
 
@@ -733,27 +851,62 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+
+
+int64_t PoissonNextSend(int64_t nNow, int64_t nAverageIntervalMicros)
+{
+    // -log(1 - U) with U uniform in [0, 1) gives an exponentially distributed delay
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * nAverageIntervalMicros * -1.0 + 0.5);
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    while (true) {
+        // finish a partly sent message first, then new relay traffic, then historical blocks
+        std::deque<CSerializeData>* pqueue;
+        if (pnode->nSendOffset > 0)
+            pqueue = pnode->fSendingBulk ? &pnode->vSendMsgBulk : &pnode->vSendMsg;
+        else if (!pnode->vSendMsg.empty())
+            pqueue = &pnode->vSendMsg;
+        else if (!pnode->vSendMsgBulk.empty() && CNode::HasUploadBudget())
+            pqueue = &pnode->vSendMsgBulk;
+        else {
+            if (!pnode->vSendMsgBulk.empty())
+                pnode->nSendBulkThrottled++;
+            break;
+        }
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        const CSerializeData &data = pqueue->front();
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        size_t nToSend = data.size() - pnode->nSendOffset;
+        int64_t nAllowed = pnode->bucketSend.Available(GetTimeMicros());
+        if (nAllowed <= 0) {
+            pnode->nSendThrottled++;
+            break;
+        }
+        if (nAllowed < (int64_t)nToSend)
+            nToSend = nAllowed;
+
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendOffset += nBytes;
+            pnode->fSendingBulk = (pqueue == &pnode->vSendMsgBulk);
+            pnode->bucketSend.Consume(nBytes);
             
             pnode->nSendBytes += nBytes;
+            if (pnode->fSendingBulk)
+                pnode->nSendBytesBulk += nBytes;
             pnode->RecordBytesSent(nBytes);
             
             if (pnode->nSendOffset == data.size()) {
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
-            } else {
+                if (pnode->fSendingBulk)
+                    pnode->nSendSizeBulk -= data.size();
+                pqueue->pop_front();
+            } else if ((size_t)nBytes < nToSend) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -772,11 +925,11 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty() && pnode->vSendMsgBulk.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
+        assert(pnode->nSendSizeBulk == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 void ThreadSocketHandler(void* parg)
@@ -903,10 +1056,12 @@ void ThreadSocketHandler2(void* parg)
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
                     if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
+                        // do not read, if draining write queue; historical blocks
+                        // don't count, as the upload target may hold them back for
+                        // hours. A throttled queue is retried when select times out
+                        if (pnode->IsSendReady())
                             FD_SET(pnode->hSocket, &fdsetSend);
-                        else
+                        if (pnode->vSendMsg.empty())
                             FD_SET(pnode->hSocket, &fdsetRecv);
                         FD_SET(pnode->hSocket, &fdsetError);
                         hSocketMax = max(hSocketMax, pnode->hSocket);
@@ -1293,6 +1448,25 @@ void ThreadDNSAddressSeed(void* parg)
     printf("ThreadDNSAddressSeed exited\n");
 }
 
+static void LookupDNSSeed(unsigned int seed_idx, int* pnFound)
+{
+    vector<CNetAddr> vaddr;
+    vector<CAddress> vAdd;
+    if (LookupHost(strDNSSeed[seed_idx][1], vaddr))
+    {
+        BOOST_FOREACH(CNetAddr& ip, vaddr)
+        {
+            int nOneDay = 24*3600;
+            CAddress addr = CAddress(CService(ip, GetDefaultPort()));
+            addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
+            vAdd.push_back(addr);
+        }
+    }
+    // addresses are usable as soon as this seed answers
+    addrman.Add(vAdd, CNetAddr(strDNSSeed[seed_idx][0], true));
+    *pnFound = vAdd.size();
+}
+
 void ThreadDNSAddressSeed2(void* parg)
 {
     printf("ThreadDNSAddressSeed started\n");
@@ -1315,26 +1489,21 @@ void ThreadDNSAddressSeed2(void* parg)
     {
         printf("Loading addresses from DNS seeds (could take a while)\n");
 
+        // Resolve all seeds at once, so the slowest seed bounds the wait
+        // instead of the sum of all of them
+        vector<int> vFound(ARRAYLEN(strDNSSeed), 0);
+        boost::thread_group threadGroup;
         for (unsigned int seed_idx = 0; seed_idx < ARRAYLEN(strDNSSeed); seed_idx++) {
             if (HaveNameProxy()) {
                 AddOneShot(strDNSSeed[seed_idx][1]);
             } else {
-                vector<CNetAddr> vaddr;
-                vector<CAddress> vAdd;
-                if (LookupHost(strDNSSeed[seed_idx][1], vaddr))
-                {
-                    BOOST_FOREACH(CNetAddr& ip, vaddr)
-                    {
-                        int nOneDay = 24*3600;
-                        CAddress addr = CAddress(CService(ip, GetDefaultPort()));
-                        addr.nTime = GetTime() - 3*nOneDay - GetRand(4*nOneDay); // use a random age between 3 and 7 days old
-                        vAdd.push_back(addr);
-                        found++;
-                    }
-                }
-                addrman.Add(vAdd, CNetAddr(strDNSSeed[seed_idx][0], true));
+                threadGroup.create_thread(boost::bind(&LookupDNSSeed, seed_idx, &vFound[seed_idx]));
             }
         }
+        threadGroup.join_all();
+
+        BOOST_FOREACH(int n, vFound)
+            found += n;
     }
 
     printf("%d addresses found from DNS seeds\n", found);
@@ -1358,10 +1527,28 @@ unsigned int pnSeed[] =
 
 void DumpAddresses()
 {
+    static CCriticalSection cs_dumpaddresses;
+    static bool fFullWritten = false;
+    LOCK(cs_dumpaddresses);
+
     int64_t nStart = GetTimeMillis();
 
+    // the first dump is always a full one, so the log never gets appended
+    // to a peers.dat that failed to load at startup
     CAddrDB adb;
-    adb.Write(addrman);
+    if (fFullWritten && !fShutdown && !adb.LogNeedsCompaction() && adb.Append(addrman))
+    {
+        printf("Appended address changes to peers.log  %dms\n", GetTimeMillis() - nStart);
+        return;
+    }
+
+    // rewrite peers.dat in full, after which the log is no longer needed
+    addrman.ClearJournal();
+    if (adb.Write(addrman))
+    {
+        adb.ClearLog();
+        fFullWritten = true;
+    }
 
     printf("Flushed %d addresses to peers.dat  %dms\n",
            addrman.size(), GetTimeMillis() - nStart);
@@ -1454,6 +1641,46 @@ void static ThreadStakeMiner(void* parg)
     printf("ThreadStakeMiner exiting, %d threads remaining\n", vnThreadsRunning[THREAD_STAKE_MINER]);
 }
 
+void static ThreadConsolidateCoins(void* parg)
+{
+    printf("ThreadConsolidateCoins started\n");
+    CWallet* pwallet = (CWallet*)parg;
+    try
+    {
+        vnThreadsRunning[THREAD_CONSOLIDATE]++;
+        ConsolidateCoins(pwallet);
+        vnThreadsRunning[THREAD_CONSOLIDATE]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_CONSOLIDATE]--;
+        PrintException(&e, "ThreadConsolidateCoins()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_CONSOLIDATE]--;
+        PrintException(NULL, "ThreadConsolidateCoins()");
+    }
+    printf("ThreadConsolidateCoins exiting, %d threads remaining\n", vnThreadsRunning[THREAD_CONSOLIDATE]);
+}
+
+void static ThreadRefillKeyPool(void* parg)
+{
+    printf("ThreadRefillKeyPool started\n");
+    CWallet* pwallet = (CWallet*)parg;
+    try
+    {
+        vnThreadsRunning[THREAD_KEYPOOL]++;
+        RefillKeyPool(pwallet);
+        vnThreadsRunning[THREAD_KEYPOOL]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_KEYPOOL]--;
+        PrintException(&e, "ThreadRefillKeyPool()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_KEYPOOL]--;
+        PrintException(NULL, "ThreadRefillKeyPool()");
+    }
+    printf("ThreadRefillKeyPool exiting, %d threads remaining\n", vnThreadsRunning[THREAD_KEYPOOL]);
+}
+
 void ThreadOpenConnections2(void* parg)
 {
     printf("ThreadOpenConnections started\n");
@@ -1519,9 +1746,10 @@ void ThreadOpenConnections2(void* parg)
         }
 
         //
-        // Choose an address to connect to based on most recently seen
+        // Choose addresses to connect to based on most recently seen
         //
-        CAddress addrConnect;
+        vector<CAddress> vConnect;
+        bool fProxied = false;
 
         // Only connect out to one peer per network group (/16 for IPv4).
         // Do this here so we don't have to critsect vNodes inside mapAddresses critsect.
@@ -1537,16 +1765,20 @@ void ThreadOpenConnections2(void* parg)
             }
         }
 
+        // Race up to twice as many candidates as there are free outbound slots
+        int nSlots = max(1, nMaxOutbound - nOutbound);
+        int nCandidates = min(MAX_CONNECT_RACE, 2 * nSlots);
+
         int64_t nANow = GetAdjustedTime();
 
         int nTries = 0;
-        while (true)
+        while ((int)vConnect.size() < nCandidates)
         {
             // use an nUnkBias between 10 (no outgoing connections) and 90 (8 outgoing connections)
             CAddress addr = addrman.Select(10 + min(nOutbound,8)*10);
 
             // if we selected an invalid address, restart
-            if (!addr.IsValid() || setConnected.count(addr.GetGroup()) || IsLocal(addr))
+            if (!addr.IsValid())
                 break;
 
             // If we didn't find an appropriate destination after trying 100 addresses fetched from addrman,
@@ -1556,6 +1788,9 @@ void ThreadOpenConnections2(void* parg)
             if (nTries > 100)
                 break;
 
+            if (setConnected.count(addr.GetGroup()) || IsLocal(addr))
+                continue;
+
             if (IsLimited(addr))
                 continue;
 
@@ -1567,12 +1802,26 @@ void ThreadOpenConnections2(void* parg)
             if (addr.GetPort() != GetDefaultPort() && nTries < 50)
                 continue;
 
-            addrConnect = addr;
-            break;
+            // connections through a proxy include a SOCKS handshake and are made one at a time
+            proxyType proxy;
+            if (GetProxy(addr.GetNetwork(), proxy))
+            {
+                if (vConnect.empty())
+                {
+                    vConnect.push_back(addr);
+                    fProxied = true;
+                }
+                break;
+            }
+
+            setConnected.insert(addr.GetGroup());
+            vConnect.push_back(addr);
         }
 
-        if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+        if (fProxied)
+            OpenNetworkConnection(vConnect[0], &grant);
+        else if (!vConnect.empty())
+            OpenNetworkConnections(vConnect, grant, nSlots);
     }
 }
 
@@ -1684,6 +1933,155 @@ void ThreadOpenAddedConnections2(void* parg)
     }
 }
 
+struct CConnectAttempt
+{
+    CAddress addr;
+    SOCKET hSocket;
+    int64_t nTimeStart;
+};
+
+// Connect to several addresses at once and keep the first ones to answer.
+// nSlots attempts start immediately; the remaining candidates are started
+// one by one every CONNECT_RACE_STAGGER ms while slots are still free, so a
+// slow or dead address never holds up the others. The passed grant goes to
+// the first node connected; further winners take whatever grants are free
+// and the rest are closed. Returns the number of nodes connected. Only an
+// address that failed or timed out counts as attempted in addrman; one that
+// answered too late, or was still pending when the race ended, does not.
+int OpenNetworkConnections(const vector<CAddress>& vConnect, CSemaphoreGrant& grantOutbound, int nSlots)
+{
+    vector<CConnectAttempt> vAttempt;
+    unsigned int nNext = 0;
+    int nConnected = 0;
+    bool fSlotsFull = false;
+    int64_t nLastStart = 0;
+
+    while (!fShutdown && !fSlotsFull && nConnected < nSlots)
+    {
+        int64_t nNow = GetTimeMillis();
+
+        // Start new attempts
+        while (nNext < vConnect.size() && ((int)nNext < nSlots || nNow - nLastStart >= CONNECT_RACE_STAGGER))
+        {
+            const CAddress& addr = vConnect[nNext++];
+            if (IsLocal(addr) || FindNode((CNetAddr)addr) || CNode::IsBanned(addr) ||
+                FindNode(addr.ToStringIPPort().c_str()))
+                continue;
+
+            /// debug print
+            printf("trying connection %s lastseen=%.1fhrs\n",
+                addr.ToString().c_str(), (double)(GetAdjustedTime() - addr.nTime)/3600.0);
+
+            CConnectAttempt attempt;
+            attempt.addr = addr;
+            attempt.nTimeStart = nNow;
+            if (!ConnectSocketStart(addr, attempt.hSocket))
+            {
+                addrman.Attempt(addr);
+                continue;
+            }
+            vAttempt.push_back(attempt);
+            nLastStart = nNow;
+        }
+
+        if (vAttempt.empty())
+        {
+            if (nNext >= vConnect.size())
+                break;
+            MilliSleep(CONNECT_RACE_STAGGER);
+            continue;
+        }
+
+        //
+        // Wait for any attempt to resolve
+        //
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = 50000;
+
+        fd_set fdsetSend;
+        fd_set fdsetError;
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        SOCKET hSocketMax = 0;
+        BOOST_FOREACH(const CConnectAttempt& attempt, vAttempt)
+        {
+            FD_SET(attempt.hSocket, &fdsetSend);
+            FD_SET(attempt.hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, attempt.hSocket);
+        }
+
+        vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
+        int nSelect = select(hSocketMax + 1, NULL, &fdsetSend, &fdsetError, &timeout);
+        vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
+        if (nSelect == SOCKET_ERROR)
+        {
+            printf("OpenNetworkConnections() : select error %d\n", WSAGetLastError());
+            break;
+        }
+
+        nNow = GetTimeMillis();
+        for (vector<CConnectAttempt>::iterator it = vAttempt.begin(); it != vAttempt.end();)
+        {
+            CConnectAttempt& attempt = *it;
+            if (!FD_ISSET(attempt.hSocket, &fdsetSend) && !FD_ISSET(attempt.hSocket, &fdsetError))
+            {
+                if (nNow - attempt.nTimeStart > nConnectTimeout)
+                {
+                    printf("connection timeout %s\n", attempt.addr.ToString().c_str());
+                    addrman.Attempt(attempt.addr);
+                    closesocket(attempt.hSocket);
+                    it = vAttempt.erase(it);
+                }
+                else
+                    it++;
+                continue;
+            }
+
+            if (ConnectSocketFinish(attempt.hSocket))
+            {
+                CSemaphoreGrant grant;
+                if (nConnected == 0)
+                    grantOutbound.MoveTo(grant);
+                else
+                {
+                    CSemaphoreGrant grantExtra(*semOutbound, true);
+                    grantExtra.MoveTo(grant);
+                }
+
+                if (!grant || FindNode((CNetAddr)attempt.addr))
+                {
+                    // lost the race for a slot
+                    closesocket(attempt.hSocket);
+                    fSlotsFull = fSlotsFull || !grant;
+                }
+                else
+                {
+                    printf("connected %s\n", attempt.addr.ToString().c_str());
+                    CNode* pnode = AddOutboundNode(attempt.hSocket, attempt.addr, NULL);
+                    grant.MoveTo(pnode->grantOutbound);
+                    pnode->fNetworkNode = true;
+                    nConnected++;
+                }
+            }
+            else
+                addrman.Attempt(attempt.addr);
+            it = vAttempt.erase(it);
+        }
+
+        if (vAttempt.empty() && nNext >= vConnect.size())
+            break;
+    }
+
+    // Abandon attempts that are still pending
+    BOOST_FOREACH(CConnectAttempt& attempt, vAttempt)
+        closesocket(attempt.hSocket);
+
+    if (fDebugNet)
+        printf("OpenNetworkConnections() : %d of %"PRIszu" candidates connected\n", nConnected, vConnect.size());
+    return nConnected;
+}
+
 // if successful, this moves the passed grant to the constructed node
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound, const char *strDest, bool fOneShot)
 {
@@ -1977,10 +2375,12 @@ void StartNode(void* parg)
 
     if (semOutbound == NULL) {
         // initialize semaphore
-        int nMaxOutbound = min(MAX_OUTBOUND_CONNECTIONS, (int)GetArg("-maxconnections", 125));
+        nMaxOutbound = min(MAX_OUTBOUND_CONNECTIONS, (int)GetArg("-maxconnections", 125));
         semOutbound = new CSemaphore(nMaxOutbound);
     }
 
+    CNode::SetMaxUploadTarget(GetArg("-maxuploadtarget", 0) * 1000000);
+
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
@@ -2026,6 +2426,15 @@ void StartNode(void* parg)
     else
         if (!NewThread(ThreadStakeMiner, pwalletMain))
             printf("Error: NewThread(ThreadStakeMiner) failed\n");
+
+    // Merge small coins and split large ones in the background
+    if (GetBoolArg("-stakeconsolidate", false))
+        if (!NewThread(ThreadConsolidateCoins, pwalletMain))
+            printf("Error: NewThread(ThreadConsolidateCoins) failed\n");
+
+    // Keep the key pool topped up, so that handing out an address needn't wait on key generation
+    if (!NewThread(ThreadRefillKeyPool, pwalletMain))
+        printf("Error: NewThread(ThreadRefillKeyPool) failed\n");
 }
 
 bool StopNode()
@@ -2060,7 +2469,11 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_STAKE_MINER] > 0) printf("ThreadStakeMiner still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    if (vnThreadsRunning[THREAD_CONSOLIDATE] > 0) printf("ThreadConsolidateCoins still running\n");
+    if (vnThreadsRunning[THREAD_KEYPOOL] > 0) printf("ThreadRefillKeyPool still running\n");
+    // the key pool refill writes to the wallet, which Shutdown closes once we return
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 ||
+           vnThreadsRunning[THREAD_KEYPOOL] > 0)
         MilliSleep(20);
     DumpAddresses();
     return true;
@@ -6,6 +6,7 @@
 #define BITCOIN_NET_H
 
 #include <deque>
+#include <limits>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
 #include <openssl/rand.h>
@@ -28,6 +29,15 @@ extern int nBestHeight;
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Average delay between trickled transaction inventory broadcasts to inbound peers (in seconds).
+ *  Outbound peers get half this delay, since they are not chosen by an attacker. */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of transaction inventory items announced to a peer per broadcast. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Maximum number of entries in a single outgoing inv message. */
+static const unsigned int MAX_INV_SEND_SZ = 1000;
+/** Blocks more than this far below the best chain are historical, and served after other traffic. */
+static const int HISTORICAL_BLOCK_DEPTH = 20;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -46,6 +56,8 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(void* parg);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int64_t nAverageIntervalMicros);
 
 enum
 {
@@ -91,6 +103,8 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_STAKE_MINER,
+    THREAD_CONSOLIDATE,
+    THREAD_KEYPOOL,
 
     THREAD_MAX
 };
@@ -133,9 +147,98 @@ public:
     int nMisbehavior;
     double dPingTime;
     double dPingWait;
+    unsigned int nInvQueueTx;
+    unsigned int nInvQueueBlock;
+    uint64_t nInvSent;
+    uint64_t nSendBytesBulk;
+    uint64_t nSendThrottled;
+    uint64_t nSendBulkThrottled;
 };
 
 
+/** Token bucket limiting a rate of bytes; a rate of 0 means unlimited */
+class CTokenBucket
+{
+private:
+    int64_t nRate;       // bytes per second
+    int64_t nCapacity;   // largest burst, in bytes
+    int64_t nTokens;     // may go negative when charged for more than was available
+    int64_t nLastFill;   // microseconds
+
+    void Fill(int64_t nNow)
+    {
+        int64_t nAdd = (nNow - nLastFill) * nRate / 1000000;
+        if (nAdd <= 0)
+            return;
+        nTokens = std::min(nCapacity, nTokens + nAdd);
+        nLastFill = (nTokens == nCapacity) ? nNow : nLastFill + nAdd * 1000000 / nRate;
+    }
+
+public:
+    CTokenBucket()
+    {
+        SetRate(0, 0);
+    }
+
+    void SetRate(int64_t nRateIn, int64_t nCapacityIn)
+    {
+        nRate = nRateIn;
+        nCapacity = std::max(nCapacityIn, nRateIn);
+        nTokens = nCapacity;
+        nLastFill = GetTimeMicros();
+    }
+
+    bool IsLimited() const { return nRate > 0; }
+
+    // bytes that may be sent right now
+    int64_t Available(int64_t nNow)
+    {
+        if (!IsLimited())
+            return std::numeric_limits<int64_t>::max();
+        Fill(nNow);
+        return nTokens;
+    }
+
+    void Consume(int64_t nBytes)
+    {
+        if (IsLimited())
+            nTokens -= nBytes;
+    }
+};
+
+
+
+
+/** Smallest and largest receive buffer kept for reuse, and the most idle buffer space to hold on to. */
+static const unsigned int NET_MESSAGE_POOL_MIN_SIZE = 512;
+static const int NET_MESSAGE_POOL_CLASSES = 13; // 512 bytes .. 2MB
+static const size_t NET_MESSAGE_POOL_MAX_BYTES = 16 * 1000 * 1000;
+
+/** Receive buffers for message payloads, recycled in power-of-two size classes.
+ *  A payload gets a buffer of its class as soon as its header is in, at most
+ *  the largest class, and it is handed back here when the message has been
+ *  processed. The buffer is filled, and grows past that, only as data arrives,
+ *  so a header claiming a large payload costs nothing until the payload is sent. */
+class CNetMessagePool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree[NET_MESSAGE_POOL_CLASSES];
+    size_t nFreeBytes;
+
+public:
+    CNetMessagePool()
+    {
+        nFreeBytes = 0;
+    }
+
+    // vch must be empty; it is left empty, with room for nSize bytes up to the largest class
+    void Acquire(CSerializeData& vch, unsigned int nSize);
+    // takes the buffer of vch, leaving it empty
+    void Release(CSerializeData& vch);
+};
+
+extern CNetMessagePool netMessagePool;
 
 
 class CNetMessage {
@@ -149,9 +252,12 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
+    CHashWriter hasher;             // checksum of the data received so far
+    uint256 hashData;               // checksum of the complete data
+
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn), hasher(SER_GETHASH, 0) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
@@ -159,6 +265,8 @@ public:
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -185,9 +293,17 @@ public:
     uint64_t nServices;
     SOCKET hSocket;
     CDataStream ssSend;
-    size_t nSendSize; // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendSize; // total size of all vSendMsg and vSendMsgBulk entries
+    size_t nSendSizeBulk; // of which in vSendMsgBulk
+    size_t nSendOffset; // offset inside the first message of the queue being sent
     std::deque<CSerializeData> vSendMsg;
+    // historical blocks, only sent when vSendMsg is empty and the upload target allows it
+    std::deque<CSerializeData> vSendMsgBulk;
+    bool fSendingBulk; // whether nSendOffset refers to vSendMsgBulk
+    CTokenBucket bucketSend; // -peerbandwidth
+    uint64_t nSendBytesBulk;
+    uint64_t nSendThrottled;
+    uint64_t nSendBulkThrottled;
     CCriticalSection cs_vSend;
 
     std::deque<CNetMessage> vRecvMsg;
@@ -237,7 +353,12 @@ public:
 
     // inventory based relay
     mruset<CInv> setInventoryKnown;
-    std::vector<CInv> vInventoryToSend;
+    // blocks are announced on the next SendMessages pass, in the order queued
+    std::vector<CInv> vInventoryBlockToSend;
+    // transactions wait for the next Poisson-timed broadcast
+    std::set<uint256> setInventoryTxToSend;
+    int64_t nNextInvSend;
+    uint64_t nInvSent;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
@@ -274,7 +395,13 @@ public:
         fDisconnect = false;
         nRefCount = 0;
         nSendSize = 0;
+        nSendSizeBulk = 0;
         nSendOffset = 0;
+        fSendingBulk = false;
+        bucketSend.SetRate(GetArg("-peerbandwidth", 0) * 1000, 0);
+        nSendBytesBulk = 0;
+        nSendThrottled = 0;
+        nSendBulkThrottled = 0;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
@@ -286,6 +413,8 @@ public:
         nPingUsecStart = 0;
         nPingUsecTime = 0;
         fPingQueued = false;
+        nNextInvSend = 0;
+        nInvSent = 0;
 
         // Be shy and don't send version until we hear
         if (hSocket != INVALID_SOCKET && !fInbound)
@@ -310,6 +439,7 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static CTokenBucket bucketUploadTarget; // -maxuploadtarget, protected by cs_totalBytesSent
 public:
 
 
@@ -379,8 +509,12 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            if (setInventoryKnown.count(inv))
+                return;
+            if (inv.type == MSG_TX)
+                setInventoryTxToSend.insert(inv.hash);
+            else
+                vInventoryBlockToSend.push_back(inv);
         }
     }
 
@@ -425,7 +559,7 @@ public:
             printf("(aborted)\n");
     }
 
-    void EndMessage()
+    void EndMessage(bool fBulk = false)
     {
         if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
         {
@@ -452,12 +586,15 @@ public:
             printf("(%d bytes)\n", nSize);
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
+        std::deque<CSerializeData>& queue = fBulk ? vSendMsgBulk : vSendMsg;
+        std::deque<CSerializeData>::iterator it = queue.insert(queue.end(), CSerializeData());
         ssSend.GetAndClear(*it);
         nSendSize += (*it).size();
+        if (fBulk)
+            nSendSizeBulk += (*it).size();
 
-        // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        // If nothing would be sent before this message, attempt "optimistic write"
+        if (nSendOffset == 0 && (fBulk ? nSendSize == (*it).size() : vSendMsg.size() == 1))
             SocketSendData(this);
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
@@ -465,6 +602,23 @@ public:
 
     void PushVersion();
 
+    // Queue a message behind all other traffic, subject to -maxuploadtarget
+    template<typename T1>
+    void PushBulkMessage(const char* pszCommand, const T1& a1)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            ssSend << a1;
+            EndMessage(true);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -650,6 +804,9 @@ public:
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
     void copyStats(CNodeStats &stats);
+
+    // requires LOCK(cs_vSend)
+    bool IsSendReady();
     
     // Network stats
     static void RecordBytesRecv(uint64_t bytes);
@@ -657,6 +814,10 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // Upload budget for historical blocks, in bytes per day; 0 means unlimited
+    static void SetMaxUploadTarget(uint64_t nBytesPerDay);
+    static bool HasUploadBudget();
 };
 
 inline void RelayInventory(const CInv& inv)
@@ -303,7 +303,7 @@ bool static Socks5(string strDest, int port, SOCKET& hSocket)
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+bool ConnectSocketStart(const CService &addrConnect, SOCKET& hSocketRet)
 {
     hSocketRet = INVALID_SOCKET;
 
@@ -339,43 +339,7 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (WSAGetLastError() == WSAEINPROGRESS || WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEINVAL)
         {
-            struct timeval timeout;
-            timeout.tv_sec  = nTimeout / 1000;
-            timeout.tv_usec = (nTimeout % 1000) * 1000;
-
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0)
-            {
-                printf("connection timeout\n");
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR)
-            {
-                printf("select() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
-#ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
-#else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
-#endif
-            {
-                printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet != 0)
-            {
-                printf("connect() failed after select(): %s\n",strerror(nRet));
-                closesocket(hSocket);
-                return false;
-            }
+            // the connection completes in the background; wait for the socket to become writable
         }
 #ifdef WIN32
         else if (WSAGetLastError() != WSAEISCONN)
@@ -389,14 +353,74 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         }
     }
 
+    hSocketRet = hSocket;
+    return true;
+}
+
+bool ConnectSocketFinish(SOCKET& hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
+#ifdef WIN32
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+#else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+#endif
+    {
+        printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
+        closesocket(hSocket);
+        hSocket = INVALID_SOCKET;
+        return false;
+    }
+    if (nRet != 0)
+    {
+        printf("connect() failed after select(): %s\n",strerror(nRet));
+        closesocket(hSocket);
+        hSocket = INVALID_SOCKET;
+        return false;
+    }
+    return true;
+}
+
+bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    hSocketRet = INVALID_SOCKET;
+
+    SOCKET hSocket;
+    if (!ConnectSocketStart(addrConnect, hSocket))
+        return false;
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+    fd_set fdset;
+    FD_ZERO(&fdset);
+    FD_SET(hSocket, &fdset);
+    int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+    if (nRet == 0)
+    {
+        printf("connection timeout\n");
+        closesocket(hSocket);
+        return false;
+    }
+    if (nRet == SOCKET_ERROR)
+    {
+        printf("select() for connection failed: %i\n",WSAGetLastError());
+        closesocket(hSocket);
+        return false;
+    }
+    if (!ConnectSocketFinish(hSocket))
+        return false;
+
     // this isn't even strictly necessary
     // CNode::ConnectNode immediately turns the socket back to non-blocking
     // but we'll turn it back to blocking just in case
 #ifdef WIN32
-    fNonblock = 0;
+    u_long fNonblock = 0;
     if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
 #else
-    fFlags = fcntl(hSocket, F_GETFL, 0);
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
     if (fcntl(hSocket, F_SETFL, fFlags & !O_NONBLOCK) == SOCKET_ERROR)
 #endif
     {
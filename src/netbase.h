@@ -142,5 +142,9 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
+/** Begin a non-blocking direct connection; the socket becomes writable once the attempt is resolved. */
+bool ConnectSocketStart(const CService &addrConnect, SOCKET& hSocketRet);
+/** Check the result of a connection begun by ConnectSocketStart. Closes the socket on failure. */
+bool ConnectSocketFinish(SOCKET& hSocket);
 
 #endif
@@ -0,0 +1,299 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "notify.h"
+#include "main.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace boost::asio;
+
+CNotifyPublisher* pnotifyPublisher = NULL;
+
+CNotifyPublisher::CNotifyPublisher(unsigned int nMaxQueueIn) : acceptor(io_service)
+{
+    nMaxQueue = nMaxQueueIn;
+    nPublished = 0;
+    nDropped = 0;
+}
+
+bool CNotifyPublisher::Listen(unsigned short nPort, string& strErrorRet)
+{
+    try
+    {
+        ip::tcp::endpoint endpoint(ip::address_v4::loopback(), nPort);
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen(socket_base::max_connections);
+    }
+    catch (boost::system::system_error& e)
+    {
+        strErrorRet = strprintf(_("Unable to listen for notification subscribers on port %u: %s"), nPort, e.what());
+        return false;
+    }
+    Accept();
+    return true;
+}
+
+unsigned short CNotifyPublisher::GetPort() const
+{
+    boost::system::error_code error;
+    return acceptor.local_endpoint(error).port();
+}
+
+void CNotifyPublisher::Run()
+{
+    io_service.run();
+}
+
+void CNotifyPublisher::Stop()
+{
+    io_service.stop();
+}
+
+void CNotifyPublisher::Accept()
+{
+    boost::shared_ptr<CNotifySubscriber> sub(new CNotifySubscriber(io_service));
+    acceptor.async_accept(sub->socket, boost::bind(&CNotifyPublisher::HandleAccept, this, sub, boost::asio::placeholders::error));
+}
+
+void CNotifyPublisher::HandleAccept(boost::shared_ptr<CNotifySubscriber> sub, const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted)
+        return;
+    if (!error)
+    {
+        boost::system::error_code errorPeer;
+        printf("Notification subscriber connected from %s\n", sub->socket.remote_endpoint(errorPeer).address().to_string().c_str());
+        AddSubscriber(sub);
+        Read(sub);
+    }
+    Accept();
+}
+
+void CNotifyPublisher::Read(boost::shared_ptr<CNotifySubscriber> sub)
+{
+    async_read_until(sub->socket, sub->bufRead, '\n', boost::bind(&CNotifyPublisher::HandleRead, this, sub, boost::asio::placeholders::error));
+}
+
+void CNotifyPublisher::HandleRead(boost::shared_ptr<CNotifySubscriber> sub, const boost::system::error_code& error)
+{
+    // a line longer than the buffer holds is an error as well
+    if (error)
+    {
+        Close(sub);
+        return;
+    }
+
+    string strLine;
+    std::istream stream(&sub->bufRead);
+    getline(stream, strLine);
+    vector<string> vTopics;
+    boost::split(vTopics, strLine, boost::is_any_of(" \t\r"), boost::token_compress_on);
+    {
+        LOCK(cs_notify);
+        BOOST_FOREACH(const string& strTopic, vTopics)
+            if (!strTopic.empty())
+                sub->setTopics.insert(strTopic);
+    }
+    Read(sub);
+}
+
+void CNotifyPublisher::Send(boost::shared_ptr<CNotifySubscriber> sub)
+{
+    LOCK(cs_notify);
+    if (sub->fWriting || sub->fClosed || sub->queue.empty())
+        return;
+    // the message stays at the front of the queue until it is written
+    sub->fWriting = true;
+    async_write(sub->socket, buffer(*sub->queue.front()), boost::bind(&CNotifyPublisher::HandleWrite, this, sub, boost::asio::placeholders::error));
+}
+
+void CNotifyPublisher::HandleWrite(boost::shared_ptr<CNotifySubscriber> sub, const boost::system::error_code& error)
+{
+    if (error)
+    {
+        Close(sub);
+        return;
+    }
+    {
+        LOCK(cs_notify);
+        sub->queue.pop_front();
+        sub->nSent++;
+        sub->fWriting = false;
+    }
+    Send(sub);
+}
+
+void CNotifyPublisher::Close(boost::shared_ptr<CNotifySubscriber> sub)
+{
+    LOCK(cs_notify);
+    if (sub->fClosed)
+        return;
+    printf("Notification subscriber disconnected, %"PRId64" messages sent, %"PRId64" dropped\n", sub->nSent, sub->nDropped);
+    sub->fClosed = true;
+    sub->queue.clear();
+    vSubscribers.erase(std::remove(vSubscribers.begin(), vSubscribers.end(), sub), vSubscribers.end());
+    boost::system::error_code errorClose;
+    sub->socket.close(errorClose);
+}
+
+void CNotifyPublisher::AddSubscriber(boost::shared_ptr<CNotifySubscriber> sub)
+{
+    LOCK(cs_notify);
+    vSubscribers.push_back(sub);
+}
+
+bool CNotifyPublisher::HaveSubscribers(const string& strTopic) const
+{
+    LOCK(cs_notify);
+    BOOST_FOREACH(const boost::shared_ptr<CNotifySubscriber>& sub, vSubscribers)
+        if (sub->setTopics.count(strTopic))
+            return true;
+    return false;
+}
+
+void CNotifyPublisher::Publish(const string& strTopic, const vector<unsigned char>& vchBody)
+{
+    LOCK(cs_notify);
+    unsigned int nSequence = mapSequence[strTopic]++;
+    nPublished++;
+
+    // Made once, and shared by the queues of all the subscribers it goes to
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << (unsigned int)0 << strTopic << nSequence << vchBody;
+    unsigned int nSize = ss.size() - sizeof(nSize);
+    memcpy(&ss[0], &nSize, sizeof(nSize));
+    boost::shared_ptr<const string> pmsg(new string(ss.begin(), ss.end()));
+
+    BOOST_FOREACH(const boost::shared_ptr<CNotifySubscriber>& sub, vSubscribers)
+    {
+        if (!sub->setTopics.count(strTopic))
+            continue;
+        if (sub->queue.size() >= nMaxQueue)
+        {
+            if (sub->nDropped++ == 0)
+                printf("Notification subscriber is not keeping up, dropping messages\n");
+            nDropped++;
+            continue;
+        }
+        sub->queue.push_back(pmsg);
+        if (!sub->fWriting)
+            io_service.post(boost::bind(&CNotifyPublisher::Send, this, sub));
+    }
+}
+
+unsigned int CNotifyPublisher::GetSubscriberCount() const
+{
+    LOCK(cs_notify);
+    return vSubscribers.size();
+}
+
+int64_t CNotifyPublisher::GetPublished() const
+{
+    LOCK(cs_notify);
+    return nPublished;
+}
+
+int64_t CNotifyPublisher::GetDropped() const
+{
+    LOCK(cs_notify);
+    return nDropped;
+}
+
+static void ThreadNotifyPublisher(void* parg)
+{
+    // Make this thread recognisable as the notification publisher
+    RenameThread("jumbucks-notify");
+
+    try
+    {
+        pnotifyPublisher->Run();
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadNotifyPublisher()");
+    } catch (...) {
+        PrintException(NULL, "ThreadNotifyPublisher()");
+    }
+    printf("ThreadNotifyPublisher exited\n");
+}
+
+bool StartNotifyPublisher(string& strErrorRet)
+{
+    unsigned short nPort = GetArg("-pubnotify", 0);
+    CNotifyPublisher* publisher = new CNotifyPublisher(max((int)GetArg("-pubnotifyqueue", DEFAULT_NOTIFY_QUEUE), 1));
+    if (!publisher->Listen(nPort, strErrorRet))
+    {
+        delete publisher;
+        return false;
+    }
+    printf("Publishing notifications to subscribers on port %u\n", publisher->GetPort());
+
+    pnotifyPublisher = publisher;
+    if (!NewThread(ThreadNotifyPublisher, NULL))
+    {
+        strErrorRet = _("Unable to start the notification publisher");
+        return false;
+    }
+    return true;
+}
+
+void StopNotifyPublisher()
+{
+    // Not deleted, as other threads may still publish to it on their way out
+    if (pnotifyPublisher)
+        pnotifyPublisher->Stop();
+}
+
+// Hashes go out in the byte order they are shown in hex
+static vector<unsigned char> HashBytes(uint256 hash)
+{
+    vector<unsigned char> vch(hash.begin(), hash.end());
+    reverse(vch.begin(), vch.end());
+    return vch;
+}
+
+void NotifyBlock(const CBlock& block)
+{
+    if (!pnotifyPublisher)
+        return;
+    if (pnotifyPublisher->HaveSubscribers(NOTIFY_TOPIC_HASHBLOCK))
+        pnotifyPublisher->Publish(NOTIFY_TOPIC_HASHBLOCK, HashBytes(block.GetHash()));
+    if (pnotifyPublisher->HaveSubscribers(NOTIFY_TOPIC_RAWBLOCK))
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+        pnotifyPublisher->Publish(NOTIFY_TOPIC_RAWBLOCK, vector<unsigned char>(ss.begin(), ss.end()));
+    }
+}
+
+void NotifyTransaction(const CTransaction& tx)
+{
+    if (!pnotifyPublisher)
+        return;
+    if (pnotifyPublisher->HaveSubscribers(NOTIFY_TOPIC_HASHTX))
+        pnotifyPublisher->Publish(NOTIFY_TOPIC_HASHTX, HashBytes(tx.GetHash()));
+    if (pnotifyPublisher->HaveSubscribers(NOTIFY_TOPIC_RAWTX))
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << tx;
+        pnotifyPublisher->Publish(NOTIFY_TOPIC_RAWTX, vector<unsigned char>(ss.begin(), ss.end()));
+    }
+}
+
+void NotifyWalletTransaction(const uint256& hashTx, bool fNew)
+{
+    if (!pnotifyPublisher || !pnotifyPublisher->HaveSubscribers(NOTIFY_TOPIC_WALLETTX))
+        return;
+    vector<unsigned char> vch = HashBytes(hashTx);
+    vch.push_back(fNew ? 1 : 0);
+    pnotifyPublisher->Publish(NOTIFY_TOPIC_WALLETTX, vch);
+}
@@ -0,0 +1,127 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NOTIFY_H
+#define BITCOIN_NOTIFY_H
+
+#include "sync.h"
+#include "uint256.h"
+
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+
+class CBlock;
+class CTransaction;
+
+/** Messages go out in topics, a subscriber gets only those it asks for */
+static const char* const NOTIFY_TOPIC_HASHBLOCK = "hashblock";   // hash of a new best block
+static const char* const NOTIFY_TOPIC_RAWBLOCK  = "rawblock";    // a new best block, serialized
+static const char* const NOTIFY_TOPIC_HASHTX    = "hashtx";      // hash of a transaction accepted to the memory pool or in a connected block
+static const char* const NOTIFY_TOPIC_RAWTX     = "rawtx";       // the same transaction, serialized
+static const char* const NOTIFY_TOPIC_WALLETTX  = "wallettx";    // hash of a wallet transaction added or updated, and whether it is new
+
+/** Messages a subscriber may have waiting before further ones are dropped */
+static const unsigned int DEFAULT_NOTIFY_QUEUE = 1000;
+
+/** A client connected to the publisher, and the messages on their way to it */
+class CNotifySubscriber
+{
+public:
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::streambuf bufRead;
+
+    // guarded by the publisher's cs_notify
+    std::set<std::string> setTopics;
+    std::deque<boost::shared_ptr<const std::string> > queue;
+    bool fWriting;
+    bool fClosed;
+    int64_t nSent;
+    int64_t nDropped;
+
+    CNotifySubscriber(boost::asio::io_service& io_service) : socket(io_service), bufRead(1024)
+    {
+        fWriting = false;
+        fClosed = false;
+        nSent = 0;
+        nDropped = 0;
+    }
+};
+
+/**
+ * Pushes new blocks and transactions to subscribers over local TCP connections,
+ * so that they need not poll for them.
+ *
+ * A subscriber connects and sends a line with the names of the topics it wants,
+ * separated by spaces, and may send more lines at any time. Each message then
+ * comes as a 4 byte little endian length, followed by that many bytes: the topic
+ * as a string, a 4 byte sequence number counting that topic's messages, and the
+ * body as a byte vector, strings and vectors being prefixed by their compact size
+ * as everywhere in the protocol. Hashes are in the byte order they are shown in
+ * hex. A gap in the sequence numbers means messages were dropped.
+ *
+ * Publishing only queues a message, the writing is done by the publisher's own
+ * thread, so a slow subscriber never holds up block validation. Its queue is
+ * bounded, and what does not fit is dropped and counted.
+ */
+class CNotifyPublisher
+{
+private:
+    boost::asio::io_service io_service;
+    boost::asio::ip::tcp::acceptor acceptor;
+    unsigned int nMaxQueue;
+
+    mutable CCriticalSection cs_notify;
+    std::vector<boost::shared_ptr<CNotifySubscriber> > vSubscribers;
+    std::map<std::string, unsigned int> mapSequence;
+    int64_t nPublished;
+    int64_t nDropped;
+
+    void Accept();
+    void HandleAccept(boost::shared_ptr<CNotifySubscriber> sub, const boost::system::error_code& error);
+    void Read(boost::shared_ptr<CNotifySubscriber> sub);
+    void HandleRead(boost::shared_ptr<CNotifySubscriber> sub, const boost::system::error_code& error);
+    void Send(boost::shared_ptr<CNotifySubscriber> sub);
+    void HandleWrite(boost::shared_ptr<CNotifySubscriber> sub, const boost::system::error_code& error);
+    void Close(boost::shared_ptr<CNotifySubscriber> sub);
+
+public:
+    CNotifyPublisher(unsigned int nMaxQueueIn);
+
+    // Listens on the loopback address, port 0 meaning any free one
+    bool Listen(unsigned short nPort, std::string& strErrorRet);
+    unsigned short GetPort() const;
+    // Serves the subscribers until Stop is called
+    void Run();
+    void Stop();
+
+    boost::asio::io_service& GetIOService() { return io_service; }
+    void AddSubscriber(boost::shared_ptr<CNotifySubscriber> sub);
+    bool HaveSubscribers(const std::string& strTopic) const;
+    void Publish(const std::string& strTopic, const std::vector<unsigned char>& vchBody);
+
+    // Counts, for getnotifyinfo
+    unsigned int GetSubscriberCount() const;
+    int64_t GetPublished() const;
+    int64_t GetDropped() const;
+};
+
+/** The publisher started for -pubnotify, NULL without it */
+extern CNotifyPublisher* pnotifyPublisher;
+
+bool StartNotifyPublisher(std::string& strErrorRet);
+void StopNotifyPublisher();
+
+/** Publish to the topics of a new best block, a transaction and a wallet
+ *  transaction; each does nothing unless someone subscribed to them. */
+void NotifyBlock(const CBlock& block);
+void NotifyTransaction(const CTransaction& tx);
+void NotifyWalletTransaction(const uint256& hashTx, bool fNew);
+
+#endif
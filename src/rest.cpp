@@ -0,0 +1,285 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bitcoinrpc.h"
+#include "main.h"
+#include "sync.h"
+
+using namespace std;
+using namespace json_spirit;
+
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer);
+
+// Most headers one request gets
+static const int MAX_REST_HEADERS_RESULTS = 2000;
+
+enum RESTFormat
+{
+    RF_BINARY,
+    RF_HEX,
+    RF_JSON,
+};
+
+static const struct
+{
+    RESTFormat rf;
+    const char* name;
+    const char* contentType;
+} vRESTFormats[] =
+{
+    { RF_BINARY, "bin",  "application/octet-stream" },
+    { RF_HEX,    "hex",  "text/plain" },
+    { RF_JSON,   "json", "application/json" },
+};
+
+static int RESTError(std::ostream& stream, string& strContentTypeRet, int nStatus, const string& strMessage)
+{
+    strContentTypeRet = "text/plain";
+    stream << strMessage << "\r\n";
+    return nStatus;
+}
+
+// Splits "<param>.<format>" apart
+static bool ParseDataFormat(const string& strReq, string& strParamRet, RESTFormat& rfRet, string& strContentTypeRet)
+{
+    string::size_type nDot = strReq.rfind('.');
+    if (nDot == string::npos)
+        return false;
+    strParamRet = strReq.substr(0, nDot);
+    string strFormat = strReq.substr(nDot + 1);
+    for (unsigned int i = 0; i < sizeof(vRESTFormats) / sizeof(vRESTFormats[0]); i++)
+    {
+        if (strFormat == vRESTFormats[i].name)
+        {
+            rfRet = vRESTFormats[i].rf;
+            strContentTypeRet = vRESTFormats[i].contentType;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ParseHash(const string& strHash, uint256& hashRet)
+{
+    if (strHash.size() != 64 || !IsHex(strHash))
+        return false;
+    hashRet.SetHex(strHash);
+    return true;
+}
+
+// A block as it is stored, which is how it goes over the network too. Each block
+// in the block files is preceded by its size.
+static bool ReadBlockBytesFromDisk(const CBlockIndex* pindex, vector<char>& vchRet)
+{
+    unsigned int nSize = 0;
+    if (pindex->nBlockPos < sizeof(nSize))
+        return false;
+    FILE* file = OpenBlockFile(pindex->nFile, pindex->nBlockPos - sizeof(nSize), "rb");
+    if (!file)
+        return false;
+    bool fOk = fread(&nSize, sizeof(nSize), 1, file) == 1 && nSize > 0 && nSize <= MAX_BLOCK_SIZE;
+    if (fOk)
+    {
+        vchRet.resize(nSize);
+        fOk = fread(&vchRet[0], 1, nSize, file) == nSize;
+    }
+    fclose(file);
+    return fOk;
+}
+
+static Object BlockHeaderToJSON(const CBlockIndex* pindex)
+{
+    Object result;
+    result.push_back(Pair("hash", pindex->GetBlockHash().GetHex()));
+    result.push_back(Pair("confirmations", pindex->IsInMainChain() ? nBestHeight - pindex->nHeight + 1 : -1));
+    result.push_back(Pair("height", pindex->nHeight));
+    result.push_back(Pair("version", pindex->nVersion));
+    result.push_back(Pair("merkleroot", pindex->hashMerkleRoot.GetHex()));
+    result.push_back(Pair("time", (int64_t)pindex->nTime));
+    result.push_back(Pair("nonce", (uint64_t)pindex->nNonce));
+    result.push_back(Pair("bits", HexBits(pindex->nBits)));
+    result.push_back(Pair("difficulty", GetDifficulty(pindex)));
+    if (pindex->pprev)
+        result.push_back(Pair("previousblockhash", pindex->pprev->GetBlockHash().GetHex()));
+    if (pindex->pnext)
+        result.push_back(Pair("nextblockhash", pindex->pnext->GetBlockHash().GetHex()));
+    result.push_back(Pair("flags", pindex->IsProofOfStake() ? "proof-of-stake" : "proof-of-work"));
+    result.push_back(Pair("proofhash", pindex->hashProof.GetHex()));
+    return result;
+}
+
+// /rest/block/<hash>.<bin|hex|json>
+static int RESTBlock(const string& strReq, string& strContentTypeRet, std::ostream& stream)
+{
+    string strHash;
+    RESTFormat rf;
+    uint256 hash;
+    if (!ParseDataFormat(strReq, strHash, rf, strContentTypeRet))
+        return RESTError(stream, strContentTypeRet, HTTP_BAD_REQUEST, "Format must be one of bin, hex or json");
+    if (!ParseHash(strHash, hash))
+        return RESTError(stream, strContentTypeRet, HTTP_BAD_REQUEST, "Invalid hash: " + strHash);
+
+    // Made holding the lock, and written out after, so a slow client can't hold up the chain
+    CBlockIndex* pindex;
+    string strJSON;
+    {
+        READ_LOCK(csChainState);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            return RESTError(stream, strContentTypeRet, HTTP_NOT_FOUND, strHash + " not found");
+        pindex = mi->second;
+
+        if (rf == RF_JSON)
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pindex, true))
+                return RESTError(stream, strContentTypeRet, HTTP_NOT_FOUND, strHash + " not found");
+            ostringstream streamJSON;
+            CJSONStreamWriter writer(streamJSON);
+            blockToJSON(block, pindex, true, writer);
+            strJSON = streamJSON.str();
+        }
+    }
+    if (rf == RF_JSON)
+    {
+        stream << strJSON << "\n";
+        return HTTP_OK;
+    }
+
+    // served as stored, without being taken apart; where a block is stored never changes
+    vector<char> vchBlock;
+    if (!ReadBlockBytesFromDisk(pindex, vchBlock))
+        return RESTError(stream, strContentTypeRet, HTTP_NOT_FOUND, strHash + " not found");
+    if (rf == RF_BINARY)
+        stream.write(&vchBlock[0], vchBlock.size());
+    else
+        stream << HexStr(vchBlock.begin(), vchBlock.end()) << "\n";
+    return HTTP_OK;
+}
+
+// /rest/tx/<txid>.<bin|hex|json>
+static int RESTTx(const string& strReq, string& strContentTypeRet, std::ostream& stream)
+{
+    string strHash;
+    RESTFormat rf;
+    uint256 hash;
+    if (!ParseDataFormat(strReq, strHash, rf, strContentTypeRet))
+        return RESTError(stream, strContentTypeRet, HTTP_BAD_REQUEST, "Format must be one of bin, hex or json");
+    if (!ParseHash(strHash, hash))
+        return RESTError(stream, strContentTypeRet, HTTP_BAD_REQUEST, "Invalid hash: " + strHash);
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    Object result;
+    {
+        READ_LOCK(csChainState);
+        if (!GetTransaction(hash, tx, hashBlock))
+            return RESTError(stream, strContentTypeRet, HTTP_NOT_FOUND, strHash + " not found");
+        // confirmations depend on the chain as it is now
+        if (rf == RF_JSON)
+            TxToJSON(tx, hashBlock, result);
+    }
+    if (rf == RF_JSON)
+    {
+        stream << write_string(Value(result), false) << "\n";
+        return HTTP_OK;
+    }
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    if (rf == RF_BINARY)
+        stream.write(&ssTx[0], ssTx.size());
+    else
+        stream << HexStr(ssTx.begin(), ssTx.end()) << "\n";
+    return HTTP_OK;
+}
+
+// Headers along the best chain from <hash> on, asked for as "<count>/<hash>.<format>".
+// Plain headers are those of the P2P protocol, index headers come with their
+// proof-of-stake fields, in binary or hex only.
+static int RESTHeaderRange(const string& strReq, string& strContentTypeRet, std::ostream& stream, bool fIndexHeaders)
+{
+    int nMaxCount = fIndexHeaders ? MAX_BLOCK_HEADERS_RESULTS : MAX_REST_HEADERS_RESULTS;
+    string::size_type nSlash = strReq.find('/');
+    if (nSlash == string::npos)
+        return RESTError(stream, strContentTypeRet, HTTP_BAD_REQUEST, "No header count specified. Use <count>/<hash>.<ext>");
+    int nCount = atoi(strReq.substr(0, nSlash));
+    if (nCount < 1 || nCount > nMaxCount)
+        return RESTError(stream, strContentTypeRet, HTTP_BAD_REQUEST, strprintf("Header count out of range: %d", nCount));
+
+    string strHash;
+    RESTFormat rf;
+    uint256 hash;
+    if (!ParseDataFormat(strReq.substr(nSlash + 1), strHash, rf, strContentTypeRet) || (fIndexHeaders && rf == RF_JSON))
+        return RESTError(stream, strContentTypeRet, HTTP_BAD_REQUEST, fIndexHeaders ? "Format must be one of bin or hex" : "Format must be one of bin, hex or json");
+    if (!ParseHash(strHash, hash))
+        return RESTError(stream, strContentTypeRet, HTTP_BAD_REQUEST, "Invalid hash: " + strHash);
+
+    // Gathered holding the lock, and written out after, so a slow client can't hold up the chain
+    Array headersJSON;
+    CDataStream ssHeaders(SER_NETWORK | (fIndexHeaders ? 0 : SER_BLOCKHEADERONLY), PROTOCOL_VERSION);
+    {
+        READ_LOCK(csChainState);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            return RESTError(stream, strContentTypeRet, HTTP_NOT_FOUND, strHash + " not found");
+
+        // pnext is only set along the best chain, a block off it gets just its own header
+        int n = 0;
+        for (const CBlockIndex* pindex = mi->second; pindex && n < nCount; pindex = pindex->pnext, n++)
+        {
+            if (fIndexHeaders)
+                ssHeaders << CBlockIndexHeader(pindex);
+            else if (rf == RF_JSON)
+                headersJSON.push_back(BlockHeaderToJSON(pindex));
+            else
+                ssHeaders << pindex->GetBlockHeader();
+        }
+    }
+
+    if (rf == RF_JSON)
+        stream << write_string(Value(headersJSON), false) << "\n";
+    else if (rf == RF_BINARY)
+        stream.write(&ssHeaders[0], ssHeaders.size());
+    else
+        stream << HexStr(ssHeaders.begin(), ssHeaders.end()) << "\n";
+    return HTTP_OK;
+}
+
+// /rest/headers/<count>/<hash>.<bin|hex|json>
+static int RESTHeaders(const string& strReq, string& strContentTypeRet, std::ostream& stream)
+{
+    return RESTHeaderRange(strReq, strContentTypeRet, stream, false);
+}
+
+// /rest/blockheaders/<count>/<hash>.<bin|hex>, as getblockheaders gives them
+static int RESTBlockHeaders(const string& strReq, string& strContentTypeRet, std::ostream& stream)
+{
+    return RESTHeaderRange(strReq, strContentTypeRet, stream, true);
+}
+
+int HTTPReqREST(const string& strURI, string& strContentTypeRet, std::ostream& stream)
+{
+    static const struct
+    {
+        const char* prefix;
+        int (*handler)(const string& strReq, string& strContentTypeRet, std::ostream& stream);
+    } vRESTHandlers[] =
+    {
+        { "/rest/block/",        RESTBlock },
+        { "/rest/tx/",           RESTTx },
+        { "/rest/headers/",      RESTHeaders },
+        { "/rest/blockheaders/", RESTBlockHeaders },
+    };
+
+    for (unsigned int i = 0; i < sizeof(vRESTHandlers) / sizeof(vRESTHandlers[0]); i++)
+    {
+        string strPrefix(vRESTHandlers[i].prefix);
+        if (strURI.compare(0, strPrefix.size(), strPrefix) == 0)
+            return vRESTHandlers[i].handler(strURI.substr(strPrefix.size()), strContentTypeRet, stream);
+    }
+    return RESTError(stream, strContentTypeRet, HTTP_NOT_FOUND, "Not found");
+}
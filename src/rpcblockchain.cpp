@@ -94,36 +94,39 @@ double GetPoSKernelPS()
     return nStakesTime ? dStakeKernelsTriedAvg / nStakesTime : 0;
 }
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail)
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail, CJSONWriter& writer)
 {
-    Object result;
-    result.push_back(Pair("hash", block.GetHash().GetHex()));
+    writer.BeginObject();
+    writer.Write("hash", block.GetHash().GetHex());
     int confirmations = -1;
     // Only report confirmations if the block is on the main chain
     if (blockindex->IsInMainChain())
         confirmations = nBestHeight - blockindex->nHeight + 1;
-    result.push_back(Pair("confirmations", confirmations));
-    result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
-    result.push_back(Pair("height", blockindex->nHeight));
-    result.push_back(Pair("version", block.nVersion));
-    result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    result.push_back(Pair("mint", ValueFromAmount(blockindex->nMint)));
-    result.push_back(Pair("time", (int64_t)block.GetBlockTime()));
-    result.push_back(Pair("nonce", (uint64_t)block.nNonce));
-    result.push_back(Pair("bits", HexBits(block.nBits)));
-    result.push_back(Pair("difficulty", GetDifficulty(blockindex)));
-    result.push_back(Pair("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0')));
-    result.push_back(Pair("chaintrust", leftTrim(blockindex->nChainTrust.GetHex(), '0')));
+    writer.Write("confirmations", confirmations);
+    writer.Write("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.Write("height", blockindex->nHeight);
+    writer.Write("version", block.nVersion);
+    writer.Write("merkleroot", block.hashMerkleRoot.GetHex());
+    writer.Write("mint", ValueFromAmount(blockindex->nMint));
+    writer.Write("time", (int64_t)block.GetBlockTime());
+    writer.Write("nonce", (uint64_t)block.nNonce);
+    writer.Write("bits", HexBits(block.nBits));
+    writer.Write("difficulty", GetDifficulty(blockindex));
+    writer.Write("blocktrust", leftTrim(blockindex->GetBlockTrust().GetHex(), '0'));
+    writer.Write("chaintrust", leftTrim(blockindex->nChainTrust.GetHex(), '0'));
     if (blockindex->pprev)
-        result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
+        writer.Write("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
     if (blockindex->pnext)
-        result.push_back(Pair("nextblockhash", blockindex->pnext->GetBlockHash().GetHex()));
+        writer.Write("nextblockhash", blockindex->pnext->GetBlockHash().GetHex());
+
+    writer.Write("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": ""));
+    writer.Write("proofhash", blockindex->hashProof.GetHex());
+    writer.Write("entropybit", (int)blockindex->GetStakeEntropyBit());
+    writer.Write("modifier", strprintf("%016x", blockindex->nStakeModifier));
 
-    result.push_back(Pair("flags", strprintf("%s%s", blockindex->IsProofOfStake()? "proof-of-stake" : "proof-of-work", blockindex->GeneratedStakeModifier()? " stake-modifier": "")));
-    result.push_back(Pair("proofhash", blockindex->hashProof.GetHex()));
-    result.push_back(Pair("entropybit", (int)blockindex->GetStakeEntropyBit()));
-    result.push_back(Pair("modifier", strprintf("%016x", blockindex->nStakeModifier)));
-    Array txinfo;
+    // one transaction at a time
+    writer.Key("tx");
+    writer.BeginArray();
     BOOST_FOREACH (const CTransaction& tx, block.vtx)
     {
         if (fPrintTransactionDetail)
@@ -133,18 +136,17 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
             entry.push_back(Pair("txid", tx.GetHash().GetHex()));
             TxToJSON(tx, 0, entry);
 
-            txinfo.push_back(entry);
+            writer.Write(entry);
         }
         else
-            txinfo.push_back(tx.GetHash().GetHex());
+            writer.Write(tx.GetHash().GetHex());
     }
-
-    result.push_back(Pair("tx", txinfo));
+    writer.EndArray();
 
     if (block.IsProofOfStake())
-        result.push_back(Pair("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end())));
+        writer.Write("signature", HexStr(block.vchBlockSig.begin(), block.vchBlockSig.end()));
 
-    return result;
+    writer.EndObject();
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -267,7 +269,32 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->phashBlock->GetHex();
 }
 
-Value getblock(const Array& params, bool fHelp)
+Value getblockheaders(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getblockheaders <index> [count=2000]\n"
+            "Returns, hex encoded, the headers of up to <count> blocks of the best chain from <index> on, "
+            "with their proof-of-stake fields, as the block index has them.\n"
+            "Each header takes 168 bytes: version, previous block hash, merkle root, time, bits and nonce, "
+            "which are the 80 bytes the block hash is taken over, then height, flags, stake modifier, "
+            "stake prevout, stake time and proof hash. Block signatures are not included.");
+
+    int nHeight = params[0].get_int();
+    if (nHeight < 0 || nHeight > nBestHeight)
+        throw runtime_error("Block number out of range.");
+    int nCount = params.size() > 1 ? params[1].get_int() : 2000;
+    if (nCount < 1 || nCount > MAX_BLOCK_HEADERS_RESULTS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("count must be from 1 to %d", MAX_BLOCK_HEADERS_RESULTS));
+
+    CDataStream ssHeaders(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeaders.reserve(min(nCount, nBestHeight - nHeight + 1) * CBlockIndexHeader::SIZE);
+    for (CBlockIndex* pindex = FindBlockByHeight(nHeight); pindex && nCount > 0; pindex = pindex->pnext, nCount--)
+        ssHeaders << CBlockIndexHeader(pindex);
+    return HexStr(ssHeaders.begin(), ssHeaders.end());
+}
+
+void getblock(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -278,17 +305,25 @@ Value getblock(const Array& params, bool fHelp)
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = mi->second;
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
 }
 
-Value getblockbynumber(const Array& params, bool fHelp)
+Value getblock(const Array& params, bool fHelp)
+{
+    CJSONValueWriter writer;
+    getblock(params, fHelp, writer);
+    return writer.GetValue();
+}
+
+void getblockbynumber(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
         throw runtime_error(
@@ -301,16 +336,17 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     block.ReadFromDisk(pblockindex, true);
 
-    return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
+    blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false, writer);
+}
+
+Value getblockbynumber(const Array& params, bool fHelp)
+{
+    CJSONValueWriter writer;
+    getblockbynumber(params, fHelp, writer);
+    return writer.GetValue();
 }
 
 // ppcoin: get information of sync-checkpoint
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "net.h"
+#include "notify.h"
 #include "bitcoinrpc.h"
 #include "alert.h"
 #include "wallet.h"
@@ -55,18 +56,46 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("services", strprintf("%08x", stats.nServices)));
         obj.push_back(Pair("lastsend", (int64_t)stats.nLastSend));
         obj.push_back(Pair("lastrecv", (int64_t)stats.nLastRecv));
+        obj.push_back(Pair("bytessent", (int64_t)stats.nSendBytes));
+        obj.push_back(Pair("bytesrecv", (int64_t)stats.nRecvBytes));
+        obj.push_back(Pair("bytessentbulk", (int64_t)stats.nSendBytesBulk));
+        obj.push_back(Pair("sendthrottled", (int64_t)stats.nSendThrottled));
+        obj.push_back(Pair("bulkthrottled", (int64_t)stats.nSendBulkThrottled));
         obj.push_back(Pair("conntime", (int64_t)stats.nTimeConnected));
         obj.push_back(Pair("version", stats.nVersion));
         obj.push_back(Pair("subver", stats.strSubVer));
         obj.push_back(Pair("inbound", stats.fInbound));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        obj.push_back(Pair("invqueuetx", (int)stats.nInvQueueTx));
+        obj.push_back(Pair("invqueueblock", (int)stats.nInvQueueBlock));
+        obj.push_back(Pair("invsent", (int64_t)stats.nInvSent));
 
         ret.push_back(obj);
     }
 
     return ret;
 }
+
+Value getnotifyinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getnotifyinfo\n"
+            "Returns the state of the notification publisher started with -pubnotify: "
+            "its subscribers, and the messages published and dropped for subscribers not keeping up.");
+
+    Object obj;
+    obj.push_back(Pair("enabled", pnotifyPublisher != NULL));
+    if (pnotifyPublisher)
+    {
+        obj.push_back(Pair("port", (int)pnotifyPublisher->GetPort()));
+        obj.push_back(Pair("subscribers", (int)pnotifyPublisher->GetSubscriberCount()));
+        obj.push_back(Pair("published", pnotifyPublisher->GetPublished()));
+        obj.push_back(Pair("dropped", pnotifyPublisher->GetDropped()));
+    }
+    return obj;
+}
  
 // ppcoin: send alert.  
 // There is a known deadlock situation with ThreadMessageHandler
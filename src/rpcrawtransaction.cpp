@@ -137,7 +137,7 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
-Value listunspent(const Array& params, bool fHelp)
+void listunspent(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -173,7 +173,7 @@ Value listunspent(const Array& params, bool fHelp)
         }
     }
 
-    Array results;
+    writer.BeginArray();
     vector<COutput> vecOutputs;
     pwalletMain->AvailableCoins(vecOutputs, false);
     BOOST_FOREACH(const COutput& out, vecOutputs)
@@ -217,10 +217,16 @@ Value listunspent(const Array& params, bool fHelp)
         }
         entry.push_back(Pair("amount",ValueFromAmount(nValue)));
         entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        writer.Write(entry);
     }
+    writer.EndArray();
+}
 
-    return results;
+Value listunspent(const Array& params, bool fHelp)
+{
+    CJSONValueWriter writer;
+    listunspent(params, fHelp, writer);
+    return writer.GetValue();
 }
 
 Value createrawtransaction(const Array& params, bool fHelp)
@@ -587,3 +593,146 @@ Value sendrawtransaction(const Array& params, bool fHelp)
 
     return hashTx.GetHex();
 }
+
+static void AddressIndexKeyFromString(const string& strAddress, unsigned char& nType, uint160& hashBytes)
+{
+    CBitcoinAddress address(strAddress);
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Jumbucks address");
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(address.Get());
+    if (!GetAddressIndexKey(scriptPubKey, nType, hashBytes))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Address type not indexed");
+}
+
+static string AddressIndexKeyToString(unsigned char nType, const uint160& hashBytes)
+{
+    if (nType == ADDRESS_INDEX_SCRIPTHASH)
+        return CBitcoinAddress(CScriptID(hashBytes)).ToString();
+    return CBitcoinAddress(CKeyID(hashBytes)).ToString();
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 5)
+        throw runtime_error(
+            "getaddresstxids <address> [startheight=0] [endheight=-1] [skip=0] [count=1000]\n"
+            "Returns the transactions paying to or spending from <address>, oldest first,\n"
+            "as {txid, height} objects, within the given block heights (-1 for no limit).\n"
+            "Skips the first [skip] transactions and returns at most [count].\n"
+            "Requires -addressindex.");
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+
+    unsigned char nType;
+    uint160 hashBytes;
+    AddressIndexKeyFromString(params[0].get_str(), nType, hashBytes);
+
+    int nStart = 0;
+    int nEnd = std::numeric_limits<int>::max();
+    if (params.size() > 1)
+        nStart = max(0, params[1].get_int());
+    if (params.size() > 2 && params[2].get_int() >= 0)
+        nEnd = params[2].get_int();
+    int nSkip = 0;
+    int nCount = 1000;
+    if (params.size() > 3)
+        nSkip = params[3].get_int();
+    if (params.size() > 4)
+        nCount = params[4].get_int();
+    if (nSkip < 0 || nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative skip or count");
+
+    vector<pair<int, uint256> > vTxids;
+    CTxDB txdb("r");
+    if (!txdb.ReadAddressTxids(nType, hashBytes, nStart, nEnd, nSkip, nCount, vTxids))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+    Array result;
+    BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, vTxids)
+    {
+        Object entry;
+        entry.push_back(Pair("txid", item.second.GetHex()));
+        entry.push_back(Pair("height", item.first));
+        result.push_back(entry);
+    }
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressutxos <address> [skip=0] [count=1000]\n"
+            "Returns the unspent outputs paying to <address> in the best chain.\n"
+            "Skips the first [skip] outputs and returns at most [count].\n"
+            "Requires -addressindex.");
+
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled");
+
+    unsigned char nType;
+    uint160 hashBytes;
+    AddressIndexKeyFromString(params[0].get_str(), nType, hashBytes);
+
+    int nSkip = 0;
+    int nCount = 1000;
+    if (params.size() > 1)
+        nSkip = params[1].get_int();
+    if (params.size() > 2)
+        nCount = params[2].get_int();
+    if (nSkip < 0 || nCount < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative skip or count");
+
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    CTxDB txdb("r");
+    if (!txdb.ReadAddressUnspent(nType, hashBytes, nSkip, nCount, vUnspent))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+    Array result;
+    BOOST_FOREACH(const PAIRTYPE(CAddressUnspentKey, CAddressUnspentValue)& item, vUnspent)
+    {
+        Object entry;
+        entry.push_back(Pair("address", AddressIndexKeyToString(item.first.nType, item.first.hashBytes)));
+        entry.push_back(Pair("txid", item.first.txhash.GetHex()));
+        entry.push_back(Pair("vout", (int)item.first.nIndex));
+        entry.push_back(Pair("amount", ValueFromAmount(item.second.nValue)));
+        entry.push_back(Pair("scriptPubKey", HexStr(item.second.script.begin(), item.second.script.end())));
+        entry.push_back(Pair("height", item.second.nBlockHeight));
+        result.push_back(entry);
+    }
+    return result;
+}
+
+Value getspentinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "getspentinfo <txid> <vout>\n"
+            "Returns the transaction and input in the best chain that spent output <vout> of <txid>.\n"
+            "Requires -spentindex.");
+
+    if (!fSpentIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Spent index not enabled");
+
+    uint256 hash;
+    hash.SetHex(params[0].get_str());
+    int nOut = params[1].get_int();
+    if (nOut < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid vout");
+
+    CSpentIndexValue value;
+    CTxDB txdb("r");
+    if (!txdb.ReadSpentIndex(COutPoint(hash, nOut), value))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unable to get spent info");
+
+    Object result;
+    result.push_back(Pair("txid", value.txid.GetHex()));
+    result.push_back(Pair("index", (int)value.nInputIndex));
+    result.push_back(Pair("height", value.nBlockHeight));
+    result.push_back(Pair("amount", ValueFromAmount(value.nValue)));
+    if (value.nType != ADDRESS_INDEX_NONE)
+        result.push_back(Pair("address", AddressIndexKeyToString(value.nType, value.hashBytes)));
+    return result;
+}
@@ -104,6 +104,7 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("testnet",       fTestNet));
     obj.push_back(Pair("keypoololdest", (int64_t)pwalletMain->GetOldestKeyPoolTime()));
     obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
+    obj.push_back(Pair("keypoolrefillrate", pwalletMain->GetKeyPoolRefillRate()));
     obj.push_back(Pair("paytxfee",      ValueFromAmount(nTransactionFee)));
     obj.push_back(Pair("mininput",      ValueFromAmount(nMinimumInputValue)));
     if (pwalletMain->IsCrypted())
@@ -125,10 +126,7 @@ Value getnewpubkey(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
-    // Generate a new key that is added to wallet
+    // Take the next key from the pool, which is refilled in the background
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey))
         throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Error: Keypool ran out, please call keypoolrefill first");
@@ -155,10 +153,7 @@ Value getnewaddress(const Array& params, bool fHelp)
     if (params.size() > 0)
         strAccount = AccountFromValue(params[0]);
 
-    if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
-
-    // Generate a new key that is added to wallet
+    // Take the next key from the pool, which is refilled in the background
     CPubKey newKey;
     if (!pwalletMain->GetKeyFromPool(newKey))
         throw JSONRPCError(RPC_WALLET_KEYPOOL_RAN_OUT, "Error: Keypool ran out, please call keypoolrefill first");
@@ -655,7 +650,7 @@ Value movecmd(const Array& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    bool fDebit = pwalletMain->AddAccountingEntry(debit, walletdb);
 
     // Credit
     CAccountingEntry credit;
@@ -665,10 +660,19 @@ Value movecmd(const Array& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    bool fCredit = fDebit && pwalletMain->AddAccountingEntry(credit, walletdb);
 
-    if (!walletdb.TxnCommit())
+    // neither entry is kept unless both are written
+    if (!fCredit || !walletdb.TxnCommit())
+    {
+        if (!fCredit)
+            walletdb.TxnAbort();
+        if (fDebit)
+            pwalletMain->UndoAccountingEntry(debit.nOrderPos);
+        if (fCredit)
+            pwalletMain->UndoAccountingEntry(credit.nOrderPos);
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    }
 
     return true;
 }
@@ -1114,7 +1118,15 @@ void AcentryToJSON(const CAccountingEntry& acentry, const string& strAccount, Ar
     }
 }
 
-Value listtransactions(const Array& params, bool fHelp)
+static void ListTransactionsItem(const CWallet::TxPair& item, const string& strAccount, Array& ret)
+{
+    if (item.first != 0)
+        ListTransactions(*item.first, strAccount, 0, true, ret);
+    if (item.second != 0)
+        AcentryToJSON(*item.second, strAccount, ret);
+}
+
+void listtransactions(const Array& params, bool fHelp, CJSONWriter& writer)
 {
     if (fHelp || params.size() > 3)
         throw runtime_error(
@@ -1136,40 +1148,44 @@ Value listtransactions(const Array& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
-    Array ret;
-
-    std::list<CAccountingEntry> acentries;
-    CWallet::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
-    // iterate backwards until we have nCount items to return:
-    for (CWallet::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    // Entries are counted newest to oldest until there are nCount+nFrom of them,
+    // and then made again oldest to newest and written out as they are, so that
+    // no more than the entries of one transaction are held at a time
+    const CWallet::TxItems& txOrdered = pwalletMain->wtxOrdered;
+    CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin();
+    int nEntries = 0;
+    while (it != txOrdered.rend() && nEntries < nCount + nFrom)
     {
-        CWalletTx *const pwtx = (*it).second.first;
-        if (pwtx != 0)
-            ListTransactions(*pwtx, strAccount, 0, true, ret);
-        CAccountingEntry *const pacentry = (*it).second.second;
-        if (pacentry != 0)
-            AcentryToJSON(*pacentry, strAccount, ret);
-
-        if ((int)ret.size() >= (nCount+nFrom)) break;
+        Array ret;
+        ListTransactionsItem((*it).second, strAccount, ret);
+        nEntries += ret.size();
+        ++it;
     }
-    // ret is newest to oldest
 
-    if (nFrom > (int)ret.size())
-        nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
-        nCount = ret.size() - nFrom;
-    Array::iterator first = ret.begin();
-    std::advance(first, nFrom);
-    Array::iterator last = ret.begin();
-    std::advance(last, nFrom+nCount);
+    // counted newest first, entries [nFrom, nEnd) are the ones to return
+    if (nFrom > nEntries)
+        nFrom = nEntries;
+    int nEnd = min(nEntries, nFrom + nCount);
 
-    if (last != ret.end()) ret.erase(last, ret.end());
-    if (first != ret.begin()) ret.erase(ret.begin(), first);
-
-    std::reverse(ret.begin(), ret.end()); // Return oldest to newest
+    writer.BeginArray();
+    int nPos = nEntries;
+    for (CWallet::TxItems::const_iterator itFwd = it.base(); itFwd != txOrdered.end() && nPos > nFrom; ++itFwd)
+    {
+        Array ret;
+        ListTransactionsItem((*itFwd).second, strAccount, ret);
+        nPos -= ret.size();
+        for (int i = ret.size() - 1; i >= 0; i--)
+            if (nPos + i >= nFrom && nPos + i < nEnd)
+                writer.Write(ret[i]);
+    }
+    writer.EndArray();
+}
 
-    return ret;
+Value listtransactions(const Array& params, bool fHelp)
+{
+    CJSONValueWriter writer;
+    listtransactions(params, fHelp, writer);
+    return writer.GetValue();
 }
 
 Value listaccounts(const Array& params, bool fHelp)
@@ -1257,12 +1273,13 @@ Value listsinceblock(const Array& params, bool fHelp)
 
     Array transactions;
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    // only the transactions in the blocks since, in none, or in orphaned blocks need to be looked at
+    vector<const CWalletTx*> vtx;
+    pwalletMain->GetTransactionsAbove(pindex ? pindex->nHeight : -1, vtx);
+    BOOST_FOREACH(const CWalletTx* pwtx, vtx)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions);
+        if (depth == -1 || pwtx->GetDepthInMainChain() < depth)
+            ListTransactions(*pwtx, "*", 0, true, transactions);
     }
 
     uint256 lastblock;
@@ -1644,6 +1661,7 @@ Value validateaddress(const Array& params, bool fHelp)
         CTxDestination dest = address.Get();
         string currentAddress = address.ToString();
         ret.push_back(Pair("address", currentAddress));
+        LOCK(pwalletMain->cs_wallet);
         bool fMine = IsMine(*pwalletMain, dest);
         ret.push_back(Pair("ismine", fMine));
         if (fMine) {
@@ -1680,6 +1698,7 @@ Value validatepubkey(const Array& params, bool fHelp)
         CTxDestination dest = address.Get();
         string currentAddress = address.ToString();
         ret.push_back(Pair("address", currentAddress));
+        LOCK(pwalletMain->cs_wallet);
         bool fMine = IsMine(*pwalletMain, dest);
         ret.push_back(Pair("ismine", fMine));
         ret.push_back(Pair("iscompressed", isCompressed));
@@ -1732,6 +1751,106 @@ Value reservebalance(const Array& params, bool fHelp)
 }
 
 
+Value consolidatecoins(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 4)
+        throw runtime_error(
+            "consolidatecoins [dryrun=true] [targetsize] [maxinputs] [feebudget]\n"
+            "Merge the wallet's coins below [targetsize] and split those of twice it or more,\n"
+            "each address on its own, spending or creating at most [maxinputs] coins a transaction\n"
+            "and paying at most [feebudget] in fees. Defaults are the -consolidate* settings.\n"
+            "With [dryrun] only shows the plan, the change in the number of kernels the stake\n"
+            "miner tries each time it searches and in the stake weight (coin-days), otherwise\n"
+            "carries it out.\n"
+            "Note that coins spent start over with no coin age, so lose their weight until they\n"
+            "have aged again.");
+
+    bool fDryRun = true;
+    if (params.size() > 0)
+        fDryRun = params[0].get_bool();
+    int64_t nTargetValue = nConsolidateTargetValue;
+    if (params.size() > 1)
+        nTargetValue = AmountFromValue(params[1]);
+    if (nTargetValue < COIN)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "targetsize must be at least 1");
+    unsigned int nMaxInputs = nConsolidateMaxInputs;
+    if (params.size() > 2)
+    {
+        if (params[2].get_int64() < 2)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "maxinputs must be at least 2");
+        nMaxInputs = params[2].get_int64();
+    }
+    int64_t nFeeBudget = nConsolidateFeeBudget;
+    if (params.size() > 3)
+        nFeeBudget = AmountFromValue(params[3]);
+
+    if (!fDryRun)
+        EnsureWalletIsUnlocked();
+
+    CConsolidatePlan plan;
+    pwalletMain->PlanConsolidation(nTargetValue, nMaxInputs, nFeeBudget, plan);
+
+    Object result;
+    result.push_back(Pair("targetsize", ValueFromAmount(nTargetValue)));
+    result.push_back(Pair("maxinputs", (boost::int64_t)nMaxInputs));
+    result.push_back(Pair("feebudget", ValueFromAmount(nFeeBudget)));
+
+    Array txs;
+    int64_t nFeeTotal = 0;
+    BOOST_FOREACH(const CConsolidateTx& ctx, plan.vTx)
+    {
+        Object entry;
+        entry.push_back(Pair("address", CBitcoinAddress(ctx.address).ToString()));
+        entry.push_back(Pair("type", ctx.fSplit ? "split" : "merge"));
+        entry.push_back(Pair("inputs", (int)ctx.vInputs.size()));
+        entry.push_back(Pair("valuein", ValueFromAmount(ctx.nValueIn)));
+        Array outputs;
+        BOOST_FOREACH(int64_t nValue, ctx.vOutputs)
+            outputs.push_back(ValueFromAmount(nValue));
+        entry.push_back(Pair("outputs", outputs));
+
+        if (fDryRun)
+        {
+            entry.push_back(Pair("fee", ValueFromAmount(ctx.nFee)));
+            nFeeTotal += ctx.nFee;
+        }
+        else
+        {
+            uint256 hashTx;
+            int64_t nFee = 0;
+            string strError;
+            if (!pwalletMain->CommitConsolidation(ctx, hashTx, nFee, strError))
+            {
+                entry.push_back(Pair("error", strError));
+                txs.push_back(entry);
+                break;
+            }
+            entry.push_back(Pair("fee", ValueFromAmount(nFee)));
+            entry.push_back(Pair("txid", hashTx.GetHex()));
+            nFeeTotal += nFee;
+        }
+        txs.push_back(entry);
+    }
+    result.push_back(Pair("transactions", txs));
+    result.push_back(Pair("outputsbefore", plan.nOutputsBefore));
+    result.push_back(Pair("outputsafter", plan.nOutputsAfter));
+    result.push_back(Pair("fee", ValueFromAmount(nFeeTotal)));
+
+    // CreateCoinStake hashes each coin for every second of the search interval, so the work of a
+    // search goes with the number of coins. The chance of a kernel goes with the coins' value
+    // times their age, which moving them puts back to nothing until they are past the min age.
+    Object kernel;
+    kernel.push_back(Pair("coinsbefore", plan.nOutputsBefore));
+    kernel.push_back(Pair("coinsafter", plan.nOutputsAfter));
+    kernel.push_back(Pair("hashesbefore", (boost::int64_t)plan.nOutputsBefore * MAX_STAKE_SEARCH_INTERVAL));
+    kernel.push_back(Pair("hashesafter", (boost::int64_t)plan.nOutputsAfter * MAX_STAKE_SEARCH_INTERVAL));
+    kernel.push_back(Pair("weightbefore", (uint64_t)plan.nCoinDaysBefore));
+    kernel.push_back(Pair("weightafter", (uint64_t)(plan.nCoinDaysBefore - plan.nCoinDaysLost)));
+    result.push_back(Pair("kernelsearch", kernel));
+    return result;
+}
+
+
 // ppcoin: check wallet integrity
 Value checkwallet(const Array& params, bool fHelp)
 {
@@ -2068,6 +2187,10 @@ Value clearwallettransactions(const Array& params, bool fHelp)
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
+        // the records are walked on disk, so queued ones must be there first
+        if (!pwalletMain->FlushPendingTxs())
+            throw JSONRPCError(RPC_WALLET_ERROR, "Error writing queued wallet transactions");
+
         CWalletDB walletdb(pwalletMain->strWalletFile);
         walletdb.TxnBegin();
         Dbc* pcursor = walletdb.GetTxnCursor();
@@ -2161,6 +2284,8 @@ Value clearwallettransactions(const Array& params, bool fHelp)
         pcursor->close();
         walletdb.TxnCommit();
 
+        pwalletMain->RebuildTxIndex();
+        pwalletMain->MarkDirty();
 
         //pwalletMain->mapWallet.clear();
     }
@@ -2190,26 +2315,26 @@ Value scanforalltxns(const Array& params, bool fHelp)
         nFromHeight = params[0].get_int();
 
 
-    if (nFromHeight > 0)
-    {
-        pindex = mapBlockIndex[hashBestChain];
-        while (pindex->nHeight > nFromHeight
-            && pindex->pprev)
-            pindex = pindex->pprev;
-    };
-
-    if (pindex == NULL)
-        throw runtime_error("Genesis Block is not set.");
-
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
+        if (nFromHeight > 0)
+        {
+            pindex = mapBlockIndex[hashBestChain];
+            while (pindex->nHeight > nFromHeight
+                && pindex->pprev)
+                pindex = pindex->pprev;
+        };
 
-        pwalletMain->MarkDirty();
+        if (pindex == NULL)
+            throw runtime_error("Genesis Block is not set.");
 
-        pwalletMain->ScanForWalletTransactions(pindex, true);
-        pwalletMain->ReacceptWalletTransactions();
+        pwalletMain->MarkDirty();
     }
 
+    // the rescan takes cs_main and cs_wallet only while committing what it finds
+    pwalletMain->ScanForWalletTransactions(pindex, true);
+    pwalletMain->ReacceptWalletTransactions();
+
     result.push_back(Pair("result", "Scan complete."));
 
     return result;
@@ -2283,6 +2408,29 @@ Value scanforstealthtxns(const Array& params, bool fHelp)
     return result;
 }
 
+Value getrescaninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrescaninfo\n"
+            "Returns the progress of the running, or last, wallet rescan.");
+
+    CRescanProgress progress = pwalletMain->GetRescanProgress();
+
+    Object obj;
+    obj.push_back(Pair("running", progress.fRunning));
+    obj.push_back(Pair("startheight", progress.nStartHeight));
+    obj.push_back(Pair("height", progress.nHeight));
+    obj.push_back(Pair("stopheight", progress.nStopHeight));
+    int nBlocks = progress.nStopHeight - progress.nStartHeight + 1;
+    if (nBlocks > 0)
+        obj.push_back(Pair("progress", (double)(progress.nHeight - progress.nStartHeight + 1) / nBlocks));
+    obj.push_back(Pair("found", progress.nFound));
+    if (progress.nStartTime)
+        obj.push_back(Pair("elapsed", (boost::int64_t)(GetTime() - progress.nStartTime)));
+    return obj;
+}
+
 Value getwalletinfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -2300,6 +2448,7 @@ Value getwalletinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("txcount", (int)pwalletMain->mapWallet.size()));
     obj.push_back(Pair("keypoololdest", (boost::int64_t)pwalletMain->GetOldestKeyPoolTime()));
     obj.push_back(Pair("keypoolsize", (int)pwalletMain->GetKeyPoolSize()));
+    obj.push_back(Pair("keypoolrefillrate", pwalletMain->GetKeyPoolRefillRate()));
     if (pwalletMain->IsCrypted())
     {
         obj.push_back(Pair("locked", pwalletMain->IsLocked()));
@@ -11,6 +11,8 @@
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
 
+#include <boost/bind.hpp>
+
 //const uint8_t stealth_version_byte = 0x2a;
 const uint8_t stealth_version_byte = 0x28;
 
@@ -681,3 +683,166 @@ bool IsStealthAddress(const std::string& encodedAddress)
     
     return true;
 };
+
+
+CStealthScanner::CStealthScanner()
+{
+    bnCtx = BN_CTX_new();
+    ecgrp = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    
+    // -- every call computes a cG, a table of multiples of G makes those cheap
+    if (ecgrp && bnCtx && !EC_GROUP_precompute_mult(ecgrp, bnCtx))
+        printf("CStealthScanner(): EC_GROUP_precompute_mult failed.\n");
+};
+
+CStealthScanner::~CStealthScanner()
+{
+    for (std::map<data_chunk, BIGNUM*>::iterator it = mapScanSecret.begin(); it != mapScanSecret.end(); ++it)
+        BN_clear_free(it->second);
+    for (std::map<ec_point, EC_POINT*>::iterator it = mapSpendPoint.begin(); it != mapSpendPoint.end(); ++it)
+        EC_POINT_free(it->second);
+    if (ecgrp)      EC_GROUP_free(ecgrp);
+    if (bnCtx)      BN_CTX_free(bnCtx);
+};
+
+int CStealthScanner::StealthSecret(const ec_secret& scanSecret, const ec_point& ephemPubkey, const ec_point& pkSpend, ec_secret& sharedSOut, ec_point& pkOut)
+{
+    // -- same steps as ::StealthSecret on the receiving side, see there
+    
+    if (!ecgrp || !bnCtx)
+    {
+        printf("CStealthScanner::StealthSecret(): not initialised.\n");
+        return 1;
+    };
+    
+    if (ephemPubkey.empty() || pkSpend.empty())
+        return 1;
+    
+    int rv = 0;
+    uint8_t vchOutQ[ec_compressed_size];
+    
+    BIGNUM* bnc     = NULL;
+    EC_POINT* Q     = NULL;
+    EC_POINT* C     = NULL;
+    EC_POINT* Rout  = NULL;
+    
+    data_chunk vchScanSecret(&scanSecret.e[0], &scanSecret.e[0] + ec_secret_size);
+    std::map<data_chunk, BIGNUM*>::iterator mi = mapScanSecret.find(vchScanSecret);
+    if (mi == mapScanSecret.end())
+    {
+        BIGNUM* bnScan = BN_bin2bn(&scanSecret.e[0], ec_secret_size, BN_new());
+        if (!bnScan)
+        {
+            printf("CStealthScanner::StealthSecret(): bnScan BN_bin2bn failed.\n");
+            return 1;
+        };
+        mi = mapScanSecret.insert(std::make_pair(vchScanSecret, bnScan)).first;
+    };
+    const BIGNUM* bnScan = mi->second;
+    
+    std::map<ec_point, EC_POINT*>::iterator mr = mapSpendPoint.find(pkSpend);
+    if (mr == mapSpendPoint.end())
+    {
+        EC_POINT* R = EC_POINT_new(ecgrp);
+        if (!R || !EC_POINT_oct2point(ecgrp, R, &pkSpend[0], pkSpend.size(), bnCtx))
+        {
+            printf("CStealthScanner::StealthSecret(): R EC_POINT_oct2point failed\n");
+            if (R) EC_POINT_free(R);
+            return 1;
+        };
+        mr = mapSpendPoint.insert(std::make_pair(pkSpend, R)).first;
+    };
+    const EC_POINT* R = mr->second;
+    
+    if (!(Q = EC_POINT_new(ecgrp))
+        || !EC_POINT_oct2point(ecgrp, Q, &ephemPubkey[0], ephemPubkey.size(), bnCtx))
+    {
+        printf("CStealthScanner::StealthSecret(): Q EC_POINT_oct2point failed\n");
+        rv = 1;
+        goto End;
+    };
+    
+    // -- dQ
+    if (!EC_POINT_mul(ecgrp, Q, NULL, Q, bnScan, bnCtx))
+    {
+        printf("CStealthScanner::StealthSecret(): dQ EC_POINT_mul failed\n");
+        rv = 1;
+        goto End;
+    };
+    
+    if (EC_POINT_point2oct(ecgrp, Q, POINT_CONVERSION_COMPRESSED, vchOutQ, sizeof(vchOutQ), bnCtx) != ec_compressed_size)
+    {
+        printf("CStealthScanner::StealthSecret(): vchOutQ incorrect length.\n");
+        rv = 1;
+        goto End;
+    };
+    
+    SHA256(vchOutQ, sizeof(vchOutQ), &sharedSOut.e[0]);
+    
+    if (!(bnc = BN_bin2bn(&sharedSOut.e[0], ec_secret_size, BN_new())))
+    {
+        printf("CStealthScanner::StealthSecret(): BN_bin2bn failed\n");
+        rv = 1;
+        goto End;
+    };
+    
+    // -- cG, from the precomputed table
+    if (!(C = EC_POINT_new(ecgrp))
+        || !EC_POINT_mul(ecgrp, C, bnc, NULL, NULL, bnCtx))
+    {
+        printf("CStealthScanner::StealthSecret(): C EC_POINT_mul failed\n");
+        rv = 1;
+        goto End;
+    };
+    
+    if (!(Rout = EC_POINT_new(ecgrp))
+        || !EC_POINT_add(ecgrp, Rout, R, C, bnCtx))
+    {
+        printf("CStealthScanner::StealthSecret(): Rout EC_POINT_add failed\n");
+        rv = 1;
+        goto End;
+    };
+    
+    pkOut.resize(ec_compressed_size);
+    if (EC_POINT_point2oct(ecgrp, Rout, POINT_CONVERSION_COMPRESSED, &pkOut[0], ec_compressed_size, bnCtx) != ec_compressed_size)
+    {
+        printf("CStealthScanner::StealthSecret(): pkOut incorrect length.\n");
+        rv = 1;
+        goto End;
+    };
+    
+    End:
+    if (Rout)       EC_POINT_free(Rout);
+    if (C)          EC_POINT_free(C);
+    if (bnc)        BN_free(bnc);
+    if (Q)          EC_POINT_free(Q);
+    
+    return rv;
+};
+
+static void ThreadStealthScan(CStealthScanner* pscanner, std::vector<CStealthScanJob>* pvJobs, unsigned int nStart, unsigned int nStep)
+{
+    for (unsigned int i = nStart; i < pvJobs->size(); i += nStep)
+    {
+        CStealthScanJob& job = (*pvJobs)[i];
+        job.rv = pscanner->StealthSecret(job.scanSecret, job.ephemPubkey, job.pkSpend, job.sharedS, job.pkOut);
+    };
+};
+
+void StealthScanBatch(std::vector<CStealthScanJob>& vJobs, const std::vector<CStealthScanner*>& vScanners)
+{
+    unsigned int nThreads = std::min(vScanners.size(), vJobs.size());
+    
+    if (nThreads <= 1)
+    {
+        if (!vScanners.empty())
+            ThreadStealthScan(vScanners[0], &vJobs, 0, 1);
+        return;
+    };
+    
+    boost::thread_group threadGroup;
+    for (unsigned int i = 1; i < nThreads; ++i)
+        threadGroup.create_thread(boost::bind(&ThreadStealthScan, vScanners[i], &vJobs, i, nThreads));
+    ThreadStealthScan(vScanners[0], &vJobs, 0, nThreads);
+    threadGroup.join_all();
+};
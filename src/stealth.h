@@ -11,8 +11,11 @@
 #include <stdlib.h> 
 #include <stdio.h> 
 #include <vector>
+#include <map>
 #include <inttypes.h>
 
+#include <openssl/ec.h>
+
 
 typedef std::vector<uint8_t> data_chunk;
 
@@ -110,5 +113,48 @@ int StealthSharedToSecretSpend(ec_secret& sharedS, ec_secret& spendSecret, ec_se
 bool IsStealthAddress(const std::string& encodedAddress);
 
 
+/** The receiving side of StealthSecret, keeping what can be reused between calls:
+ * the curve with its table of generator multiples, a BN_CTX, and the scan
+ * secrets and spend public keys already decoded. Gives exactly the results of
+ * StealthSecret(scanSecret, ephemPubkey, pkSpend, ...).
+ * Not thread safe, use one per thread.
+ */
+class CStealthScanner
+{
+private:
+    EC_GROUP* ecgrp;
+    BN_CTX* bnCtx;
+    std::map<data_chunk, BIGNUM*> mapScanSecret;
+    std::map<ec_point, EC_POINT*> mapSpendPoint;
+
+    // not copyable
+    CStealthScanner(const CStealthScanner&);
+    CStealthScanner& operator=(const CStealthScanner&);
+
+public:
+    CStealthScanner();
+    ~CStealthScanner();
+
+    int StealthSecret(const ec_secret& scanSecret, const ec_point& ephemPubkey, const ec_point& pkSpend, ec_secret& sharedSOut, ec_point& pkOut);
+};
+
+/** One ephemeral key to test against one stealth address */
+class CStealthScanJob
+{
+public:
+    ec_secret scanSecret;
+    ec_point ephemPubkey;
+    ec_point pkSpend;
+
+    int rv;
+    ec_secret sharedS;
+    ec_point pkOut;
+};
+
+// Run StealthSecret for each job, split over a thread per scanner, which keep what
+// they decode for the next batch given them
+void StealthScanBatch(std::vector<CStealthScanJob>& vJobs, const std::vector<CStealthScanner*>& vScanners);
+
+
 #endif  // BITCOIN_STEALTH_H
 
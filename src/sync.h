@@ -12,6 +12,7 @@
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 
 ////////////////////////////////////////////////
@@ -157,6 +158,12 @@ typedef CMutexLock<CCriticalSection> CCriticalBlock;
 #define LOCK2(cs1,cs2) CCriticalBlock criticalblock1(cs1, #cs1, __FILE__, __LINE__),criticalblock2(cs2, #cs2, __FILE__, __LINE__)
 #define TRY_LOCK(cs,name) CCriticalBlock name(cs, #cs, __FILE__, __LINE__, true)
 
+/** Many readers or one writer. Not recursive, and not followed by the lock order checks. */
+typedef boost::shared_mutex CSharedCriticalSection;
+
+#define READ_LOCK(cs) boost::shared_lock<CSharedCriticalSection> sharedblock(cs)
+#define WRITE_LOCK(cs) boost::unique_lock<CSharedCriticalSection> exclusiveblock(cs)
+
 #define ENTER_CRITICAL_SECTION(cs) \
     { \
         EnterCritical(#cs, __FILE__, __LINE__, (void*)(&cs)); \
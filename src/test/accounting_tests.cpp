@@ -9,7 +9,7 @@
 BOOST_AUTO_TEST_SUITE(accounting_tests)
 
 static void
-GetResults(CWalletDB& walletdb, std::map<int64, CAccountingEntry>& results)
+GetResults(CWalletDB& walletdb, std::map<int64_t, CAccountingEntry>& results)
 {
     std::list<CAccountingEntry> aes;
 
@@ -24,18 +24,19 @@ GetResults(CWalletDB& walletdb, std::map<int64, CAccountingEntry>& results)
 
 BOOST_AUTO_TEST_CASE(acc_orderupgrade)
 {
+    LOCK(pwalletMain->cs_wallet);
     CWalletDB walletdb(pwalletMain->strWalletFile);
     std::vector<CWalletTx*> vpwtx;
     CWalletTx wtx;
     CAccountingEntry ae;
-    std::map<int64, CAccountingEntry> results;
+    std::map<int64_t, CAccountingEntry> results;
 
     ae.strAccount = "";
     ae.nCreditDebit = 1;
     ae.nTime = 1333333333;
     ae.strOtherAccount = "b";
     ae.strComment = "";
-    walletdb.WriteAccountingEntry(ae);
+    pwalletMain->AddAccountingEntry(ae, walletdb);
 
     wtx.mapValue["comment"] = "z";
     pwalletMain->AddToWallet(wtx);
@@ -45,7 +46,7 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
 
     ae.nTime = 1333333336;
     ae.strOtherAccount = "c";
-    walletdb.WriteAccountingEntry(ae);
+    pwalletMain->AddAccountingEntry(ae, walletdb);
 
     GetResults(walletdb, results);
 
@@ -61,7 +62,7 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     ae.nTime = 1333333330;
     ae.strOtherAccount = "d";
     ae.nOrderPos = pwalletMain->IncOrderPosNext();
-    walletdb.WriteAccountingEntry(ae);
+    pwalletMain->AddAccountingEntry(ae, walletdb);
 
     GetResults(walletdb, results);
 
@@ -103,7 +104,7 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     ae.nTime = 1333333334;
     ae.strOtherAccount = "e";
     ae.nOrderPos = -1;
-    walletdb.WriteAccountingEntry(ae);
+    pwalletMain->AddAccountingEntry(ae, walletdb);
 
     GetResults(walletdb, results);
 
@@ -118,6 +119,22 @@ BOOST_AUTO_TEST_CASE(acc_orderupgrade)
     BOOST_CHECK(results[4].strComment.empty());
     BOOST_CHECK(results[5].nTime == 1333333334);
     BOOST_CHECK(6 == vpwtx[1]->nOrderPos);
+
+    // the activity log, once rebuilt after reordering, has everything in the new order
+    pwalletMain->RebuildTxIndex();
+    BOOST_CHECK(pwalletMain->wtxOrdered.size() == pwalletMain->mapWallet.size() + pwalletMain->laccentries.size());
+    CWallet::TxItems::iterator it = pwalletMain->wtxOrdered.find(6);
+    BOOST_CHECK(it != pwalletMain->wtxOrdered.end() && it->second.first == vpwtx[1]);
+    it = pwalletMain->wtxOrdered.find(5);
+    BOOST_CHECK(it != pwalletMain->wtxOrdered.end() && it->second.second && it->second.second->nTime == 1333333334);
+
+    // an entry taken back, as move does when its write fails, is gone from both
+    size_t nEntries = pwalletMain->laccentries.size();
+    ae.nOrderPos = pwalletMain->IncOrderPosNext();
+    pwalletMain->AddAccountingEntry(ae, walletdb);
+    pwalletMain->UndoAccountingEntry(ae.nOrderPos);
+    BOOST_CHECK(pwalletMain->laccentries.size() == nEntries);
+    BOOST_CHECK(pwalletMain->wtxOrdered.count(ae.nOrderPos) == 0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addressindex.h"
+#include "key.h"
+#include "main.h"
+
+using namespace std;
+
+static string SerializedKey(const CAddressIndexKey& key)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << make_pair(string("addr"), key);
+    return ss.str();
+}
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    uint160 hash1 = 1, hash2 = 2;
+    uint256 txhashLow = 1, txhashHigh = ~uint256(0);
+
+    // by address, then height, whatever the txid
+    BOOST_CHECK(SerializedKey(CAddressIndexKey(1, hash1, 500000, txhashHigh, 0, false)) <
+                SerializedKey(CAddressIndexKey(1, hash2, 0, txhashLow, 0, false)));
+    BOOST_CHECK(SerializedKey(CAddressIndexKey(1, hash1, 255, txhashHigh, 0, false)) <
+                SerializedKey(CAddressIndexKey(1, hash1, 256, txhashLow, 0, false)));
+    BOOST_CHECK(SerializedKey(CAddressIndexKey(1, hash1, 65535, txhashHigh, 0, false)) <
+                SerializedKey(CAddressIndexKey(1, hash1, 65536, txhashLow, 0, false)));
+
+    // where a height range scan starts sorts before every entry at that height
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << make_pair(string("addr"), CAddressIndexIteratorKey(1, hash1, 256));
+    BOOST_CHECK(ss.str() < SerializedKey(CAddressIndexKey(1, hash1, 256, 0, 0, false)));
+    BOOST_CHECK(ss.str() > SerializedKey(CAddressIndexKey(1, hash1, 255, txhashHigh, 0xffffffff, true)));
+
+    // and reads back as written
+    CAddressIndexKey key(2, hash2, 123456, txhashHigh, 7, true), keyRead;
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << key;
+    BOOST_CHECK_EQUAL(ssKey.size(), key.GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    ssKey >> keyRead;
+    BOOST_CHECK_EQUAL(keyRead.nBlockHeight, 123456);
+    BOOST_CHECK(keyRead.hashBytes == hash2 && keyRead.txhash == txhashHigh);
+    BOOST_CHECK(keyRead.nIndex == 7 && keyRead.fSpending);
+}
+
+BOOST_AUTO_TEST_CASE(addressindex_block_entries)
+{
+    bool fAddressIndexOld = fAddressIndex, fSpentIndexOld = fSpentIndex;
+    fAddressIndex = fSpentIndex = true;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CKeyID keyID = key.GetPubKey().GetID();
+
+    CTransaction txPrev;
+    txPrev.vin.resize(1);
+    txPrev.vin[0].prevout.SetNull();
+    txPrev.vout.resize(2);
+    txPrev.vout[0].nValue = 5 * COIN;
+    txPrev.vout[0].scriptPubKey.SetDestination(keyID);
+    txPrev.vout[1].nValue = 1 * COIN;
+    txPrev.vout[1].scriptPubKey << OP_TRUE;
+
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].prevout = COutPoint(txPrev.GetHash(), 0);
+    tx.vin[1].prevout = COutPoint(txPrev.GetHash(), 1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 6 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination((CScript() << OP_TRUE).GetID());
+
+    MapPrevTx mapInputs;
+    mapInputs[txPrev.GetHash()].second = txPrev;
+
+    CBlockAddressIndex index;
+    index.AddTx(txPrev, MapPrevTx(), 10);
+    index.AddTx(tx, mapInputs, 11);
+
+    // paid to the key at 10, spent from it at 11, paid to the script at 11
+    BOOST_CHECK_EQUAL(index.vAddressIndex.size(), 3U);
+    BOOST_CHECK(index.vAddressIndex[0].first.hashBytes == keyID);
+    BOOST_CHECK_EQUAL(index.vAddressIndex[0].second, 5 * COIN);
+    BOOST_CHECK(index.vAddressIndex[1].first.fSpending);
+    BOOST_CHECK_EQUAL(index.vAddressIndex[1].first.nBlockHeight, 11);
+    BOOST_CHECK_EQUAL(index.vAddressIndex[1].second, -5 * COIN);
+    BOOST_CHECK_EQUAL(index.vAddressIndex[2].first.nType, ADDRESS_INDEX_SCRIPTHASH);
+
+    BOOST_CHECK_EQUAL(index.vUnspentCreated.size(), 2U);
+    BOOST_CHECK_EQUAL(index.vUnspentSpent.size(), 1U);
+    BOOST_CHECK(index.vUnspentSpent[0].txhash == txPrev.GetHash());
+
+    // both inputs are in the spent index, known address or not
+    BOOST_CHECK_EQUAL(index.vSpentIndex.size(), 2U);
+    BOOST_CHECK(index.vSpentIndex[1].second.txid == tx.GetHash());
+    BOOST_CHECK_EQUAL(index.vSpentIndex[1].second.nInputIndex, 1U);
+    BOOST_CHECK_EQUAL(index.vSpentIndex[1].second.nType, ADDRESS_INDEX_NONE);
+
+    fAddressIndex = fAddressIndexOld;
+    fSpentIndex = fSpentIndexOld;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
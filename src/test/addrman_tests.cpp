@@ -0,0 +1,105 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "addrman.h"
+#include "serialize.h"
+
+using namespace std;
+
+static CAddress MakeAddr(const char* pszIp, int64_t nTime)
+{
+    CAddress addr(CService(pszIp, 8333));
+    addr.nTime = nTime;
+    return addr;
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_select_snapshot)
+{
+    CAddrMan addrman;
+    CNetAddr source("250.1.1.1");
+    int64_t nNow = GetAdjustedTime();
+
+    // empty table gives nothing back
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    // a snapshot taken while empty must not hide later additions
+    BOOST_CHECK(addrman.Add(MakeAddr("250.1.1.2", nNow), source));
+    CAddress addr = addrman.Select();
+    BOOST_CHECK(addr.IsValid());
+    BOOST_CHECK((CService)addr == CService("250.1.1.2", 8333));
+
+    // entries marked good move to tried and stay selectable
+    addrman.Good(CService("250.1.1.2", 8333));
+    for (int i = 0; i < 20; i++)
+        BOOST_CHECK((CService)addrman.Select(0) == CService("250.1.1.2", 8333));
+}
+
+BOOST_AUTO_TEST_CASE(addrman_select_after_attempt)
+{
+    CAddrMan addrman;
+    CNetAddr source("250.1.1.1");
+    int64_t nNow = GetAdjustedTime();
+    addrman.Add(MakeAddr("250.5.1.1", nNow), source);
+    addrman.Add(MakeAddr("250.6.1.1", nNow), source);
+
+    // with the snapshot taken, an address that has just failed is drawn far less than
+    // the other, as it would be from the tables themselves
+    addrman.Select(100);
+    addrman.Attempt(CService("250.5.1.1", 8333));
+    int nFailed = 0;
+    for (int i = 0; i < 1000; i++)
+        if ((CService)addrman.Select(100) == CService("250.5.1.1", 8333))
+            nFailed++;
+    BOOST_CHECK(nFailed < 100);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_journal_replay)
+{
+    CAddrMan addrman;
+    CNetAddr source("250.1.1.1");
+    int64_t nNow = GetAdjustedTime();
+
+    addrman.Add(MakeAddr("250.2.1.1", nNow), source);
+    addrman.Add(MakeAddr("250.3.1.1", nNow), source);
+    addrman.Add(MakeAddr("250.4.1.1", nNow), source);
+    addrman.Attempt(CService("250.3.1.1", 8333));
+    addrman.Good(CService("250.4.1.1", 8333));
+
+    // adding a known address again is not a change worth logging
+    addrman.Add(MakeAddr("250.2.1.1", nNow), source);
+
+    vector<CAddrJournalEntry> vEntries;
+    BOOST_CHECK(addrman.TakeJournal(vEntries));
+    BOOST_CHECK_EQUAL(vEntries.size(), 5U);
+    BOOST_CHECK(vEntries[0].nAction == CAddrJournalEntry::ADD);
+    BOOST_CHECK(vEntries[3].nAction == CAddrJournalEntry::ATTEMPT);
+    BOOST_CHECK(vEntries[4].nAction == CAddrJournalEntry::GOOD);
+
+    // taking the journal empties it
+    vector<CAddrJournalEntry> vEmpty;
+    BOOST_CHECK(addrman.TakeJournal(vEmpty));
+    BOOST_CHECK(vEmpty.empty());
+
+    // entries survive a round trip through the on-disk encoding
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << vEntries;
+    vector<CAddrJournalEntry> vRead;
+    ss >> vRead;
+    BOOST_CHECK_EQUAL(vRead.size(), vEntries.size());
+    BOOST_CHECK(vRead[0].source == source);
+    BOOST_CHECK((CService)vRead[4].addr == CService("250.4.1.1", 8333));
+
+    // replaying on an empty table rebuilds the same contents without journaling them again
+    CAddrMan addrmanReplay;
+    addrmanReplay.Replay(vRead);
+    BOOST_CHECK_EQUAL(addrmanReplay.size(), 3);
+    BOOST_CHECK(addrmanReplay.TakeJournal(vEmpty));
+    BOOST_CHECK(vEmpty.empty());
+    BOOST_CHECK((CService)addrmanReplay.Select(0) == CService("250.4.1.1", 8333));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
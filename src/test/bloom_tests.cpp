@@ -0,0 +1,70 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include <openssl/rand.h>
+
+#include "bloom.h"
+#include "uint256.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(bloom_no_false_negatives)
+{
+    CBloomFilter filter;
+    BOOST_CHECK(!filter.contains(GetRandHash()));
+
+    filter.Reset(1000, GetRandHash().Get64());
+    vector<uint256> vHash;
+    vector<uint160> vID;
+    for (int i = 0; i < 500; i++)
+    {
+        vHash.push_back(GetRandHash());
+        vID.push_back(Hash160(vector<unsigned char>(vHash.back().begin(), vHash.back().end())));
+        filter.insert(vHash.back());
+        filter.insert(vID.back());
+    }
+    BOOST_CHECK_EQUAL(filter.size(), 1000U);
+    BOOST_CHECK(filter.IsFull());
+
+    for (int i = 0; i < 500; i++)
+    {
+        BOOST_CHECK(filter.contains(vHash[i]));
+        BOOST_CHECK(filter.contains(vID[i]));
+        // raw bytes and the typed overload agree
+        BOOST_CHECK(filter.contains(vID[i].begin(), 20));
+    }
+
+    // keys of any length, such as public keys
+    vector<unsigned char> vchPubKey(33);
+    RAND_bytes(&vchPubKey[0], vchPubKey.size());
+    filter.insert(&vchPubKey[0], vchPubKey.size());
+    BOOST_CHECK(filter.contains(&vchPubKey[0], vchPubKey.size()));
+}
+
+BOOST_AUTO_TEST_CASE(bloom_false_positive_rate)
+{
+    CBloomFilter filter;
+    filter.Reset(10000, GetRandHash().Get64());
+    for (int i = 0; i < 10000; i++)
+        filter.insert(GetRandHash());
+
+    // sized for about 1 in 1700 when full, allow plenty of slack
+    int nFalse = 0;
+    for (int i = 0; i < 100000; i++)
+        if (filter.contains(GetRandHash()))
+            nFalse++;
+    BOOST_CHECK(nFalse < 200);
+
+    // emptied by a reset
+    uint256 hash = GetRandHash();
+    filter.insert(hash);
+    filter.Reset(10, GetRandHash().Get64());
+    BOOST_CHECK(!filter.contains(hash));
+    BOOST_CHECK_EQUAL(filter.size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
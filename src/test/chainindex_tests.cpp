@@ -0,0 +1,112 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// A synthetic chain of nLength blocks, branching off pindexFork (or from a genesis block of its own)
+static void MakeChain(vector<CBlockIndex>& vIndex, vector<uint256>& vHash, CBlockIndex* pindexFork, int nLength, int nSalt)
+{
+    vIndex.resize(nLength);
+    vHash.resize(nLength);
+    for (int i = 0; i < nLength; i++)
+    {
+        vHash[i] = (uint256(nSalt) << 32) + i;
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].pprev = i > 0 ? &vIndex[i - 1] : pindexFork;
+        vIndex[i].nHeight = vIndex[i].pprev ? vIndex[i].pprev->nHeight + 1 : 0;
+    }
+}
+
+class CBlockLocatorInspect : public CBlockLocator
+{
+public:
+    CBlockLocatorInspect(const CBlockIndex* pindex) : CBlockLocator(pindex) {}
+
+    const vector<uint256>& Have() const { return vHave; }
+};
+
+// CBlockLocator::Set as it was, stepping back one block at a time
+static vector<uint256> WalkLocator(const CBlockIndex* pindex)
+{
+    vector<uint256> vHave;
+    int nStep = 1;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back((!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
+    return vHave;
+}
+
+BOOST_AUTO_TEST_SUITE(chainindex_tests)
+
+BOOST_AUTO_TEST_CASE(chainindex_by_height)
+{
+    LOCK(cs_main);
+
+    // the synthetic chain takes the place of the real one for the duration
+    vector<CBlockIndex*> vSaved;
+    vSaved.swap(vBlockIndexByHeight);
+
+    vector<CBlockIndex> vIndex;
+    vector<uint256> vHash;
+    MakeChain(vIndex, vHash, NULL, 100000, 1);
+    SetBlockIndexByHeight(&vIndex.back());
+    BOOST_CHECK_EQUAL(vBlockIndexByHeight.size(), 100000U);
+    for (int i = 0; i < 1000; i++)
+    {
+        int nHeight = GetRandInt(100000);
+        BOOST_CHECK(FindBlockByHeight(nHeight) == &vIndex[nHeight]);
+    }
+    BOOST_CHECK(FindBlockByHeight(-1) == NULL);
+    BOOST_CHECK(FindBlockByHeight(100000) == NULL);
+
+    BOOST_CHECK(CBlockLocatorInspect(&vIndex.back()).Have() == WalkLocator(&vIndex.back()));
+
+    // reorganised onto a shorter branch forking off at 90000
+    vector<CBlockIndex> vBranch;
+    vector<uint256> vBranchHash;
+    MakeChain(vBranch, vBranchHash, &vIndex[90000], 5000, 2);
+    SetBlockIndexByHeight(&vBranch.back());
+    BOOST_CHECK_EQUAL(vBlockIndexByHeight.size(), 95001U);
+    BOOST_CHECK(FindBlockByHeight(90000) == &vIndex[90000]);
+    BOOST_CHECK(FindBlockByHeight(90001) == &vBranch[0]);
+    BOOST_CHECK(FindBlockByHeight(95000) == &vBranch.back());
+    BOOST_CHECK(FindBlockByHeight(95001) == NULL);
+
+    // a locator from the old tip, no longer on the best chain, still comes out the same
+    BOOST_CHECK(CBlockLocatorInspect(&vIndex.back()).Have() == WalkLocator(&vIndex.back()));
+    BOOST_CHECK(CBlockLocatorInspect(&vBranch.back()).Have() == WalkLocator(&vBranch.back()));
+
+    // Random heights, as an explorer fetches them, against walking back from the
+    // tip as getblockbynumber did; run with --log_level=message to see the times.
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < 100000; i++)
+        BOOST_CHECK(FindBlockByHeight(GetRandInt(95001)) != NULL);
+    int64_t nIndexed = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < 1000; i++)
+    {
+        int nHeight = GetRandInt(95001);
+        const CBlockIndex* pindex = &vBranch.back();
+        while (pindex->nHeight > nHeight)
+            pindex = pindex->pprev;
+        BOOST_CHECK(pindex == vBlockIndexByHeight[nHeight]);
+    }
+    int64_t nWalked = GetTimeMicros() - nStart;
+    BOOST_TEST_MESSAGE(strprintf("random heights: 100000 by index in %"PRId64" us, 1000 walked in %"PRId64" us",
+        nIndexed, nWalked));
+
+    vBlockIndexByHeight.swap(vSaved);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,151 @@
+#include <boost/test/unit_test.hpp>
+
+#include <set>
+#include <vector>
+
+#include "coinselection.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+typedef CCoinSelector::CoinValue CoinValue;
+
+// coins only need a value here, the output index tells them apart
+static void AddCoin(vector<CoinValue>& vCoins, int64_t nValue)
+{
+    vCoins.push_back(make_pair(nValue, make_pair((const CWalletTx*)NULL, (unsigned int)vCoins.size())));
+}
+
+static bool CheckSelection(const vector<CoinValue>& vSelected, int64_t nValue)
+{
+    set<unsigned int> setSeen;
+    int64_t nTotal = 0;
+    BOOST_FOREACH(const CoinValue& coin, vSelected)
+    {
+        if (!setSeen.insert(coin.second.second).second)
+            return false;
+        nTotal += coin.first;
+    }
+    return nTotal == nValue;
+}
+
+BOOST_AUTO_TEST_SUITE(coinselection_tests)
+
+BOOST_AUTO_TEST_CASE(coinselection_basic)
+{
+    vector<CoinValue> vCoins;
+    AddCoin(vCoins, 11 * CENT);
+    AddCoin(vCoins, 7 * CENT);
+    AddCoin(vCoins, 5 * CENT);
+    AddCoin(vCoins, 3 * CENT);
+    CCoinSelector selector(vCoins);
+    BOOST_CHECK_EQUAL(selector.GetTotal(), 26 * CENT);
+
+    vector<CoinValue> vSelected;
+    int64_t nValue;
+    bool fChangeless;
+
+    // a single coin of the right value
+    BOOST_CHECK(selector.Select(7 * CENT, MIN_TX_FEE, vSelected, nValue, fChangeless));
+    BOOST_CHECK_EQUAL(nValue, 7 * CENT);
+    BOOST_CHECK_EQUAL(vSelected.size(), 1U);
+    BOOST_CHECK(fChangeless);
+
+    // a combination that adds up exactly
+    BOOST_CHECK(selector.Select(16 * CENT, MIN_TX_FEE, vSelected, nValue, fChangeless));
+    BOOST_CHECK_EQUAL(nValue, 16 * CENT);
+    BOOST_CHECK(CheckSelection(vSelected, nValue));
+    BOOST_CHECK(fChangeless);
+
+    // or overshoots by no more than the slack
+    BOOST_CHECK(selector.Select(16 * CENT - 50, 100, vSelected, nValue, fChangeless));
+    BOOST_CHECK_EQUAL(nValue, 16 * CENT);
+    BOOST_CHECK(fChangeless);
+
+    // without slack that needs change
+    BOOST_CHECK(selector.Select(16 * CENT - 50, -1, vSelected, nValue, fChangeless));
+    BOOST_CHECK(nValue >= 16 * CENT - 50);
+    BOOST_CHECK(CheckSelection(vSelected, nValue));
+    BOOST_CHECK(!fChangeless);
+
+    // everything
+    BOOST_CHECK(selector.Select(26 * CENT, MIN_TX_FEE, vSelected, nValue, fChangeless));
+    BOOST_CHECK_EQUAL(vSelected.size(), 4U);
+
+    // more than there is
+    BOOST_CHECK(!selector.Select(26 * CENT + 1, MIN_TX_FEE, vSelected, nValue, fChangeless));
+    BOOST_CHECK(vSelected.empty());
+
+    // nothing at all
+    CCoinSelector selectorEmpty((vector<CoinValue>()));
+    BOOST_CHECK(!selectorEmpty.Select(1, MIN_TX_FEE, vSelected, nValue, fChangeless));
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_lowest_larger)
+{
+    vector<CoinValue> vCoins;
+    AddCoin(vCoins, 1 * CENT);
+    AddCoin(vCoins, 2 * CENT);
+    AddCoin(vCoins, 5 * COIN);
+    AddCoin(vCoins, 3 * COIN);
+    CCoinSelector selector(vCoins);
+
+    vector<CoinValue> vSelected;
+    int64_t nValue;
+    bool fChangeless;
+
+    // the small coins don't reach, the smallest larger coin is taken
+    BOOST_CHECK(selector.Select(1 * COIN, MIN_TX_FEE, vSelected, nValue, fChangeless));
+    BOOST_CHECK_EQUAL(nValue, 3 * COIN);
+    BOOST_CHECK_EQUAL(vSelected.size(), 1U);
+    BOOST_CHECK(!fChangeless);
+}
+
+// Synthetic wallets of many coins, with the time each takes reported; run with
+// --log_level=message to see them.
+BOOST_AUTO_TEST_CASE(coinselection_large_wallets)
+{
+    const char* vName[] = { "uniform", "dust-heavy", "equal" };
+    for (int nDist = 0; nDist < 3; nDist++)
+    {
+        vector<CoinValue> vCoins;
+        for (int i = 0; i < 100000; i++)
+        {
+            if (nDist == 0)
+                AddCoin(vCoins, 1 + GetRand(10 * COIN));
+            else if (nDist == 1)
+                AddCoin(vCoins, i % 10 ? 1 + GetRand(CENT) : 1 + GetRand(100 * COIN));
+            else
+                AddCoin(vCoins, COIN);
+        }
+
+        int64_t nStart = GetTimeMillis();
+        CCoinSelector selector(vCoins);
+        int64_t nSorted = GetTimeMillis();
+
+        // as the fee loop would, a few targets each a little higher than the last
+        int nChangeless = 0;
+        for (int i = 0; i < 10; i++)
+        {
+            int64_t nTarget = 50 * COIN + 123456 + i * MIN_TX_FEE;
+            vector<CoinValue> vSelected;
+            int64_t nValue;
+            bool fChangeless;
+            BOOST_CHECK(selector.Select(nTarget, MIN_TX_FEE, vSelected, nValue, fChangeless));
+            BOOST_CHECK(nValue >= nTarget);
+            BOOST_CHECK(CheckSelection(vSelected, nValue));
+            if (fChangeless)
+            {
+                BOOST_CHECK(nValue <= nTarget + MIN_TX_FEE);
+                nChangeless++;
+            }
+        }
+        int64_t nDone = GetTimeMillis();
+        BOOST_CHECK(nDone - nSorted < 10 * 2 * SELECT_COINS_MAX_MILLIS + 1000);
+        BOOST_TEST_MESSAGE(strprintf("%s: sorted in %"PRId64" ms, 10 selections in %"PRId64" ms, %d without change",
+            vName[nDist], nSorted - nStart, nDone - nSorted, nChangeless));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,170 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+// serialize a complete network message with the given payload
+static CDataStream MakeMessage(const char* pszCommand, const vector<char>& vPayload)
+{
+    CMessageHeader hdr(pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss.insert(ss.end(), vPayload.begin(), vPayload.end());
+    return ss;
+}
+
+// feed a message in chunks of nChunk bytes, returns false on a parse error
+static bool FeedMessage(CNetMessage& msg, const CDataStream& ss, unsigned int nChunk)
+{
+    const char* pch = &ss.begin()[0];
+    unsigned int nBytes = ss.size();
+    while (nBytes > 0)
+    {
+        int handled = msg.in_data ? msg.readData(pch, min(nChunk, nBytes)) : msg.readHeader(pch, min(nChunk, nBytes));
+        if (handled < 0)
+            return false;
+        pch += handled;
+        nBytes -= handled;
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(netmessage_incremental_checksum)
+{
+    vector<char> vPayload;
+    for (int i = 0; i < 3000; i++)
+        vPayload.push_back((char)(i * 7));
+    CDataStream ss = MakeMessage("tx", vPayload);
+    uint256 hashExpected = Hash(vPayload.begin(), vPayload.end());
+
+    // however the bytes are split up, the result must be the same
+    unsigned int vChunk[] = { 1, 7, 24, 25, 1000, 100000 };
+    BOOST_FOREACH(unsigned int nChunk, vChunk)
+    {
+        CNetMessage msg(SER_NETWORK, PROTOCOL_VERSION);
+        BOOST_CHECK(FeedMessage(msg, ss, nChunk));
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK(msg.hashData == hashExpected);
+        BOOST_CHECK(msg.vRecv.size() == vPayload.size());
+        BOOST_CHECK(memcmp(&msg.vRecv[0], &vPayload[0], vPayload.size()) == 0);
+    }
+
+    // an empty payload is complete, with a valid checksum, right after the header
+    CNetMessage msgEmpty(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(FeedMessage(msgEmpty, MakeMessage("verack", vector<char>()), 24));
+    BOOST_CHECK(msgEmpty.complete());
+    vector<char> vEmpty;
+    BOOST_CHECK(msgEmpty.hashData == Hash(vEmpty.begin(), vEmpty.end()));
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_pool_reuse)
+{
+    CNetMessagePool pool;
+    CSerializeData vch;
+
+    // payloads are allocated at the full size of their class, and filled as they arrive
+    pool.Acquire(vch, 600);
+    BOOST_CHECK(vch.empty());
+    BOOST_CHECK(vch.capacity() >= 1024U);
+    vch.resize(600);
+    const char* pchFirst = &vch[0];
+
+    // and handed out again for any later payload of that class
+    pool.Release(vch);
+    BOOST_CHECK(vch.empty());
+    pool.Acquire(vch, 1000);
+    vch.resize(1000);
+    BOOST_CHECK(&vch[0] == pchFirst);
+    pool.Release(vch);
+
+    // but not for a payload of another class
+    CSerializeData vchSmall;
+    pool.Acquire(vchSmall, 100);
+    vchSmall.resize(100);
+    BOOST_CHECK(&vchSmall[0] != pchFirst);
+    BOOST_CHECK(vchSmall.capacity() < 1024U);
+
+    // a header claiming a huge payload gets no more than the largest class up front
+    CSerializeData vchHuge;
+    pool.Acquire(vchHuge, MAX_SIZE);
+    BOOST_CHECK(vchHuge.capacity() <= ((size_t)NET_MESSAGE_POOL_MIN_SIZE << (NET_MESSAGE_POOL_CLASSES - 1)));
+}
+
+BOOST_AUTO_TEST_CASE(token_bucket)
+{
+    CTokenBucket bucket;
+    BOOST_CHECK(!bucket.IsLimited());
+    BOOST_CHECK(bucket.Available(GetTimeMicros()) > 1000000000);
+
+    bucket.SetRate(1000, 1000);
+    BOOST_CHECK(bucket.IsLimited());
+    int64_t nNow = GetTimeMicros();
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), 1000);
+
+    // charging more than is available leaves a debt to be paid off first
+    bucket.Consume(1500);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow), -500);
+    BOOST_CHECK_EQUAL(bucket.Available(nNow + 1000000), 500);
+
+    // refills up to the burst size only
+    BOOST_CHECK_EQUAL(bucket.Available(nNow + 10000000), 1000);
+}
+
+BOOST_AUTO_TEST_CASE(held_getdata_does_not_block_ping)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("250.1.1.1", 8333)));
+    node.nVersion = PROTOCOL_VERSION;
+    node.nRecvVersion = PROTOCOL_VERSION;
+
+    // a historical block held back by the upload target, part sent, fills the send buffer
+    {
+        LOCK(node.cs_vSend);
+        node.vSendMsgBulk.push_back(CSerializeData(SendBufferSize() + 1));
+        node.nSendSize = node.nSendSizeBulk = SendBufferSize() + 1;
+        node.nSendOffset = 1;
+        node.fSendingBulk = true;
+    }
+
+    CDataStream ssGetData(SER_NETWORK, PROTOCOL_VERSION);
+    ssGetData << vector<CInv>();
+    CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing << (uint64_t)42;
+    const char* vCommand[] = { "getdata", "ping" };
+    CDataStream* vPayload[] = { &ssGetData, &ssPing };
+    for (int i = 0; i < 2; i++)
+    {
+        node.vRecvMsg.push_back(CNetMessage(SER_NETWORK, PROTOCOL_VERSION));
+        BOOST_CHECK(FeedMessage(node.vRecvMsg.back(), MakeMessage(vCommand[i], vector<char>(vPayload[i]->begin(), vPayload[i]->end())), 1000));
+    }
+
+    // the ping behind the held getdata is answered, the getdata waits its turn
+    {
+        LOCK(node.cs_vRecvMsg);
+        BOOST_CHECK(ProcessMessages(&node));
+    }
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(node.vRecvMsg.front().hdr.GetCommand() == "getdata");
+    BOOST_CHECK_EQUAL(node.vSendMsg.size(), 1U);
+    CMessageHeader hdrReply;
+    CDataStream ssReply(node.vSendMsg.front().begin(), node.vSendMsg.front().end(), SER_NETWORK, PROTOCOL_VERSION);
+    ssReply >> hdrReply;
+    BOOST_CHECK(hdrReply.GetCommand() == "pong");
+
+    // the send queue was made up, so is not left for anything to send
+    node.vSendMsg.clear();
+    node.vSendMsgBulk.clear();
+    node.nSendSize = node.nSendSizeBulk = node.nSendOffset = 0;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,94 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "main.h"
+#include "notify.h"
+
+using namespace std;
+using namespace boost::asio;
+
+static void CheckMessage(const string& strMsg, const string& strTopic, unsigned int nSequence, const vector<unsigned char>& vchBody)
+{
+    unsigned int nSize;
+    BOOST_REQUIRE(strMsg.size() >= sizeof(nSize));
+    memcpy(&nSize, &strMsg[0], sizeof(nSize));
+    BOOST_CHECK_EQUAL(nSize, strMsg.size() - sizeof(nSize));
+
+    CDataStream ss(strMsg.data() + sizeof(nSize), strMsg.data() + strMsg.size(), SER_NETWORK, PROTOCOL_VERSION);
+    string strTopicRead;
+    unsigned int nSequenceRead;
+    vector<unsigned char> vchBodyRead;
+    ss >> strTopicRead >> nSequenceRead >> vchBodyRead;
+    BOOST_CHECK_EQUAL(strTopicRead, strTopic);
+    BOOST_CHECK_EQUAL(nSequenceRead, nSequence);
+    BOOST_CHECK(vchBodyRead == vchBody);
+    BOOST_CHECK(ss.empty());
+}
+
+BOOST_AUTO_TEST_SUITE(notify_tests)
+
+BOOST_AUTO_TEST_CASE(notify_queue_bounded)
+{
+    // Never run, so nothing is written and the queue only fills
+    CNotifyPublisher publisher(3);
+    boost::shared_ptr<CNotifySubscriber> sub(new CNotifySubscriber(publisher.GetIOService()));
+    sub->setTopics.insert(NOTIFY_TOPIC_HASHTX);
+    publisher.AddSubscriber(sub);
+    BOOST_CHECK(publisher.HaveSubscribers(NOTIFY_TOPIC_HASHTX));
+    BOOST_CHECK(!publisher.HaveSubscribers(NOTIFY_TOPIC_RAWBLOCK));
+
+    vector<unsigned char> vchBody(32, 0xab);
+    for (int i = 0; i < 5; i++)
+        publisher.Publish(NOTIFY_TOPIC_HASHTX, vchBody);
+    publisher.Publish(NOTIFY_TOPIC_RAWTX, vchBody);
+
+    BOOST_CHECK_EQUAL(sub->queue.size(), 3U);
+    BOOST_CHECK_EQUAL(sub->nDropped, 2);
+    BOOST_CHECK_EQUAL(publisher.GetDropped(), 2);
+    BOOST_CHECK_EQUAL(publisher.GetPublished(), 6);
+    CheckMessage(*sub->queue[0], NOTIFY_TOPIC_HASHTX, 0, vchBody);
+    CheckMessage(*sub->queue[2], NOTIFY_TOPIC_HASHTX, 2, vchBody);
+}
+
+BOOST_AUTO_TEST_CASE(notify_stream)
+{
+    CNotifyPublisher publisher(DEFAULT_NOTIFY_QUEUE);
+    string strError;
+    BOOST_REQUIRE(publisher.Listen(0, strError));
+    boost::thread thread(boost::bind(&CNotifyPublisher::Run, &publisher));
+
+    io_service io_serviceClient;
+    ip::tcp::socket socket(io_serviceClient);
+    socket.connect(ip::tcp::endpoint(ip::address_v4::loopback(), publisher.GetPort()));
+    string strSubscribe = string(NOTIFY_TOPIC_HASHBLOCK) + " " + NOTIFY_TOPIC_WALLETTX + "\n";
+    write(socket, buffer(strSubscribe));
+    for (int i = 0; i < 500 && !publisher.HaveSubscribers(NOTIFY_TOPIC_WALLETTX); i++)
+        MilliSleep(10);
+    BOOST_REQUIRE(publisher.HaveSubscribers(NOTIFY_TOPIC_WALLETTX));
+
+    vector<unsigned char> vchTx(33, 0x01), vchBlock(32, 0x02);
+    publisher.Publish(NOTIFY_TOPIC_WALLETTX, vchTx);
+    publisher.Publish(NOTIFY_TOPIC_RAWTX, vchTx);
+    publisher.Publish(NOTIFY_TOPIC_HASHBLOCK, vchBlock);
+
+    // only the topics asked for come, in the order they were published
+    for (int i = 0; i < 2; i++)
+    {
+        unsigned int nSize;
+        read(socket, buffer(&nSize, sizeof(nSize)));
+        string strMsg(sizeof(nSize) + nSize, '\0');
+        memcpy(&strMsg[0], &nSize, sizeof(nSize));
+        read(socket, buffer(&strMsg[sizeof(nSize)], nSize));
+        if (i == 0)
+            CheckMessage(strMsg, NOTIFY_TOPIC_WALLETTX, 0, vchTx);
+        else
+            CheckMessage(strMsg, NOTIFY_TOPIC_HASHBLOCK, 0, vchBlock);
+    }
+
+    publisher.Stop();
+    thread.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,144 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bitcoinrpc.h"
+#include "main.h"
+
+using namespace std;
+using namespace json_spirit;
+
+static const int REST_TEST_CALLS = 1000;
+
+static int RESTRequest(const string& strURI, string& strBodyRet, string& strContentTypeRet)
+{
+    ostringstream stream;
+    strContentTypeRet = "text/plain";
+    int nStatus = HTTPReqREST(strURI, strContentTypeRet, stream);
+    strBodyRet = stream.str();
+    return nStatus;
+}
+
+BOOST_AUTO_TEST_SUITE(rest_tests)
+
+BOOST_AUTO_TEST_CASE(rest_block_formats)
+{
+    string strHash = hashBestChain.GetHex();
+    string strBody, strContentType;
+
+    CBlock block;
+    BOOST_CHECK(block.ReadFromDisk(pindexBest, true));
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+
+    // the bytes on disk are the block as it serializes
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/block/" + strHash + ".bin", strBody, strContentType), HTTP_OK);
+    BOOST_CHECK_EQUAL(strContentType, "application/octet-stream");
+    BOOST_CHECK(strBody == ssBlock.str());
+
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/block/" + strHash + ".hex", strBody, strContentType), HTTP_OK);
+    BOOST_CHECK_EQUAL(strBody, HexStr(ssBlock.begin(), ssBlock.end()) + "\n");
+
+    // the same as getblock with transaction details
+    Array params;
+    params.push_back(strHash);
+    params.push_back(true);
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/block/" + strHash + ".json", strBody, strContentType), HTTP_OK);
+    BOOST_CHECK_EQUAL(strContentType, "application/json");
+    BOOST_CHECK_EQUAL(strBody, write_string(tableRPC.execute("getblock", params), false) + "\n");
+
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/headers/1/" + strHash + ".bin", strBody, strContentType), HTTP_OK);
+    CDataStream ssHeader(SER_NETWORK | SER_BLOCKHEADERONLY, PROTOCOL_VERSION);
+    ssHeader << pindexBest->GetBlockHeader();
+    BOOST_CHECK(strBody == ssHeader.str());
+
+    CTransaction& tx = block.vtx[0];
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/tx/" + tx.GetHash().GetHex() + ".hex", strBody, strContentType), HTTP_OK);
+    BOOST_CHECK_EQUAL(strBody, HexStr(ssTx.begin(), ssTx.end()) + "\n");
+}
+
+BOOST_AUTO_TEST_CASE(rest_bad_requests)
+{
+    string strHash = hashBestChain.GetHex();
+    string strBody, strContentType;
+
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/block/" + strHash, strBody, strContentType), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/block/" + strHash + ".xml", strBody, strContentType), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/block/1234.bin", strBody, strContentType), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/block/" + uint256(1).GetHex() + ".bin", strBody, strContentType), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/tx/" + uint256(1).GetHex() + ".json", strBody, strContentType), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/headers/0/" + strHash + ".bin", strBody, strContentType), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/headers/2001/" + strHash + ".bin", strBody, strContentType), HTTP_BAD_REQUEST);
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/mempool/contents.json", strBody, strContentType), HTTP_NOT_FOUND);
+    BOOST_CHECK_EQUAL(strContentType, "text/plain");
+}
+
+BOOST_AUTO_TEST_CASE(rest_block_index_headers)
+{
+    CBlockIndexHeader header(pindexBest);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header;
+    BOOST_CHECK_EQUAL(ss.size(), CBlockIndexHeader::SIZE);
+    BOOST_CHECK(header.GetHash() == hashBestChain);
+
+    CBlockIndexHeader headerRead;
+    ss >> headerRead;
+    BOOST_CHECK(headerRead.hashProof == pindexBest->hashProof);
+    BOOST_CHECK(headerRead.nStakeModifier == pindexBest->nStakeModifier);
+    BOOST_CHECK_EQUAL(headerRead.nHeight, nBestHeight);
+
+    // the headers follow on from each other, up to the best block
+    Array params;
+    params.push_back(0);
+    params.push_back(MAX_BLOCK_HEADERS_RESULTS);
+    vector<unsigned char> vchHeaders = ParseHex(tableRPC.execute("getblockheaders", params).get_str());
+    BOOST_CHECK_EQUAL(vchHeaders.size(), (min(nBestHeight, MAX_BLOCK_HEADERS_RESULTS - 1) + 1) * CBlockIndexHeader::SIZE);
+    CDataStream ssHeaders(vchHeaders, SER_NETWORK, PROTOCOL_VERSION);
+    uint256 hashPrev = 0;
+    while (!ssHeaders.empty())
+    {
+        ssHeaders >> headerRead;
+        BOOST_CHECK(headerRead.hashPrevBlock == hashPrev);
+        hashPrev = headerRead.GetHash();
+    }
+
+    // REST gives the same bytes, from a hash
+    string strBody, strContentType;
+    params[0] = nBestHeight;
+    params[1] = 5;
+    string strHex = tableRPC.execute("getblockheaders", params).get_str();
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/blockheaders/5/" + hashBestChain.GetHex() + ".hex", strBody, strContentType), HTTP_OK);
+    BOOST_CHECK_EQUAL(strBody, strHex + "\n");
+    BOOST_CHECK_EQUAL(RESTRequest("/rest/blockheaders/5/" + hashBestChain.GetHex() + ".json", strBody, strContentType), HTTP_BAD_REQUEST);
+}
+
+// The same block fetched over REST and through getblock, with the time each takes
+// reported; run with --log_level=message to see it.
+BOOST_AUTO_TEST_CASE(rest_block_throughput)
+{
+    string strHash = hashBestChain.GetHex();
+    string strBody, strContentType;
+    Array params;
+    params.push_back(strHash);
+    params.push_back(true);
+
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < REST_TEST_CALLS; i++)
+        RESTRequest("/rest/block/" + strHash + ".bin", strBody, strContentType);
+    int64_t nBinary = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < REST_TEST_CALLS; i++)
+        RESTRequest("/rest/block/" + strHash + ".json", strBody, strContentType);
+    int64_t nJSON = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    for (int i = 0; i < REST_TEST_CALLS; i++)
+        strBody = write_string(tableRPC.execute("getblock", params), false);
+    int64_t nRPC = GetTimeMicros() - nStart;
+
+    BOOST_TEST_MESSAGE(strprintf("%d blocks: REST .bin %"PRId64" us, REST .json %"PRId64" us, getblock %"PRId64" us",
+                                 REST_TEST_CALLS, nBinary, nJSON, nRPC));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
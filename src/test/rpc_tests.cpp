@@ -0,0 +1,304 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "base58.h"
+#include "bitcoinrpc.h"
+#include "init.h"
+#include "main.h"
+
+using namespace std;
+using namespace json_spirit;
+
+static const int RPC_TEST_CLIENTS = 64;
+static const int RPC_TEST_CALLS = 200;
+
+static void ReadChain(int* pnFailed)
+{
+    for (int i = 0; i < RPC_TEST_CALLS; i++)
+    {
+        Value result = tableRPC.execute("getblockcount", Array());
+        if (result.get_int() != nBestHeight)
+            (*pnFailed)++;
+        result = tableRPC.execute("getbestblockhash", Array());
+        if (result.get_str() != hashBestChain.GetHex())
+            (*pnFailed)++;
+    }
+}
+
+static int64_t RunClients(vector<int>& vFailed)
+{
+    int64_t nStart = GetTimeMicros();
+    boost::thread_group threadGroup;
+    vFailed.assign(RPC_TEST_CLIENTS, 0);
+    for (int i = 0; i < RPC_TEST_CLIENTS; i++)
+        threadGroup.create_thread(boost::bind(&ReadChain, &vFailed[i]));
+    threadGroup.join_all();
+    return GetTimeMicros() - nStart;
+}
+
+static const int RPC_TEST_BATCH_SIZE = 400;
+
+static Value BatchRequest(const string& strMethod, const Array& params, int nId)
+{
+    Object request;
+    request.push_back(Pair("method", strMethod));
+    request.push_back(Pair("params", params));
+    request.push_back(Pair("id", nId));
+    return request;
+}
+
+// Runs the batch on nThreads threads, this one included
+static Array RunBatch(const Array& vReq, int nThreads, int64_t& nMicrosRet)
+{
+    int64_t nStart = GetTimeMicros();
+    CRPCBatch batch(vReq);
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CRPCBatch::Help, &batch));
+    Array vReply = batch.Wait();
+    threadGroup.join_all();
+    nMicrosRet = GetTimeMicros() - nStart;
+    return vReply;
+}
+
+BOOST_AUTO_TEST_SUITE(rpc_tests)
+
+BOOST_AUTO_TEST_CASE(rpc_locks_declared)
+{
+    BOOST_CHECK_EQUAL(tableRPC["getblock"]->locks, RPC_LOCKS_CHAIN_SHARED);
+    BOOST_CHECK_EQUAL(tableRPC["getrawtransaction"]->locks, RPC_LOCKS_CHAIN_SHARED);
+    BOOST_CHECK_EQUAL(tableRPC["sendtoaddress"]->locks, RPC_LOCKS_MAIN_WALLET);
+    BOOST_CHECK_EQUAL(tableRPC["decoderawtransaction"]->locks, RPC_LOCKS_NONE);
+    // waits for a new block holding no lock, and takes cs_main itself
+    BOOST_CHECK_EQUAL(tableRPC["getblocktemplate"]->locks, RPC_LOCKS_NONE);
+    // rescans take cs_rescan before cs_main and cs_wallet, and progress is read alongside
+    BOOST_CHECK_EQUAL(tableRPC["importprivkey"]->locks, RPC_LOCKS_WALLET_SELF);
+    BOOST_CHECK_EQUAL(tableRPC["scanforalltxns"]->locks, RPC_LOCKS_WALLET_SELF);
+    BOOST_CHECK_EQUAL(tableRPC["getrescaninfo"]->locks, RPC_LOCKS_NONE);
+    // only reads, so is run alongside the rest of a batch
+    BOOST_CHECK_EQUAL(tableRPC["gettransaction"]->locks, RPC_LOCKS_WALLET_SHARED);
+}
+
+// Parallel clients reading the chain, with the time they take reported; run with
+// --log_level=message to see it.
+BOOST_AUTO_TEST_CASE(rpc_chain_reads_concurrent)
+{
+    vector<int> vFailed;
+    int64_t nFree = RunClients(vFailed);
+    BOOST_CHECK_EQUAL(count(vFailed.begin(), vFailed.end(), 0), RPC_TEST_CLIENTS);
+
+    // cs_main held throughout, as while a block is validated: the reads still go
+    // through, where they would all have waited on it before
+    int64_t nBusy;
+    {
+        LOCK(cs_main);
+        nBusy = RunClients(vFailed);
+    }
+    BOOST_CHECK_EQUAL(count(vFailed.begin(), vFailed.end(), 0), RPC_TEST_CLIENTS);
+
+    BOOST_TEST_MESSAGE(strprintf("%d clients, %d calls each: %"PRId64" us, %"PRId64" us with cs_main held",
+        RPC_TEST_CLIENTS, 2 * RPC_TEST_CALLS, nFree, nBusy));
+}
+
+// The same calls on both writers
+static void WriteSample(CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Write("name", "quote \" and \\ backslash");
+    writer.Write("amount", ValueFromAmount(123456789));
+    writer.Write("count", (int64_t)-42);
+    writer.Write("none", Value::null);
+    writer.Key("empty");
+    writer.BeginArray();
+    writer.EndArray();
+    writer.Key("list");
+    writer.BeginArray();
+    for (int i = 0; i < 3; i++)
+    {
+        Object entry;
+        entry.push_back(Pair("i", i));
+        entry.push_back(Pair("ok", i % 2 == 0));
+        writer.Write(entry);
+    }
+    writer.BeginObject();
+    writer.EndObject();
+    writer.Write("last");
+    writer.EndArray();
+    writer.EndObject();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_json_writers)
+{
+    Array list;
+    for (int i = 0; i < 3; i++)
+    {
+        Object entry;
+        entry.push_back(Pair("i", i));
+        entry.push_back(Pair("ok", i % 2 == 0));
+        list.push_back(entry);
+    }
+    list.push_back(Object());
+    list.push_back("last");
+    Object sample;
+    sample.push_back(Pair("name", "quote \" and \\ backslash"));
+    sample.push_back(Pair("amount", ValueFromAmount(123456789)));
+    sample.push_back(Pair("count", (int64_t)-42));
+    sample.push_back(Pair("none", Value::null));
+    sample.push_back(Pair("empty", Array()));
+    sample.push_back(Pair("list", list));
+    string strExpected = write_string(Value(sample), false);
+
+    CJSONValueWriter valuewriter;
+    WriteSample(valuewriter);
+    BOOST_CHECK_EQUAL(write_string(valuewriter.GetValue(), false), strExpected);
+
+    ostringstream stream;
+    CJSONStreamWriter streamwriter(stream);
+    WriteSample(streamwriter);
+    BOOST_CHECK_EQUAL(stream.str(), strExpected);
+}
+
+static void CheckStreamedResult(const string& strMethod, const Array& params)
+{
+    BOOST_CHECK(tableRPC.IsStreamed(strMethod));
+    string strWhole = write_string(tableRPC.execute(strMethod, params), false);
+
+    ostringstream stream;
+    CJSONStreamWriter writer(stream);
+    tableRPC.execute(strMethod, params, writer);
+    BOOST_CHECK_EQUAL(stream.str(), strWhole);
+}
+
+BOOST_AUTO_TEST_CASE(rpc_streamed_results)
+{
+    Array params;
+    params.push_back(hashBestChain.GetHex());
+    params.push_back(true);
+    CheckStreamedResult("getblock", params);
+
+    params.clear();
+    params.push_back(nBestHeight);
+    CheckStreamedResult("getblockbynumber", params);
+
+    params.clear();
+    CheckStreamedResult("listunspent", params);
+    params.push_back("*");
+    params.push_back(1000);
+    CheckStreamedResult("listtransactions", params);
+    params.push_back(3);
+    CheckStreamedResult("listtransactions", params);
+}
+
+// A batch run by several threads gives the replies a single thread does, in the
+// order of the requests, with the time each takes reported; run with
+// --log_level=message to see it.
+BOOST_AUTO_TEST_CASE(rpc_batch_parallel)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    Array paramsBlock, paramsAddress;
+    paramsBlock.push_back(hashBestChain.GetHex());
+    paramsBlock.push_back(true);
+    paramsAddress.push_back(CBitcoinAddress(key.GetPubKey().GetID()).ToString());
+
+    Array vReq;
+    for (int i = 0; i < RPC_TEST_BATCH_SIZE; i++)
+    {
+        if (i % 4 == 0)
+            vReq.push_back(BatchRequest("getblock", paramsBlock, i));
+        else if (i % 4 == 1)
+            vReq.push_back(BatchRequest("validateaddress", paramsAddress, i));
+        else if (i % 4 == 2)
+            vReq.push_back(BatchRequest("getblockcount", Array(), i));
+        else
+            vReq.push_back(BatchRequest("nosuchmethod", Array(), i));
+    }
+
+    int64_t nSerial;
+    Array vSerial = RunBatch(vReq, 1, nSerial);
+    BOOST_CHECK_EQUAL(vSerial.size(), vReq.size());
+    BOOST_CHECK_EQUAL(find_value(vSerial[7].get_obj(), "id").get_int(), 7);
+    BOOST_CHECK(find_value(vSerial[7].get_obj(), "error").type() == obj_type);
+    BOOST_CHECK_EQUAL(find_value(vSerial[2].get_obj(), "result").get_int(), nBestHeight);
+    string strSerial = write_string(Value(vSerial), false);
+
+    string strTimes;
+    for (int nThreads = 2; nThreads <= 8; nThreads *= 2)
+    {
+        int64_t nMicros;
+        Array vReply = RunBatch(vReq, nThreads, nMicros);
+        BOOST_CHECK_EQUAL(write_string(Value(vReply), false), strSerial);
+        strTimes += strprintf(", %d threads %"PRId64" us", nThreads, nMicros);
+    }
+    BOOST_TEST_MESSAGE(strprintf("batch of %d: 1 thread %"PRId64" us", RPC_TEST_BATCH_SIZE, nSerial) + strTimes);
+
+    // requests that change the wallet are run in the order they were asked for,
+    // around reads that may run in parallel with them
+    string strAddress = tableRPC.execute("getnewaddress", Array()).get_str();
+    Array vReqOrdered;
+    for (int i = 0; i < RPC_TEST_BATCH_SIZE / 4; i++)
+    {
+        Array paramsSet, paramsGet;
+        paramsSet.push_back(strAddress);
+        paramsSet.push_back(strprintf("batch %d", i));
+        paramsGet.push_back(strAddress);
+        vReqOrdered.push_back(BatchRequest("setaccount", paramsSet, 3 * i));
+        vReqOrdered.push_back(BatchRequest("getblockcount", Array(), 3 * i + 1));
+        vReqOrdered.push_back(BatchRequest("getaccount", paramsGet, 3 * i + 2));
+    }
+    int64_t nMicros;
+    Array vReplyOrdered = RunBatch(vReqOrdered, 8, nMicros);
+    BOOST_REQUIRE_EQUAL(vReplyOrdered.size(), vReqOrdered.size());
+    for (int i = 0; i < RPC_TEST_BATCH_SIZE / 4; i++)
+        BOOST_CHECK_EQUAL(find_value(vReplyOrdered[3 * i + 2].get_obj(), "result").get_str(), strprintf("batch %d", i));
+
+    // a batch with no requests needs no thread to finish it
+    CRPCBatch batchEmpty((Array()));
+    BOOST_CHECK(batchEmpty.Wait().empty());
+}
+
+// A batch of wallet reads: gettransaction is not held back behind the requests
+// that may change the wallet, which run one after another.
+BOOST_AUTO_TEST_CASE(rpc_batch_gettransaction)
+{
+    CWalletTx wtx;
+    string strAddress = tableRPC.execute("getnewaddress", Array()).get_str();
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(CBitcoinAddress(strAddress).Get());
+    wtx.vout.push_back(CTxOut(COIN, scriptPubKey));
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pwalletMain->AddToWallet(wtx);
+    }
+    Array paramsTx;
+    paramsTx.push_back(wtx.GetHash().GetHex());
+
+    Array vReq;
+    for (int i = 0; i < RPC_TEST_BATCH_SIZE; i++)
+    {
+        if (i % 8 == 7)
+            vReq.push_back(BatchRequest("getbalance", Array(), i));
+        else
+            vReq.push_back(BatchRequest("gettransaction", paramsTx, i));
+    }
+
+    int64_t nSerial;
+    Array vSerial = RunBatch(vReq, 1, nSerial);
+    BOOST_REQUIRE_EQUAL(vSerial.size(), vReq.size());
+    BOOST_CHECK_EQUAL(find_value(find_value(vSerial[0].get_obj(), "result").get_obj(), "txid").get_str(), wtx.GetHash().GetHex());
+    string strSerial = write_string(Value(vSerial), false);
+
+    string strTimes;
+    for (int nThreads = 2; nThreads <= 8; nThreads *= 2)
+    {
+        int64_t nMicros;
+        Array vReply = RunBatch(vReq, nThreads, nMicros);
+        BOOST_CHECK_EQUAL(write_string(Value(vReply), false), strSerial);
+        strTimes += strprintf(", %d threads %"PRId64" us", nThreads, nMicros);
+    }
+    BOOST_TEST_MESSAGE(strprintf("gettransaction batch of %d: 1 thread %"PRId64" us", RPC_TEST_BATCH_SIZE, nSerial) + strTimes);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
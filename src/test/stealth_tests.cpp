@@ -0,0 +1,73 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+#include <boost/foreach.hpp>
+
+#include "stealth.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(stealth_tests)
+
+BOOST_AUTO_TEST_CASE(stealth_scanner_matches_stealthsecret)
+{
+    // a few receiving addresses and payments to them
+    vector<ec_secret> vScanSecret(3);
+    vector<ec_point> vSpendPubkey(3);
+    for (unsigned int i = 0; i < vScanSecret.size(); i++)
+    {
+        ec_secret sSpend;
+        BOOST_CHECK(GenerateRandomSecret(vScanSecret[i]) == 0);
+        BOOST_CHECK(GenerateRandomSecret(sSpend) == 0);
+        BOOST_CHECK(SecretToPublicKey(sSpend, vSpendPubkey[i]) == 0);
+    }
+
+    vector<CStealthScanJob> vJobs;
+    for (unsigned int n = 0; n < 10; n++)
+    {
+        ec_secret sEphem;
+        ec_point pkEphem;
+        BOOST_CHECK(GenerateRandomSecret(sEphem) == 0);
+        BOOST_CHECK(SecretToPublicKey(sEphem, pkEphem) == 0);
+        for (unsigned int i = 0; i < vScanSecret.size(); i++)
+        {
+            CStealthScanJob job;
+            job.scanSecret = vScanSecret[i];
+            job.ephemPubkey = pkEphem;
+            job.pkSpend = vSpendPubkey[i];
+            vJobs.push_back(job);
+        }
+    }
+
+    // including an ephemeral key that is not a point
+    CStealthScanJob jobBad = vJobs[0];
+    jobBad.ephemPubkey[0] = 0x05;
+    vJobs.push_back(jobBad);
+
+    // whether on one thread or several, and with scanners new or reused from an
+    // earlier batch, every result is the one StealthSecret gives
+    CStealthScanner vScanner[4];
+    vector<CStealthScanner*> vpScanners;
+    for (unsigned int i = 0; i < 4; i++)
+        vpScanners.push_back(&vScanner[i]);
+    unsigned int vThreads[] = { 1, 4, 4 };
+    BOOST_FOREACH(unsigned int nThreads, vThreads)
+    {
+        vector<CStealthScanJob> vRun(vJobs);
+        StealthScanBatch(vRun, vector<CStealthScanner*>(vpScanners.begin(), vpScanners.begin() + nThreads));
+        for (unsigned int i = 0; i < vRun.size(); i++)
+        {
+            ec_secret sShared;
+            ec_point pkOut;
+            int rv = StealthSecret(vJobs[i].scanSecret, vJobs[i].ephemPubkey, vJobs[i].pkSpend, sShared, pkOut);
+            BOOST_CHECK_EQUAL(vRun[i].rv, rv);
+            if (rv != 0)
+                continue;
+            BOOST_CHECK(memcmp(&vRun[i].sharedS.e[0], &sShared.e[0], ec_secret_size) == 0);
+            BOOST_CHECK(vRun[i].pkOut == pkOut);
+        }
+        BOOST_CHECK(vRun.back().rv != 0);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -292,4 +292,80 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     }
 }
 
+BOOST_AUTO_TEST_CASE(unspent_set_tests)
+{
+    CWallet walletUnspent;
+    CKey key;
+    key.MakeNewKey(true);
+    {
+        LOCK(walletUnspent.cs_wallet);
+        walletUnspent.AddKey(key);
+    }
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 5 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[1].nValue = 3 * COIN; // not ours
+    uint256 hash = tx.GetHash();
+
+    {
+        LOCK(walletUnspent.cs_wallet);
+        walletUnspent.mapWallet[hash] = CWalletTx(&walletUnspent, tx);
+        walletUnspent.UpdateUnspent(hash);
+    }
+
+    // unconfirmed and not from us: available, but not yet trusted
+    vector<COutput> vAvailable;
+    walletUnspent.AvailableCoins(vAvailable, false);
+    BOOST_CHECK_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK_EQUAL(walletUnspent.GetUnconfirmedBalance(), 5 * COIN);
+    BOOST_CHECK_EQUAL(walletUnspent.GetBalance(), 0);
+
+    // once spent, it drops out of both the coins and the cached balances
+    {
+        LOCK(walletUnspent.cs_wallet);
+        walletUnspent.mapWallet[hash].MarkSpent(0);
+        walletUnspent.UpdateUnspent(hash);
+    }
+    walletUnspent.AvailableCoins(vAvailable, false);
+    BOOST_CHECK(vAvailable.empty());
+    BOOST_CHECK_EQUAL(walletUnspent.GetUnconfirmedBalance(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(orphaned_tx_listed_since_block)
+{
+    CWallet walletIndex;
+    CTransaction tx;
+    tx.vout.resize(1);
+    uint256 hash = tx.GetHash();
+
+    // confirmed in the genesis block, it is not above height 0
+    vector<const CWalletTx*> vtx;
+    {
+        LOCK(walletIndex.cs_wallet);
+        walletIndex.mapWallet[hash] = CWalletTx(&walletIndex, tx);
+        walletIndex.mapWallet[hash].hashBlock = hashGenesisBlock;
+        walletIndex.UpdateTxHeight(hash);
+        walletIndex.GetTransactionsAbove(0, vtx);
+    }
+    BOOST_CHECK(vtx.empty());
+
+    // once its block is disconnected it is, though the index still has it at height 0
+    walletIndex.TxBlockDisconnected(hash);
+    {
+        LOCK(walletIndex.cs_wallet);
+        walletIndex.GetTransactionsAbove(0, vtx);
+        BOOST_CHECK_EQUAL(vtx.size(), 1U);
+        BOOST_CHECK(vtx.size() == 1 && vtx[0]->GetHash() == hash);
+
+        // and gone with the transaction
+        walletIndex.mapWallet.erase(hash);
+        walletIndex.UpdateTxHeight(hash);
+        walletIndex.GetTransactionsAbove(-1, vtx);
+    }
+    BOOST_CHECK(vtx.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
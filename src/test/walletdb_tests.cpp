@@ -0,0 +1,194 @@
+#include <boost/test/unit_test.hpp>
+
+#include "init.h"
+#include "wallet.h"
+#include "walletdb.h"
+
+#include <boost/filesystem.hpp>
+
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
+using namespace std;
+
+// Looks straight at the wallet transaction records on disk
+class CWalletDBInspect : public CWalletDB
+{
+public:
+    CWalletDBInspect(const string& strFilename) : CWalletDB(strFilename) {}
+
+    bool HaveTx(const uint256& hash)
+    {
+        return Exists(make_pair(string("tx"), hash));
+    }
+
+    bool ReadTx(const uint256& hash, CWalletTx& wtx)
+    {
+        return Read(make_pair(string("tx"), hash), wtx);
+    }
+};
+
+static uint256 AddTestTx(const string& strComment, unsigned int nLockTime)
+{
+    CWalletTx wtx;
+    wtx.mapValue["comment"] = strComment;
+    wtx.nLockTime = nLockTime;
+    pwalletMain->AddToWallet(wtx);
+    return wtx.GetHash();
+}
+
+BOOST_AUTO_TEST_SUITE(walletdb_tests)
+
+BOOST_AUTO_TEST_CASE(walletdb_write_behind)
+{
+    // held throughout, so that the flushing thread can't write the queue out early
+    LOCK(pwalletMain->cs_wallet);
+    CWalletDBInspect walletdb(pwalletMain->strWalletFile);
+
+    uint256 hash = AddTestTx("write behind", 1001);
+    BOOST_CHECK(!walletdb.HaveTx(hash));
+
+    // changed again before being written, only the latest goes to disk
+    CWalletTx& wtx = pwalletMain->mapWallet[hash];
+    wtx.mapValue["comment"] = "changed";
+    wtx.WriteToDisk();
+    BOOST_CHECK(pwalletMain->FlushPendingTxs());
+
+    CWalletTx wtxRead;
+    BOOST_CHECK(walletdb.ReadTx(hash, wtxRead));
+    BOOST_CHECK(wtxRead.mapValue["comment"] == "changed");
+
+    // erasing is queued just the same
+    BOOST_CHECK(pwalletMain->EraseFromWallet(hash));
+    BOOST_CHECK(walletdb.HaveTx(hash));
+    BOOST_CHECK(pwalletMain->FlushPendingTxs());
+    BOOST_CHECK(!walletdb.HaveTx(hash));
+}
+
+#ifndef WIN32
+// The wallet transactions the crash test writes, the first committed before the crash
+static CWalletTx MakeCrashTestTx(int n)
+{
+    CWalletTx wtx;
+    wtx.mapValue["comment"] = strprintf("crash %d", n);
+    wtx.nLockTime = 3000 + n;
+    return wtx;
+}
+
+// In a child process, leaves the test's in-memory database environment for one on
+// disk; the old one is left as it is, the child never returns to the tests.
+static bool UseDatabaseAt(const boost::filesystem::path& pathEnv)
+{
+    new (&bitdb) CDBEnv();
+    return bitdb.Open(pathEnv);
+}
+
+// Stops the process dead after the first record of a flush
+static void CrashAfterFirstRecord(unsigned int nDone)
+{
+    if (nDone == 1)
+        _exit(1);
+}
+
+// Commits one transaction, then is killed writing the next two
+static int FlushAndCrash(const boost::filesystem::path& pathEnv)
+{
+    if (!UseDatabaseAt(pathEnv))
+        return 2;
+    CWallet wallet("wallet.dat");
+    bool fFirstRun;
+    if (wallet.LoadWallet(fFirstRun) != DB_LOAD_OK)
+        return 3;
+
+    LOCK(wallet.cs_wallet);
+    wallet.AddToWallet(MakeCrashTestTx(1));
+    if (!wallet.FlushPendingTxs())
+        return 4;
+    wallet.AddToWallet(MakeCrashTestTx(2));
+    wallet.AddToWallet(MakeCrashTestTx(3));
+    pfnFlushPendingTxsTestHook = CrashAfterFirstRecord;
+    wallet.FlushPendingTxs();
+    return 5;
+}
+
+// Loads the wallet as the next start would, recovering the database first
+static int LoadAfterCrash(const boost::filesystem::path& pathEnv)
+{
+    if (!UseDatabaseAt(pathEnv))
+        return 2;
+    CWallet wallet("wallet.dat");
+    bool fFirstRun;
+    if (wallet.LoadWallet(fFirstRun) != DB_LOAD_OK)
+        return 3;
+
+    CWalletDBInspect walletdb("wallet.dat");
+    for (int n = 1; n <= 3; n++)
+    {
+        uint256 hash = MakeCrashTestTx(n).GetHash();
+        bool fExpected = (n == 1);
+        if (walletdb.HaveTx(hash) != fExpected || (wallet.mapWallet.count(hash) > 0) != fExpected)
+            return 10 + n;
+    }
+    return 0;
+}
+
+static int RunInChild(int (*pfn)(const boost::filesystem::path&), const boost::filesystem::path& pathEnv)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(pfn(pathEnv));
+    int nStatus = 0;
+    if (pid < 0 || waitpid(pid, &nStatus, 0) != pid || !WIFEXITED(nStatus))
+        return -1;
+    return WEXITSTATUS(nStatus);
+}
+
+BOOST_AUTO_TEST_CASE(walletdb_crash_mid_flush)
+{
+    boost::filesystem::path pathEnv = boost::filesystem::temp_directory_path() / strprintf("test_jumbucks_walletcrash_%d_%d", (int)getpid(), (int)GetRand(100000));
+    boost::filesystem::create_directories(pathEnv);
+
+    // a process killed with one of a flush's two records written, and the commit not reached
+    BOOST_CHECK_EQUAL(RunInChild(FlushAndCrash, pathEnv), 1);
+
+    // has the flush before it on disk, and nothing of the one it died in
+    BOOST_CHECK_EQUAL(RunInChild(LoadAfterCrash, pathEnv), 0);
+
+    boost::filesystem::remove_all(pathEnv);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(walletdb_keypool_batch)
+{
+    LOCK(pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+
+    unsigned int nSize = pwalletMain->GetKeyPoolSize();
+    BOOST_CHECK_EQUAL(pwalletMain->AddKeysToPool(25), 25U);
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), nSize + 25);
+    BOOST_CHECK(pwalletMain->GetKeyPoolRefillRate() > 0);
+
+    // the whole batch was committed, each pool entry with its key
+    int64_t nIndex;
+    CKeyPool keypool;
+    for (unsigned int i = 0; i < nSize + 25; i++)
+    {
+        pwalletMain->ReserveKeyFromKeyPool(nIndex, keypool);
+        BOOST_CHECK(nIndex != -1);
+        CKeyPool keypoolRead;
+        BOOST_CHECK(walletdb.ReadPool(nIndex, keypoolRead));
+        BOOST_CHECK(keypoolRead.vchPubKey == keypool.vchPubKey);
+        BOOST_CHECK(pwalletMain->HaveKey(keypool.vchPubKey.GetID()));
+        pwalletMain->KeepKey(nIndex);
+    }
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), 0U);
+
+    // run dry, taking a key makes a batch on the spot
+    CPubKey pubkey;
+    BOOST_CHECK(pwalletMain->GetKeyFromPool(pubkey));
+    BOOST_CHECK(pwalletMain->HaveKey(pubkey.GetID()));
+    BOOST_CHECK_EQUAL(pwalletMain->GetKeyPoolSize(), KEYPOOL_REFILL_BATCH - 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
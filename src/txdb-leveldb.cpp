@@ -276,6 +276,225 @@ bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
     return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
+bool CTxDB::ReadIndexFlags(int& nFlags)
+{
+    nFlags = 0;
+    return Read(string("indexflags"), nFlags);
+}
+
+bool CTxDB::WriteIndexFlags(int nFlags)
+{
+    return Write(string("indexflags"), nFlags);
+}
+
+bool CTxDB::WriteBlockAddressIndex(const uint256& hashBlock, const CBlockAddressIndex& index)
+{
+    typedef pair<CAddressUnspentKey, CAddressUnspentValue> UnspentEntry;
+
+    // Outputs first, so that one spent again within the same block is found below
+    BOOST_FOREACH(const UnspentEntry& entry, index.vUnspentCreated)
+        if (!Write(make_pair(string("autxo"), entry.first), entry.second))
+            return false;
+
+    // What the block spends is kept aside, for DisconnectBlock to put back
+    vector<UnspentEntry> vUndo;
+    BOOST_FOREACH(const CAddressUnspentKey& key, index.vUnspentSpent)
+    {
+        CAddressUnspentValue value;
+        if (!Read(make_pair(string("autxo"), key), value))
+        {
+            printf("WriteBlockAddressIndex() : %s:%u missing from the address index\n", key.txhash.ToString().substr(0,10).c_str(), key.nIndex);
+            continue;
+        }
+        vUndo.push_back(make_pair(key, value));
+        if (!Erase(make_pair(string("autxo"), key)))
+            return false;
+    }
+    if (!vUndo.empty() && !Write(make_pair(string("aundo"), hashBlock), vUndo))
+        return false;
+
+    BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, int64_t)& entry, index.vAddressIndex)
+        if (!Write(make_pair(string("addr"), entry.first), entry.second))
+            return false;
+
+    BOOST_FOREACH(const PAIRTYPE(COutPoint, CSpentIndexValue)& entry, index.vSpentIndex)
+        if (!Write(make_pair(string("spent"), entry.first), entry.second))
+            return false;
+
+    return true;
+}
+
+bool CTxDB::EraseBlockAddressIndex(const uint256& hashBlock, const CBlockAddressIndex& index)
+{
+    typedef pair<CAddressUnspentKey, CAddressUnspentValue> UnspentEntry;
+
+    BOOST_FOREACH(const PAIRTYPE(CAddressIndexKey, int64_t)& entry, index.vAddressIndex)
+        if (!Erase(make_pair(string("addr"), entry.first)))
+            return false;
+
+    BOOST_FOREACH(const PAIRTYPE(COutPoint, CSpentIndexValue)& entry, index.vSpentIndex)
+        if (!Erase(make_pair(string("spent"), entry.first)))
+            return false;
+
+    // Put back what the block spent before taking out what it created, so that
+    // an output both created and spent within the block ends up gone
+    vector<UnspentEntry> vUndo;
+    if (Read(make_pair(string("aundo"), hashBlock), vUndo))
+    {
+        BOOST_FOREACH(const UnspentEntry& entry, vUndo)
+            if (!Write(make_pair(string("autxo"), entry.first), entry.second))
+                return false;
+        if (!Erase(make_pair(string("aundo"), hashBlock)))
+            return false;
+    }
+
+    BOOST_FOREACH(const UnspentEntry& entry, index.vUnspentCreated)
+        if (!Erase(make_pair(string("autxo"), entry.first)))
+            return false;
+
+    return true;
+}
+
+// The index scans below read the database as committed, and are meant for RPC
+// callers, which never have a transaction open.
+
+bool CTxDB::ReadAddressTxids(unsigned char nType, const uint160& hashBytes, int nStart, int nEnd, unsigned int nSkip, unsigned int nCount,
+                             vector<pair<int, uint256> >& vTxidsRet)
+{
+    vTxidsRet.clear();
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("addr"), CAddressIndexIteratorKey(nType, hashBytes, nStart));
+    iterator->Seek(ssStartKey.str());
+
+    // Entries of one transaction are next to each other, ordered by height and
+    // then txid, so counting distinct transactions only needs the last one seen
+    uint256 hashLast = 0;
+    unsigned int nSeen = 0;
+    while (iterator->Valid() && vTxidsRet.size() < nCount)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        CAddressIndexKey key;
+        try {
+            ssKey >> strType;
+            if (strType != "addr")
+                break;
+            ssKey >> key;
+        }
+        catch (std::exception &e) {
+            break;
+        }
+        if (key.nType != nType || key.hashBytes != hashBytes || key.nBlockHeight > nEnd)
+            break;
+
+        if (key.txhash != hashLast)
+        {
+            hashLast = key.txhash;
+            if (nSeen++ >= nSkip)
+                vTxidsRet.push_back(make_pair(key.nBlockHeight, key.txhash));
+        }
+        iterator->Next();
+    }
+    delete iterator;
+    return true;
+}
+
+bool CTxDB::ReadAddressUnspent(unsigned char nType, const uint160& hashBytes, unsigned int nSkip, unsigned int nCount,
+                               vector<pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspentRet)
+{
+    vUnspentRet.clear();
+
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("autxo"), CAddressUnspentKey(nType, hashBytes, 0, 0));
+    iterator->Seek(ssStartKey.str());
+
+    unsigned int nSeen = 0;
+    while (iterator->Valid() && vUnspentRet.size() < nCount)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        CAddressUnspentKey key;
+        try {
+            ssKey >> strType;
+            if (strType != "autxo")
+                break;
+            ssKey >> key;
+        }
+        catch (std::exception &e) {
+            break;
+        }
+        if (key.nType != nType || key.hashBytes != hashBytes)
+            break;
+
+        if (nSeen++ >= nSkip)
+        {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            ssValue.write(iterator->value().data(), iterator->value().size());
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vUnspentRet.push_back(make_pair(key, value));
+        }
+        iterator->Next();
+    }
+    delete iterator;
+    return true;
+}
+
+bool CTxDB::ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value)
+{
+    return Read(make_pair(string("spent"), outpoint), value);
+}
+
+bool CTxDB::WipeAddressIndex()
+{
+    assert(!activeBatch);
+    const char* pszPrefix[] = { "addr", "autxo", "aundo", "spent" };
+    for (unsigned int i = 0; i < sizeof(pszPrefix) / sizeof(pszPrefix[0]); i++)
+    {
+        string strPrefix(pszPrefix[i]);
+        leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+        CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+        ssStartKey << strPrefix;
+        iterator->Seek(ssStartKey.str());
+
+        leveldb::WriteBatch batch;
+        unsigned int nBatch = 0;
+        while (iterator->Valid())
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey.write(iterator->key().data(), iterator->key().size());
+            string strType;
+            ssKey >> strType;
+            if (strType != strPrefix)
+                break;
+            batch.Delete(iterator->key());
+            if (++nBatch == 10000)
+            {
+                leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+                if (!status.ok())
+                {
+                    delete iterator;
+                    return error("WipeAddressIndex() : %s", status.ToString().c_str());
+                }
+                batch.Clear();
+                nBatch = 0;
+            }
+            iterator->Next();
+        }
+        delete iterator;
+
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), &batch);
+        if (!status.ok())
+            return error("WipeAddressIndex() : %s", status.ToString().c_str());
+    }
+    return true;
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
@@ -394,6 +613,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    SetBlockIndexByHeight(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
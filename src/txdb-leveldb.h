@@ -7,6 +7,7 @@
 #define BITCOIN_LEVELDB_H
 
 #include "main.h"
+#include "addressindex.h"
 
 #include <map>
 #include <string>
@@ -198,6 +199,18 @@ public:
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
     bool LoadBlockIndex();
+
+    // -addressindex and -spentindex
+    bool ReadIndexFlags(int& nFlags);
+    bool WriteIndexFlags(int nFlags);
+    bool WriteBlockAddressIndex(const uint256& hashBlock, const CBlockAddressIndex& index);
+    bool EraseBlockAddressIndex(const uint256& hashBlock, const CBlockAddressIndex& index);
+    bool ReadAddressTxids(unsigned char nType, const uint160& hashBytes, int nStart, int nEnd, unsigned int nSkip, unsigned int nCount,
+                          std::vector<std::pair<int, uint256> >& vTxidsRet);
+    bool ReadAddressUnspent(unsigned char nType, const uint160& hashBytes, unsigned int nSkip, unsigned int nCount,
+                            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspentRet);
+    bool ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value);
+    bool WipeAddressIndex();
 private:
     bool LoadBlockIndexGuts();
 };
@@ -11,28 +11,25 @@
 #include "base58.h"
 #include "kernel.h"
 #include "coincontrol.h"
+#include "notify.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/scoped_ptr.hpp>
 
 using namespace std;
 
 unsigned int nStakeSplitAge = 2 * 24 * 60 * 60;
 int64_t nStakeCombineThreshold = 900 * COIN;
 int64_t nStakeSplitThreshold = 200 * COIN;
+int64_t nConsolidateTargetValue = 1000 * COIN;
+unsigned int nConsolidateMaxInputs = 50;
+int64_t nConsolidateFeeBudget = COIN / 10;
+void (*pfnFlushPendingTxsTestHook)(unsigned int nDone) = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapWallet
 //
 
-struct CompareValueOnly
-{
-    bool operator()(const pair<int64_t, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<int64_t, pair<const CWalletTx*, unsigned int> >& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 CPubKey CWallet::GenerateNewKey()
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
@@ -46,6 +43,13 @@ CPubKey CWallet::GenerateNewKey()
     if (fCompressed)
         SetMinVersion(FEATURE_COMPRPUBKEY);
 
+    return AddNewKey(key);
+}
+
+CPubKey CWallet::AddNewKey(const CKey& key)
+{
+    AssertLockHeld(cs_wallet); // mapKeyMetadata
+
     CPubKey pubkey = key.GetPubKey();
 
     // Create new metadata
@@ -55,8 +59,8 @@ CPubKey CWallet::GenerateNewKey()
         nTimeFirstKey = nCreationTime;
 
     if (!AddKey(key))
-        throw std::runtime_error("CWallet::GenerateNewKey() : AddKey failed");
-    return key.GetPubKey();
+        throw std::runtime_error("CWallet::AddNewKey() : AddKey failed");
+    return pubkey;
 }
 
 bool CWallet::AddKey(const CKey& key)
@@ -67,10 +71,15 @@ bool CWallet::AddKey(const CKey& key)
 
     if (!CCryptoKeyStore::AddKey(key))
         return false;
+    FilterAddPubKey(pubkey);
     if (!fFileBacked)
         return true;
     if (!IsCrypted())
+    {
+        if (pwalletdbEncryption)
+            return pwalletdbEncryption->WriteKey(pubkey, key.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey, key.GetPrivKey(), mapKeyMetadata[pubkey.GetID()]);
+    }
     return true;
 }
 
@@ -78,6 +87,10 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey, const vector<unsigned char
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    {
+        LOCK(cs_wallet);
+        FilterAddPubKey(vchPubKey);
+    }
     if (!fFileBacked)
         return true;
     {
@@ -109,6 +122,13 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_wallet);
+        if (filterMine.IsFull())
+            fFilterStale = true;
+        else
+            filterMine.insert(redeemScript.GetID());
+    }
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -412,29 +432,182 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
     return nRet;
 }
 
-CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void CWallet::QueueTxWrite(const uint256& hashTx) const
 {
-    AssertLockHeld(cs_wallet); // mapWallet
+    LOCK(cs_wallet);
+    mapTxPending[hashTx] = true;
+}
+
+void CWallet::QueueTxErase(const uint256& hashTx) const
+{
+    LOCK(cs_wallet);
+    mapTxPending[hashTx] = false;
+}
+
+// Write out the queued transaction changes as one database transaction, so that after a
+// crash either all of them or none are on disk. When it fails they stay queued.
+bool CWallet::FlushPendingTxs() const
+{
+    LOCK(cs_wallet);
+    if (mapTxPending.empty())
+        return true;
+    if (!fFileBacked)
+    {
+        mapTxPending.clear();
+        return true;
+    }
+
     CWalletDB walletdb(strWalletFile);
+    if (!walletdb.TxnBegin())
+        return error("FlushPendingTxs() : could not begin database transaction");
+    unsigned int nWritten = 0, nErased = 0;
+    for (map<uint256, bool>::const_iterator it = mapTxPending.begin(); it != mapTxPending.end(); ++it)
+    {
+        bool fOK = true;
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find((*it).first);
+        if (!(*it).second || mi == mapWallet.end())
+        {
+            // also when erased from the wallet since it was queued
+            fOK = walletdb.EraseTx((*it).first);
+            nErased++;
+        }
+        else
+        {
+            fOK = walletdb.WriteTx((*it).first, (*mi).second);
+            nWritten++;
+        }
+        if (!fOK)
+        {
+            walletdb.TxnAbort();
+            return error("FlushPendingTxs() : writing %s failed", (*it).first.ToString().c_str());
+        }
+
+        if (pfnFlushPendingTxsTestHook)
+            pfnFlushPendingTxsTestHook(nWritten + nErased);
+    }
+    if (!walletdb.TxnCommit())
+        return error("FlushPendingTxs() : commit failed");
+    mapTxPending.clear();
 
-    // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    if (fDebug)
+        printf("FlushPendingTxs() : wrote %u, erased %u wallet transactions\n", nWritten, nErased);
+    return true;
+}
+
+bool CWallet::AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb)
+{
+    AssertLockHeld(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    if (!walletdb.WriteAccountingEntry(entry))
+    {
+        laccentries.pop_back();
+        return false;
+    }
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+    return true;
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
+void CWallet::UndoAccountingEntry(int64_t nOrderPos)
+{
+    AssertLockHeld(cs_wallet);
+    pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
+    {
+        CAccountingEntry* pacentry = (*it).second.second;
+        if (pacentry == 0)
+            continue;
+        wtxOrdered.erase(it);
+        for (list<CAccountingEntry>::iterator li = laccentries.begin(); li != laccentries.end(); ++li)
+            if (&(*li) == pacentry)
+            {
+                laccentries.erase(li);
+                break;
+            }
+        return;
+    }
+}
+
+int CWallet::GetTxIndexHeight(const CWalletTx& wtx) const
+{
+    if (wtx.hashBlock == 0)
+        return INT_MAX;
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return INT_MAX;
+    return (*mi).second->nHeight;
+}
+
+void CWallet::UpdateTxHeight(const uint256& hashTx)
+{
+    AssertLockHeld(cs_wallet);
+    map<uint256, int>::iterator mi = mapTxHeight.find(hashTx);
+    if (mi != mapTxHeight.end())
+    {
+        setTxByHeight.erase(make_pair((*mi).second, hashTx));
+        mapTxHeight.erase(mi);
+    }
+
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hashTx);
+    if (it == mapWallet.end())
+    {
+        setTxOrphaned.erase(hashTx);
+        return;
+    }
+    int nHeight = GetTxIndexHeight((*it).second);
+    mapTxHeight[hashTx] = nHeight;
+    setTxByHeight.insert(make_pair(nHeight, hashTx));
+}
+
+void CWallet::RebuildTxIndex()
+{
+    AssertLockHeld(cs_wallet);
+    wtxOrdered.clear();
+    setTxByHeight.clear();
+    mapTxHeight.clear();
+    setTxOrphaned.clear();
     for (map<uint256, CWalletTx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
     {
         CWalletTx* wtx = &((*it).second);
-        txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        wtxOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+        UpdateTxHeight((*it).first);
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(wtx->hashBlock);
+        if (wtx->hashBlock != 0 && mi != mapBlockIndex.end() && !(*mi).second->IsInMainChain())
+            setTxOrphaned.insert((*it).first);
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+        wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+}
+
+void CWallet::GetTransactionsAbove(int nHeight, vector<const CWalletTx*>& vtxRet) const
+{
+    AssertLockHeld(cs_wallet);
+    vtxRet.clear();
+
+    // those orphaned at or below nHeight; the ones above are found in the index
+    BOOST_FOREACH(const uint256& hash, setTxOrphaned)
     {
-        txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
+        map<uint256, int>::const_iterator mh = mapTxHeight.find(hash);
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mh != mapTxHeight.end() && (*mh).second <= nHeight && mi != mapWallet.end())
+            vtxRet.push_back(&(*mi).second);
     }
 
-    return txOrdered;
+    set<pair<int, uint256> >::const_iterator it = setTxByHeight.lower_bound(make_pair(nHeight + 1, uint256(0)));
+    for (; it != setTxByHeight.end(); ++it)
+    {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find((*it).second);
+        if (mi != mapWallet.end())
+            vtxRet.push_back(&(*mi).second);
+    }
+}
+
+void CWallet::TxBlockDisconnected(const uint256& hashTx)
+{
+    LOCK(cs_wallet);
+    if (mapWallet.count(hashTx))
+        setTxOrphaned.insert(hashTx);
 }
 
 void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
@@ -457,6 +630,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     printf("WalletUpdateSpent found spent coin %s JBS %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    UpdateUnspent(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -474,6 +648,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                 {
                     wtx.MarkUnspent(&txout - &tx.vout[0]);
                     wtx.WriteToDisk();
+                    UpdateUnspent(hash);
                     NotifyTransactionChanged(this, hash, CT_UPDATED);
                 }
             }
@@ -488,7 +663,149 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+
+        // what counts as ours may have changed
+        RebuildUnspent();
+    }
+}
+
+// requires LOCK(cs_wallet)
+void CWallet::UpdateUnspent(const uint256& hashTx)
+{
+    nBalanceUpdate++;
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hashTx);
+    if (mi != mapWallet.end())
+    {
+        const CWalletTx& wtx = (*mi).second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        {
+            if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            {
+                setUnspentTx.insert(hashTx);
+                return;
+            }
+        }
     }
+    setUnspentTx.erase(hashTx);
+}
+
+// requires LOCK(cs_wallet)
+void CWallet::RebuildUnspent()
+{
+    setUnspentTx.clear();
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspent((*it).first);
+}
+
+// requires LOCK(cs_wallet)
+void CWallet::RebuildFilter()
+{
+    std::set<CKeyID> setAddress;
+    GetKeys(setAddress);
+
+    // a key goes in as both its pubkey and its hash; leave room for the keys
+    // and transactions to come before the filter has to be rebuilt again
+    unsigned int nElements = setAddress.size() * 2 + mapScripts.size() + mapWallet.size();
+    filterMine.Reset(nElements * 2 + 1000, GetRandHash().Get64());
+    BOOST_FOREACH(const CKeyID& keyID, setAddress)
+    {
+        CPubKey pubkey;
+        if (GetPubKey(keyID, pubkey))
+            FilterAddPubKey(pubkey);
+        else
+            filterMine.insert(keyID);
+    }
+    {
+        LOCK(cs_KeyStore);
+        for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+            filterMine.insert((*it).first);
+    }
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        filterMine.insert((*it).first);
+    fFilterStale = false;
+}
+
+// requires LOCK(cs_wallet)
+void CWallet::FilterAddPubKey(const CPubKey& pubkey)
+{
+    if (filterMine.IsFull())
+    {
+        fFilterStale = true;
+        return;
+    }
+    std::vector<unsigned char> vchPubKey = pubkey.Raw();
+    if (!vchPubKey.empty())
+        filterMine.insert(&vchPubKey[0], vchPubKey.size());
+    filterMine.insert(pubkey.GetID());
+}
+
+// requires LOCK(cs_wallet)
+// False if the transaction certainly neither pays to nor spends from this wallet,
+// true if it might; there are no false negatives.
+bool CWallet::MayBeInvolvingMe(const CTransaction& tx)
+{
+    if (fFilterStale)
+        RebuildFilter();
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (filterMine.contains(txin.prevout.hash))
+            return true;
+
+    bool fStealth = !stealthAddresses.empty();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        const CScript& script = txout.scriptPubKey;
+        unsigned int nSize = script.size();
+        if (nSize == 0)
+            continue;
+        const unsigned char* pch = &script[0];
+
+        // the common templates are picked apart in place
+        if (nSize == 25 && pch[0] == OP_DUP && pch[1] == OP_HASH160 && pch[2] == 20
+            && pch[23] == OP_EQUALVERIFY && pch[24] == OP_CHECKSIG)
+        {
+            if (filterMine.contains(pch + 3, 20))
+                return true;
+            continue;
+        }
+        if (script.IsPayToScriptHash())
+        {
+            if (filterMine.contains(pch + 2, 20))
+                return true;
+            continue;
+        }
+        if (((nSize == 35 && pch[0] == 33) || (nSize == 67 && pch[0] == 65)) && pch[nSize - 1] == OP_CHECKSIG)
+        {
+            if (filterMine.contains(pch + 1, nSize - 2))
+                return true;
+            continue;
+        }
+        if (pch[0] == OP_RETURN)
+        {
+            // may carry the ephemeral key of a payment to one of our stealth addresses
+            if (fStealth)
+                return true;
+            continue;
+        }
+
+        txnouttype whichType;
+        vector<valtype> vSolutions;
+        if (!Solver(script, whichType, vSolutions))
+            continue;
+        if (whichType == TX_MULTISIG)
+        {
+            for (unsigned int i = 1; i < vSolutions.size() - 1; i++)
+                if (filterMine.contains(&vSolutions[i][0], vSolutions[i].size()))
+                    return true;
+        }
+        else if (whichType == TX_PUBKEY || whichType == TX_PUBKEYHASH || whichType == TX_SCRIPTHASH)
+        {
+            if (filterMine.contains(&vSolutions[0][0], vSolutions[0].size()))
+                return true;
+        }
+    }
+    return false;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn)
@@ -503,8 +820,13 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
+            if (filterMine.IsFull())
+                fFilterStale = true;
+            else
+                filterMine.insert(hash);
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
+            wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
 
             wtx.nTimeSmart = wtx.nTimeReceived;
             if (wtxIn.hashBlock != 0)
@@ -516,9 +838,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
                     {
                         // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
                         int64_t latestTolerated = latestNow + 300;
-                        std::list<CAccountingEntry> acentries;
-                        TxItems txOrdered = OrderedTxItems(acentries);
-                        for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+                        for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
                         {
                             CWalletTx *const pwtx = (*it).second.first;
                             if (pwtx == &wtx)
@@ -575,6 +895,11 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             }
             fUpdated |= wtx.UpdateSpent(wtxIn.vfSpent);
         }
+        // back in a block after a reorganisation
+        if (wtxIn.hashBlock != 0)
+            setTxOrphaned.erase(hash);
+        UpdateUnspent(hash);
+        UpdateTxHeight(hash);
 
         //// debug print
         printf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString().substr(0,10).c_str(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
@@ -608,6 +933,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
+        NotifyWalletTransaction(hash, fInsertedNew);
+
         // notify an external script when a wallet transaction comes in or is updated
         std::string strCmd = GetArg("-walletnotify", "");
 
@@ -631,6 +958,7 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
         LOCK(cs_wallet);
         bool fExisted = mapWallet.count(hash);
         if (fExisted && !fUpdate) return false;
+        if (!fExisted && !MayBeInvolvingMe(tx)) return false;
         
         mapValue_t mapNarr;
         FindStealthTransactions(tx, mapNarr);
@@ -659,8 +987,21 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
-            CWalletDB(strWalletFile).EraseTx(hash);
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+        {
+            pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range((*mi).second.nOrderPos);
+            for (TxItems::iterator it = range.first; it != range.second; ++it)
+                if ((*it).second.first == &(*mi).second)
+                {
+                    wtxOrdered.erase(it);
+                    break;
+                }
+            mapWallet.erase(mi);
+            QueueTxErase(hash);
+        }
+        UpdateUnspent(hash);
+        UpdateTxHeight(hash);
     }
     return true;
 }
@@ -924,97 +1265,389 @@ void CWalletTx::AddSupportingTransactions(CTxDB& txdb)
 
 bool CWalletTx::WriteToDisk()
 {
-    return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
+    pwallet->QueueTxWrite(GetHash());
+    return true;
 }
 
-// Scan the block chain (starting in pindexStart) for transactions
-// from or to us. If fUpdate is true, found transactions that already
+CWalletScanFilter::CWalletScanFilter(const CWallet* pwallet)
+{
+    pkeystore = pwallet;
+    pwallet->GetKeys(setKeyID);
+    for (map<uint256, CWalletTx>::const_iterator it = pwallet->mapWallet.begin(); it != pwallet->mapWallet.end(); ++it)
+        setTxid.insert((*it).first);
+    fStealth = !pwallet->stealthAddresses.empty();
+}
+
+bool CWalletScanFilter::MatchesOutputs(const CTransaction& tx) const
+{
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+    {
+        txnouttype whichType;
+        vector<valtype> vSolutions;
+        if (!Solver(txout.scriptPubKey, whichType, vSolutions))
+            continue;
+
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+            if (setKeyID.count(CPubKey(vSolutions[0]).GetID()))
+                return true;
+            break;
+        case TX_PUBKEYHASH:
+            if (setKeyID.count(CKeyID(uint160(vSolutions[0]))))
+                return true;
+            break;
+        case TX_SCRIPTHASH:
+            if (pkeystore->HaveCScript(CScriptID(uint160(vSolutions[0]))))
+                return true;
+            break;
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i < vSolutions.size() - 1; i++)
+                if (setKeyID.count(CPubKey(vSolutions[i]).GetID()))
+                    return true;
+            break;
+        case TX_NULL_DATA:
+            // may carry the ephemeral key of a payment to one of our stealth addresses
+            if (fStealth)
+                return true;
+            break;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+bool CWalletScanFilter::MatchesInputs(const CTransaction& tx, const uint256& hash) const
+{
+    if (setTxid.count(hash))
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (setTxid.count(txin.prevout.hash))
+            return true;
+    return false;
+}
+
+// blocks read ahead of the one being committed
+static const unsigned int RESCAN_WINDOW = 64;
+// blocks between checkpoints of the rescan position
+static const int RESCAN_CHECKPOINT_BLOCKS = 1000;
+// matched transactions committed to the wallet at once
+static const unsigned int RESCAN_BATCH_SIZE = 100;
+
+/** A block read by a rescan worker, with its transactions pre-matched against the outputs filter */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    std::vector<uint256> vHash;
+    std::vector<bool> vOutputMatch;
+};
+
+/** Blocks handed from the rescan workers to the thread committing them, in chain order */
+class CRescanQueue
+{
+public:
+    const std::vector<CBlockIndex*>& vIndex;
+    const CWalletScanFilter& filter;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    unsigned int nNext;      // next block for a worker to read
+    unsigned int nConsumed;  // blocks taken by the committing thread
+    bool fStop;
+    CRescanBlock* vSlot[RESCAN_WINDOW];
+    boost::thread_group threadGroup;
+
+    CRescanQueue(const std::vector<CBlockIndex*>& vIndexIn, const CWalletScanFilter& filterIn) : vIndex(vIndexIn), filter(filterIn)
+    {
+        nNext = 0;
+        nConsumed = 0;
+        fStop = false;
+        for (unsigned int i = 0; i < RESCAN_WINDOW; i++)
+            vSlot[i] = NULL;
+    }
+
+    // stops the workers, also when the scan is left through an exception
+    ~CRescanQueue()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        cond.notify_all();
+        threadGroup.join_all();
+        for (unsigned int i = 0; i < RESCAN_WINDOW; i++)
+            delete vSlot[i];
+    }
+
+    // blocks until block i has been read; the caller takes ownership
+    CRescanBlock* Take(unsigned int i)
+    {
+        CRescanBlock* pblock;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (vSlot[i % RESCAN_WINDOW] == NULL)
+                cond.wait(lock);
+            pblock = vSlot[i % RESCAN_WINDOW];
+            vSlot[i % RESCAN_WINDOW] = NULL;
+            nConsumed = i + 1;
+        }
+        cond.notify_all();
+        return pblock;
+    }
+};
+
+/** Marks the rescan as no longer running once it is left, also through an exception */
+class CRescanRunningGuard
+{
+private:
+    CCriticalSection& cs;
+    CRescanProgress& progress;
+
+public:
+    CRescanRunningGuard(CCriticalSection& csIn, CRescanProgress& progressIn) : cs(csIn), progress(progressIn) {}
+
+    ~CRescanRunningGuard()
+    {
+        LOCK(cs);
+        progress.fRunning = false;
+    }
+};
+
+static void ThreadRescanRead(CRescanQueue* pqueue)
+{
+    while (true)
+    {
+        unsigned int i;
+        {
+            boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+            while (!pqueue->fStop && pqueue->nNext < pqueue->vIndex.size() && pqueue->nNext >= pqueue->nConsumed + RESCAN_WINDOW)
+                pqueue->cond.wait(lock);
+            if (pqueue->fStop || pqueue->nNext >= pqueue->vIndex.size())
+                return;
+            i = pqueue->nNext++;
+        }
+
+        // read, hash and match outside of any lock
+        CRescanBlock* pblock = new CRescanBlock();
+        pblock->pindex = pqueue->vIndex[i];
+        pblock->block.ReadFromDisk(pblock->pindex, true);
+        BOOST_FOREACH(const CTransaction& tx, pblock->block.vtx)
+        {
+            pblock->vHash.push_back(tx.GetHash());
+            pblock->vOutputMatch.push_back(pqueue->filter.MatchesOutputs(tx));
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+            pqueue->vSlot[i % RESCAN_WINDOW] = pblock;
+        }
+        pqueue->cond.notify_all();
+    }
+}
+
+// Scan the blockchain, starting at pindexStart, for transactions of ours.
+// Blocks are read and matched against a snapshot of our keys by worker threads;
+// cs_main and cs_wallet are only taken to commit matches, a batch at a time.
+// The position is checkpointed in the wallet, so that an interrupted rescan is
+// resumed at the next start. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
+// Must be called without cs_main or cs_wallet held, which are taken after cs_rescan.
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
+    LOCK(cs_rescan);
     int ret = 0;
 
-    CBlockIndex* pindex = pindexStart;
+    // the blocks to scan; later blocks reach us through SyncWithWallets
+    std::vector<CBlockIndex*> vIndex;
     {
-        LOCK2(cs_main, cs_wallet);
-        while (pindex)
+        LOCK(cs_main);
+        for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
         {
             // no need to read and scan block, if block was created before
             // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
+            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
                 continue;
+            vIndex.push_back(pindex);
+        }
+    }
+    if (vIndex.empty())
+        return 0;
+
+    {
+        LOCK(cs_rescanProgress);
+        rescanProgress.fRunning = true;
+        rescanProgress.nStartHeight = vIndex.front()->nHeight;
+        rescanProgress.nHeight = rescanProgress.nStartHeight - 1;
+        rescanProgress.nStopHeight = vIndex.back()->nHeight;
+        rescanProgress.nFound = 0;
+        rescanProgress.nStartTime = GetTime();
+    }
+    CRescanRunningGuard runningGuard(cs_rescanProgress, rescanProgress);
+
+    boost::scoped_ptr<CWalletScanFilter> pfilter;
+    {
+        LOCK2(cs_main, cs_wallet);
+        pfilter.reset(new CWalletScanFilter(this));
+        if (fFileBacked)
+            CWalletDB(strWalletFile).WriteRescanPos(CBlockLocator(vIndex.front()));
+    }
+
+    int nThreads = std::max(1, std::min(4, (int)boost::thread::hardware_concurrency()));
+    std::vector<std::pair<CRescanBlock*, unsigned int> > vBatch;
+    boost::ptr_vector<CRescanBlock> vBatchBlocks;          // owns the blocks vBatch points into
+    boost::ptr_vector<CStealthScanner> vStealthScanners;   // kept for the whole rescan
+    int nLastCheckpoint = vIndex.front()->nHeight;
+    int nHeight = nLastCheckpoint;
+    bool fInterrupted = false;
+    {
+        CRescanQueue queue(vIndex, *pfilter);
+        for (int i = 0; i < nThreads; i++)
+            queue.threadGroup.create_thread(boost::bind(&ThreadRescanRead, &queue));
+
+        for (unsigned int i = 0; i < vIndex.size(); i++)
+        {
+            std::auto_ptr<CRescanBlock> pblock(queue.Take(i));
+            nHeight = pblock->pindex->nHeight;
+
+            // spends are matched in chain order, since earlier matches add to what we may spend
+            bool fMatched = false;
+            for (unsigned int j = 0; j < pblock->block.vtx.size(); j++)
+            {
+                if (pblock->vOutputMatch[j] || pfilter->MatchesInputs(pblock->block.vtx[j], pblock->vHash[j]))
+                {
+                    pfilter->AddTx(pblock->vHash[j]);
+                    vBatch.push_back(make_pair(pblock.get(), j));
+                    fMatched = true;
+                }
             }
+            if (fMatched)
+                vBatchBlocks.push_back(pblock.release());
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            bool fLast = (i + 1 == vIndex.size());
+            fInterrupted = fShutdown;
+            if (fLast || fInterrupted || vBatch.size() >= RESCAN_BATCH_SIZE || nHeight >= nLastCheckpoint + RESCAN_CHECKPOINT_BLOCKS)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                LOCK2(cs_main, cs_wallet);
+                std::vector<const CTransaction*> vBatchTx;
+                for (unsigned int k = 0; k < vBatch.size(); k++)
+                    vBatchTx.push_back(&vBatch[k].first->block.vtx[vBatch[k].second]);
+                PrepareStealthScan(vBatchTx, vStealthScanners);
+                for (unsigned int k = 0; k < vBatch.size(); k++)
+                {
+                    CRescanBlock* pmatch = vBatch[k].first;
+                    // skip blocks that were reorganized away while we were reading them
+                    if (!pmatch->pindex->IsInMainChain())
+                        continue;
+                    if (AddToWalletIfInvolvingMe(pmatch->block.vtx[vBatch[k].second], &pmatch->block, fUpdate))
+                        ret++;
+                }
+                vBatch.clear();
+                vBatchBlocks.clear();
+
+                // what was found goes to disk before the position that is past it
+                FlushPendingTxs();
+                if (fFileBacked && !fLast)
+                    CWalletDB(strWalletFile).WriteRescanPos(CBlockLocator(vIndex[i]));
+                nLastCheckpoint = nHeight;
+
+                LOCK(cs_rescanProgress);
+                rescanProgress.nHeight = nHeight;
+                rescanProgress.nFound = ret;
             }
-            pindex = pindex->pnext;
+            if (fInterrupted)
+                break;
         }
     }
+
+    if (fFileBacked && !fInterrupted)
+        CWalletDB(strWalletFile).EraseRescanPos();
+
+    printf("ScanForWalletTransactions() : scanned blocks %d to %d with %d threads, %d transactions found%s\n",
+        vIndex.front()->nHeight, nHeight, nThreads, ret, fInterrupted ? " (interrupted)" : "");
     return ret;
 }
 
+CRescanProgress CWallet::GetRescanProgress() const
+{
+    LOCK(cs_rescanProgress);
+    return rescanProgress;
+}
+
 void CWallet::ReacceptWalletTransactions()
 {
     CTxDB txdb("r");
     bool fRepeat = true;
     while (fRepeat)
     {
-        LOCK2(cs_main, cs_wallet);
         fRepeat = false;
-        vector<CDiskTxPos> vMissingTx;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        CBlockIndex* pindexScan = NULL;
+        bool fMissing = false;
         {
-            CWalletTx& wtx = item.second;
-            if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
-                continue;
-
-            CTxIndex txindex;
-            bool fUpdated = false;
-            if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
+            LOCK2(cs_main, cs_wallet);
+            vector<CDiskTxPos> vMissingTx;
+            BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             {
-                // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
-                if (txindex.vSpent.size() != wtx.vout.size())
-                {
-                    printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %u != wtx.vout.size() %u\n", txindex.vSpent.size(), wtx.vout.size());
+                CWalletTx& wtx = item.second;
+                if ((wtx.IsCoinBase() && wtx.IsSpent(0)) || (wtx.IsCoinStake() && wtx.IsSpent(1)))
                     continue;
-                }
-                for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+
+                CTxIndex txindex;
+                bool fUpdated = false;
+                if (txdb.ReadTxIndex(wtx.GetHash(), txindex))
                 {
-                    if (wtx.IsSpent(i))
+                    // Update fSpent if a tx got spent somewhere else by a copy of wallet.dat
+                    if (txindex.vSpent.size() != wtx.vout.size())
+                    {
+                        printf("ERROR: ReacceptWalletTransactions() : txindex.vSpent.size() %u != wtx.vout.size() %u\n", txindex.vSpent.size(), wtx.vout.size());
                         continue;
-                    if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                    }
+                    for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
                     {
-                        wtx.MarkSpent(i);
-                        fUpdated = true;
-                        vMissingTx.push_back(txindex.vSpent[i]);
+                        if (wtx.IsSpent(i))
+                            continue;
+                        if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+                        {
+                            wtx.MarkSpent(i);
+                            UpdateUnspent(wtx.GetHash());
+                            fUpdated = true;
+                            vMissingTx.push_back(txindex.vSpent[i]);
+                        }
+                    }
+                    if (fUpdated)
+                    {
+                        printf("ReacceptWalletTransactions found spent coin %s JBS %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
+                        wtx.MarkDirty();
+                        wtx.WriteToDisk();
                     }
                 }
-                if (fUpdated)
+                else
                 {
-                    printf("ReacceptWalletTransactions found spent coin %s JBS %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
-                    wtx.MarkDirty();
-                    wtx.WriteToDisk();
+                    // Re-accept any txes of ours that aren't already in a block
+                    if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
+                        wtx.AcceptWalletTransaction(txdb);
                 }
             }
-            else
+            if (!vMissingTx.empty())
             {
-                // Re-accept any txes of ours that aren't already in a block
-                if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
-                    wtx.AcceptWalletTransaction(txdb);
+                // Only scan from the earliest block holding one of the missing spends
+                set<pair<unsigned int, unsigned int> > setMissingBlockPos;
+                BOOST_FOREACH(const CDiskTxPos& pos, vMissingTx)
+                    setMissingBlockPos.insert(make_pair(pos.nFile, pos.nBlockPos));
+                for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+                {
+                    CBlockIndex* pindex = (*mi).second;
+                    if (setMissingBlockPos.count(make_pair(pindex->nFile, pindex->nBlockPos)) && pindex->IsInMainChain() &&
+                        (!pindexScan || pindex->nHeight < pindexScan->nHeight))
+                        pindexScan = pindex;
+                }
+                fMissing = true;
             }
         }
-        if (!vMissingTx.empty())
-        {
-            // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
-                fRepeat = true;  // Found missing transactions: re-do re-accept.
-        }
+
+        // the rescan takes cs_rescan before cs_main and cs_wallet, so is started without them
+        if (fMissing && ScanForWalletTransactions(pindexScan ? pindexScan : pindexGenesisBlock))
+            fRepeat = true;  // Found missing transactions: re-do re-accept.
     }
 }
 
@@ -1104,52 +1737,63 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-int64_t CWallet::GetBalance() const
+// Sum up the balances of all transactions with unspent outputs of ours. Confirmation
+// depth, and so trust and maturity, changes with every block, so the result is kept
+// only until the best chain or the wallet changes.
+// requires LOCK2(cs_main, cs_wallet)
+const CWalletBalances& CWallet::GetBalances() const
 {
-    int64_t nTotal = 0;
+    if (nBalanceUpdateCached == nBalanceUpdate && hashBalanceBlockCached == hashBestChain)
+        return balancesCached;
+
+    balancesCached.SetNull();
+    BOOST_FOREACH(const uint256& hash, setUnspentTx)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &(*mi).second;
+
+        int nDepth = pcoin->GetDepthInMainChain();
+        bool fTrusted = pcoin->IsTrusted();
+        if (fTrusted)
+            balancesCached.nTrusted += pcoin->GetAvailableCredit();
+        if (!pcoin->IsFinal() || (!fTrusted && nDepth == 0))
+            balancesCached.nUnconfirmed += pcoin->GetAvailableCredit();
+
+        if (pcoin->GetBlocksToMaturity() > 0 && nDepth > 0)
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            if (pcoin->IsCoinBase())
+            {
+                balancesCached.nImmature += GetCredit(*pcoin);
+                balancesCached.nNewMint += GetCredit(*pcoin);
+            }
+            else if (pcoin->IsCoinStake())
+                balancesCached.nStake += GetCredit(*pcoin);
         }
     }
 
-    return nTotal;
+    nBalanceUpdateCached = nBalanceUpdate;
+    hashBalanceBlockCached = hashBestChain;
+    return balancesCached;
 }
 
-
+int64_t CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nTrusted;
+}
 
 int64_t CWallet::GetUnconfirmedBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmed;
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
 }
 
 // populate vCoins with vector of spendable COutputs
@@ -1159,8 +1803,11 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTx)
         {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             if (!pcoin->IsFinal())
@@ -1194,8 +1841,11 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        BOOST_FOREACH(const uint256& hash, setUnspentTx)
         {
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
@@ -1216,185 +1866,68 @@ void CWallet::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSp
     }
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
-                                  vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        int64_t nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
-        {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
-}
-
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nStake;
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    return GetBalances().nNewMint;
 }
 
-bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
+// keep coins that have the confirmations asked for and follow the timestamp rules
+static void FilterCoinsMinConf(unsigned int nSpendTime, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins, vector<CCoinSelector::CoinValue>& vValue)
 {
-    setCoinsRet.clear();
-    nValueRet = 0;
-
-    // List of values less than target
-    pair<int64_t, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<int64_t>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > > vValue;
-    int64_t nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
+    BOOST_FOREACH(const COutput& output, vCoins)
     {
         const CWalletTx *pcoin = output.tx;
 
         if (output.nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
             continue;
 
-        int i = output.i;
-
         // Follow the timestamp rules
         if (pcoin->nTime > nSpendTime)
             continue;
 
-        int64_t n = pcoin->vout[i].nValue;
-
-        pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
-
-        if (n == nTargetValue)
-        {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
-        }
-        else if (n < nTargetValue + CENT)
-        {
-            vValue.push_back(coin);
-            nTotalLower += n;
-        }
-        else if (n < coinLowestLarger.first)
-        {
-            coinLowestLarger = coin;
-        }
-    }
-
-    if (nTotalLower == nTargetValue)
-    {
-        for (unsigned int i = 0; i < vValue.size(); ++i)
-        {
-            setCoinsRet.insert(vValue[i].second);
-            nValueRet += vValue[i].first;
-        }
-        return true;
-    }
-
-    if (nTotalLower < nTargetValue)
-    {
-        if (coinLowestLarger.second.first == NULL)
-            return false;
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-        return true;
+        vValue.push_back(make_pair(pcoin->vout[output.i].nValue, make_pair(pcoin, output.i)));
     }
+}
 
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    vector<char> vfBest;
-    int64_t nBest;
-
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
-
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
-    {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    }
-    else {
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-            {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
+bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
 
-        if (fDebug && GetBoolArg("-printpriority"))
-        {
-            //// debug print
-            printf("SelectCoins() best subset: ");
-            for (unsigned int i = 0; i < vValue.size(); i++)
-                if (vfBest[i])
-                    printf("%s ", FormatMoney(vValue[i].first).c_str());
-            printf("total %s\n", FormatMoney(nBest).c_str());
-        }
-    }
+    vector<CCoinSelector::CoinValue> vValue;
+    FilterCoinsMinConf(nSpendTime, nConfMine, nConfTheirs, vCoins, vValue);
 
+    vector<CCoinSelector::CoinValue> vSelected;
+    bool fChangeless;
+    if (!CCoinSelector(vValue).Select(nTargetValue, -1, vSelected, nValueRet, fChangeless))
+        return false;
+    BOOST_FOREACH(const CCoinSelector::CoinValue& coin, vSelected)
+        setCoinsRet.insert(coin.second);
     return true;
 }
 
-bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl) const
+// confirmations from our own and from others' transactions, in the order SelectCoins tries them
+static const int vSelectCoinsConf[][2] = { {1, 10}, {1, 1}, {0, 1} };
+
+bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl,
+                          vector<CCoinSelector>* pvSelectors, bool* pfChangeless) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
+    if (pfChangeless)
+        *pfChangeless = false;
 
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
+        vector<COutput> vCoins;
+        AvailableCoins(vCoins, true, coinControl);
         BOOST_FOREACH(const COutput& out, vCoins)
         {
             nValueRet += out.tx->vout[out.i].nValue;
@@ -1403,9 +1936,37 @@ bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pai
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, nSpendTime, 1, 10, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, nSpendTime, 0, 1, vCoins, setCoinsRet, nValueRet));
+    // the sorted coins of each confirmation tier, kept by the caller across calls if it wants
+    vector<CCoinSelector> vSelectors;
+    if (!pvSelectors)
+        pvSelectors = &vSelectors;
+    if (pvSelectors->empty())
+    {
+        vector<COutput> vCoins;
+        AvailableCoins(vCoins, true, coinControl);
+        for (unsigned int i = 0; i < sizeof(vSelectCoinsConf) / sizeof(vSelectCoinsConf[0]); i++)
+        {
+            vector<CCoinSelector::CoinValue> vValue;
+            FilterCoinsMinConf(nSpendTime, vSelectCoinsConf[i][0], vSelectCoinsConf[i][1], vCoins, vValue);
+            pvSelectors->push_back(CCoinSelector(vValue));
+        }
+    }
+
+    BOOST_FOREACH(const CCoinSelector& selector, *pvSelectors)
+    {
+        // overshooting by up to the minimum fee beats making a change output worth less than that
+        vector<CCoinSelector::CoinValue> vSelected;
+        bool fChangeless;
+        if (!selector.Select(nTargetValue, MIN_TX_FEE, vSelected, nValueRet, fChangeless))
+            continue;
+        setCoinsRet.clear();
+        BOOST_FOREACH(const CCoinSelector::CoinValue& coin, vSelected)
+            setCoinsRet.insert(coin.second);
+        if (pfChangeless)
+            *pfChangeless = fChangeless;
+        return true;
+    }
+    return false;
 }
 
 // Select some coins without random shuffle or best subset approximation
@@ -1468,6 +2029,8 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
         // txdb must be opened before the mapWallet lock
         CTxDB txdb("r");
         {
+            // coins sorted once, for all rounds of the fee loop
+            vector<CCoinSelector> vSelectors;
             nFeeRet = nTransactionFee;
             while (true)
             {
@@ -1486,7 +2049,8 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64_t nValueIn = 0;
-                if (!SelectCoins(nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl))
+                bool fChangeless = false;
+                if (!SelectCoins(nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl, &vSelectors, &fChangeless))
                     return false;
                 BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
                 {
@@ -1495,6 +2059,13 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend,
                 }
 
                 int64_t nChange = nValueIn - nValue - nFeeRet;
+                // the selection was made to do without change, or the caller asked for none,
+                // what is left over goes to the fee
+                if ((fChangeless || (coinControl && coinControl->fNoChange)) && nChange > 0)
+                {
+                    nFeeRet += nChange;
+                    nChange = 0;
+                }
                 // if sub-cent change is required, the fee must be raised to at least MIN_TX_FEE
                 // or until nChange becomes zero
                 // NOTE: this depends on the exact behaviour of GetMinFee
@@ -2095,6 +2666,127 @@ bool CWallet::SendStealthMoneyToDestination(CStealthAddress& sxAddress, int64_t
     return true;
 }
 
+// at most this many threads work out the stealth derivations of a block
+static const unsigned int STEALTH_SCAN_MAX_THREADS = 4;
+// derivations per thread below which starting threads is not worth it
+static const unsigned int STEALTH_SCAN_THREAD_JOBS = 8;
+// derivations kept between blocks at most
+static const unsigned int STEALTH_SCAN_MAX_CACHED = 10000;
+
+static data_chunk StealthScanKey(const ec_point& ephemPubkey, const CStealthAddress& sxAddr)
+{
+    data_chunk vchKey(ephemPubkey);
+    vchKey.insert(vchKey.end(), sxAddr.scan_secret.begin(), sxAddr.scan_secret.end());
+    vchKey.insert(vchKey.end(), sxAddr.spend_pubkey.begin(), sxAddr.spend_pubkey.end());
+    return vchKey;
+}
+
+// ephemeral key of a stealth payment carried by txout, as FindStealthTransactions reads them
+static bool GetStealthEphemKey(const CTxOut& txout, ec_point& vchEphemPK)
+{
+    opcodetype opCode;
+    CScript::const_iterator itTxA = txout.scriptPubKey.begin();
+    return txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
+        && opCode == OP_RETURN
+        && txout.scriptPubKey.GetOp(itTxA, opCode, vchEphemPK)
+        && vchEphemPK.size() == ec_compressed_size;
+}
+
+// requires LOCK(cs_wallet)
+// Same results as StealthSecret(scan_secret, ephemPubkey, spend_pubkey, ...)
+int CWallet::StealthScanSecret(const CStealthAddress& sxAddr, const ec_point& ephemPubkey, ec_secret& sharedSOut, ec_point& pkOut)
+{
+    data_chunk vchKey = StealthScanKey(ephemPubkey, sxAddr);
+    std::map<data_chunk, CStealthScanJob>::iterator mi = mapStealthScan.find(vchKey);
+    if (mi == mapStealthScan.end())
+    {
+        if (mapStealthScan.size() >= STEALTH_SCAN_MAX_CACHED)
+            mapStealthScan.clear();
+        CStealthScanJob job;
+        memcpy(&job.scanSecret.e[0], &sxAddr.scan_secret[0], ec_secret_size);
+        job.rv = stealthScanner.StealthSecret(job.scanSecret, ephemPubkey, sxAddr.spend_pubkey, job.sharedS, job.pkOut);
+        mi = mapStealthScan.insert(make_pair(vchKey, job)).first;
+    }
+    const CStealthScanJob& job = (*mi).second;
+    if (job.rv != 0)
+        return job.rv;
+    sharedSOut = job.sharedS;
+    pkOut = job.pkOut;
+    return 0;
+}
+
+// Work out the stealth derivations the transactions of a block will need, all
+// at once and over several threads, before they are synced one by one. The
+// threads besides this one use the scanners in vScanners, made as they are first
+// needed; passing the same ones for every batch keeps what they have decoded.
+void CWallet::PrepareStealthScan(const std::vector<const CTransaction*>& vtx, boost::ptr_vector<CStealthScanner>& vScanners)
+{
+    LOCK(cs_wallet);
+    mapStealthScan.clear();
+
+    std::vector<const CStealthAddress*> vAddr;
+    BOOST_FOREACH(const CStealthAddress& sxAddr, stealthAddresses)
+        if (sxAddr.scan_secret.size() == ec_secret_size)
+            vAddr.push_back(&sxAddr);
+    if (vAddr.empty())
+        return;
+
+    std::vector<CStealthScanJob> vJobs;
+    std::vector<data_chunk> vKey;
+    std::set<data_chunk> setQueued;
+    BOOST_FOREACH(const CTransaction* ptx, vtx)
+    {
+        // only worth it if there is an output the ephemeral key could be paying to
+        bool fKeyOutput = false;
+        BOOST_FOREACH(const CTxOut& txout, ptx->vout)
+        {
+            CTxDestination address;
+            if (ExtractDestination(txout.scriptPubKey, address) && address.type() == typeid(CKeyID))
+            {
+                fKeyOutput = true;
+                break;
+            }
+        }
+        if (!fKeyOutput)
+            continue;
+
+        BOOST_FOREACH(const CTxOut& txout, ptx->vout)
+        {
+            ec_point vchEphemPK;
+            if (!GetStealthEphemKey(txout, vchEphemPK))
+                continue;
+            BOOST_FOREACH(const CStealthAddress* pAddr, vAddr)
+            {
+                data_chunk vchKey = StealthScanKey(vchEphemPK, *pAddr);
+                if (!setQueued.insert(vchKey).second)
+                    continue;
+                vKey.push_back(vchKey);
+                CStealthScanJob job;
+                memcpy(&job.scanSecret.e[0], &pAddr->scan_secret[0], ec_secret_size);
+                job.ephemPubkey = vchEphemPK;
+                job.pkSpend = pAddr->spend_pubkey;
+                vJobs.push_back(job);
+            }
+        }
+    }
+    if (vJobs.empty())
+        return;
+
+    unsigned int nThreads = std::min(STEALTH_SCAN_MAX_THREADS, (unsigned int)boost::thread::hardware_concurrency());
+    nThreads = std::min(nThreads, (unsigned int)vJobs.size() / STEALTH_SCAN_THREAD_JOBS);
+    std::vector<CStealthScanner*> vpScanners(1, &stealthScanner);
+    for (unsigned int i = 1; i < nThreads; i++)
+    {
+        if (vScanners.size() < i)
+            vScanners.push_back(new CStealthScanner());
+        vpScanners.push_back(&vScanners[i - 1]);
+    }
+    StealthScanBatch(vJobs, vpScanners);
+
+    for (unsigned int i = 0; i < vJobs.size(); i++)
+        mapStealthScan.insert(make_pair(vKey[i], vJobs[i]));
+}
+
 bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr)
 {
     if (fDebug)
@@ -2105,7 +2797,6 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
     LOCK(cs_wallet);
     ec_secret sSpendR;
     ec_secret sSpend;
-    ec_secret sScan;
     ec_secret sShared;
     
     ec_point pkExtracted;
@@ -2186,9 +2877,8 @@ bool CWallet::FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNar
                     continue; // stealth address is not owned
                 
                 //printf("it->Encodeded() %s\n",  it->Encoded().c_str());
-                memcpy(&sScan.e[0], &it->scan_secret[0], ec_secret_size);
                 
-                if (StealthSecret(sScan, vchEphemPK, it->spend_pubkey, sShared, pkExtracted) != 0)
+                if (StealthScanSecret(*it, vchEphemPK, sShared, pkExtracted) != 0)
                 {
                     printf("StealthSecret failed.\n");
                     continue;
@@ -2405,15 +3095,14 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
                 continue;
         }
 
-        static int nMaxStakeSearchInterval = 60;
-        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
+        if (block.GetBlockTime() + nStakeMinAge > txNew.nTime - MAX_STAKE_SEARCH_INTERVAL)
             continue; // only count coins meeting min age requirement
         
         bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
+        for (unsigned int n=0; n<min(nSearchInterval,MAX_STAKE_SEARCH_INTERVAL) && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
         {
             // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+            // Search nSearchInterval seconds back up to MAX_STAKE_SEARCH_INTERVAL
             uint256 hashProofOfStake = 0, targetProofOfStake = 0;
             COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
             if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, txNew.nTime - n, hashProofOfStake, targetProofOfStake))
@@ -2601,6 +3290,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                UpdateUnspent(coin.GetHash());
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -2686,6 +3376,279 @@ string CWallet::SendMoneyToDestination(const CTxDestination& address, int64_t nV
 
 
 
+// Rough size of a transaction spending nIn pay-to-pubkey-hash inputs to nOut outputs, and the fee
+// CreateTransaction will want for it
+static int64_t EstimateConsolidateFee(unsigned int nIn, unsigned int nOut)
+{
+    unsigned int nBytes = 10 + 180 * nIn + 34 * nOut;
+    return max(nTransactionFee * (1 + (int64_t)nBytes / 1000), MIN_TX_FEE);
+}
+
+// Stake weight of a coin in coin-days, as CheckStakeKernelHash weighs it: value times age past
+// the min age
+static uint64_t GetCoinDayWeight(const COutput& out, int64_t nTime)
+{
+    int64_t nWeight = max(GetWeight((int64_t)out.tx->nTime, nTime), (int64_t)0);
+    CBigNum bnCoinDays = CBigNum(out.tx->vout[out.i].nValue) * nWeight / COIN / (24 * 60 * 60);
+    return bnCoinDays.getuint64();
+}
+
+static bool CompareConsolidateCoin(const pair<uint64_t, COutput>& a, const pair<uint64_t, COutput>& b)
+{
+    if (a.first != b.first)
+        return a.first < b.first;
+    return a.second.tx->vout[a.second.i].nValue < b.second.tx->vout[b.second.i].nValue;
+}
+
+static bool CompareConsolidateTx(const CConsolidateTx& a, const CConsolidateTx& b)
+{
+    return a.nCoinDaysIn < b.nCoinDaysIn;
+}
+
+bool CWallet::PlanConsolidation(int64_t nTargetValue, unsigned int nMaxInputs, int64_t nFeeBudget, CConsolidatePlan& plan) const
+{
+    plan = CConsolidatePlan();
+    if (nTargetValue <= 0 || nMaxInputs < 2)
+        return false;
+
+    // A coin's chance of being a kernel goes with its value times its age, so merging coins
+    // leaves the wallet's chance per search as it was once the merged coin has aged again,
+    // and takes fewer hashes to search. What a move costs is the age it throws away.
+    vector<CConsolidateTx> vMerge, vSplit;
+    {
+        LOCK2(cs_main, cs_wallet);
+
+        int64_t nTime = GetAdjustedTime();
+        vector<COutput> vCoins;
+        AvailableCoins(vCoins, true);
+        plan.nOutputsBefore = vCoins.size();
+
+        // coins only ever move back to the address they are at
+        map<CTxDestination, vector<pair<uint64_t, COutput> > > mapByAddress;
+        BOOST_FOREACH(const COutput& out, vCoins)
+        {
+            uint64_t nCoinDays = GetCoinDayWeight(out, nTime);
+            plan.nCoinDaysBefore += nCoinDays;
+            CTxDestination address;
+            if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+                mapByAddress[address].push_back(make_pair(nCoinDays, out));
+        }
+
+        for (map<CTxDestination, vector<pair<uint64_t, COutput> > >::iterator it = mapByAddress.begin(); it != mapByAddress.end(); ++it)
+        {
+            // those with the least weight first, they lose the least by moving
+            vector<pair<uint64_t, COutput> >& vOut = it->second;
+            sort(vOut.begin(), vOut.end(), CompareConsolidateCoin);
+
+            // merge the coins below the target into outputs of about the target
+            vector<pair<uint64_t, COutput> > vSmall;
+            for (unsigned int i = 0; i < vOut.size(); i++)
+                if (vOut[i].second.tx->vout[vOut[i].second.i].nValue < nTargetValue)
+                    vSmall.push_back(vOut[i]);
+            unsigned int i = 0;
+            while (i < vSmall.size())
+            {
+                CConsolidateTx ctx;
+                ctx.address = it->first;
+                for (; i < vSmall.size() && ctx.vInputs.size() < nMaxInputs && ctx.nValueIn < nTargetValue; i++)
+                {
+                    const COutput& out = vSmall[i].second;
+                    ctx.vInputs.push_back(COutPoint(out.tx->GetHash(), out.i));
+                    ctx.nValueIn += out.tx->vout[out.i].nValue;
+                    ctx.nCoinDaysIn += vSmall[i].first;
+                }
+                if (ctx.vInputs.size() < 2)
+                    break;
+                ctx.nFee = EstimateConsolidateFee(ctx.vInputs.size(), 1);
+                if (ctx.nValueIn - ctx.nFee < CENT)
+                    continue;
+                ctx.vOutputs.push_back(ctx.nValueIn - ctx.nFee);
+                vMerge.push_back(ctx);
+            }
+
+            // Split the coins of twice the target or more into pieces of the target. Splitting
+            // adds no weight, but a coin that stakes goes without any until it is past the min
+            // age again, and pieces go without it one at a time rather than all the value at once.
+            for (i = 0; i < vOut.size(); i++)
+            {
+                const COutput& out = vOut[i].second;
+                int64_t nValue = out.tx->vout[out.i].nValue;
+                if (nValue < 2 * nTargetValue)
+                    continue;
+                unsigned int nPieces = min((int64_t)nMaxInputs, nValue / nTargetValue);
+                CConsolidateTx ctx;
+                ctx.address = it->first;
+                ctx.fSplit = true;
+                ctx.vInputs.push_back(COutPoint(out.tx->GetHash(), out.i));
+                ctx.nValueIn = nValue;
+                ctx.nCoinDaysIn = vOut[i].first;
+                ctx.nFee = EstimateConsolidateFee(1, nPieces);
+                int64_t nPiece = nValue / nPieces;
+                ctx.vOutputs.assign(nPieces, nPiece);
+                ctx.vOutputs.back() = nValue - nPiece * (nPieces - 1) - ctx.nFee;
+                if (ctx.vOutputs.back() < CENT)
+                    continue;
+                vSplit.push_back(ctx);
+            }
+        }
+    }
+
+    // merges first, they are what saves hashes; then each kind by the least weight given up
+    sort(vMerge.begin(), vMerge.end(), CompareConsolidateTx);
+    sort(vSplit.begin(), vSplit.end(), CompareConsolidateTx);
+    vMerge.insert(vMerge.end(), vSplit.begin(), vSplit.end());
+    plan.nOutputsAfter = plan.nOutputsBefore;
+    BOOST_FOREACH(const CConsolidateTx& ctx, vMerge)
+    {
+        if (plan.nFee + ctx.nFee > nFeeBudget)
+            break;
+        plan.vTx.push_back(ctx);
+        plan.nFee += ctx.nFee;
+        plan.nOutputsAfter += ctx.vOutputs.size() - ctx.vInputs.size();
+        plan.nCoinDaysLost += ctx.nCoinDaysIn;
+    }
+    return !plan.vTx.empty();
+}
+
+// Carry out one transaction of a consolidation plan, raising the fee a couple of times if it falls short
+bool CWallet::CommitConsolidation(const CConsolidateTx& ctx, uint256& hashTx, int64_t& nFeeRet, string& strError)
+{
+    if (IsLocked())
+    {
+        strError = _("Error: Wallet locked, unable to create transaction  ");
+        return false;
+    }
+
+    CCoinControl coinControl;
+    BOOST_FOREACH(COutPoint outpoint, ctx.vInputs)
+        coinControl.Select(outpoint);
+    coinControl.destChange = ctx.address;
+    coinControl.fNoChange = true;
+
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(ctx.address);
+
+    int64_t nFee = ctx.nFee;
+    for (int nTry = 0; nTry < 3; nTry++, nFee *= 2)
+    {
+        // whatever the outputs leave over is the fee
+        vector<pair<CScript, int64_t> > vecSend;
+        int64_t nValueOut = 0;
+        for (unsigned int i = 0; i + 1 < ctx.vOutputs.size(); i++)
+        {
+            vecSend.push_back(make_pair(scriptPubKey, ctx.vOutputs[i]));
+            nValueOut += ctx.vOutputs[i];
+        }
+        int64_t nLast = ctx.nValueIn - nValueOut - nFee;
+        if (nLast < CENT)
+            break;
+        vecSend.push_back(make_pair(scriptPubKey, nLast));
+
+        CWalletTx wtx;
+        CReserveKey reservekey(this);
+        int32_t nChangePos;
+        if (!CreateTransaction(vecSend, wtx, reservekey, nFeeRet, nChangePos, &coinControl))
+            continue;
+        if (!CommitTransaction(wtx, reservekey))
+        {
+            strError = _("Error: The transaction was rejected.");
+            return false;
+        }
+        hashTx = wtx.GetHash();
+        return true;
+    }
+    strError = _("Error: Transaction creation failed  ");
+    return false;
+}
+
+// Background service merging and splitting the wallet's coins, from time to time, within a daily fee budget
+void ConsolidateCoins(CWallet* pwallet)
+{
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("jumbucks-consolidate");
+
+    int64_t nWindowStart = GetTime();
+    int64_t nWindowFee = 0;
+
+    while (true)
+    {
+        for (int i = 0; i < CONSOLIDATE_INTERVAL; i++)
+        {
+            if (fShutdown)
+                return;
+            MilliSleep(1000);
+        }
+
+        if (pwallet->IsLocked() || IsInitialBlockDownload())
+            continue;
+
+        if (GetTime() - nWindowStart >= 24 * 60 * 60)
+        {
+            nWindowStart = GetTime();
+            nWindowFee = 0;
+        }
+
+        CConsolidatePlan plan;
+        if (!pwallet->PlanConsolidation(nConsolidateTargetValue, nConsolidateMaxInputs, nConsolidateFeeBudget - nWindowFee, plan))
+            continue;
+
+        printf("ConsolidateCoins() : %"PRIszu" transactions planned, %d coins to %d\n", plan.vTx.size(), plan.nOutputsBefore, plan.nOutputsAfter);
+        BOOST_FOREACH(const CConsolidateTx& ctx, plan.vTx)
+        {
+            if (fShutdown)
+                return;
+            if (nWindowFee + ctx.nFee > nConsolidateFeeBudget)
+                break;
+
+            uint256 hashTx;
+            int64_t nFee = 0;
+            string strError;
+            if (!pwallet->CommitConsolidation(ctx, hashTx, nFee, strError))
+            {
+                printf("ConsolidateCoins() : %s\n", strError.c_str());
+                break;
+            }
+            nWindowFee += nFee;
+            printf("ConsolidateCoins() : %s %"PRIszu" coins of %s into %"PRIszu", fee %s, tx %s\n",
+                ctx.fSplit ? "split" : "merged", ctx.vInputs.size(), CBitcoinAddress(ctx.address).ToString().c_str(),
+                ctx.vOutputs.size(), FormatMoney(nFee).c_str(), hashTx.ToString().c_str());
+        }
+    }
+}
+
+void RefillKeyPool(CWallet* pwallet)
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    RenameThread("jumbucks-keypool");
+
+    bool fRefilling = false;
+    while (!fShutdown)
+    {
+        unsigned int nTargetSize = max(GetArg("-keypool", 100), (int64_t)0) + 1;
+        unsigned int nPoolSize;
+        bool fLocked;
+        {
+            LOCK(pwallet->cs_wallet);
+            nPoolSize = pwallet->GetKeyPoolSize();
+            fLocked = pwallet->IsLocked();
+        }
+
+        // Once down to the low watermark the pool is filled right up again, a
+        // batch at a time so that getnewaddress never waits long for the lock
+        if (!fRefilling && nPoolSize <= (uint64_t)nTargetSize * KEYPOOL_LOW_WATERMARK / 100)
+            fRefilling = true;
+        if (fRefilling && !fLocked && nPoolSize < nTargetSize &&
+            pwallet->AddKeysToPool(min(nTargetSize - nPoolSize, KEYPOOL_REFILL_BATCH)) > 0)
+            continue;
+
+        fRefilling = false;
+        MilliSleep(250);
+    }
+}
+
+
+
+
 DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
 {
     if (!fFileBacked)
@@ -2708,6 +3671,13 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
         return nLoadWalletRet;
     fFirstRunRet = !vchDefaultKey.IsValid();
 
+    {
+        LOCK(cs_wallet);
+        RebuildUnspent();
+        RebuildTxIndex();
+        fFilterStale = true;
+    }
+
     NewThread(ThreadFlushWalletDB, &strWalletFile);
     return DB_LOAD_OK;
 }
@@ -2827,49 +3797,112 @@ bool CWallet::NewKeyPool()
         if (IsLocked())
             return false;
 
-        int64_t nKeys = max(GetArg("-keypool", 100), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
-        printf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
+        unsigned int nKeys = max(GetArg("-keypool", 100), (int64_t)0);
+        while (setKeyPool.size() < nKeys)
+            if (AddKeysToPool(min(nKeys - (unsigned int)setKeyPool.size(), KEYPOOL_REFILL_BATCH)) == 0)
+                return false;
+        printf("CWallet::NewKeyPool wrote %u new keys\n", nKeys);
     }
     return true;
 }
 
-bool CWallet::TopUpKeyPool(unsigned int nSize)
+unsigned int CWallet::AddKeysToPool(unsigned int nKeys)
 {
-    {
-        LOCK(cs_wallet);
+    if (nKeys == 0)
+        return 0;
+    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
 
-        if (IsLocked())
-            return false;
+    // Making the keys is most of the work and needs nothing of the wallet,
+    // so it is done before taking the lock
+    int64_t nStart = GetTimeMicros();
+    RandAddSeedPerfmon();
+    vector<CKey> vKey(nKeys);
+    for (unsigned int i = 0; i < nKeys; i++)
+        vKey[i].MakeNewKey(fCompressed);
 
-        CWalletDB walletdb(strWalletFile);
+    LOCK(cs_wallet);
+    if (IsLocked())
+        return 0;
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (nSize > 0)
-            nTargetSize = nSize;
-        else
-            nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
+    // Compressed public keys were introduced in version 0.6.0
+    if (fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+    // The keys and their pool entries all go into one database transaction,
+    // AddKey and AddCryptedKey write through pwalletdbEncryption meanwhile
+    CWalletDB walletdb(strWalletFile);
+    bool fTxn = fFileBacked && walletdb.TxnBegin();
+    pwalletdbEncryption = &walletdb;
+
+    vector<int64_t> vIndex;
+    try
+    {
+        BOOST_FOREACH(const CKey& key, vKey)
         {
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error("TopUpKeyPool() : writing generated key failed");
+            CPubKey pubkey = AddNewKey(key);
+            if (!walletdb.WritePool(nEnd, CKeyPool(pubkey)))
+                throw runtime_error("AddKeysToPool() : writing generated key failed");
             setKeyPool.insert(nEnd);
-            printf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            vIndex.push_back(nEnd);
+        }
+        if (fTxn && !walletdb.TxnCommit())
+            throw runtime_error("AddKeysToPool() : committing generated keys failed");
+    }
+    catch (...)
+    {
+        // the keys stay in memory, but none of them may be handed out from the pool
+        pwalletdbEncryption = NULL;
+        if (fTxn)
+            walletdb.TxnAbort();
+        BOOST_FOREACH(int64_t nIndex, vIndex)
+            setKeyPool.erase(nIndex);
+        throw;
+    }
+    pwalletdbEncryption = NULL;
+
+    nKeyPoolAdded += nKeys;
+    nKeyPoolMicros += GetTimeMicros() - nStart;
+    printf("keypool added keys %"PRId64"-%"PRId64", size=%"PRIszu"\n", vIndex.front(), vIndex.back(), setKeyPool.size());
+    return nKeys;
+}
+
+bool CWallet::TopUpKeyPool(unsigned int nSize)
+{
+    // Top up key pool
+    unsigned int nTargetSize;
+    if (nSize > 0)
+        nTargetSize = nSize;
+    else
+        nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
+
+    while (true)
+    {
+        unsigned int nPoolSize;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                return false;
+            nPoolSize = setKeyPool.size();
         }
+        if (nPoolSize >= nTargetSize + 1)
+            break;
+        if (AddKeysToPool(min(nTargetSize + 1 - nPoolSize, KEYPOOL_REFILL_BATCH)) == 0)
+            return false;
     }
     return true;
 }
 
+double CWallet::GetKeyPoolRefillRate() const
+{
+    LOCK(cs_wallet);
+    if (nKeyPoolMicros <= 0)
+        return 0;
+    return (double)nKeyPoolAdded * 1000000 / nKeyPoolMicros;
+}
+
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
 {
     nIndex = -1;
@@ -2877,8 +3910,10 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
     {
         LOCK(cs_wallet);
 
-        if (!IsLocked())
-            TopUpKeyPool();
+        // RefillKeyPool keeps the pool topped up in the background, only when it
+        // has run dry is a batch made here
+        if (setKeyPool.empty() && !IsLocked())
+            AddKeysToPool(KEYPOOL_REFILL_BATCH);
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -3122,6 +4157,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(pcoin->GetHash());
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -3134,6 +4170,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    UpdateUnspent(pcoin->GetHash());
                 }
             }
         }
@@ -3157,6 +4194,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                UpdateUnspent(txin.prevout.hash);
             }
         }
     }
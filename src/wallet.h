@@ -10,6 +10,8 @@
 
 #include <stdlib.h>
 
+#include <boost/ptr_container/ptr_vector.hpp>
+
 
 #include "main.h"
 #include "key.h"
@@ -19,9 +21,17 @@
 #include "util.h"
 #include "walletdb.h"
 #include "stealth.h"
+#include "bloom.h"
+#include "coinselection.h"
 
 extern bool fWalletUnlockStakingOnly;
+extern int64_t nConsolidateTargetValue;
+extern unsigned int nConsolidateMaxInputs;
+extern int64_t nConsolidateFeeBudget;
 extern bool fConfChange;
+// For the tests: called by FlushPendingTxs after each record it writes, with the
+// number written so far, to stop it part way through as a crash would
+extern void (*pfnFlushPendingTxsTestHook)(unsigned int nDone);
 class CAccountingEntry;
 class CWalletTx;
 class CReserveKey;
@@ -69,6 +79,127 @@ public:
     )
 };
 
+/** Wallet balances, split up the way the balance queries report them */
+class CWalletBalances
+{
+public:
+    int64_t nTrusted;
+    int64_t nUnconfirmed;
+    int64_t nImmature;
+    int64_t nStake;
+    int64_t nNewMint;
+
+    CWalletBalances()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nTrusted = 0;
+        nUnconfirmed = 0;
+        nImmature = 0;
+        nStake = 0;
+        nNewMint = 0;
+    }
+};
+
+/** What makes a transaction possibly ours, captured once so that blocks can be
+ * matched during a rescan without holding cs_wallet. False positives are weeded
+ * out by AddToWalletIfInvolvingMe; there must be no false negatives.
+ */
+class CWalletScanFilter
+{
+private:
+    const CKeyStore* pkeystore;
+    std::set<CKeyID> setKeyID;
+    std::set<uint256> setTxid; // wallet transactions, whose outputs we may be spending
+    bool fStealth;
+
+public:
+    // requires LOCK(cs_wallet)
+    CWalletScanFilter(const CWallet* pwallet);
+
+    bool MatchesOutputs(const CTransaction& tx) const;
+    bool MatchesInputs(const CTransaction& tx, const uint256& hash) const;
+    void AddTx(const uint256& hash) { setTxid.insert(hash); }
+};
+
+/** State of the running, or last finished, wallet rescan */
+class CRescanProgress
+{
+public:
+    bool fRunning;
+    int nStartHeight;
+    int nHeight;      // last block committed
+    int nStopHeight;
+    int nFound;
+    int64_t nStartTime;
+
+    CRescanProgress()
+    {
+        fRunning = false;
+        nStartHeight = 0;
+        nHeight = 0;
+        nStopHeight = 0;
+        nFound = 0;
+        nStartTime = 0;
+    }
+};
+
+/** Seconds back from the current time CreateCoinStake tries each coin as a kernel */
+static const int64_t MAX_STAKE_SEARCH_INTERVAL = 60;
+/** Seconds between runs of the consolidation service */
+static const int CONSOLIDATE_INTERVAL = 60 * 60;
+/** Keys made and written to the key pool together */
+static const unsigned int KEYPOOL_REFILL_BATCH = 100;
+/** The key pool is refilled in the background once it is down to this percentage of -keypool */
+static const unsigned int KEYPOOL_LOW_WATERMARK = 75;
+
+/** A transaction planned by the consolidation service: small coins of one
+ * address merged, or one large coin split, into outputs of about the target size
+ */
+class CConsolidateTx
+{
+public:
+    CTxDestination address;
+    bool fSplit;
+    std::vector<COutPoint> vInputs;
+    int64_t nValueIn;
+    std::vector<int64_t> vOutputs;
+    int64_t nFee;
+    uint64_t nCoinDaysIn;       // stake weight the inputs have now, and give up when spent
+
+    CConsolidateTx()
+    {
+        fSplit = false;
+        nValueIn = 0;
+        nFee = 0;
+        nCoinDaysIn = 0;
+    }
+};
+
+/** What the consolidation service would do with the wallet's coins */
+class CConsolidatePlan
+{
+public:
+    std::vector<CConsolidateTx> vTx;
+    int nOutputsBefore;
+    int nOutputsAfter;
+    int64_t nFee;
+    uint64_t nCoinDaysBefore;   // stake weight of all the coins
+    uint64_t nCoinDaysLost;     // of it, what the planned transactions spend
+
+    CConsolidatePlan()
+    {
+        nOutputsBefore = 0;
+        nOutputsAfter = 0;
+        nFee = 0;
+        nCoinDaysBefore = 0;
+        nCoinDaysLost = 0;
+    }
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -76,8 +207,10 @@ class CWallet : public CCryptoKeyStore
 {
 private:
     bool SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
-    bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL,
+                     std::vector<CCoinSelector>* pvSelectors=NULL, bool* pfChangeless=NULL) const;
 
+    // while encrypting the wallet or adding a batch of keys, all key writes go through this
     CWalletDB *pwalletdbEncryption;
 
     // the current wallet version: clients below this version are not able to load the wallet
@@ -86,6 +219,57 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Transactions with at least one unspent output of ours. Balance and coin queries
+    // only look at these, instead of the whole of mapWallet.
+    std::set<uint256> setUnspentTx;
+
+    // Wallet transactions changed since they were last written, to be written (true)
+    // or erased (false) all in one database transaction by FlushPendingTxs
+    mutable std::map<uint256, bool> mapTxPending;
+
+    // Transactions by the height of the block they are in, INT_MAX when in none
+    // we know of, for listing what has happened since a given block
+    std::set<std::pair<int, uint256> > setTxByHeight;
+    std::map<uint256, int> mapTxHeight;
+    // Transactions whose block was disconnected and that are in no block since; the
+    // index above still has them at the old height
+    std::set<uint256> setTxOrphaned;
+
+    int GetTxIndexHeight(const CWalletTx& wtx) const;
+
+    // Balances are cached until the wallet or the best chain changes
+    unsigned int nBalanceUpdate;
+    mutable unsigned int nBalanceUpdateCached;
+    mutable uint256 hashBalanceBlockCached;
+    mutable CWalletBalances balancesCached;
+
+    const CWalletBalances& GetBalances() const;
+
+    // Our keys, scripts and transactions in compact form, so that most transactions
+    // seen while connecting blocks are turned away after a few probes instead of
+    // going through IsMine/IsFromMe. Rebuilt lazily once stale or full.
+    CBloomFilter filterMine;
+    bool fFilterStale;
+
+    // Keys added to the pool so far and the time that took, for the refill rate
+    int64_t nKeyPoolAdded;
+    int64_t nKeyPoolMicros;
+
+    void RebuildFilter();
+    void FilterAddPubKey(const CPubKey& pubkey);
+
+    // Stealth derivations by ephemeral key and address, worked out ahead of time
+    // for a whole block by PrepareStealthScan, or as they are first needed
+    CStealthScanner stealthScanner;
+    std::map<data_chunk, CStealthScanJob> mapStealthScan;
+
+    int StealthScanSecret(const CStealthAddress& sxAddr, const ec_point& ephemPubkey, ec_secret& sharedSOut, ec_point& pkOut);
+
+    // only one rescan at a time; progress is readable while it runs
+    CCriticalSection cs_rescan;
+    mutable CCriticalSection cs_rescanProgress;
+    CRescanProgress rescanProgress;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -129,6 +313,11 @@ public:
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
+        nBalanceUpdate = 1;
+        nBalanceUpdateCached = 0;
+        fFilterStale = true;
+        nKeyPoolAdded = 0;
+        nKeyPoolMicros = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -150,6 +339,8 @@ public:
     // keystore implementation
     // Generate a new key
     CPubKey GenerateNewKey();
+    // Adds a freshly made key to the store with its metadata, and saves it to disk
+    CPubKey AddNewKey(const CKey& key);
     // Adds a key to the store, and saves it to disk.
     bool AddKey(const CKey& key);
     // Adds a key to the store, without saving it to disk (used by LoadWallet)
@@ -182,18 +373,35 @@ public:
     typedef std::pair<CWalletTx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
-     */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    /** The wallet's activity log: all transactions and accounting entries by nOrderPos,
+        kept up to date as they are added, so it can be read a page at a time */
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+
+    bool AddAccountingEntry(const CAccountingEntry& acentry, CWalletDB& walletdb);
+    // Take back an entry added in a database transaction that was then aborted
+    void UndoAccountingEntry(int64_t nOrderPos);
+    void UpdateTxHeight(const uint256& hashTx);
+    void RebuildTxIndex();
+    // Transactions in blocks above nHeight, in no block, or in a block no longer in
+    // the main chain
+    void GetTransactionsAbove(int nHeight, std::vector<const CWalletTx*>& vtxRet) const;
+    void TxBlockDisconnected(const uint256& hashTx);
+
+    void QueueTxWrite(const uint256& hashTx) const;
+    void QueueTxErase(const uint256& hashTx) const;
+    bool FlushPendingTxs() const;
 
     void MarkDirty();
+    void UpdateUnspent(const uint256& hashTx);
+    void RebuildUnspent();
+    bool MayBeInvolvingMe(const CTransaction& tx);
     bool AddToWallet(const CWalletTx& wtxIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate = false, bool fFindBlock = false);
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout, bool fBlock = false);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    CRescanProgress GetRescanProgress() const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(bool fForce = false);
     int64_t GetBalance() const;
@@ -204,6 +412,8 @@ public:
     bool CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, int32_t& nChangePos, const CCoinControl *coinControl=NULL);
     bool CreateTransaction(CScript scriptPubKey, int64_t nValue, std::string& sNarr, CWalletTx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
+    bool PlanConsolidation(int64_t nTargetValue, unsigned int nMaxInputs, int64_t nFeeBudget, CConsolidatePlan& plan) const;
+    bool CommitConsolidation(const CConsolidateTx& ctx, uint256& hashTx, int64_t& nFeeRet, std::string& strError);
     
     
     
@@ -224,10 +434,13 @@ public:
     std::string SendStealthMoney(CScript scriptPubKey, int64_t nValue, std::vector<uint8_t>& P, std::vector<uint8_t>& narr, std::string& sNarr, CWalletTx& wtxNew, bool fAskFee=false);
     bool SendStealthMoneyToDestination(CStealthAddress& sxAddress, int64_t nValue, std::string& sNarr, CWalletTx& wtxNew, std::string& sError, bool fAskFee=false);
     bool FindStealthTransactions(const CTransaction& tx, mapValue_t& mapNarr);
+    void PrepareStealthScan(const std::vector<const CTransaction*>& vtx, boost::ptr_vector<CStealthScanner>& vScanners);
 
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int nSize = 0);
+    unsigned int AddKeysToPool(unsigned int nKeys);
+    double GetKeyPoolRefillRate() const;
     int64_t AddReserveKey(const CKeyPool& keypool);
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
@@ -907,4 +1120,7 @@ private:
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+void ConsolidateCoins(CWallet* pwallet);
+void RefillKeyPool(CWallet* pwallet);
+
 #endif
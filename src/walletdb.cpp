@@ -7,10 +7,20 @@
 #include "wallet.h"
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace boost;
 
+// LoadWallet reads the database this many records at a time, in bulk reads of this size at least
+static const unsigned int WALLET_LOAD_BATCH = 10000;
+static const unsigned int WALLET_LOAD_BUFFER_SIZE = 1024 * 1024;
+// and spreads the work over up to this many threads, giving each this many records at least
+static const int WALLET_LOAD_MAX_THREADS = 8;
+static const unsigned int WALLET_LOAD_THREAD_RECORDS = 64;
+
 
 static uint64_t nAccountingEntryNumber = 0;
 extern bool fWalletUnlockStakingOnly;
@@ -49,9 +59,10 @@ bool CWalletDB::WriteAccountingEntry(const uint64_t nAccEntryNum, const CAccount
     return Write(boost::make_tuple(string("acentry"), acentry.strAccount, nAccEntryNum), acentry);
 }
 
-bool CWalletDB::WriteAccountingEntry(const CAccountingEntry& acentry)
+bool CWalletDB::WriteAccountingEntry(CAccountingEntry& acentry)
 {
-    return WriteAccountingEntry(++nAccountingEntryNumber, acentry);
+    acentry.nEntryNo = ++nAccountingEntryNumber;
+    return WriteAccountingEntry(acentry.nEntryNo, acentry);
 }
 
 int64_t CWalletDB::GetAccountCreditDebit(const string& strAccount)
@@ -127,9 +138,7 @@ CWalletDB::ReorderTransactions(CWallet* pwallet)
         CWalletTx* wtx = &((*it).second);
         txByTime.insert(make_pair(wtx->nTimeReceived, TxPair(wtx, (CAccountingEntry*)0)));
     }
-    list<CAccountingEntry> acentries;
-    ListAccountCreditDebit("", acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(CAccountingEntry& entry, pwallet->laccentries)
     {
         txByTime.insert(make_pair(entry.nTime, TxPair((CWalletTx*)0, &entry)));
     }
@@ -205,6 +214,101 @@ public:
     }
 };
 
+// Take in a wallet transaction read from the database, or drop it if it is invalid
+static bool LoadWalletTx(CWallet* pwallet, const uint256& hash, CWalletTx& wtx, bool fValid,
+                         CDataStream& ssValue, CWalletScanState &wss, string& strErr)
+{
+    if (fValid)
+        wtx.BindWallet(pwallet);
+    else
+    {
+        pwallet->mapWallet.erase(hash);
+        return false;
+    }
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        wss.vWalletUpgrade.push_back(hash);
+    }
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    //// debug print
+    //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
+    //printf(" %12d  %s  %s  %s\n",
+    //    wtx.vout[0].nValue,
+    //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
+    //    wtx.hashBlock.ToString().substr(0,20).c_str(),
+    //    wtx.mapValue["message"].c_str());
+    return true;
+}
+
+// Read a plaintext "key" or "wkey" record and check its private key matches the public key
+static bool ReadWalletKey(const string& strType, CDataStream& ssKey, CDataStream& ssValue, CKey& key, string& strErr)
+{
+    vector<unsigned char> vchPubKey;
+    ssKey >> vchPubKey;
+    if (strType == "key")
+    {
+        CPrivKey pkey;
+        ssValue >> pkey;
+        key.SetPubKey(vchPubKey);
+        if (!key.SetPrivKey(pkey))
+        {
+            strErr = "Error reading wallet database: CPrivKey corrupt";
+            return false;
+        }
+        if (key.GetPubKey() != vchPubKey)
+        {
+            strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
+            return false;
+        }
+        if (!key.IsValid())
+        {
+            strErr = "Error reading wallet database: invalid CPrivKey";
+            return false;
+        }
+    }
+    else
+    {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        key.SetPubKey(vchPubKey);
+        if (!key.SetPrivKey(wkey.vchPrivKey))
+        {
+            strErr = "Error reading wallet database: CPrivKey corrupt";
+            return false;
+        }
+        if (key.GetPubKey() != vchPubKey)
+        {
+            strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
+            return false;
+        }
+        if (!key.IsValid())
+        {
+            strErr = "Error reading wallet database: invalid CWalletKey";
+            return false;
+        }
+    }
+    return true;
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -226,44 +330,8 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             ssKey >> hash;
             CWalletTx& wtx = pwallet->mapWallet[hash];
             ssValue >> wtx;
-            if (wtx.CheckTransaction() && (wtx.GetHash() == hash))
-                wtx.BindWallet(pwallet);
-            else
-            {
-                pwallet->mapWallet.erase(hash);
+            if (!LoadWalletTx(pwallet, hash, wtx, wtx.CheckTransaction() && (wtx.GetHash() == hash), ssValue, wss, strErr))
                 return false;
-            }
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            //// debug print
-            //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-            //printf(" %12d  %s  %s  %s\n",
-            //    wtx.vout[0].nValue,
-            //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-            //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-            //    wtx.mapValue["message"].c_str());
         } else
         if (strType == "sxAddr")
         {
@@ -283,62 +351,21 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             if (nNumber > nAccountingEntryNumber)
                 nAccountingEntryNumber = nNumber;
 
-            if (!wss.fAnyUnordered)
-            {
-                CAccountingEntry acentry;
-                ssValue >> acentry;
-                if (acentry.nOrderPos == -1)
-                    wss.fAnyUnordered = true;
-            }
+            CAccountingEntry acentry;
+            ssValue >> acentry;
+            acentry.strAccount = strAccount;
+            acentry.nEntryNo = nNumber;
+            if (acentry.nOrderPos == -1)
+                wss.fAnyUnordered = true;
+            pwallet->laccentries.push_back(acentry);
         }
         else if (strType == "key" || strType == "wkey")
         {
-            vector<unsigned char> vchPubKey;
-            ssKey >> vchPubKey;
-            CKey key;
             if (strType == "key")
-            {
                 wss.nKeys++;
-                CPrivKey pkey;
-                ssValue >> pkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(pkey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CPrivKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CPrivKey";
-                    return false;
-                }
-            }
-            else
-            {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                key.SetPubKey(vchPubKey);
-                if (!key.SetPrivKey(wkey.vchPrivKey))
-                {
-                    strErr = "Error reading wallet database: CPrivKey corrupt";
-                    return false;
-                }
-                if (key.GetPubKey() != vchPubKey)
-                {
-                    strErr = "Error reading wallet database: CWalletKey pubkey inconsistency";
-                    return false;
-                }
-                if (!key.IsValid())
-                {
-                    strErr = "Error reading wallet database: invalid CWalletKey";
-                    return false;
-                }
-            }
+            CKey key;
+            if (!ReadWalletKey(strType, ssKey, ssValue, key, strErr))
+                return false;
             if (!pwallet->LoadKey(key))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -456,6 +483,71 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+/** A wallet record as the load workers leave it for the pass that puts it in the wallet */
+class CWalletLoadEntry
+{
+public:
+    string strType;
+    bool fDecode;       // a tx or plaintext key, read and checked by the workers
+    uint256 hash;
+    CWalletTx* pwtx;    // the mapWallet entry a tx record is read into
+    boost::shared_ptr<CKey> pkey;   // freed with the batch, however loading it ends
+    bool fOK;
+    string strErr;
+    int64_t nMicros;
+
+    CWalletLoadEntry()
+    {
+        fDecode = false;
+        pwtx = NULL;
+        fOK = false;
+        nMicros = 0;
+    }
+};
+
+class CWalletLoadTiming
+{
+public:
+    unsigned int nCount;
+    int64_t nDecodeMicros;
+    int64_t nLoadMicros;
+
+    CWalletLoadTiming()
+    {
+        nCount = 0;
+        nDecodeMicros = 0;
+        nLoadMicros = 0;
+    }
+};
+
+typedef vector<pair<CDataStream, CDataStream> > WalletRecords;
+
+static void ThreadDecodeWalletRecords(WalletRecords* pvRecords, vector<CWalletLoadEntry>* pvEntry, unsigned int nThread, unsigned int nThreads)
+{
+    for (unsigned int i = nThread; i < pvEntry->size(); i += nThreads)
+    {
+        CWalletLoadEntry& entry = (*pvEntry)[i];
+        if (!entry.fDecode)
+            continue;
+        int64_t nStart = GetTimeMicros();
+        try {
+            if (entry.pwtx)
+            {
+                (*pvRecords)[i].second >> *entry.pwtx;
+                entry.fOK = entry.pwtx->CheckTransaction() && (entry.pwtx->GetHash() == entry.hash);
+            }
+            else
+            {
+                entry.pkey.reset(new CKey());
+                entry.fOK = ReadWalletKey(entry.strType, (*pvRecords)[i].first, (*pvRecords)[i].second, *entry.pkey, entry.strErr);
+            }
+        } catch (...) {
+            entry.fOK = false;
+        }
+        entry.nMicros = GetTimeMicros() - nStart;
+    }
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -463,6 +555,15 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
 
+    // The records are read in bulk, a batch at a time. Transactions are deserialized and
+    // hashed, and plaintext keys checked, by a pool of threads, then everything is put in
+    // the wallet in database order by this thread.
+    unsigned int nThreads = max(1, min(WALLET_LOAD_MAX_THREADS, (int)boost::thread::hardware_concurrency()));
+    map<string, CWalletLoadTiming> mapTiming;
+    int64_t nReadMicros = 0, nDecodeMicros = 0;
+    int64_t nLoadStart = GetTimeMillis();
+    vector<char> vchBuffer(WALLET_LOAD_BUFFER_SIZE);
+
     try {
         LOCK(pwallet->cs_wallet);
         int nMinVersion = 0;
@@ -481,39 +582,126 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             return DB_CORRUPT;
         }
 
-        while (true)
+        bool fDone = false;
+        while (!fDone)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            // Read the next batch of records
+            WalletRecords vRecords;
+            int64_t nStart = GetTimeMicros();
+            while (vRecords.size() < WALLET_LOAD_BATCH)
             {
-                printf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                int ret = ReadBulkAtCursor(pcursor, vchBuffer, vRecords);
+                if (ret == DB_NOTFOUND)
+                {
+                    fDone = true;
+                    break;
+                }
+                else if (ret != 0)
+                {
+                    printf("Error reading next record from wallet database\n");
+                    pcursor->close();
+                    return DB_CORRUPT;
+                }
             }
+            nReadMicros += GetTimeMicros() - nStart;
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            // Sort out what the workers have to do, making room in mapWallet for the
+            // transactions up front as the map can't be changed while they run
+            vector<CWalletLoadEntry> vEntry(vRecords.size());
+            unsigned int nDecode = 0;
+            for (unsigned int i = 0; i < vRecords.size(); i++)
+            {
+                CWalletLoadEntry& entry = vEntry[i];
+                try {
+                    CDataStream ssType(vRecords[i].first);
+                    ssType >> entry.strType;
+                    if (entry.strType == "tx")
+                    {
+                        vRecords[i].first >> entry.strType >> entry.hash;
+                        entry.pwtx = &pwallet->mapWallet[entry.hash];
+                        entry.fDecode = true;
+                    }
+                    else if (entry.strType == "key" || entry.strType == "wkey")
+                    {
+                        vRecords[i].first >> entry.strType;
+                        entry.fDecode = true;
+                    }
+                } catch (...) {
+                    // left to ReadKeyValue to fail on
+                }
+                if (entry.fDecode)
+                    nDecode++;
+            }
+
+            nStart = GetTimeMicros();
+            if (nDecode > 0)
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
+                unsigned int nThreadsUsed = min(nThreads, (nDecode + WALLET_LOAD_THREAD_RECORDS - 1) / WALLET_LOAD_THREAD_RECORDS);
+                boost::thread_group threadGroup;
+                for (unsigned int i = 1; i < nThreadsUsed; i++)
+                    threadGroup.create_thread(boost::bind(&ThreadDecodeWalletRecords, &vRecords, &vEntry, i, nThreadsUsed));
+                ThreadDecodeWalletRecords(&vRecords, &vEntry, 0, nThreadsUsed);
+                threadGroup.join_all();
+            }
+            nDecodeMicros += GetTimeMicros() - nStart;
+
+            for (unsigned int i = 0; i < vRecords.size(); i++)
+            {
+                CDataStream& ssKey = vRecords[i].first;
+                CDataStream& ssValue = vRecords[i].second;
+                CWalletLoadEntry& entry = vEntry[i];
+                int64_t nRecordStart = GetTimeMicros();
+
+                // Try to be tolerant of single corrupt records:
+                string strType = entry.strType, strErr;
+                bool fOK;
+                if (!entry.fDecode)
+                    fOK = ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr);
+                else if (entry.pwtx)
+                {
+                    fOK = false;
+                    try {
+                        fOK = LoadWalletTx(pwallet, entry.hash, *entry.pwtx, entry.fOK, ssValue, wss, strErr);
+                    } catch (...) {
+                    }
+                }
                 else
                 {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                    if (strType == "key")
+                        wss.nKeys++;
+                    fOK = entry.fOK;
+                    strErr = entry.strErr;
+                    if (fOK && !pwallet->LoadKey(*entry.pkey))
+                    {
+                        strErr = "Error reading wallet database: LoadKey failed";
+                        fOK = false;
+                    }
+                    entry.pkey.reset();
                 }
+
+                if (!fOK)
+                {
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(strType))
+                        result = DB_CORRUPT;
+                    else
+                    {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
+                }
+                if (!strErr.empty())
+                    printf("%s\n", strErr.c_str());
+
+                CWalletLoadTiming& timing = mapTiming[strType];
+                timing.nCount++;
+                timing.nDecodeMicros += entry.nMicros;
+                timing.nLoadMicros += GetTimeMicros() - nRecordStart;
             }
-            if (!strErr.empty())
-                printf("%s\n", strErr.c_str());
         }
         pcursor->close();
     }
@@ -521,6 +709,13 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     {
         result = DB_CORRUPT;
     }
+    memset(&vchBuffer[0], 0, vchBuffer.size());
+
+    printf("LoadWallet() : read %"PRId64"ms, decode %"PRId64"ms on %u threads, %"PRId64"ms in all\n",
+           nReadMicros / 1000, nDecodeMicros / 1000, nThreads, GetTimeMillis() - nLoadStart);
+    for (map<string, CWalletLoadTiming>::iterator it = mapTiming.begin(); it != mapTiming.end(); ++it)
+        printf("LoadWallet() : %-12s %8u records, decode %6"PRId64"ms (thread time), load %6"PRId64"ms\n",
+               it->first.c_str(), it->second.nCount, it->second.nDecodeMicros / 1000, it->second.nLoadMicros / 1000);
 
     if (fNoncriticalErrors && result == DB_LOAD_OK)
         result = DB_NONCRITICAL_ERROR;
@@ -566,8 +761,7 @@ void ThreadFlushWalletDB(void* parg)
     if (fOneThread)
         return;
     fOneThread = true;
-    if (!GetBoolArg("-flushwallet", true))
-        return;
+    bool fFlushDb = GetBoolArg("-flushwallet", true);
 
     unsigned int nLastSeen = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
@@ -576,6 +770,11 @@ void ThreadFlushWalletDB(void* parg)
     {
         MilliSleep(500);
 
+        // wallet transactions changed outside of blocks and RPC calls
+        FlushWallets();
+        if (!fFlushDb)
+            continue;
+
         if (nLastSeen != nWalletDBUpdated)
         {
             nLastSeen = nWalletDBUpdated;
@@ -620,6 +819,7 @@ void ThreadFlushWalletDB(void* parg)
 
 bool BackupWallet(const CWallet& wallet, const string& strDest)
 {
+    wallet.FlushPendingTxs();
     if (!wallet.fFileBacked)
         return false;
     while (!fShutdown)
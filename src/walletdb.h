@@ -206,6 +206,24 @@ public:
         return Read(std::string("bestblock"), locator);
     }
 
+    // where an interrupted rescan should resume
+    bool WriteRescanPos(const CBlockLocator& locator)
+    {
+        nWalletDBUpdated++;
+        return Write(std::string("rescanpos"), locator);
+    }
+
+    bool ReadRescanPos(CBlockLocator& locator)
+    {
+        return Read(std::string("rescanpos"), locator);
+    }
+
+    bool EraseRescanPos()
+    {
+        nWalletDBUpdated++;
+        return Erase(std::string("rescanpos"));
+    }
+
     bool WriteOrderPosNext(int64_t nOrderPosNext)
     {
         nWalletDBUpdated++;
@@ -245,7 +263,7 @@ public:
 private:
     bool WriteAccountingEntry(const uint64_t nAccEntryNum, const CAccountingEntry& acentry);
 public:
-    bool WriteAccountingEntry(const CAccountingEntry& acentry);
+    bool WriteAccountingEntry(CAccountingEntry& acentry);
     int64_t GetAccountCreditDebit(const std::string& strAccount);
     void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& acentries);
 